@@ -0,0 +1,165 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "helper_funcs.h"
+#include "vector.h"
+
+/* Transparent huge pages are 2 MiB on x86-64 and most arm64 kernels. */
+#define SPT_HUGE_PAGE ((size_t)2 << 20)
+
+
+/**
+ * Create an arena
+ * @param arena an uninitialized arena
+ * @param size  the number of bytes it can hand out
+ * @param flags SPT_ARENA_HUGE_PAGES and/or SPT_ARENA_LOCKED, or 0
+ *
+ * The block is anonymous memory mapped at once, so pages are only backed
+ * as they are touched. With SPT_ARENA_HUGE_PAGES it is rounded and aligned
+ * to 2 MiB and advised for transparent huge pages, which the kernel may
+ * still decline. SPT_ARENA_LOCKED fails if the pages cannot be pinned.
+ */
+int sptNewArena(sptArena * const arena, size_t const size, int const flags)
+{
+	size_t const granule = flags & SPT_ARENA_HUGE_PAGES ? SPT_HUGE_PAGE : SPT_ARENA_ALIGN;
+	size_t const bytes = ((size > 0 ? size : 1) + granule - 1) / granule * granule;
+	/* Over-map by one huge page so an aligned start can be cut out of it. */
+	size_t const mapped = flags & SPT_ARENA_HUGE_PAGES ? bytes + SPT_HUGE_PAGE : bytes;
+
+	char * const map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	spt_CheckOSError(map == MAP_FAILED, "Arena New");
+	arena->base = map;
+	if(flags & SPT_ARENA_HUGE_PAGES) {
+		size_t const head = (SPT_HUGE_PAGE - (uintptr_t)map % SPT_HUGE_PAGE) % SPT_HUGE_PAGE;
+		arena->base = map + head;
+		if(head > 0) {
+			munmap(map, head);
+		}
+		munmap(arena->base + bytes, mapped - head - bytes);
+#ifdef MADV_HUGEPAGE
+		madvise(arena->base, bytes, MADV_HUGEPAGE);
+#endif
+	}
+	arena->size = bytes;
+	arena->used = 0;
+	arena->flags = flags;
+	if(flags & SPT_ARENA_LOCKED) {
+		int const locked = mlock(arena->base, bytes);
+		if(locked != 0) {
+			int const err = errno;
+			munmap(arena->base, bytes);
+			errno = err;
+		}
+		spt_CheckOSError(locked != 0, "Arena New");
+	}
+	return 0;
+}
+
+
+/**
+ * Take bytes from an arena
+ * @param arena the arena
+ * @param bytes the size of the allocation
+ *
+ * Returns a pointer aligned to SPT_ARENA_ALIGN, or NULL when the arena is
+ * full; after a failure it stays full until rewound. Safe to call from
+ * several threads. The memory is released with the arena or by
+ * sptArenaRewind.
+ */
+void * sptArenaAlloc(sptArena * const arena, size_t const bytes)
+{
+	size_t const rounded = sptArenaRounded(bytes);
+	size_t offset;
+#pragma omp atomic capture
+	{
+		offset = arena->used;
+		arena->used += rounded;
+	}
+	if(offset + rounded > arena->size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return arena->base + offset;
+}
+
+
+/**
+ * The arena bytes an allocation takes
+ * @param bytes the size of the allocation
+ */
+size_t sptArenaRounded(size_t const bytes)
+{
+	return ((bytes > 0 ? bytes : 1) + SPT_ARENA_ALIGN - 1) / SPT_ARENA_ALIGN * SPT_ARENA_ALIGN;
+}
+
+
+/**
+ * Move a heap block into an arena
+ * @param arena the arena
+ * @param ptr   points to a malloc'd block, which is released and replaced by its copy
+ * @param bytes the size of the block
+ *
+ * A NULL block stays NULL. When the arena is full *ptr is left as it was.
+ */
+int sptArenaMove(sptArena * const arena, void ** const ptr, size_t const bytes)
+{
+	if(*ptr == NULL) {
+		return 0;
+	}
+	void * const moved = sptArenaAlloc(arena, bytes);
+	spt_CheckOSError(!moved, "Arena Move");
+	memcpy(moved, *ptr, bytes);
+	free(*ptr);
+	*ptr = moved;
+	return 0;
+}
+
+
+/**
+ * Release everything taken from an arena after a mark
+ * @param arena the arena
+ * @param mark  an earlier value of arena->used
+ *
+ * For workspaces: read arena->used before allocating them and rewind to it
+ * when done. Anything allocated after the mark must no longer be used.
+ */
+void sptArenaRewind(sptArena * const arena, size_t const mark)
+{
+	if(mark < arena->used) {
+		arena->used = mark;
+	}
+}
+
+
+/**
+ * Release an arena and everything allocated from it
+ * @param arena the arena
+ */
+void sptFreeArena(sptArena * const arena)
+{
+	if(arena->base != NULL) {
+		munmap(arena->base, arena->size);
+	}
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "types.h"
 
 
@@ -49,3 +50,24 @@ sptValue sptRandomValue(void)
 	}
 	return v;
 }
+
+
+/**
+ * Data cache size in bytes of level 1, 2 or 3, as sysconf reports it.
+ * Where it reports nothing (e.g. many ARM kernels) 32KB, 256KB or 8MB.
+ */
+long sptCacheSize(int const level)
+{
+	long size = 0;
+	long fallback = 8 * 1024 * 1024;
+	if(level == 1) {
+		size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+		fallback = 32 * 1024;
+	} else if(level == 2) {
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		fallback = 256 * 1024;
+	} else {
+		size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	}
+	return size > 0 ? size : fallback;
+}
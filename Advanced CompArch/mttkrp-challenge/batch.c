@@ -0,0 +1,303 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/**
+ * Load every tensor listed in a manifest
+ * @param[out] batch    an uninitialized batch
+ * @param[in]  manifest    a text file with one tensor file per line, blank
+ * lines and lines starting with '#' are skipped. Relative paths are taken
+ * relative to the manifest's directory.
+ *
+ * The files are loaded in parallel, indices are 1-based as for -i.
+ */
+int sptLoadSparseTensorBatch(sptSparseTensorBatch * const batch, char const * const manifest)
+{
+	char line[1000];
+	sptIndex cap = 16;
+	int result = 0;
+
+	FILE * fp = fopen(manifest, "r");
+	spt_CheckOSError(fp == NULL, "Batch Load");
+	char const * const slash = strrchr(manifest, '/');
+	int const dir_len = slash != NULL ? (int)(slash - manifest + 1) : 0;
+
+	batch->ntensors = 0;
+	batch->names = malloc(cap * sizeof *batch->names);
+	spt_CheckOSError(!batch->names, "Batch Load");
+	while(fgets(line, sizeof line, fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		char const * name = line;
+		while(*name == ' ' || *name == '\t') {
+			++name;
+		}
+		if(*name == '\0' || *name == '#') {
+			continue;
+		}
+		if(batch->ntensors == cap) {
+			cap *= 2;
+			batch->names = realloc(batch->names, cap * sizeof *batch->names);
+			spt_CheckOSError(!batch->names, "Batch Load");
+		}
+		char * path = NULL;
+		if(asprintf(&path, "%.*s%s", name[0] == '/' ? 0 : dir_len, manifest, name) == -1) {
+			path = NULL;
+		}
+		spt_CheckOSError(!path, "Batch Load");
+		batch->names[batch->ntensors++] = path;
+	}
+	fclose(fp);
+
+	batch->tensors = malloc((batch->ntensors > 0 ? batch->ntensors : 1) * sizeof *batch->tensors);
+	spt_CheckOSError(!batch->tensors, "Batch Load");
+#pragma omp parallel for schedule(dynamic, 1)
+	for(sptIndex t=0; t<batch->ntensors; ++t) {
+		if(sptLoadSparseTensor(&batch->tensors[t], 1, batch->names[t]) != 0) {
+#pragma omp atomic write
+			result = -1;
+		}
+	}
+	spt_CheckError(result, "Batch Load", "a tensor failed to load");
+
+	batch->max_nmodes = 0;
+	batch->total_nnz = 0;
+	for(sptIndex t=0; t<batch->ntensors; ++t) {
+		if(batch->tensors[t].nmodes > batch->max_nmodes) {
+			batch->max_nmodes = batch->tensors[t].nmodes;
+		}
+		batch->total_nnz += batch->tensors[t].nnz;
+	}
+	batch->max_dims = calloc(batch->max_nmodes > 0 ? batch->max_nmodes : 1, sizeof *batch->max_dims);
+	spt_CheckOSError(!batch->max_dims, "Batch Load");
+	for(sptIndex t=0; t<batch->ntensors; ++t) {
+		for(sptIndex m=0; m<batch->tensors[t].nmodes; ++m) {
+			if(batch->tensors[t].ndims[m] > batch->max_dims[m]) {
+				batch->max_dims[m] = batch->tensors[t].ndims[m];
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Release a batch and its tensors
+ * @param batch the batch
+ */
+void sptFreeSparseTensorBatch(sptSparseTensorBatch *batch)
+{
+	for(sptIndex t=0; t<batch->ntensors; ++t) {
+		sptFreeSparseTensor(&batch->tensors[t]);
+		free(batch->names[t]);
+	}
+	free(batch->tensors);
+	free(batch->names);
+	free(batch->max_dims);
+	batch->ntensors = 0;
+}
+
+
+/* Larger tensors first, so the dynamic schedule ends with the small ones. */
+static sptSparseTensor const * batch_sort_base;
+
+static int batch_compare_nnz(void const * a, void const * b)
+{
+	sptNnzIndex const na = batch_sort_base[*(sptIndex const *)a].nnz;
+	sptNnzIndex const nb = batch_sort_base[*(sptIndex const *)b].nnz;
+	return na > nb ? -1 : na < nb;
+}
+
+
+/* Row i of the mode m factor, R reproducible values padded with zeros to stride. */
+static inline void batch_factor_row(
+		sptValue * const restrict f,
+		sptIndex const m,
+		sptIndex const i,
+		sptIndex const R,
+		sptIndex const stride)
+{
+	uint64_t const key = spt_SplitMix64((1234 + m) ^ spt_SplitMix64(i));
+	for(sptIndex r=0; r<stride; ++r) {
+		f[r] = r < R ? sptCounterRandomValue(key, r) : 0;
+	}
+}
+
+
+/**
+ * Fill a matrix with the factor rows sptMTTKRPBatch uses
+ * @param mtx    a row-major matrix, its rows become the leading rows of the mode m factor
+ * @param m    the mode
+ *
+ * For checking a batch against the single tensor kernels.
+ */
+int sptMTTKRPBatchFactor(sptMatrix * const mtx, sptIndex const m)
+{
+	if(mtx->layout != SPT_LAYOUT_ROW_MAJOR) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Batch", "the matrix is not row-major");
+	}
+	for(sptIndex i=0; i<mtx->nrows; ++i) {
+		batch_factor_row(mtx->values + (size_t)i * mtx->stride, m, i, mtx->ncols, mtx->stride);
+	}
+	return 0;
+}
+
+
+/* MTTKRP of one tensor into out, factors[m] has a row for every index of mode m. */
+static void batch_one(
+		sptSparseTensor const * const X,
+		sptValue * const * const factors,
+		sptIndex const mode,
+		sptIndex const R,
+		sptIndex const stride,
+		sptValue * const restrict out,
+		sptValue * const restrict row)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+
+	memset(out, 0, (size_t)X->ndims[mode] * stride * sizeof *out);
+	for(sptNnzIndex x=0; x<X->nnz; ++x) {
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] = vals[x];
+		}
+		for(sptIndex m=0; m<nmodes; ++m) {
+			if(m == mode) {
+				continue;
+			}
+			sptValue const * const restrict times_row = factors[m] + (size_t)X->inds[m].data[x] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] *= times_row[r];
+			}
+		}
+		sptValue * const restrict out_row = out + (size_t)mode_ind[x] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			out_row[r] += row[r];
+		}
+	}
+}
+
+
+/**
+ * MTTKRP over every tensor of a batch
+ * @param[out] checksums    the sum of each tensor's MTTKRP output, length ntensors,
+ * from one more pass after the timed ones
+ * @param[out] elapsed    the seconds taken by the niters passes, excluding setup
+ * @param[in]  batch    the tensors
+ * @param[in]  R    the rank
+ * @param[in]  mode    the mode on which the MTTKRP is performed, must exist in every tensor
+ * @param[in]  tk    the number of threads
+ * @param[in]  niters    the number of passes over the batch
+ *
+ * One thread team runs all passes and each thread processes whole tensors,
+ * so a tensor costs no fork/join and no allocation. The factor matrices are
+ * a single shared pool sized by the largest dimension of each mode and
+ * filled once with reproducible values; each tensor uses the leading rows.
+ * Every thread owns one output buffer for the largest tensor.
+ */
+int sptMTTKRPBatch(
+		double * const checksums,
+		double * const elapsed,
+		sptSparseTensorBatch const * const batch,
+		sptIndex const R,
+		sptIndex const mode,
+		int const tk,
+		int const niters)
+{
+	sptIndex const nmodes = batch->max_nmodes;
+	sptIndex const stride = ((R-1)/8+1)*8;
+	sptIndex const ntensors = batch->ntensors;
+
+	for(sptIndex t=0; t<ntensors; ++t) {
+		if(mode >= batch->tensors[t].nmodes) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Batch", "mode >= nmodes of a tensor");
+		}
+	}
+
+	sptIndex * order = malloc((ntensors > 0 ? ntensors : 1) * sizeof *order);
+	sptValue ** factors = malloc((nmodes > 0 ? nmodes : 1) * sizeof *factors);
+	size_t const out_len = (size_t)batch->max_dims[mode] * stride + stride;
+	sptValue * outs = malloc((size_t)tk * out_len * sizeof *outs);
+	spt_CheckOSError(!order || !factors || !outs, "MTTKRP Batch");
+	for(sptIndex t=0; t<ntensors; ++t) {
+		order[t] = t;
+	}
+	batch_sort_base = batch->tensors;
+	qsort(order, ntensors, sizeof *order, batch_compare_nnz);
+
+	for(sptIndex m=0; m<nmodes; ++m) {
+		factors[m] = malloc(((size_t)batch->max_dims[m] * stride + 1) * sizeof *factors[m]);
+		spt_CheckOSError(!factors[m], "MTTKRP Batch");
+	}
+
+	double start = 0;
+#pragma omp parallel num_threads(tk)
+	{
+		sptValue * const out = outs + (size_t)omp_get_thread_num() * out_len;
+		sptValue * const row = out + (size_t)batch->max_dims[mode] * stride;
+
+		for(sptIndex m=0; m<nmodes; ++m) {
+#pragma omp for schedule(static)
+			for(sptIndex i=0; i<batch->max_dims[m]; ++i) {
+				batch_factor_row(factors[m] + (size_t)i * stride, m, i, R, stride);
+			}
+		}
+#pragma omp single
+		start = omp_get_wtime();
+
+		for(int it=0; it<niters; ++it) {
+#pragma omp for schedule(dynamic, 1)
+			for(sptIndex k=0; k<ntensors; ++k) {
+				batch_one(&batch->tensors[order[k]], factors, mode, R, stride, out, row);
+			}
+		}
+#pragma omp single
+		*elapsed = omp_get_wtime() - start;
+
+		/* The outputs are not kept, so the checksums take a pass of their own. */
+#pragma omp for schedule(dynamic, 1)
+		for(sptIndex k=0; k<ntensors; ++k) {
+			sptSparseTensor const * const X = &batch->tensors[order[k]];
+			batch_one(X, factors, mode, R, stride, out, row);
+			double sum = 0;
+			for(sptIndex i=0; i<X->ndims[mode]; ++i) {
+				for(sptIndex r=0; r<R; ++r) {
+					sum += out[(size_t)i * stride + r];
+				}
+			}
+			checksums[order[k]] = sum;
+		}
+	}
+
+	for(sptIndex m=0; m<nmodes; ++m) {
+		free(factors[m]);
+	}
+	free(factors);
+	free(outs);
+	free(order);
+
+	return 0;
+}
@@ -0,0 +1,1166 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+#include "matricies.h"
+
+/**
+ * Common signature every MTTKRP variant is wrapped into for checking
+ */
+typedef int (*spt_CheckKernel)(
+		sptSparseTensor * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const nthreads);
+
+static int check_coo(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	return sptMTTKRP(X, mats, mats_order, mode);
+}
+
+static int check_omp_coo(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return sptOmpMTTKRP(X, mats, mats_order, mode, nthreads);
+}
+
+static int check_omp_profile(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptMTTKRPProfile prof;
+	int result = sptOmpMTTKRPProfile(X, mats, mats_order, mode, nthreads, &prof);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	sptFreeMTTKRPProfile(&prof);
+	return 0;
+}
+
+static int check_plan(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads, sptMTTKRPStrategy const strategy)
+{
+	sptMTTKRPPlan plan;
+	int result = sptNewMTTKRPPlan(&plan, X, mats, mats_order, mode, nthreads, strategy);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	/* The up-front footprint is exact, or for stealing may count a permutation that was not needed. */
+	size_t const predicted = sptMTTKRPPlanFootprint(X, mats[X->nmodes]->stride, mode, nthreads, strategy);
+	size_t const held = sptMTTKRPPlanBytes(&plan);
+	if(held > predicted || (plan.strategy != SPT_MTTKRP_STEALING && held != predicted)) {
+		sptFreeMTTKRPPlan(&plan);
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Check", "plan footprint differs from its prediction");
+	}
+	/* Twice, the second run must not depend on what the first left behind. */
+	result = sptMTTKRPExecute(&plan, mats);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptMTTKRPExecute(&plan, mats);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	sptFreeMTTKRPPlan(&plan);
+	return 0;
+}
+
+static int check_plan_atomic(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_plan(X, mats, mats_order, mode, nthreads, SPT_MTTKRP_ATOMIC);
+}
+
+static int check_plan_privatized(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_plan(X, mats, mats_order, mode, nthreads, SPT_MTTKRP_PRIVATIZED);
+}
+
+static int check_plan_stealing(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_plan(X, mats, mats_order, mode, nthreads, SPT_MTTKRP_STEALING);
+}
+
+static int check_numa(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptMTTKRPNuma numa;
+	int result = sptNewMTTKRPNuma(&numa, X, mats, mode, nthreads);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptMTTKRPNumaReplicate(&numa, mats);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptMTTKRPNumaExecute(&numa, mats_order, mats);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptMTTKRPNumaExecute(&numa, mats_order, mats);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	sptFreeMTTKRPNuma(&numa);
+	return 0;
+}
+
+/* Narrow panels and short blocks, so R = 33 leaves a partial last panel. */
+static int check_rank_tiled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	return sptMTTKRPRankTiled(X, mats, mats_order, mode, 8, 100);
+}
+
+static int check_omp_rank_tiled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return sptOmpMTTKRPRankTiled(X, mats, mats_order, mode, 8, 100, nthreads);
+}
+
+/* A 4KB budget, so even the small generated tensors split into many tiles. */
+static int check_tiled_run(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads, int const omp)
+{
+	sptSparseTensorTiled tiled;
+	int result = sptNewSparseTensorTiled(&tiled, X, mode, mats[mode]->ncols, 4096);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	if(omp) {
+		result = sptOmpMTTKRPTiled(&tiled, mats, mats_order, nthreads);
+	} else {
+		result = sptMTTKRPTiled(&tiled, mats, mats_order);
+	}
+	sptFreeSparseTensorTiled(&tiled);
+	return result;
+}
+
+static int check_tiled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_tiled_run(X, mats, mats_order, mode, nthreads, 0);
+}
+
+static int check_omp_tiled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_tiled_run(X, mats, mats_order, mode, nthreads, 1);
+}
+
+static int check_prefetch(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	return sptMTTKRPPrefetch(X, mats, mats_order, mode, 16);
+}
+
+static int check_omp_prefetch(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return sptOmpMTTKRPPrefetch(X, mats, mats_order, mode, 16, nthreads);
+}
+
+/* Sorting reorders X in place, the reference does not depend on the order. */
+static int check_segmented(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	int result = sptSparseTensorSortByMode(X, mode);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	return sptMTTKRPSegmented(X, mats, mats_order, mode);
+}
+
+static int check_omp_segmented(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	int result = sptSparseTensorSortByMode(X, mode);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	return sptOmpMTTKRPSegmented(X, mats, mats_order, mode, nthreads);
+}
+
+/* Orders 2 to 6 cover both the unrolled record widths and the generic one. */
+static int check_packed(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	sptSparseTensorPacked packed;
+	int result = sptNewSparseTensorPacked(&packed, X);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptMTTKRPPacked(&packed, mats, mats_order, mode);
+	sptFreeSparseTensorPacked(&packed);
+	return result;
+}
+
+static int check_omp_packed(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptSparseTensorPacked packed;
+	int result = sptNewSparseTensorPacked(&packed, X);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptOmpMTTKRPPacked(&packed, mats, mats_order, mode, nthreads);
+	sptFreeSparseTensorPacked(&packed);
+	return result;
+}
+
+/* Slices along mode 0 with a low threshold, so blocks are contracted in every mode. */
+static int check_hybrid_run(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads, int const omp)
+{
+	sptSparseTensorHybrid hyb;
+	int result = sptNewSparseTensorHybrid(&hyb, X, 0, 0.05);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	if(omp) {
+		result = sptOmpMTTKRPHybrid(&hyb, mats, mats_order, mode, nthreads);
+	} else {
+		result = sptMTTKRPHybrid(&hyb, mats, mats_order, mode);
+	}
+	sptFreeSparseTensorHybrid(&hyb);
+	return result;
+}
+
+static int check_hybrid(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_hybrid_run(X, mats, mats_order, mode, nthreads, 0);
+}
+
+static int check_omp_hybrid(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_hybrid_run(X, mats, mats_order, mode, nthreads, 1);
+}
+
+/*
+ * MTTKRP through TTM: contract the last mode of mats_order into fibers,
+ * then multiply each fiber row by the remaining factor rows.
+ */
+static int check_ttm_mttkrp(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const omp)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const last = mats_order[nmodes-1];
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptSemiSparseTensor Y;
+	int result = omp ? sptOmpSparseTensorMulMatrix(&Y, X, mats[last], last) : sptSparseTensorMulMatrix(&Y, X, mats[last], last);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+
+	memset(mats[nmodes]->values, 0, (size_t)X->ndims[mode] * stride * sizeof(sptValue));
+	for(sptNnzIndex f=0; f < Y.nnz; ++f) {
+		sptValue * const out = mats[nmodes]->values + (size_t)Y.inds[mode].data[f] * stride;
+		sptValue const * const fiber = Y.values.values + (size_t)f * Y.values.stride;
+		for(sptIndex r=0; r < R; ++r) {
+			sptValue prod = fiber[r];
+			for(sptIndex i=1; i < nmodes-1; ++i) {
+				prod *= mats[mats_order[i]]->values[(size_t)Y.inds[mats_order[i]].data[f] * stride + r];
+			}
+			out[r] += prod;
+		}
+	}
+	sptFreeSemiSparseTensor(&Y);
+	return 0;
+}
+
+static int check_ttm(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	return check_ttm_mttkrp(X, mats, mats_order, mode, 0);
+}
+
+static int check_omp_ttm(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	(void)nthreads;
+	return check_ttm_mttkrp(X, mats, mats_order, mode, 1);
+}
+
+/* 5-column blocks, so every generated tensor spans many blocks. */
+static int check_spmm_run(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads, int const omp)
+{
+	sptMTTKRPSpMM spmm;
+	int result = sptNewMTTKRPSpMM(&spmm, X, mats_order, mode, mats[mode]->ncols, 5);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	if(omp) {
+		result = sptOmpMTTKRPSpMMExecute(&spmm, mats, nthreads);
+	} else {
+		result = sptMTTKRPSpMMExecute(&spmm, mats);
+	}
+	sptFreeMTTKRPSpMM(&spmm);
+	return result;
+}
+
+static int check_spmm(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_spmm_run(X, mats, mats_order, mode, nthreads, 0);
+}
+
+static int check_omp_spmm(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_spmm_run(X, mats, mats_order, mode, nthreads, 1);
+}
+
+/*
+ * MTTKRP of a coalesced copy, which must have no repeated coordinates and
+ * no zeros. The generated tensors hold duplicates; an explicit zero and a
+ * pair that cancels out are added, neither changes the result.
+ */
+static int check_coalesce(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptSparseTensor C;
+	int result = sptCopySparseTensor(&C, X);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	for(int e=0; e < 3; ++e) {
+		for(sptIndex m=0; m < C.nmodes; ++m) {
+			sptAppendIndexVector(&C.inds[m], e == 0 ? C.ndims[m] - 1 : 0);
+		}
+		sptAppendValueVector(&C.values, e == 0 ? 0 : e == 1 ? 0.5 : -0.5);
+		++C.nnz;
+	}
+	result = sptSparseTensorCoalesce(&C, NULL, NULL);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	for(sptNnzIndex x=0; x < C.nnz; ++x) {
+		int same = x > 0;
+		for(sptIndex m=0; same && m < C.nmodes; ++m) {
+			same = C.inds[m].data[x-1] == C.inds[m].data[x];
+		}
+		if(same || C.values.data[x] == 0) {
+			sptFreeSparseTensor(&C);
+			spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Check", "coalesced tensor has duplicates or zeros");
+		}
+	}
+	result = sptOmpMTTKRP(&C, mats, mats_order, mode, nthreads);
+	sptFreeSparseTensor(&C);
+	return result;
+}
+
+/*
+ * MTTKRP of a copy moved into a huge page arena, sorted there and grown
+ * past its capacity by a zero, which must leave the result unchanged.
+ */
+static int check_arena(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptArena arena;
+	sptSparseTensor A;
+	int result = sptNewArena(&arena, 2 * sptSparseTensorArenaSize(X->nmodes, X->nnz + 1), SPT_ARENA_HUGE_PAGES);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptCopySparseTensor(&A, X);
+	if(result != 0) {
+		sptFreeArena(&arena);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+	}
+	result = sptSparseTensorMoveToArena(&A, &arena);
+	if(result == 0) {
+		result = sptSparseTensorSortByMode(&A, mode);
+	}
+	for(sptIndex m=0; result == 0 && m < A.nmodes; ++m) {
+		result = sptAppendIndexVector(&A.inds[m], 0);
+	}
+	if(result == 0) {
+		result = sptAppendValueVector(&A.values, 0);
+		++A.nnz;
+	}
+	if(result == 0 && (A.values.arena != &arena || A.inds[0].arena != &arena)) {
+		result = SPTERR_VALUE_ERROR;
+	}
+	if(result == 0) {
+		result = sptOmpMTTKRP(&A, mats, mats_order, mode, nthreads);
+	}
+	sptFreeSparseTensor(&A);
+	sptFreeArena(&arena);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	return 0;
+}
+
+/*
+ * The mean of CHECK_SAMPLED_RUNS estimates, each of nnz draws, must be
+ * within two standard errors of the exact MTTKRP in Frobenius norm, and the
+ * reported variance within a factor of two of the squared error of one
+ * estimate. The exact result is left in mats[nmodes].
+ */
+#define CHECK_SAMPLED_RUNS 16
+static int check_sampled_run(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads, sptSampleWeighting const weighting)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	size_t const len = (size_t)X->ndims[mode] * stride;
+	sptValue * const out = mats[nmodes]->values;
+	sptMTTKRPSampler sampler;
+	int result = sptOmpMTTKRP(X, mats, mats_order, mode, nthreads);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	double * exact = malloc(len * sizeof *exact);
+	double * mean = calloc(len, sizeof *mean);
+	spt_CheckOSError(!exact || !mean, "MTTKRP Check");
+	double norm = 0;
+	for(size_t j=0; j < len; ++j) {
+		exact[j] = out[j];
+		norm += j % stride < R ? exact[j] * exact[j] : 0;
+	}
+
+	result = sptNewMTTKRPSampler(&sampler, X, mats, mode, weighting);
+	if(result != 0) {
+		free(mean);
+		free(exact);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+	}
+	double sq_err = 0, reported = 0;
+	for(int run=0; result == 0 && run < CHECK_SAMPLED_RUNS; ++run) {
+		double variance;
+		result = sptMTTKRPSampled(&variance, &sampler, X, mats, mats_order, X->nnz, 1000 + run, nthreads);
+		for(size_t j=0; result == 0 && j < len; ++j) {
+			if(j % stride < R) {
+				sq_err += (out[j] - exact[j]) * (out[j] - exact[j]);
+				mean[j] += (double)out[j] / CHECK_SAMPLED_RUNS;
+			}
+		}
+		reported += variance;
+	}
+	sptFreeMTTKRPSampler(&sampler);
+	double dev = 0;
+	for(size_t j=0; j < len; ++j) {
+		dev += j % stride < R ? (mean[j] - exact[j]) * (mean[j] - exact[j]) : 0;
+		out[j] = exact[j];
+	}
+	free(mean);
+	free(exact);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+
+	/* The floor absorbs rounding when the variance is 0. */
+	double const floor = 1e-10 * norm + 1e-12;
+	double const variance = reported / CHECK_SAMPLED_RUNS;
+	if(!(dev <= 4 * variance / CHECK_SAMPLED_RUNS + floor)) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Check", "the sampled estimates are biased");
+	}
+	if(!(sq_err / CHECK_SAMPLED_RUNS <= 2 * variance + floor && variance <= 2 * sq_err / CHECK_SAMPLED_RUNS + floor)) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Check", "the reported variance does not match the error");
+	}
+	return 0;
+}
+
+static int check_sampled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_sampled_run(X, mats, mats_order, mode, nthreads, SPT_SAMPLE_VALUE);
+}
+
+static int check_sampled_row_norm(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_sampled_run(X, mats, mats_order, mode, nthreads, SPT_SAMPLE_ROW_NORM);
+}
+
+/*
+ * The nonzeros appended to an empty tensor in three batches: the MTTKRP of
+ * the first, then the others applied as deltas, sequential and OpenMP.
+ */
+static int check_delta(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptNnzIndex const cuts[4] = { 0, X->nnz / 2, X->nnz * 3 / 4, X->nnz };
+	sptSparseTensor A, D;
+	int result = sptNewSparseTensor(&A, X->nmodes, X->ndims);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	for(int b=0; b < 3; ++b) {
+		result = sptNewSparseTensor(&D, X->nmodes, X->ndims);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+		for(sptNnzIndex x=cuts[b]; x < cuts[b+1]; ++x) {
+			for(sptIndex m=0; m < X->nmodes; ++m) {
+				sptAppendIndexVector(&D.inds[m], X->inds[m].data[x]);
+			}
+			sptAppendValueVector(&D.values, X->values.data[x]);
+			++D.nnz;
+		}
+		result = sptSparseTensorAppend(&A, &D);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+		if(b == 0) {
+			result = sptMTTKRP(&A, mats, mats_order, mode);
+		} else if(b == 1) {
+			result = sptMTTKRPDelta(&D, mats, mats_order, mode);
+		} else {
+			result = sptOmpMTTKRPDelta(&D, mats, mats_order, mode, nthreads);
+		}
+		spt_CheckError(result, "MTTKRP Check", NULL);
+		sptFreeSparseTensor(&D);
+	}
+	int const same = A.nnz == X->nnz && memcmp(A.values.data, X->values.data, X->nnz * sizeof *A.values.data) == 0;
+	sptFreeSparseTensor(&A);
+	if(!same) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Check", "appended tensor differs from the original");
+	}
+	return 0;
+}
+
+/*
+ * MTTKRP through a second attachment to a published copy of X and the
+ * factors. A child that attaches and exits without detaching must not be
+ * counted. Republishing the name must leave that attachment stale.
+ */
+static int check_shared(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	sptIndex const nmodes = X->nmodes;
+	char name[64];
+	sptSharedStore pub, att, again;
+	snprintf(name, sizeof name, "/spt_check_%ld", (long)getpid());
+	int result = sptSharedStorePublish(&pub, name, X, mats, nmodes);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptSharedStoreAttach(&att, name);
+	if(result != 0) {
+		sptSharedStoreDetach(&pub);
+		sptSharedStoreUnpublish(name, 1);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+	}
+	sptMatrix ** views = malloc((nmodes+1) * sizeof *views);
+	spt_CheckOSError(!views, "MTTKRP Check");
+	for(sptIndex m=0; m < nmodes; ++m) {
+		views[m] = &att.mats[m];
+	}
+	views[nmodes] = mats[nmodes];
+	result = sptOmpMTTKRP(&att.tensor, views, mats_order, mode, nthreads);
+	free(views);
+	if(result == 0 && (sptSharedStoreRefCount(&att) != 2 || !sptSharedStoreIsCurrent(&att))) {
+		result = SPTERR_VALUE_ERROR;
+	}
+	if(result == 0) {
+		pid_t const child = fork();
+		if(child == 0) {
+			sptSharedStore crashed;
+			_exit(sptSharedStoreAttach(&crashed, name) == 0 ? 0 : 1);
+		}
+		int status = 1;
+		if(child < 0 || waitpid(child, &status, 0) != child || status != 0 || sptSharedStoreRefCount(&att) != 2) {
+			result = SPTERR_VALUE_ERROR;
+		}
+	}
+	if(result == 0) {
+		result = sptSharedStorePublish(&again, name, X, NULL, 0);
+		if(result == 0) {
+			if(sptSharedStoreIsCurrent(&att) || sptSharedStoreIsCurrent(&pub) || !sptSharedStoreIsCurrent(&again)) {
+				result = SPTERR_VALUE_ERROR;
+			}
+			sptSharedStoreDetach(&again);
+		}
+	}
+	sptSharedStoreDetach(&att);
+	sptSharedStoreDetach(&pub);
+	if(result == 0) {
+		result = sptSharedStoreUnpublish(name, 0);
+	} else {
+		sptSharedStoreUnpublish(name, 1);
+	}
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	return 0;
+}
+
+/*
+ * A kernel run on copies of the matrices in another layout, its output
+ * copied back into mats[nmodes] for the comparison.
+ */
+static int check_layout(
+		sptSparseTensor * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const nthreads,
+		sptMatrixPadding const padding,
+		sptMatrixLayout const layout,
+		sptIndex const panel,
+		spt_CheckKernel run)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptMatrix * copies = malloc((nmodes+1) * sizeof *copies);
+	sptMatrix ** ptrs = malloc((nmodes+1) * sizeof *ptrs);
+	spt_CheckOSError(!copies || !ptrs, "MTTKRP Check");
+	int result = 0;
+	sptIndex made = 0;
+	for(; made <= nmodes; ++made) {
+		result = sptMatrixConvert(&copies[made], mats[made], padding, layout, panel);
+		if(result != 0) {
+			break;
+		}
+		ptrs[made] = &copies[made];
+	}
+	if(result == 0) {
+		result = run(X, ptrs, mats_order, mode, nthreads);
+	}
+	if(result == 0) {
+		result = sptMatrixCopyValues(mats[nmodes], ptrs[nmodes]);
+	}
+	for(sptIndex m=0; m < made; ++m) {
+		sptFreeMatrix(&copies[m]);
+	}
+	free(copies);
+	free(ptrs);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	return 0;
+}
+
+/* Unpadded rows, so R = 10 and 33 take the segmented tail pass. */
+static int check_unpadded_segmented(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_layout(X, mats, mats_order, mode, nthreads, SPT_PAD_NONE, SPT_LAYOUT_ROW_MAJOR, 0, check_omp_segmented);
+}
+
+static int check_line_padded_coo(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_layout(X, mats, mats_order, mode, nthreads, SPT_PAD_CACHE_LINE, SPT_LAYOUT_ROW_MAJOR, 0, check_omp_coo);
+}
+
+/* Panels of 16 replace the tile of 8 the wrapped check asks for. */
+static int check_panel_rank_tiled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_layout(X, mats, mats_order, mode, nthreads, SPT_PAD_NONE, SPT_LAYOUT_PANELS, 16, check_omp_rank_tiled);
+}
+
+static int check_col_major_rank_tiled(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_layout(X, mats, mats_order, mode, nthreads, SPT_PAD_VECTOR, SPT_LAYOUT_COL_MAJOR, 0, check_rank_tiled);
+}
+
+/*
+ * A pattern-only kernel checked against the reference for X by linearity:
+ * run on the coordinates of X with every value 1, plus the COO kernel on the
+ * values of X minus 1.
+ */
+static int check_pattern(
+		sptSparseTensor * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const nthreads,
+		spt_CheckKernel run)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptMatrix * const output = mats[nmodes];
+	sptSparseTensor ones, rest;
+	sptMatrix partial;
+	int result = sptCopySparseTensor(&ones, X);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	result = sptCopySparseTensor(&rest, X);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	for(sptNnzIndex x=0; x < X->nnz; ++x) {
+		ones.values.data[x] = 1;
+		rest.values.data[x] -= 1;
+	}
+	result = sptSparseTensorDropValues(&ones);
+	if(result == 0) {
+		result = sptMatrixConvert(&partial, output, output->padding, output->layout, output->panel);
+	}
+	if(result == 0) {
+		mats[nmodes] = &partial;
+		result = sptOmpMTTKRP(&rest, mats, mats_order, mode, nthreads);
+		mats[nmodes] = output;
+		if(result == 0) {
+			result = run(&ones, mats, mats_order, mode, nthreads);
+		}
+		for(sptIndex i=0; result == 0 && i < X->ndims[mode]; ++i) {
+			for(sptIndex r=0; r < output->stride; ++r) {
+				output->values[(size_t)i * output->stride + r] += partial.values[(size_t)i * output->stride + r];
+			}
+		}
+		sptFreeMatrix(&partial);
+	}
+	sptFreeSparseTensor(&ones);
+	sptFreeSparseTensor(&rest);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	return 0;
+}
+
+static int check_pattern_coo(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_coo);
+}
+
+static int check_pattern_omp_coo(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_omp_coo);
+}
+
+static int check_pattern_profile(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_omp_profile);
+}
+
+static int check_pattern_plan(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_plan_privatized);
+}
+
+static int check_pattern_stealing(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_plan_stealing);
+}
+
+static int check_pattern_segmented(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_omp_segmented);
+}
+
+static int check_pattern_packed(sptSparseTensor * const X, sptMatrix * mats[], sptIndex const mats_order[], sptIndex const mode, int const nthreads)
+{
+	return check_pattern(X, mats, mats_order, mode, nthreads, check_omp_packed);
+}
+
+struct check_kernel
+{
+		char const * name;
+		spt_CheckKernel run;
+};
+
+static struct check_kernel check_kernels[] = {
+		{ "COO", check_coo },
+		{ "Omp COO", check_omp_coo },
+		{ "Omp COO profile", check_omp_profile },
+		{ "Plan atomic", check_plan_atomic },
+		{ "Plan privatized", check_plan_privatized },
+		{ "Plan stealing", check_plan_stealing },
+		{ "NUMA", check_numa },
+		{ "Rank tiled", check_rank_tiled },
+		{ "Omp rank tiled", check_omp_rank_tiled },
+		{ "Cache tiled", check_tiled },
+		{ "Omp cache tiled", check_omp_tiled },
+		{ "Prefetch", check_prefetch },
+		{ "Omp prefetch", check_omp_prefetch },
+		{ "Segmented", check_segmented },
+		{ "Omp segmented", check_omp_segmented },
+		{ "Packed", check_packed },
+		{ "Omp packed", check_omp_packed },
+		{ "Hybrid", check_hybrid },
+		{ "Omp hybrid", check_omp_hybrid },
+		{ "TTM", check_ttm },
+		{ "Omp TTM", check_omp_ttm },
+		{ "CSR SpMM", check_spmm },
+		{ "Omp CSR SpMM", check_omp_spmm },
+		{ "Sampled mean", check_sampled },
+		{ "Sampled row-norm mean", check_sampled_row_norm },
+		{ "Coalesced", check_coalesce },
+		{ "Delta", check_delta },
+		{ "Arena", check_arena },
+		{ "Shared", check_shared },
+		{ "Unpadded segmented", check_unpadded_segmented },
+		{ "Line-padded omp COO", check_line_padded_coo },
+		{ "Panel rank tiled", check_panel_rank_tiled },
+		{ "Column-major rank tiled", check_col_major_rank_tiled },
+		{ "Pattern COO", check_pattern_coo },
+		{ "Pattern omp COO", check_pattern_omp_coo },
+		{ "Pattern omp COO profile", check_pattern_profile },
+		{ "Pattern plan privatized", check_pattern_plan },
+		{ "Pattern plan stealing", check_pattern_stealing },
+		{ "Pattern omp segmented", check_pattern_segmented },
+		{ "Pattern omp packed", check_pattern_packed },
+		{ NULL, NULL }
+};
+
+static sptIndex const check_ranks[] = { 1, 3, 8, 10, 16, 33 };
+
+
+/* A reproducible random tensor, duplicate coordinates are allowed. */
+static int check_random_tensor(sptSparseTensor *tsr, sptIndex const nmodes, sptNnzIndex const nnz, unsigned const seed)
+{
+	sptIndex ndims[8];
+	int result;
+
+	srand(seed);
+	for(sptIndex m=0; m < nmodes; ++m) {
+		ndims[m] = 2 + rand() % 40;
+	}
+	result = sptNewSparseTensor(tsr, nmodes, ndims);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	for(sptIndex m=0; m < nmodes; ++m) {
+		result = sptResizeIndexVector(&tsr->inds[m], nnz);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+	}
+	result = sptResizeValueVector(&tsr->values, nnz);
+	spt_CheckError(result, "MTTKRP Check", NULL);
+	for(sptNnzIndex x=0; x < nnz; ++x) {
+		for(sptIndex m=0; m < nmodes; ++m) {
+			tsr->inds[m].data[x] = rand() % ndims[m];
+		}
+		tsr->values.data[x] = sptRandomValue();
+	}
+	tsr->nnz = nnz;
+	return 0;
+}
+
+
+/*
+ * Double precision MTTKRP, plus the sum of absolute products per entry which
+ * scales the tolerance to the rounding the single precision kernels can incur.
+ */
+static void check_reference(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mode,
+		double * const ref,
+		double * const mag)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[mode]->ncols;
+	sptIndex const stride = mats[0]->stride;
+
+	memset(ref, 0, X->ndims[mode] * R * sizeof *ref);
+	memset(mag, 0, X->ndims[mode] * R * sizeof *mag);
+	for(sptNnzIndex x=0; x < X->nnz; ++x) {
+		sptIndex const mode_i = X->inds[mode].data[x];
+		for(sptIndex r=0; r < R; ++r) {
+			double prod = X->values.data[x];
+			for(sptIndex m=0; m < nmodes; ++m) {
+				if(m != mode) {
+					prod *= mats[m]->values[X->inds[m].data[x] * stride + r];
+				}
+			}
+			ref[mode_i * R + r] += prod;
+			mag[mode_i * R + r] += fabs(prod);
+		}
+	}
+}
+
+
+/*
+ * Two tensors on a small dense grid, X and Y each holding about 30% of the
+ * cells in sorted order. Where both hold a cell, Y's value is sometimes X's
+ * or its negation so sums and differences cancel. E holds X's pattern with
+ * nonzero values of the same kind, for the Eq operations.
+ */
+static int check_dot_tensors(sptSparseTensor *X, sptSparseTensor *Y, sptSparseTensor *E, sptIndex const ndims[3])
+{
+	int result = sptNewSparseTensor(X, 3, ndims);
+	result |= sptNewSparseTensor(Y, 3, ndims);
+	result |= sptNewSparseTensor(E, 3, ndims);
+	spt_CheckError(result, "Dot Check", NULL);
+	srand(5);
+	for(sptIndex i=0; i < ndims[0]; ++i) {
+		for(sptIndex j=0; j < ndims[1]; ++j) {
+			for(sptIndex k=0; k < ndims[2]; ++k) {
+				int const in_x = rand() % 10 < 3;
+				int const in_y = rand() % 10 < 3;
+				int const kind = rand() % 4;
+				sptValue const x = sptRandomValue();
+				sptValue const y = kind == 0 ? x : kind == 1 ? -x : sptRandomValue();
+				if(in_x) {
+					sptAppendIndexVector(&X->inds[0], i);
+					sptAppendIndexVector(&X->inds[1], j);
+					sptAppendIndexVector(&X->inds[2], k);
+					sptAppendValueVector(&X->values, x);
+					sptAppendIndexVector(&E->inds[0], i);
+					sptAppendIndexVector(&E->inds[1], j);
+					sptAppendIndexVector(&E->inds[2], k);
+					sptAppendValueVector(&E->values, y != 0 ? y : 1);
+					++X->nnz;
+					++E->nnz;
+				}
+				if(in_y) {
+					sptAppendIndexVector(&Y->inds[0], i);
+					sptAppendIndexVector(&Y->inds[1], j);
+					sptAppendIndexVector(&Y->inds[2], k);
+					sptAppendValueVector(&Y->values, y);
+					++Y->nnz;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+
+/* Scatter into a dense grid, with present[c] marking cells that hold an entry. */
+static void check_dot_scatter(sptSparseTensor const * const T, sptIndex const ndims[3], sptValue * const dense, char * const present)
+{
+	sptIndex const ncells = ndims[0] * ndims[1] * ndims[2];
+	memset(dense, 0, ncells * sizeof *dense);
+	memset(present, 0, ncells);
+	for(sptNnzIndex x=0; x < T->nnz; ++x) {
+		sptIndex const c = (T->inds[0].data[x] * ndims[1] + T->inds[1].data[x]) * ndims[2] + T->inds[2].data[x];
+		dense[c] = T->values.data[x];
+		present[c] = 1;
+	}
+}
+
+
+/*
+ * Whether Z is strictly sorted and matches op applied cell by cell: the union
+ * of the patterns for + and -, the intersection for * and /, without the
+ * zero results when collectZero is set.
+ */
+static int check_dot_result(
+		sptSparseTensor const * const Z,
+		sptSparseTensor const * const X,
+		sptSparseTensor const * const Y,
+		sptIndex const ndims[3],
+		char const op,
+		int const collectZero)
+{
+	sptIndex const ncells = ndims[0] * ndims[1] * ndims[2];
+	sptValue * dx = malloc(ncells * sizeof *dx);
+	sptValue * dy = malloc(ncells * sizeof *dy);
+	sptValue * dz = malloc(ncells * sizeof *dz);
+	char * px = malloc(ncells);
+	char * py = malloc(ncells);
+	char * pz = malloc(ncells);
+	sptAssert(dx && dy && dz && px && py && pz);
+	check_dot_scatter(X, ndims, dx, px);
+	check_dot_scatter(Y, ndims, dy, py);
+	check_dot_scatter(Z, ndims, dz, pz);
+
+	int ok = 1;
+	sptNnzIndex expected = 0;
+	for(sptNnzIndex x=1; x < Z->nnz; ++x) {
+		sptIndex const a = (Z->inds[0].data[x-1] * ndims[1] + Z->inds[1].data[x-1]) * ndims[2] + Z->inds[2].data[x-1];
+		sptIndex const b = (Z->inds[0].data[x] * ndims[1] + Z->inds[1].data[x]) * ndims[2] + Z->inds[2].data[x];
+		ok &= a < b;
+	}
+	for(sptIndex c=0; c < ncells; ++c) {
+		int const want = op == '+' || op == '-' ? px[c] || py[c] : px[c] && py[c];
+		sptValue const v = op == '+' ? dx[c] + dy[c] : op == '-' ? dx[c] - dy[c] : op == '*' ? dx[c] * dy[c] : (want ? dx[c] / dy[c] : 0);
+		if(want && !(collectZero && v == 0)) {
+			++expected;
+			ok &= pz[c] && fabs(dz[c] - v) <= 1e-5 * fabs(v);
+		} else {
+			ok &= !pz[c];
+		}
+	}
+	ok &= Z->nnz == expected;
+
+	free(dx);
+	free(dy);
+	free(dz);
+	free(px);
+	free(py);
+	free(pz);
+	return ok;
+}
+
+
+/*
+ * Every element-wise operation, sequential and OpenMP, with and without
+ * collectZero, against the same operation on dense grids.
+ */
+static int check_dot(int const nthreads, FILE *fp)
+{
+	static sptIndex const ndims[3] = { 12, 10, 9 };
+	unsigned nchecks = 0, nfailed = 0;
+	sptSparseTensor X, Y, E;
+	int result = check_dot_tensors(&X, &Y, &E, ndims);
+	spt_CheckError(result, "Dot Check", NULL);
+
+	for(int collectZero=0; collectZero <= 1; ++collectZero) {
+		for(int variant=0; variant < 14; ++variant) {
+			sptSparseTensor Z;
+			char op;
+			switch(variant) {
+			case 0: op = '+'; result = sptSparseTensorDotAdd(&Z, &X, &Y, collectZero); break;
+			case 1: op = '+'; result = sptOmpSparseTensorDotAdd(&Z, &X, &Y, collectZero, nthreads); break;
+			case 2: op = '-'; result = sptSparseTensorDotSub(&Z, &X, &Y, collectZero); break;
+			case 3: op = '-'; result = sptOmpSparseTensorDotSub(&Z, &X, &Y, collectZero, nthreads); break;
+			case 4: op = '*'; result = sptSparseTensorDotMul(&Z, &X, &Y, collectZero); break;
+			case 5: op = '*'; result = sptOmpSparseTensorDotMul(&Z, &X, &Y, collectZero, nthreads); break;
+			case 6: op = '+'; result = sptSparseTensorDotAddEq(&Z, &X, &E, collectZero); break;
+			case 7: op = '+'; result = sptOmpSparseTensorDotAddEq(&Z, &X, &E, collectZero); break;
+			case 8: op = '-'; result = sptSparseTensorDotSubEq(&Z, &X, &E, collectZero); break;
+			case 9: op = '-'; result = sptOmpSparseTensorDotSubEq(&Z, &X, &E, collectZero); break;
+			case 10: op = '*'; result = sptSparseTensorDotMulEq(&Z, &X, &E, collectZero); break;
+			case 11: op = '*'; result = sptOmpSparseTensorDotMulEq(&Z, &X, &E, collectZero); break;
+			case 12: op = '/'; result = sptSparseTensorDotDivEq(&Z, &X, &E, collectZero); break;
+			default: op = '/'; result = sptOmpSparseTensorDotDivEq(&Z, &X, &E, collectZero); break;
+			}
+			int const ok = result == 0 && check_dot_result(&Z, &X, variant < 6 ? &Y : &E, ndims, op, collectZero);
+			if(result == 0) {
+				sptFreeSparseTensor(&Z);
+			}
+			++nchecks;
+			if(!ok) {
+				++nfailed;
+				fprintf(fp, "[FAILED] element-wise variant %d op %c collectZero %d\n", variant, op, collectZero);
+			}
+		}
+	}
+	sptFreeSparseTensor(&X);
+	sptFreeSparseTensor(&Y);
+	sptFreeSparseTensor(&E);
+
+	fprintf(fp, "Element-wise check: %u / %u passed\n", nchecks - nfailed, nchecks);
+	return nfailed == 0 ? 0 : -1;
+}
+
+
+/*
+ * sptMTTKRPBatch over tensors of orders 3 to 5, all in one team: each
+ * checksum must match the sum of sptMTTKRP's output on the batch's factors.
+ */
+static int check_batch(int const nthreads, FILE *fp)
+{
+	static sptIndex const R = 10;
+	static sptIndex const mode = 1;
+	sptSparseTensorBatch batch;
+	unsigned nchecks = 0, nfailed = 0;
+	double elapsed;
+	int result;
+
+	batch.ntensors = 6;
+	batch.tensors = malloc(batch.ntensors * sizeof *batch.tensors);
+	batch.names = calloc(batch.ntensors, sizeof *batch.names);
+	double * checksums = malloc(batch.ntensors * sizeof *checksums);
+	sptAssert(batch.tensors && batch.names && checksums);
+	batch.max_nmodes = 0;
+	batch.total_nnz = 0;
+	for(sptIndex t=0; t < batch.ntensors; ++t) {
+		sptIndex const nmodes = 3 + t % 3;
+		result = check_random_tensor(&batch.tensors[t], nmodes, 100 + 150 * t, 101 + t);
+		spt_CheckError(result, "Batch Check", NULL);
+		if(nmodes > batch.max_nmodes) {
+			batch.max_nmodes = nmodes;
+		}
+		batch.total_nnz += batch.tensors[t].nnz;
+	}
+	batch.max_dims = calloc(batch.max_nmodes, sizeof *batch.max_dims);
+	sptAssert(batch.max_dims);
+	for(sptIndex t=0; t < batch.ntensors; ++t) {
+		for(sptIndex m=0; m < batch.tensors[t].nmodes; ++m) {
+			if(batch.tensors[t].ndims[m] > batch.max_dims[m]) {
+				batch.max_dims[m] = batch.tensors[t].ndims[m];
+			}
+		}
+	}
+
+	result = sptMTTKRPBatch(checksums, &elapsed, &batch, R, mode, nthreads, 2);
+	spt_CheckError(result, "Batch Check", NULL);
+
+	for(sptIndex t=0; t < batch.ntensors; ++t) {
+		sptSparseTensor * const X = &batch.tensors[t];
+		sptIndex const nmodes = X->nmodes;
+		sptIndex mats_order[5];
+		sptMatrix * mats[6];
+		for(sptIndex m=0; m <= nmodes; ++m) {
+			mats[m] = malloc(sizeof *mats[m]);
+			sptAssert(sptNewMatrix(mats[m], X->ndims[m < nmodes ? m : mode], R) == 0);
+			if(m < nmodes) {
+				sptAssert(sptMTTKRPBatchFactor(mats[m], m) == 0);
+			}
+		}
+		mats_order[0] = mode;
+		for(sptIndex i=1; i < nmodes; ++i) {
+			mats_order[i] = (mode+i) % nmodes;
+		}
+		double * ref = malloc(X->ndims[mode] * R * sizeof *ref);
+		double * mag = malloc(X->ndims[mode] * R * sizeof *mag);
+		sptAssert(ref != NULL && mag != NULL);
+		check_reference(X, mats, mode, ref, mag);
+
+		double sum = 0, tol = 1e-6;
+		int ok = sptMTTKRP(X, mats, mats_order, mode) == 0;
+		for(sptIndex i=0; ok && i < X->ndims[mode]; ++i) {
+			for(sptIndex r=0; r < R; ++r) {
+				sum += mats[nmodes]->values[i * mats[nmodes]->stride + r];
+				tol += 1e-4 * mag[i * R + r];
+			}
+		}
+		ok &= fabs(checksums[t] - sum) <= tol;
+		++nchecks;
+		if(!ok) {
+			++nfailed;
+			fprintf(fp, "[FAILED] batch tensor %"PASTA_PRI_INDEX ": nmodes %"PASTA_PRI_INDEX ", checksum %e, sptMTTKRP %e\n",
+							t, nmodes, checksums[t], sum);
+		}
+
+		free(mag);
+		free(ref);
+		for(sptIndex m=0; m <= nmodes; ++m) {
+			sptFreeMatrix(mats[m]);
+			free(mats[m]);
+		}
+	}
+	free(checksums);
+	sptFreeSparseTensorBatch(&batch);
+
+	fprintf(fp, "Batch check: %u / %u passed\n", nchecks - nfailed, nchecks);
+	return nfailed == 0 ? 0 : -1;
+}
+
+
+/**
+ * Differential correctness check of every MTTKRP variant
+ * @param nthreads the number of threads given to the parallel variants
+ * @param fp       the file to report to
+ *
+ * Runs each registered kernel on generated 2- to 6-mode tensors, in every
+ * mode and for a set of ranks including ones that are not multiples of 8,
+ * and compares the result with a double precision reference. An entry
+ * passes when |out - ref| <= 1e-4 * sum(|products|) + 1e-6.
+ * The element-wise operations are checked too, against dense grids, and
+ * the batch kernel against sptMTTKRP. The kernels' timing lines are
+ * silenced meanwhile, so fp gets only failures and the summaries.
+ * Returns 0 when all checks pass.
+ */
+int sptCheckMTTKRP(int const nthreads, FILE *fp)
+{
+	int result;
+	unsigned nchecks = 0, nfailed = 0;
+	/* Only failures and the summaries, not the kernels' own timing lines. */
+	int const timer_print = sptSetTimerPrint(0);
+
+	for(sptIndex nmodes=2; nmodes <= 6; ++nmodes) {
+		sptSparseTensor X;
+		result = check_random_tensor(&X, nmodes, 500 * nmodes, 17 + nmodes);
+		spt_CheckError(result, "MTTKRP Check", NULL);
+
+		sptIndex max_ndims = 0;
+		for(sptIndex m=0; m < nmodes; ++m) {
+			if(X.ndims[m] > max_ndims) {
+				max_ndims = X.ndims[m];
+			}
+		}
+
+		for(size_t ri=0; ri < sizeof check_ranks / sizeof check_ranks[0]; ++ri) {
+			sptIndex const R = check_ranks[ri];
+			sptMatrix * mats[7];
+			for(sptIndex m=0; m < nmodes; ++m) {
+				mats[m] = malloc(sizeof *mats[m]);
+				sptAssert(sptNewMatrix(mats[m], X.ndims[m], R) == 0);
+				sptAssert(sptRandomizeMatrix(mats[m], false, m) == 0);
+			}
+			mats[nmodes] = malloc(sizeof *mats[nmodes]);
+			sptAssert(sptNewMatrix(mats[nmodes], max_ndims, R) == 0);
+			sptIndex const stride = mats[nmodes]->stride;
+			double * ref = malloc(max_ndims * R * sizeof *ref);
+			double * mag = malloc(max_ndims * R * sizeof *mag);
+			sptAssert(ref != NULL && mag != NULL);
+
+			for(sptIndex mode=0; mode < nmodes; ++mode) {
+				sptIndex mats_order[6];
+				mats_order[0] = mode;
+				for(sptIndex i=1; i < nmodes; ++i) {
+					mats_order[i] = (mode+i) % nmodes;
+				}
+				check_reference(&X, mats, mode, ref, mag);
+
+				for(struct check_kernel const * k = check_kernels; k->name != NULL; ++k) {
+					double max_err = 0;
+					int ok;
+					/* Kernels overwrite their output, stale values must not leak through. */
+					sptAssert(sptConstantMatrix(mats[nmodes], 7) == 0);
+					ok = k->run(&X, mats, mats_order, mode, nthreads) == 0;
+					for(sptIndex i=0; ok && i < X.ndims[mode]; ++i) {
+						for(sptIndex r=0; r < R; ++r) {
+							double const err = fabs(mats[nmodes]->values[i * stride + r] - ref[i * R + r]);
+							if(err > max_err) {
+								max_err = err;
+							}
+							if(!(err <= 1e-4 * mag[i * R + r] + 1e-6)) {
+								ok = 0;
+							}
+						}
+					}
+					++nchecks;
+					if(!ok) {
+						++nfailed;
+						fprintf(fp, "[FAILED] %s: nmodes %"PASTA_PRI_INDEX " mode %"PASTA_PRI_INDEX " R %"PASTA_PRI_INDEX ", max error %e\n",
+										k->name, nmodes, mode, R, max_err);
+					}
+				}
+			}
+
+			free(mag);
+			free(ref);
+			for(sptIndex m=0; m <= nmodes; ++m) {
+				sptFreeMatrix(mats[m]);
+				free(mats[m]);
+			}
+		}
+		sptFreeSparseTensor(&X);
+	}
+
+	fprintf(fp, "MTTKRP check: %u / %u passed\n", nchecks - nfailed, nchecks);
+	if(check_dot(nthreads, fp) != 0) {
+		++nfailed;
+	}
+	if(check_batch(nthreads, fp) != 0) {
+		++nfailed;
+	}
+	sptSetTimerPrint(timer_print);
+	if(nfailed != 0) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Check", "kernel output differs from the reference");
+	}
+	return 0;
+}
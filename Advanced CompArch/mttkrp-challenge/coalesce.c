@@ -0,0 +1,176 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+/* Whether nonzeros a and b have the same coordinates. */
+static inline int coalesce_same(sptSparseTensor const * const tsr, sptNnzIndex const a, sptNnzIndex const b)
+{
+	for(sptIndex m=0; m<tsr->nmodes; ++m) {
+		if(tsr->inds[m].data[a] != tsr->inds[m].data[b]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * The runs of equal coordinates starting in [begin, end), each summed and
+ * written from begin onwards unless the sum is zero. Runs may extend past
+ * end, but not to limit, where the next thread's first run starts and its
+ * writes begin. Writes never pass the run being read, so this is safe in
+ * place. Returns the number of runs kept, *nruns gets the number of runs.
+ */
+static sptNnzIndex coalesce_range(
+		sptSparseTensor * const tsr,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptNnzIndex const limit,
+		sptNnzIndex * const nruns)
+{
+	sptIndex const nmodes = tsr->nmodes;
+	sptValue * const restrict vals = tsr->values.data;
+	sptNnzIndex w = begin;
+	sptNnzIndex x = begin;
+
+	*nruns = 0;
+	while(x < end) {
+		double sum = vals[x];
+		sptNnzIndex run_end = x + 1;
+		while(run_end < limit && coalesce_same(tsr, x, run_end)) {
+			sum += vals[run_end];
+			++run_end;
+		}
+		++*nruns;
+		if((sptValue)sum != 0) {
+			for(sptIndex m=0; m<nmodes; ++m) {
+				tsr->inds[m].data[w] = tsr->inds[m].data[x];
+			}
+			vals[w] = (sptValue)sum;
+			++w;
+		}
+		x = run_end;
+	}
+	return w - begin;
+}
+
+
+/**
+ * Sum duplicate coordinates and drop zeros, in place
+ * @param tsr    the sparse tensor, sorted and compacted
+ * @param ndups  if not NULL, the number of nonzeros merged into an earlier one with the same coordinates
+ * @param nzeros if not NULL, the number of coordinates dropped because their value (or sum) is zero
+ *
+ * The tensor is radix sorted in its recorded order, or in mode order if
+ * none is recorded, so duplicates become adjacent. Threads take equal
+ * nonzero ranges; a run of duplicates belongs to the thread it starts in.
+ * Each thread compacts its runs to the front of its own range, then the
+ * * ranges are moved together, each array by its own thread.
+ */
+int sptSparseTensorCoalesce(sptSparseTensor *tsr, sptNnzIndex * const ndups, sptNnzIndex * const nzeros)
+{
+	sptIndex const nmodes = tsr->nmodes;
+	int result;
+
+	if(tsr->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "SpTns Coalesce", "pattern-only tensor");
+	}
+	if(!spt_SortOrderKnown(tsr)) {
+		sptIndex * order = malloc(nmodes * sizeof *order);
+		spt_CheckOSError(!order, "SpTns Coalesce");
+		for(sptIndex m=0; m<nmodes; ++m) {
+			order[m] = m;
+		}
+		result = sptSparseTensorSortByOrder(tsr, order);
+		free(order);
+		spt_CheckError(result, "SpTns Coalesce", NULL);
+	}
+
+	int nt = omp_get_max_threads();
+	sptNnzIndex * starts = malloc(nt * sizeof *starts);
+	sptNnzIndex * kept = malloc(nt * sizeof *kept);
+	sptNnzIndex * runs = malloc(nt * sizeof *runs);
+	spt_CheckOSError(!starts || !kept || !runs, "SpTns Coalesce");
+
+#pragma omp parallel num_threads(nt)
+	{
+		int const tid = omp_get_thread_num();
+		int const nth = omp_get_num_threads();
+		/* Advance to the first run that starts in this thread's share. */
+		sptNnzIndex begin = tsr->nnz * tid / nth;
+		sptNnzIndex const end = tsr->nnz * (tid + 1) / nth;
+		while(begin > 0 && begin < end && coalesce_same(tsr, begin - 1, begin)) {
+			++begin;
+		}
+		starts[tid] = begin;
+#pragma omp barrier
+		/* Threads whose share lies inside an earlier run write nothing, look past them. */
+		sptNnzIndex limit = tsr->nnz;
+		for(int u=tid+1; u<nth; ++u) {
+			if(starts[u] < tsr->nnz * (u + 1) / nth) {
+				limit = starts[u];
+				break;
+			}
+		}
+		kept[tid] = coalesce_range(tsr, begin, end, limit, &runs[tid]);
+#pragma omp single
+		nt = nth;
+	}
+
+	sptNnzIndex nnz = 0, nruns = 0;
+	for(int t=0; t<nt; ++t) {
+		nruns += runs[t];
+		nnz += kept[t];
+	}
+	/* Range t moves below ranges t+1.. that are still in place, so they go in order. */
+#pragma omp parallel for schedule(dynamic, 1)
+	for(sptIndex a=0; a<=nmodes; ++a) {
+		char * const data = a < nmodes ? (char *)tsr->inds[a].data : (char *)tsr->values.data;
+		size_t const size = a < nmodes ? sizeof *tsr->inds[a].data : sizeof *tsr->values.data;
+		sptNnzIndex w = 0;
+		for(int t=0; t<nt; ++t) {
+			if(w != starts[t]) {
+				memmove(data + w * size, data + starts[t] * size, kept[t] * size);
+			}
+			w += kept[t];
+		}
+	}
+
+	if(ndups != NULL) {
+		*ndups = tsr->nnz - nruns;
+	}
+	if(nzeros != NULL) {
+		*nzeros = nruns - nnz;
+	}
+	tsr->nnz = nnz;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		tsr->inds[m].len = nnz;
+	}
+	tsr->values.len = nnz;
+	free(starts);
+	free(kept);
+	free(runs);
+
+	return 0;
+}
@@ -0,0 +1,535 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+typedef enum {
+	SPT_DOT_ADD,
+	SPT_DOT_SUB,
+	SPT_DOT_MUL,
+	SPT_DOT_DIV,
+} spt_DotOp;
+
+
+static inline sptValue dot_apply(spt_DotOp const op, sptValue const a, sptValue const b)
+{
+	switch(op) {
+	case SPT_DOT_ADD:
+		return a + b;
+	case SPT_DOT_SUB:
+		return a - b;
+	case SPT_DOT_MUL:
+		return a * b;
+	default:
+		return a / b;
+	}
+}
+
+
+/* <0, 0 or >0 as nonzero x of X sorts before, with or after nonzero y of Y, modes in order. */
+static inline int dot_compare(
+		sptSparseTensor const * const X,
+		sptNnzIndex const x,
+		sptSparseTensor const * const Y,
+		sptNnzIndex const y)
+{
+	for(sptIndex m=0; m<X->nmodes; ++m) {
+		sptIndex const a = X->inds[m].data[x];
+		sptIndex const b = Y->inds[m].data[y];
+		if(a != b) {
+			return a < b ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+
+static int dot_check_shape(sptSparseTensor const * const X, sptSparseTensor const * const Y, char const * const name)
+{
+	if(X->nmodes != Y->nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, name, "X->nmodes != Y->nmodes");
+	}
+	for(sptIndex m=0; m<X->nmodes; ++m) {
+		if(X->ndims[m] != Y->ndims[m]) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, name, "X->ndims[m] != Y->ndims[m]");
+		}
+	}
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, name, "pattern-only tensor");
+	}
+	if(Y->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, name, "pattern-only tensor");
+	}
+	return 0;
+}
+
+
+/* The natural mode order 0, 1, ..., nmodes-1 the merges run in, NULL if out of memory. */
+static sptIndex * dot_order(sptIndex const nmodes)
+{
+	sptIndex * order = malloc(nmodes * sizeof *order);
+	if(order != NULL) {
+		for(sptIndex m=0; m<nmodes; ++m) {
+			order[m] = m;
+		}
+	}
+	return order;
+}
+
+
+static int dot_new_output(sptSparseTensor * const Z, sptSparseTensor const * const X, sptNnzIndex const nnz, char const * const name)
+{
+	int result = sptNewSparseTensor(Z, X->nmodes, X->ndims);
+	spt_CheckError(result, name, NULL);
+	for(sptIndex m=0; m<X->nmodes; ++m) {
+		result = sptResizeIndexVector(&Z->inds[m], nnz);
+		spt_CheckError(result, name, NULL);
+	}
+	result = sptResizeValueVector(&Z->values, nnz);
+	spt_CheckError(result, name, NULL);
+	Z->nnz = nnz;
+	/* The merges emit coordinates in mode order. */
+	for(sptIndex m=0; m<X->nmodes; ++m) {
+		Z->sortorder[m] = m;
+	}
+	return 0;
+}
+
+
+/*
+ * Merge-path split of diagonal d: the i + j = d nonzeros of X and Y that come
+ * first in the merged order, ties taking X first. A Y entry equal to the last
+ * X entry taken is moved before the split too, so matching pairs are never
+ * divided between threads.
+ */
+static void dot_split(
+		sptSparseTensor const * const X,
+		sptSparseTensor const * const Y,
+		sptNnzIndex const d,
+		sptNnzIndex * const i,
+		sptNnzIndex * const j)
+{
+	sptNnzIndex lo = d > Y->nnz ? d - Y->nnz : 0;
+	sptNnzIndex hi = d < X->nnz ? d : X->nnz;
+	while(lo < hi) {
+		sptNnzIndex const mid = lo + (hi - lo) / 2;
+		if(dot_compare(X, mid, Y, d - mid - 1) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*i = lo;
+	*j = d - lo;
+	if(*i > 0 && *j < Y->nnz && dot_compare(X, *i - 1, Y, *j) == 0) {
+		++*j;
+	}
+}
+
+
+/*
+ * Merge X[xb, xe) with Y[yb, ye). ADD and SUB keep the union, MUL the
+ * intersection. With Z NULL only counts, otherwise writes from Z position
+ * out. Returns the number of output nonzeros.
+ */
+static sptNnzIndex dot_merge(
+		sptSparseTensor * const Z,
+		sptNnzIndex const out,
+		sptSparseTensor const * const X,
+		sptNnzIndex xb,
+		sptNnzIndex const xe,
+		sptSparseTensor const * const Y,
+		sptNnzIndex yb,
+		sptNnzIndex const ye,
+		spt_DotOp const op,
+		int const collectZero)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex n = 0;
+
+	while(xb < xe || yb < ye) {
+		int const c = xb < xe && yb < ye ? dot_compare(X, xb, Y, yb) : (xb < xe ? -1 : 1);
+		sptSparseTensor const * src = X;
+		sptNnzIndex at = xb;
+		sptValue v;
+		if(c < 0) {
+			v = X->values.data[xb++];
+			if(op == SPT_DOT_MUL) {
+				continue;
+			}
+		} else if(c > 0) {
+			src = Y;
+			at = yb;
+			v = op == SPT_DOT_SUB ? -Y->values.data[yb] : Y->values.data[yb];
+			++yb;
+			if(op == SPT_DOT_MUL) {
+				continue;
+			}
+		} else {
+			v = dot_apply(op, X->values.data[xb++], Y->values.data[yb++]);
+		}
+		if(collectZero && v == 0) {
+			continue;
+		}
+		if(Z != NULL) {
+			for(sptIndex m=0; m<nmodes; ++m) {
+				Z->inds[m].data[out + n] = src->inds[m].data[at];
+			}
+			Z->values.data[out + n] = v;
+		}
+		++n;
+	}
+	return n;
+}
+
+
+/*
+ * Z = X op Y on sorted tensors. Each thread takes an equal share of the
+ * nx + ny merge steps, found by binary search, counts its output, and after
+ * a prefix sum over the counts writes it at its offset.
+ */
+static int dot_merge_tensors(
+		sptSparseTensor * const Z,
+		sptSparseTensor const * const X,
+		sptSparseTensor const * const Y,
+		spt_DotOp const op,
+		int const collectZero,
+		int const tk,
+		char const * const name)
+{
+	sptNnzIndex const total = X->nnz + Y->nnz;
+	int result = dot_check_shape(X, Y, name);
+	spt_CheckError(result, name, NULL);
+
+	sptNnzIndex * splits = malloc(2 * ((size_t)tk + 1) * sizeof *splits);
+	sptNnzIndex * counts = malloc(((size_t)tk + 1) * sizeof *counts);
+	spt_CheckOSError(!splits || !counts, name);
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		sptNnzIndex * const split = splits + 2 * (size_t)tid;
+		dot_split(X, Y, total * (tid + 1) / nt, &split[2], &split[3]);
+		if(tid == 0) {
+			split[0] = 0;
+			split[1] = 0;
+		}
+#pragma omp barrier
+		counts[tid + 1] = dot_merge(NULL, 0, X, split[0], split[2], Y, split[1], split[3], op, collectZero);
+#pragma omp barrier
+#pragma omp single
+		{
+			counts[0] = 0;
+			for(int t=0; t<nt; ++t) {
+				counts[t + 1] += counts[t];
+			}
+			result = dot_new_output(Z, X, counts[nt], name);
+		}
+		if(result == 0) {
+			dot_merge(Z, counts[tid], X, split[0], split[2], Y, split[1], split[3], op, collectZero);
+		}
+	}
+	free(splits);
+	free(counts);
+
+	return result;
+}
+
+
+/*
+ * Z = X op Y on tensors with identical coordinates, position by position.
+ * Zeros are dropped through the same count and prefix sum as the merge.
+ */
+static int dot_eq_tensors(
+		sptSparseTensor * const Z,
+		sptSparseTensor const * const X,
+		sptSparseTensor const * const Y,
+		spt_DotOp const op,
+		int const collectZero,
+		int const tk,
+		char const * const name)
+{
+	sptNnzIndex const nnz = X->nnz;
+	int result = dot_check_shape(X, Y, name);
+	spt_CheckError(result, name, NULL);
+	if(X->nnz != Y->nnz) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, name, "X->nnz != Y->nnz");
+	}
+	sptValue const * const xvals = X->values.data;
+	sptValue const * const yvals = Y->values.data;
+	if(op == SPT_DOT_DIV) {
+		int zero = 0;
+#pragma omp parallel for num_threads(tk) reduction(|:zero)
+		for(sptNnzIndex x=0; x<nnz; ++x) {
+			zero |= yvals[x] == 0;
+		}
+		if(zero) {
+			spt_CheckError(SPTERR_ZERO_DIVISION, name, "Y has a zero value");
+		}
+	}
+
+	sptNnzIndex * counts = malloc(((size_t)tk + 1) * sizeof *counts);
+	spt_CheckOSError(!counts, name);
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		sptNnzIndex const begin = nnz * tid / nt;
+		sptNnzIndex const end = nnz * (tid + 1) / nt;
+		sptNnzIndex n = 0;
+		for(sptNnzIndex x=begin; x<end; ++x) {
+			n += !collectZero || dot_apply(op, xvals[x], yvals[x]) != 0;
+		}
+		counts[tid + 1] = n;
+#pragma omp barrier
+#pragma omp single
+		{
+			counts[0] = 0;
+			for(int t=0; t<nt; ++t) {
+				counts[t + 1] += counts[t];
+			}
+			result = dot_new_output(Z, X, counts[nt], name);
+		}
+		if(result == 0) {
+			sptNnzIndex p = counts[tid];
+			for(sptNnzIndex x=begin; x<end; ++x) {
+				sptValue const v = dot_apply(op, xvals[x], yvals[x]);
+				if(collectZero && v == 0) {
+					continue;
+				}
+				for(sptIndex m=0; m<X->nmodes; ++m) {
+					Z->inds[m].data[p] = X->inds[m].data[x];
+				}
+				Z->values.data[p++] = v;
+			}
+		}
+	}
+	free(counts);
+
+	return result;
+}
+
+
+static int dot_seq(
+		sptSparseTensor * const Z,
+		sptSparseTensor const * const X,
+		sptSparseTensor const * const Y,
+		spt_DotOp const op,
+		int const collectZero,
+		char const * const name)
+{
+	int result = dot_check_shape(X, Y, name);
+	spt_CheckError(result, name, NULL);
+	sptIndex * order = dot_order(X->nmodes);
+	spt_CheckOSError(!order, name);
+	int const sorted = sptSparseTensorIsSortedByOrder(X, order) && sptSparseTensorIsSortedByOrder(Y, order);
+	free(order);
+	if(!sorted) {
+		spt_CheckError(SPTERR_VALUE_ERROR, name, "X and Y must be sorted in mode order");
+	}
+	return dot_merge_tensors(Z, X, Y, op, collectZero, 1, name);
+}
+
+
+static int dot_omp(
+		sptSparseTensor * const Z,
+		sptSparseTensor * const X,
+		sptSparseTensor * const Y,
+		spt_DotOp const op,
+		int const collectZero,
+		int const nthreads,
+		char const * const name)
+{
+	int result = dot_check_shape(X, Y, name);
+	spt_CheckError(result, name, NULL);
+	sptIndex * order = dot_order(X->nmodes);
+	spt_CheckOSError(!order, name);
+	if(!sptSparseTensorIsSortedByOrder(X, order)) {
+		result = sptSparseTensorSortByOrder(X, order);
+	}
+	if(result == 0 && !sptSparseTensorIsSortedByOrder(Y, order)) {
+		result = sptSparseTensorSortByOrder(Y, order);
+	}
+	free(order);
+	spt_CheckError(result, name, NULL);
+	return dot_merge_tensors(Z, X, Y, op, collectZero, nthreads, name);
+}
+
+
+/**
+ * Element-wise sum of two sparse tensors
+ * @param[out] Z    an uninitialized sparse tensor, receives X + Y sorted in mode order
+ * @param[in]  X, Y    sparse tensors of the same shape, each sorted in mode order
+ * (sptSparseTensorSortByOrder with 0, 1, ..., nmodes-1) and free of duplicates
+ * @param[in]  collectZero    nonzero to drop entries whose result is 0
+ *
+ * Coordinates in either tensor appear in Z, coordinates in both are added.
+ */
+int sptSparseTensorDotAdd(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_seq(Z, X, Y, SPT_DOT_ADD, collectZero, "SpTns DotAdd");
+}
+
+
+/**
+ * OpenMP element-wise sum of two sparse tensors
+ * @param nthreads    the number of threads, X and Y are sorted in place if
+ * needed, the other parameters are as for sptSparseTensorDotAdd
+ *
+ * The merge is split by merge path: each thread binary searches where its
+ * equal share of the nnz(X) + nnz(Y) merge steps starts, so the partition
+ * needs no serial pass over the tensors.
+ */
+int sptOmpSparseTensorDotAdd(sptSparseTensor *Z, sptSparseTensor *X, sptSparseTensor *Y, int collectZero, int nthreads)
+{
+	return dot_omp(Z, X, Y, SPT_DOT_ADD, collectZero, nthreads, "Omp SpTns DotAdd");
+}
+
+
+/**
+ * Element-wise difference of two sparse tensors
+ * @param[out] Z    an uninitialized sparse tensor, receives X - Y
+ * @param X, Y, collectZero    as for sptSparseTensorDotAdd
+ */
+int sptSparseTensorDotSub(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_seq(Z, X, Y, SPT_DOT_SUB, collectZero, "SpTns DotSub");
+}
+
+
+/**
+ * OpenMP element-wise difference of two sparse tensors
+ * @param Z, X, Y, collectZero, nthreads    as for sptOmpSparseTensorDotAdd
+ */
+int sptOmpSparseTensorDotSub(sptSparseTensor *Z, sptSparseTensor *X, sptSparseTensor *Y, int collectZero, int nthreads)
+{
+	return dot_omp(Z, X, Y, SPT_DOT_SUB, collectZero, nthreads, "Omp SpTns DotSub");
+}
+
+
+/**
+ * Element-wise product of two sparse tensors
+ * @param[out] Z    an uninitialized sparse tensor, receives X .* Y on the
+ * coordinates present in both
+ * @param X, Y, collectZero    as for sptSparseTensorDotAdd
+ */
+int sptSparseTensorDotMul(sptSparseTensor *Z, const sptSparseTensor * X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_seq(Z, X, Y, SPT_DOT_MUL, collectZero, "SpTns DotMul");
+}
+
+
+/**
+ * OpenMP element-wise product of two sparse tensors
+ * @param Z, X, Y, collectZero, nthreads    as for sptOmpSparseTensorDotAdd
+ */
+int sptOmpSparseTensorDotMul(sptSparseTensor *Z, sptSparseTensor *X, sptSparseTensor *Y, int collectZero, int nthreads)
+{
+	return dot_omp(Z, X, Y, SPT_DOT_MUL, collectZero, nthreads, "Omp SpTns DotMul");
+}
+
+
+/**
+ * Element-wise sum of two sparse tensors with the same nonzero pattern
+ * @param[out] Z    an uninitialized sparse tensor, receives X + Y with X's coordinates
+ * @param[in]  X, Y    sparse tensors of the same shape and nnz whose coordinates match position by position
+ * @param[in]  collectZero    nonzero to drop entries whose result is 0
+ */
+int sptSparseTensorDotAddEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_ADD, collectZero, 1, "SpTns DotAddEq");
+}
+
+
+/**
+ * OpenMP element-wise sum of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotAddEq, runs on the default number of threads
+ */
+int sptOmpSparseTensorDotAddEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_ADD, collectZero, omp_get_max_threads(), "Omp SpTns DotAddEq");
+}
+
+
+/**
+ * Element-wise difference of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotAddEq, Z receives X - Y
+ */
+int sptSparseTensorDotSubEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_SUB, collectZero, 1, "SpTns DotSubEq");
+}
+
+
+/**
+ * OpenMP element-wise difference of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotSubEq
+ */
+int sptOmpSparseTensorDotSubEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_SUB, collectZero, omp_get_max_threads(), "Omp SpTns DotSubEq");
+}
+
+
+/**
+ * Element-wise product of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotAddEq, Z receives X .* Y
+ */
+int sptSparseTensorDotMulEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_MUL, collectZero, 1, "SpTns DotMulEq");
+}
+
+
+/**
+ * OpenMP element-wise product of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotMulEq
+ */
+int sptOmpSparseTensorDotMulEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_MUL, collectZero, omp_get_max_threads(), "Omp SpTns DotMulEq");
+}
+
+
+/**
+ * Element-wise quotient of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotAddEq, Z receives X ./ Y
+ *
+ * Fails with SPTERR_ZERO_DIVISION if Y holds a zero.
+ */
+int sptSparseTensorDotDivEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_DIV, collectZero, 1, "SpTns DotDivEq");
+}
+
+
+/**
+ * OpenMP element-wise quotient of two sparse tensors with the same nonzero pattern
+ * @param Z, X, Y, collectZero    as for sptSparseTensorDotDivEq
+ */
+int sptOmpSparseTensorDotDivEq(sptSparseTensor *Z, const sptSparseTensor *X, const sptSparseTensor *Y, int collectZero)
+{
+	return dot_eq_tensors(Z, X, Y, SPT_DOT_DIV, collectZero, omp_get_max_threads(), "Omp SpTns DotDivEq");
+}
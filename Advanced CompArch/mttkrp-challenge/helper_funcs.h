@@ -38,11 +38,44 @@ int sptStopTimer(sptTimer timer);
 double sptElapsedTime(const sptTimer timer);
 double sptPrintElapsedTime(const sptTimer timer, const char *name);
 double sptPrintAverageElapsedTime(const sptTimer timer, const int niters, const char *name);
+void sptPrintTotalTime(double const total_time);
+int sptSetTimerPrint(int const on);
 int sptFreeTimer(sptTimer timer);
 
 /* Base functions */
 char * sptBytesString(uint64_t const bytes);
 sptValue sptRandomValue(void);
+long sptCacheSize(int const level);
+
+/* Sorting */
+int spt_RadixSortPairs(uint64_t * keys, sptNnzIndex * vals, sptNnzIndex const n, unsigned const lo, unsigned const hi);
+
+/**
+ * SplitMix64 finalizer, a bijective 64-bit mixing function
+ */
+static inline uint64_t spt_SplitMix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/**
+ * Counter-based pseudorandom value in [-3, 3], a pure function of its key
+ *
+ * @param key   per-row key, spt_SplitMix64(seed ^ spt_SplitMix64(row))
+ * @param col   the column counter
+ *
+ * Having no state, it gives the same value for (seed, row, col) whichever
+ * thread computes it and in whichever order.
+ */
+static inline sptValue sptCounterRandomValue(uint64_t const key, uint64_t const col)
+{
+	uint64_t const h = spt_SplitMix64(key + col * 0x9E3779B97F4A7C15ULL);
+	/* 24 random bits fill a float mantissa */
+	return (sptValue)3.0 * ((sptValue)(h >> 40) * (sptValue)(2.0 / 16777216.0) - (sptValue)1.0);
+}
 
 
 
@@ -72,10 +72,14 @@ static int p_tt_read_file(sptSparseTensor *tsr, sptIndex start_index, FILE *fp)
 	sptIndex mode;
 	iores = fscanf(fp, "%u", &tsr->nmodes);
 	spt_CheckOSError(iores < 0, "SpTns Load");
-	/* Only allocate space for sortorder, initialized to 0s. */
+	tsr->arena = NULL;
+	tsr->pattern = false;
+	/* Only allocate space for sortorder, marked unsorted (not a permutation). */
 	tsr->sortorder = malloc(tsr->nmodes * sizeof tsr->sortorder[0]);
 	spt_CheckOSError(!tsr->sortorder, "SpTns Load");
-	memset(tsr->sortorder, 0, tsr->nmodes * sizeof tsr->sortorder[0]);
+	for(mode = 0; mode < tsr->nmodes; ++mode) {
+		tsr->sortorder[mode] = tsr->nmodes;
+	}
 	tsr->ndims = malloc(tsr->nmodes * sizeof *tsr->ndims);
 	spt_CheckOSError(!tsr->ndims, "SpTns Load");
 	for(mode = 0; mode < tsr->nmodes; ++mode) {
@@ -118,7 +122,7 @@ static int p_tt_read_file(sptSparseTensor *tsr, sptIndex start_index, FILE *fp)
 	for(mode = 0; mode < tsr->nmodes; ++mode) {
 		tsr->inds[mode].len = tsr->nnz;
 	}
-	// sptSparseTensorCollectZeros(tsr);
+	/* Duplicates and zeros are kept as read, see sptSparseTensorCoalesce. */
 
 	return 0;
 }
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <getopt.h>
 //#include <pasta.h>
 //#include "../src/sptensor/sptensor.h"
@@ -27,6 +28,7 @@
 #include "error.h"
 #include "helper_funcs.h"
 #include "types.h"
+#include "vector.h"
 #include "sptensors.h"
 #include "matricies.h"
 
@@ -37,26 +39,385 @@ static void print_usage(char ** argv) {
 	printf("         -m MODE, --mode=MODE (specify a mode, e.g., 0 (default) or 1 or 2 for third-order tensors.)\n");
 	printf("         -d DEV_ID, --dev-id=DEV_ID (-2:sequential,default; -1:OpenMP parallel)\n");
 	printf("         -r RANK (the number of matrix columns, 16:default)\n");
+	printf("         -k KERNEL, --kernel=KERNEL (coo:default; plan: reusable plan with preallocated workspace; steal: plan with work-stealing row-owning tasks; numa: node-local tensor partitions and factor replicas; rank-tiled: rank split into cache-sized column panels; tiled: nonzeros grouped into tiles whose factor rows fit in L2; prefetch: software prefetching with a tuned lookahead; segmented: sort by mode, one write per output row; packed: one padded record per nonzero instead of an array per mode; hybrid: dense blocks for dense slices, COO for the rest; spmm: CSR matricization times Khatri-Rao blocks formed on the fly; sampled: unbiased estimate from nnz/16 draws weighted by |value|, reports its error; ttm: tensor times U[mode] into a semi-sparse tensor instead of MTTKRP, -o writes its fibers)\n");
 	printf("         -v VALIDATION, --validate=VALIDFILE (a previous output file to compare against). This also removes randomisation from matrix creation\n");
+	printf("         -b MANIFEST, --batch=MANIFEST (MTTKRP of every tensor listed in MANIFEST, one per line, on a shared thread team; reports tensors/s)\n");
+	printf("         -z, --coalesce (sum duplicate coordinates and drop zeros after loading)\n");
+	printf("         --mem-budget=SIZE (pick the fastest kernel whose tensor, factors, output and kernel state fit in SIZE bytes, K/M/G suffixes allowed; overrides -k)\n");
+	printf("         -H, --huge-pages (place the tensor, the matrices and the kernel's derived format in arenas backed by transparent huge pages)\n");
+	printf("         --publish=NAME (copy the loaded tensor into shared memory NAME, or a file if NAME is a path, for other processes to --attach; sorted by -m first for -k segmented)\n");
+	printf("         --attach=NAME (use the tensor published as NAME instead of -i, read-only and without a copy)\n");
+	printf("         --unpublish=NAME (remove NAME unless running processes are still attached, and exit)\n");
+	printf("         --force (with --unpublish, remove NAME even while processes are attached)\n");
+	printf("         --padding=PAD (round matrix rows up to: vector, 8 values, default; line, a 64-byte cache line; none)\n");
+	printf("         --panels (with -k rank-tiled, lay the factors and output out in column panels of the rank tile before timing)\n");
+	printf("         --pattern (drop the values, which must all be 1, and run the pattern-only kernel; done without asking for coo, plan, steal, segmented and packed when every value is 1)\n");
+	printf("         -c, --check (run every MTTKRP kernel and element-wise operation on generated tensors against a reference, no input needed)\n");
+	printf("         -p, --profile (report per-thread load balance, write conflicts and slice size histograms)\n");
 	printf("         --help\n");
 	printf("\n");
 }
 /* Function declaration */
 int compareFile(FILE * fPtr1, FILE * fPtr2);
 
+/**
+ * The kernel selected on the command line and whatever it prepared up front
+ */
+struct bench {
+	char kernel[64];
+	int dev_id;
+	int nthreads;
+	bool planned;
+	sptMTTKRPStrategy strategy;
+	sptMTTKRPPlan plan;
+	bool replicated;
+	sptMTTKRPNuma numa;
+	sptIndex tile;
+	sptNnzIndex block;
+	bool panels;
+	bool tiled;
+	sptSparseTensorTiled tiles;
+	bool prefetch;
+	sptIndex dist;
+	bool segmented;
+	bool packed;
+	sptSparseTensorPacked pk;
+	bool hybrid;
+	sptSparseTensorHybrid hyb;
+	bool spmm;
+	sptMTTKRPSpMM csr;
+	bool ttm;
+	sptSemiSparseTensor y;
+	sptNnzIndexVector fibers;
+	bool sampled;
+	sptMTTKRPSampler sampler;
+	sptNnzIndex nsamples;
+	double variance;
+};
+
+static int bench_prepare(struct bench * b, sptSparseTensor * X, sptMatrix ** U, sptIndex const * mats_order, sptIndex mode) {
+	if(strcmp(b->kernel, "plan") == 0) {
+		b->planned = true;
+		return sptNewMTTKRPPlan(&b->plan, X, U, mats_order, mode, b->nthreads, b->strategy);
+	} else if(strcmp(b->kernel, "steal") == 0) {
+		b->planned = true;
+		return sptNewMTTKRPPlan(&b->plan, X, U, mats_order, mode, b->nthreads, SPT_MTTKRP_STEALING);
+	} else if(strcmp(b->kernel, "numa") == 0) {
+		int result = sptNewMTTKRPNuma(&b->numa, X, U, mode, b->nthreads);
+		if(result != 0) {
+			return result;
+		}
+		b->planned = true;
+		b->replicated = true;
+		return sptMTTKRPNumaReplicate(&b->numa, U);
+	} else if(strcmp(b->kernel, "tiled") == 0) {
+		sptTimer timer;
+		sptNewTimer(&timer, 0);
+		sptStartTimer(timer);
+		int result = sptNewSparseTensorTiled(&b->tiles, X, mode, U[X->nmodes]->ncols, 0);
+		sptStopTimer(timer);
+		sptPrintElapsedTime(timer, "Tiling");
+		sptFreeTimer(timer);
+		if(result != 0) {
+			return result;
+		}
+		b->tiled = true;
+		sptSparseTensorTiledStatus(&b->tiles, stdout);
+	} else if(strcmp(b->kernel, "prefetch") == 0) {
+		int result = sptMTTKRPPrefetchTune(&b->dist, X, U, mats_order, mode, b->dev_id == -1 ? b->nthreads : 1, stdout);
+		if(result != 0) {
+			return result;
+		}
+		b->prefetch = true;
+		printf("prefetch distance: %"PASTA_PRI_INDEX "\n", b->dist);
+	} else if(strcmp(b->kernel, "segmented") == 0) {
+		b->segmented = true;
+		return sptSparseTensorSortByMode(X, mode);
+	} else if(strcmp(b->kernel, "packed") == 0) {
+		int result = sptNewSparseTensorPacked(&b->pk, X);
+		if(result != 0) {
+			return result;
+		}
+		b->packed = true;
+		sptSparseTensorPackedStatus(&b->pk, stdout);
+	} else if(strcmp(b->kernel, "hybrid") == 0) {
+		/* Slice along whichever mode moves the most nonzeros into blocks. */
+		for(sptIndex m=0; m<X->nmodes; ++m) {
+			sptSparseTensorHybrid candidate;
+			int result = sptNewSparseTensorHybrid(&candidate, X, m, 0.5);
+			if(result != 0) {
+				return result;
+			}
+			if(!b->hybrid || candidate.dense_nnz > b->hyb.dense_nnz) {
+				if(b->hybrid) {
+					sptFreeSparseTensorHybrid(&b->hyb);
+				}
+				b->hyb = candidate;
+				b->hybrid = true;
+			} else {
+				sptFreeSparseTensorHybrid(&candidate);
+			}
+		}
+		sptSparseTensorHybridStatus(&b->hyb, stdout);
+	} else if(strcmp(b->kernel, "spmm") == 0) {
+		sptTimer timer;
+		sptNewTimer(&timer, 0);
+		sptStartTimer(timer);
+		int result = sptNewMTTKRPSpMM(&b->csr, X, mats_order, mode, U[X->nmodes]->ncols, 0);
+		sptStopTimer(timer);
+		sptPrintElapsedTime(timer, "Matricize");
+		sptFreeTimer(timer);
+		if(result != 0) {
+			return result;
+		}
+		b->spmm = true;
+		sptMTTKRPSpMMStatus(&b->csr, stdout);
+	} else if(strcmp(b->kernel, "ttm") == 0) {
+		int result = sptSparseTensorMulMatrixPrepare(&b->y, &b->fibers, X, U[mode], mode);
+		if(result != 0) {
+			return result;
+		}
+		b->ttm = true;
+	} else if(strcmp(b->kernel, "sampled") == 0) {
+		/* One draw per 16 nonzeros, weighted by |value|. */
+		b->nsamples = X->nnz / 16 > 2 ? X->nnz / 16 : 2;
+		int result = sptNewMTTKRPSampler(&b->sampler, X, U, mode, SPT_SAMPLE_VALUE);
+		if(result != 0) {
+			return result;
+		}
+		b->sampled = true;
+		printf("sampled: %"PASTA_PRI_NNZ_INDEX " draws of %"PASTA_PRI_NNZ_INDEX " nonzeros\n", b->nsamples, X->nnz);
+	} else if(strcmp(b->kernel, "rank-tiled") == 0) {
+		sptMTTKRPRankTile(&b->tile, &b->block, X->nmodes, U[X->nmodes]->ncols);
+		printf("rank tile: %"PASTA_PRI_INDEX " columns, %"PASTA_PRI_NNZ_INDEX " nonzeros per block\n", b->tile, b->block);
+		if(b->panels) {
+			double const start = omp_get_wtime();
+			for(sptIndex m=0; m<=X->nmodes; ++m) {
+				int result = sptMatrixSetLayout(U[m], U[m]->padding, SPT_LAYOUT_PANELS, b->tile);
+				if(result != 0) {
+					return result;
+				}
+			}
+			printf("panels: %"PASTA_PRI_INDEX " columns each, converted in %.6lf s\n", b->tile, omp_get_wtime() - start);
+		}
+	} else if(strcmp(b->kernel, "coo") != 0) {
+		fprintf(stderr, "Error: unknown kernel '%s'.\n", b->kernel);
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_run(struct bench * b, sptSparseTensor * X, sptMatrix ** U, sptIndex const * mats_order, sptIndex mode) {
+	if(b->replicated) {
+		return sptMTTKRPNumaExecute(&b->numa, mats_order, U);
+	} else if(b->planned) {
+		return sptMTTKRPExecute(&b->plan, U);
+	} else if(b->tiled) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPTiled(&b->tiles, U, mats_order, b->nthreads);
+		}
+		return sptMTTKRPTiled(&b->tiles, U, mats_order);
+	} else if(b->prefetch) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPPrefetch(X, U, mats_order, mode, b->dist, b->nthreads);
+		}
+		return sptMTTKRPPrefetch(X, U, mats_order, mode, b->dist);
+	} else if(b->segmented) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPSegmented(X, U, mats_order, mode, b->nthreads);
+		}
+		return sptMTTKRPSegmented(X, U, mats_order, mode);
+	} else if(b->packed) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPPacked(&b->pk, U, mats_order, mode, b->nthreads);
+		}
+		return sptMTTKRPPacked(&b->pk, U, mats_order, mode);
+	} else if(b->hybrid) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPHybrid(&b->hyb, U, mats_order, mode, b->nthreads);
+		}
+		return sptMTTKRPHybrid(&b->hyb, U, mats_order, mode);
+	} else if(b->spmm) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPSpMMExecute(&b->csr, U, b->nthreads);
+		}
+		return sptMTTKRPSpMMExecute(&b->csr, U);
+	} else if(b->ttm) {
+		if(b->dev_id == -1) {
+			return sptOmpSparseTensorMulMatrixFill(&b->y, &b->fibers, X, U[mode], mode);
+		}
+		return sptSparseTensorMulMatrixFill(&b->y, &b->fibers, X, U[mode], mode);
+	} else if(b->sampled) {
+		return sptMTTKRPSampled(&b->variance, &b->sampler, X, U, mats_order, b->nsamples, 1234, b->dev_id == -1 ? b->nthreads : 1);
+	} else if(b->tile != 0) {
+		if(b->dev_id == -1) {
+			return sptOmpMTTKRPRankTiled(X, U, mats_order, mode, b->tile, b->block, b->nthreads);
+		}
+		return sptMTTKRPRankTiled(X, U, mats_order, mode, b->tile, b->block);
+	}
+	if(b->dev_id == -1) {
+		return sptOmpMTTKRP(X, U, mats_order, mode, b->nthreads);
+	}
+	return sptMTTKRP(X, U, mats_order, mode);
+}
+
+/* What the kernel holds beyond the tensor, factors and output. */
+static size_t bench_bytes(struct bench const * b, sptSparseTensor const * X) {
+	if(b->replicated) {
+		return sptMTTKRPNumaBytes(&b->numa);
+	} else if(b->planned) {
+		return sptMTTKRPPlanBytes(&b->plan);
+	} else if(b->tiled) {
+		return sptSparseTensorTiledBytes(&b->tiles);
+	} else if(b->packed) {
+		return sptSparseTensorPackedBytes(&b->pk);
+	} else if(b->hybrid) {
+		return sptSparseTensorHybridBytes(&b->hyb);
+	} else if(b->spmm) {
+		return sptMTTKRPSpMMBytes(&b->csr);
+	} else if(b->sampled) {
+		return sptMTTKRPSamplerBytes(&b->sampler, X);
+	}
+	return 0;
+}
+/* The arena bytes bench_move_to_arena takes, 0 if the kernel has nothing to move. */
+static size_t bench_arena_size(struct bench const * b) {
+	if(b->replicated) {
+		return 0;
+	} else if(b->planned) {
+		return sptMTTKRPPlanArenaSize(&b->plan);
+	} else if(b->tiled) {
+		return sptSparseTensorTiledArenaSize(&b->tiles);
+	} else if(b->packed) {
+		return sptSparseTensorPackedArenaSize(&b->pk);
+	} else if(b->hybrid) {
+		return sptSparseTensorHybridArenaSize(&b->hyb);
+	} else if(b->spmm) {
+		return sptMTTKRPSpMMArenaSize(&b->csr);
+	}
+	return 0;
+}
+/* Move what bench_prepare built into an arena, for -H. */
+static int bench_move_to_arena(struct bench * b, sptArena * arena) {
+	if(b->replicated) {
+		return 0;
+	} else if(b->planned) {
+		return sptMTTKRPPlanMoveToArena(&b->plan, arena);
+	} else if(b->tiled) {
+		return sptSparseTensorTiledMoveToArena(&b->tiles, arena);
+	} else if(b->packed) {
+		return sptSparseTensorPackedMoveToArena(&b->pk, arena);
+	} else if(b->hybrid) {
+		return sptSparseTensorHybridMoveToArena(&b->hyb, arena);
+	} else if(b->spmm) {
+		return sptMTTKRPSpMMMoveToArena(&b->csr, arena);
+	}
+	return 0;
+}
+/* Whether the kernel runs on a pattern-only tensor. */
+static bool bench_takes_pattern(char const * kernel) {
+	return strcmp(kernel, "coo") == 0 || strcmp(kernel, "plan") == 0 || strcmp(kernel, "steal") == 0 ||
+			strcmp(kernel, "segmented") == 0 || strcmp(kernel, "packed") == 0;
+}
+
+/* Parse a byte count with an optional K, M or G (binary) suffix, 0 if malformed. */
+static size_t parse_bytes(char const * s) {
+	char * end;
+	double const value = strtod(s, &end);
+	double scale = 1;
+	switch(*end) {
+		case 'K': case 'k': scale = 1024.; ++end; break;
+		case 'M': case 'm': scale = 1024. * 1024.; ++end; break;
+		case 'G': case 'g': scale = 1024. * 1024. * 1024.; ++end; break;
+	}
+	if(end == s || *end != '\0' || value <= 0) {
+		return 0;
+	}
+	return (size_t)(value * scale);
+}
+static void bench_free(struct bench * b) {
+	if(b->replicated) {
+		sptFreeMTTKRPNuma(&b->numa);
+	} else if(b->planned) {
+		sptFreeMTTKRPPlan(&b->plan);
+	} else if(b->tiled) {
+		sptFreeSparseTensorTiled(&b->tiles);
+	} else if(b->packed) {
+		sptFreeSparseTensorPacked(&b->pk);
+	} else if(b->hybrid) {
+		sptFreeSparseTensorHybrid(&b->hyb);
+	} else if(b->spmm) {
+		sptFreeMTTKRPSpMM(&b->csr);
+	} else if(b->ttm) {
+		sptFreeSemiSparseTensor(&b->y);
+		free(b->fibers.data);
+	} else if(b->sampled) {
+		sptFreeMTTKRPSampler(&b->sampler);
+	}
+}
+
+/**
+ * Batch mode: every tensor of a manifest, throughput over niters passes
+ */
+static int run_batch(char const * manifest, sptIndex R, sptIndex mode, int niters) {
+	sptSparseTensorBatch batch;
+	double elapsed;
+	int const nthreads = omp_get_max_threads();
+
+	sptAssert(sptLoadSparseTensorBatch(&batch, manifest) == 0);
+	printf("batch: %"PASTA_PRI_INDEX " tensors, %"PASTA_PRI_NNZ_INDEX " nnz, nthreads: %d\n", batch.ntensors, batch.total_nnz, nthreads);
+	double * checksums = malloc((batch.ntensors > 0 ? batch.ntensors : 1) * sizeof *checksums);
+	sptAssert(checksums != NULL);
+
+	/* For warm-up caches, timing not included */
+	sptAssert(sptMTTKRPBatch(checksums, &elapsed, &batch, R, mode, nthreads, 1) == 0);
+	sptAssert(sptMTTKRPBatch(checksums, &elapsed, &batch, R, mode, nthreads, niters) == 0);
+
+	double checksum = 0;
+	for(sptIndex t=0; t<batch.ntensors; ++t) {
+		checksum += checksums[t];
+	}
+	double const per_pass = elapsed / niters;
+	printf("[Average batch pass]: %.9lf s\n", per_pass);
+	printf("Throughput: %.1lf tensors/s, %.2lf Mnnz/s, %.3lf ms per tensor (checksum %e)\n\n",
+					batch.ntensors / per_pass, batch.total_nnz / per_pass / 1e6,
+					batch.ntensors > 0 ? per_pass * 1e3 / batch.ntensors : 0.0, checksum);
+
+	free(checksums);
+	sptFreeSparseTensorBatch(&batch);
+	return 0;
+}
+
 /**
  * Benchmark Matriced Tensor Times Khatri-Rao Product (MTTKRP), tensor in COO format, matrices are dense.
  */
 int main(int argc, char ** argv)
 {
 	FILE *fo = NULL;
-	char fname[1000];
+	char fname[1000] = "";
 	char fvname[1000];
 	char foname[1000];
+	char fbname[1000] = "";
 	sptSparseTensor X;
 	sptMatrix ** U;
+	struct bench bench = { .kernel = "coo", .dev_id = -2, .nthreads = 1 };
 
 	bool random = true;
+	bool profile = false;
+	bool check = false;
+	bool coalesce = false;
+	bool huge_pages = false;
+	bool pattern = false;
+	size_t mem_budget = 0;
+	sptMatrixPadding padding = SPT_PAD_VECTOR;
+	char fsname[256] = "";
+	bool publish = false;
+	bool force = false;
+	char funame[256] = "";
+	bool shared = false;
+	sptSharedStore store;
+	sptArena arena = { NULL, 0, 0, 0 };
+	sptArena kernel_arena = { NULL, 0, 0, 0 };
 	sptIndex mode = 0;
 	sptIndex R = 16;
 	int dev_id = -2;
@@ -64,7 +425,7 @@ int main(int argc, char ** argv)
 	int nthreads = 1;
 	printf("niters: %d\n", niters);
 
-	if(argc <= 3) { // #Required arguments
+	if(argc < 2) { // #Required arguments
 		print_usage(argv);
 		exit(1);
 	}
@@ -76,14 +437,28 @@ int main(int argc, char ** argv)
 			{"dev-id", optional_argument, 0, 'd'},
 			{"rank", optional_argument, 0, 'r'},
 			{"nthreads", optional_argument, 0, 't'},
+			{"kernel", required_argument, 0, 'k'},
 			{"help", no_argument, 0, 0},
 			{"validate", optional_argument, 0, 'v'},
+			{"profile", no_argument, 0, 'p'},
+			{"check", no_argument, 0, 'c'},
+			{"batch", required_argument, 0, 'b'},
+			{"coalesce", no_argument, 0, 'z'},
+			{"huge-pages", no_argument, 0, 'H'},
+			{"mem-budget", required_argument, 0, 'M'},
+			{"padding", required_argument, 0, 'P'},
+			{"panels", no_argument, 0, 'L'},
+			{"pattern", no_argument, 0, 'T'},
+			{"publish", required_argument, 0, 'S'},
+			{"attach", required_argument, 0, 'A'},
+			{"unpublish", required_argument, 0, 'U'},
+			{"force", no_argument, 0, 'F'},
 			{0, 0, 0, 0}
 	};
 	int c;
 	for(;;) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "i:m:o:d:r:v:", long_options, &option_index);
+		c = getopt_long(argc, argv, "i:m:o:d:r:v:pczHk:b:", long_options, &option_index);
 		if(c == -1) {
 			break;
 		}
@@ -116,6 +491,61 @@ int main(int argc, char ** argv)
 				strcpy(fvname, optarg);
 				printf("validation input file: %s\n", fvname); fflush(stdout);
 				break;
+			case 'p':
+				profile = true;
+				break;
+			case 'c':
+				check = true;
+				break;
+			case 'z':
+				coalesce = true;
+				break;
+			case 'H':
+				huge_pages = true;
+				break;
+			case 'M':
+				mem_budget = parse_bytes(optarg);
+				if(mem_budget == 0) {
+					fprintf(stderr, "Error: --mem-budget takes a size such as 512M or 2G.\n");
+					exit(1);
+				}
+				break;
+			case 'P':
+				if(strcmp(optarg, "vector") == 0) {
+					padding = SPT_PAD_VECTOR;
+				} else if(strcmp(optarg, "line") == 0) {
+					padding = SPT_PAD_CACHE_LINE;
+				} else if(strcmp(optarg, "none") == 0) {
+					padding = SPT_PAD_NONE;
+				} else {
+					fprintf(stderr, "Error: --padding takes vector, line or none.\n");
+					exit(1);
+				}
+				break;
+			case 'L':
+				bench.panels = true;
+				break;
+			case 'T':
+				pattern = true;
+				break;
+			case 'S':
+			case 'A':
+				strncpy(fsname, optarg, sizeof fsname - 1);
+				publish = c == 'S';
+				shared = true;
+				break;
+			case 'U':
+				strncpy(funame, optarg, sizeof funame - 1);
+				break;
+			case 'F':
+				force = true;
+				break;
+			case 'k':
+				strncpy(bench.kernel, optarg, sizeof bench.kernel - 1);
+				break;
+			case 'b':
+				strncpy(fbname, optarg, sizeof fbname - 1);
+				break;
 			case '?':   /* invalid option */
 			case 'h':
 			default:
@@ -124,27 +554,135 @@ int main(int argc, char ** argv)
 		}
 	}
 
+	if(funame[0] != '\0') {
+		if(sptSharedStoreUnpublish(funame, force) != 0) {
+			fprintf(stderr, "Error: could not unpublish %s%s.\n", funame, force ? "" : ", --force removes it while attached");
+			exit(1);
+		}
+		printf("unpublished: %s\n", funame);
+		exit(0);
+	}
+	if(force) {
+		fprintf(stderr, "Error: --force is read by --unpublish only.\n");
+		exit(1);
+	}
+	if(check) {
+		return sptCheckMTTKRP(omp_get_max_threads(), stdout) == 0 ? 0 : 1;
+	}
+	if(fbname[0] != '\0') {
+		return run_batch(fbname, R, mode, niters);
+	}
+	if(fname[0] == '\0' && !(shared && !publish)) {
+		print_usage(argv);
+		exit(1);
+	}
+	if(shared && (huge_pages || (coalesce && !publish))) {
+		fprintf(stderr, "Error: an attached tensor is read-only and cannot be coalesced or moved to huge pages.\n");
+		exit(1);
+	}
+	if(shared && strcmp(bench.kernel, "ttm") == 0) {
+		fprintf(stderr, "Error: -k ttm sorts the tensor in place and cannot run on a shared tensor.\n");
+		exit(1);
+	}
+	if(pattern && !bench_takes_pattern(bench.kernel) && mem_budget == 0) {
+		fprintf(stderr, "Error: --pattern runs with -k coo, plan, steal, segmented or packed only.\n");
+		exit(1);
+	}
+	if(huge_pages && padding != SPT_PAD_VECTOR) {
+		fprintf(stderr, "Error: --huge-pages lays matrices out with the default padding only.\n");
+		exit(1);
+	}
+
 	printf("mode: %"PASTA_PRI_INDEX "\n", mode);
 	printf("dev_id: %d\n", dev_id);
 
-	/* Load a sparse tensor from file as it is */
-	sptAssert(sptLoadSparseTensor(&X, 1, fname) == 0);
+	if(shared && !publish) {
+		sptAssert(sptSharedStoreAttach(&store, fsname) == 0);
+		X = store.tensor;
+		sptSharedStoreStatus(&store, stdout);
+		if(pattern && !X.pattern) {
+			fprintf(stderr, "Error: the attached tensor has values; publish it with --pattern.\n");
+			sptSharedStoreDetach(&store);
+			exit(1);
+		}
+	} else {
+		/* Load a sparse tensor from file as it is */
+		sptAssert(sptLoadSparseTensor(&X, 1, fname) == 0);
+	}
+	if(coalesce) {
+		sptNnzIndex const loaded = X.nnz;
+		sptNnzIndex ndups, nzeros;
+		double const start = omp_get_wtime();
+		sptAssert(sptSparseTensorCoalesce(&X, &ndups, &nzeros) == 0);
+		printf("Coalesce: %"PASTA_PRI_NNZ_INDEX " duplicates merged, %"PASTA_PRI_NNZ_INDEX " zeros removed, NNZ %"PASTA_PRI_NNZ_INDEX " -> %"PASTA_PRI_NNZ_INDEX " (%.6lf s)\n",
+						ndups, nzeros, loaded, X.nnz, omp_get_wtime() - start);
+	}
+	if(!(shared && !publish) && (pattern || bench_takes_pattern(bench.kernel) || mem_budget > 0)) {
+		/* Every kernel --mem-budget picks takes a pattern-only tensor. */
+		bool const ones = sptSparseTensorIsAllOnes(&X);
+		if(pattern && !ones) {
+			fprintf(stderr, "Error: --pattern needs every value to be 1.\n");
+			exit(1);
+		}
+		if(ones && X.nnz > 0) {
+			size_t const before = sptSparseTensorBytes(&X);
+			sptAssert(sptSparseTensorDropValues(&X) == 0);
+			char * savedstr = sptBytesString(before - sptSparseTensorBytes(&X));
+			printf("Pattern: every value is 1, dropped the values (%s)%s\n", savedstr, pattern ? "" : ", found on load");
+			free(savedstr);
+		}
+	}
+	if(publish) {
+		/* A full order starting with mode, so workers running the same kernel find it recorded. */
+		if(strcmp(bench.kernel, "segmented") == 0) {
+			sptIndex * order = malloc(X.nmodes * sizeof *order);
+			for(sptIndex i=0; i<X.nmodes; ++i) {
+				order[i] = (mode + i) % X.nmodes;
+			}
+			sptAssert(sptSparseTensorSortByOrder(&X, order) == 0);
+			free(order);
+		}
+		sptAssert(sptSharedStorePublish(&store, fsname, &X, NULL, 0) == 0);
+		sptFreeSparseTensor(&X);
+		X = store.tensor;
+		sptSharedStoreStatus(&store, stdout);
+	}
+	sptIndex nmodes = X.nmodes;
+	sptIndex max_ndims = 0;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		if(X.ndims[m] > max_ndims)
+			max_ndims = X.ndims[m];
+	}
+	if(huge_pages) {
+		/* One mapping for everything the kernels stream through. */
+		size_t size = sptSparseTensorArenaSize(nmodes, X.nnz) + sptMatrixArenaSize(max_ndims, R);
+		for(sptIndex m=0; m<nmodes; ++m) {
+			size += sptMatrixArenaSize(X.ndims[m], R);
+		}
+		sptAssert(sptNewArena(&arena, size, SPT_ARENA_HUGE_PAGES) == 0);
+		sptAssert(sptSparseTensorMoveToArena(&X, &arena) == 0);
+		printf("Arena: %zu bytes in 2 MiB pages\n", arena.size);
+	}
 	sptSparseTensorStatus(&X, stdout);
 
-	sptIndex nmodes = X.nmodes;
 	U = (sptMatrix **)malloc((nmodes+1) * sizeof(sptMatrix*));
 	for(sptIndex m=0; m<nmodes+1; ++m) {
 		U[m] = (sptMatrix *)malloc(sizeof(sptMatrix));
 	}
-	sptIndex max_ndims = 0;
 	for(sptIndex m=0; m<nmodes; ++m) {
-		sptAssert(sptNewMatrix(U[m], X.ndims[m], R) == 0);
+		if(huge_pages) {
+			sptAssert(sptNewMatrixInArena(U[m], X.ndims[m], R, &arena) == 0);
+		} else {
+			sptAssert(sptNewMatrixWithLayout(U[m], X.ndims[m], R, padding, SPT_LAYOUT_ROW_MAJOR, 0) == 0);
+		}
 		// sptAssert(sptConstantMatrix(U[m], 1) == 0);
-		sptAssert(sptRandomizeMatrix(U[m], random) == 0);
-		if(X.ndims[m] > max_ndims)
-			max_ndims = X.ndims[m];
+		sptAssert(sptRandomizeMatrix(U[m], random, m) == 0);
+	}
+	if(huge_pages) {
+		sptAssert(sptNewMatrixInArena(U[nmodes], max_ndims, R, &arena) == 0);
+	} else {
+		sptAssert(sptNewMatrixWithLayout(U[nmodes], max_ndims, R, padding, SPT_LAYOUT_ROW_MAJOR, 0) == 0);
 	}
-	sptAssert(sptNewMatrix(U[nmodes], max_ndims, R) == 0);
 	sptAssert(sptConstantMatrix(U[nmodes], 0) == 0);
 	sptIndex stride = U[0]->stride;
 
@@ -153,10 +691,8 @@ int main(int argc, char ** argv)
 	for(sptIndex i=1; i<nmodes; ++i)
 		mats_order[i] = (mode+i) % nmodes;
 
-	/* For warm-up caches, timing not included */
 	if(dev_id == -2) {
 		nthreads = 1;
-		sptAssert(sptMTTKRP(&X, U, mats_order, mode) == 0);
 	} else if(dev_id == -1) {
 #ifdef PASTA_USE_OPENMP
 		#pragma omp parallel
@@ -164,9 +700,75 @@ int main(int argc, char ** argv)
             nthreads = omp_get_num_threads();
         }
         printf("\nnthreads: %d\n", nthreads);
-        sptAssert(sptOmpMTTKRP(&X, U, mats_order, mode, nthreads) == 0);
 #endif
 	}
+	bench.dev_id = dev_id;
+	bench.nthreads = nthreads;
+	if(mem_budget > 0) {
+		sptMTTKRPBudget choice;
+		if(sptMTTKRPChooseForBudget(&choice, &X, stride, mode, nthreads, mem_budget, stdout) != 0) {
+			fprintf(stderr, "Error: nothing fits in --mem-budget.\n");
+			exit(1);
+		}
+		strcpy(bench.kernel, choice.kernel);
+		bench.strategy = choice.strategy;
+	}
+	printf("kernel: %s\n", bench.kernel);
+	if(shared && strcmp(bench.kernel, "segmented") == 0 && !(spt_SortOrderKnown(&X) && X.sortorder[0] == mode)) {
+		fprintf(stderr, "Error: -k segmented sorts the tensor in place; publish it with -k segmented -m %"PASTA_PRI_INDEX ".\n", mode);
+		sptSharedStoreDetach(&store);
+		exit(1);
+	}
+	if(X.pattern && !bench_takes_pattern(bench.kernel)) {
+		fprintf(stderr, "Error: the attached tensor is pattern-only, which -k %s cannot run on.\n", bench.kernel);
+		sptSharedStoreDetach(&store);
+		exit(1);
+	}
+	if(bench.panels && strcmp(bench.kernel, "rank-tiled") != 0) {
+		fprintf(stderr, "Error: --panels is read by -k rank-tiled only.\n");
+		exit(1);
+	}
+	if(profile) {
+		/* Before the kernel converts the factors, and into a scratch output so -o keeps the kernel's result. */
+		sptMTTKRPProfile prof;
+		sptMatrix prof_out;
+		sptMatrix ** prof_mats = malloc((nmodes+1) * sizeof *prof_mats);
+		sptAssert(prof_mats != NULL);
+		memcpy(prof_mats, U, nmodes * sizeof *prof_mats);
+		sptAssert(sptNewMatrixWithLayout(&prof_out, max_ndims, R, U[nmodes]->padding, SPT_LAYOUT_ROW_MAJOR, 0) == 0);
+		prof_mats[nmodes] = &prof_out;
+		sptSparseTensorSliceHistogram(&X, stdout);
+		sptAssert(sptOmpMTTKRPProfile(&X, prof_mats, mats_order, mode, nthreads, &prof) == 0);
+		sptMTTKRPProfileStatus(&prof, stdout);
+		sptFreeMTTKRPProfile(&prof);
+		sptFreeMatrix(&prof_out);
+		free(prof_mats);
+	}
+	sptAssert(bench_prepare(&bench, &X, U, mats_order, mode) == 0);
+	if(huge_pages && bench_arena_size(&bench) > 0) {
+		/* Derived formats are only sized once built, so they get an arena of their own. */
+		sptAssert(sptNewArena(&kernel_arena, bench_arena_size(&bench), SPT_ARENA_HUGE_PAGES) == 0);
+		sptAssert(bench_move_to_arena(&bench, &kernel_arena) == 0);
+		printf("Kernel arena: %zu bytes in 2 MiB pages\n", kernel_arena.size);
+	}
+	{
+		size_t const tensor_bytes = sptSparseTensorBytes(&X);
+		size_t factor_bytes = 0;
+		for(sptIndex m=0; m<nmodes; ++m) {
+			factor_bytes += sptMatrixBytes(U[m]);
+		}
+		size_t const output_bytes = sptMatrixBytes(U[nmodes]);
+		size_t const kernel_bytes = bench_bytes(&bench, &X);
+		char * strs[5] = { sptBytesString(tensor_bytes), sptBytesString(factor_bytes), sptBytesString(output_bytes),
+				sptBytesString(kernel_bytes), sptBytesString(tensor_bytes + factor_bytes + output_bytes + kernel_bytes) };
+		printf("Footprint: tensor %s, factors %s, output %s, kernel %s, total %s\n\n", strs[0], strs[1], strs[2], strs[3], strs[4]);
+		for(int i=0; i<5; ++i) {
+			free(strs[i]);
+		}
+	}
+
+	/* For warm-up caches, timing not included */
+	sptAssert(bench_run(&bench, &X, U, mats_order, mode) == 0);
 
 
 	sptTimer timer;
@@ -174,14 +776,11 @@ int main(int argc, char ** argv)
 	sptStartTimer(timer);
 
 	for(int it=0; it<niters; ++it) {
-		sptAssert(sptConstantMatrix(U[nmodes], 0) == 0);
-		if(dev_id == -2) {
-			sptAssert(sptMTTKRP(&X, U, mats_order, mode) == 0);
-		} else if(dev_id == -1) {
-#ifdef PASTA_USE_OPENMP
-			sptAssert(sptOmpMTTKRP(&X, U, mats_order, mode, nthreads) == 0);
-#endif
+		/* A plan clears the output itself */
+		if(!bench.planned) {
+			sptAssert(sptConstantMatrix(U[nmodes], 0) == 0);
 		}
+		sptAssert(bench_run(&bench, &X, U, mats_order, mode) == 0);
 	}
 
 	sptStopTimer(timer);
@@ -194,20 +793,88 @@ int main(int argc, char ** argv)
 	}
 	double gbw = (double)bytes / aver_time / 1e9;
 	printf("Performance: %.10lf GFlop/s, Bandwidth: %.2lf GB/s\n\n", gflops, gbw);
+	if(bench.ttm) {
+		printf("TTM: %"PASTA_PRI_NNZ_INDEX " fibers x %"PASTA_PRI_INDEX ", %.10lf GFlop/s\n\n",
+						bench.y.nnz, R, 2.0 * R * X.nnz / aver_time / 1e9);
+	}
+	if(bench.replicated) {
+		/* The same runs on the plain COO tensor, for the bandwidth gained. */
+		sptAssert(sptMTTKRPNumaCompare(&bench.numa, mats_order, U, niters) == 0);
+		sptMTTKRPNumaStatus(&bench.numa, stdout);
+	}
+	if(bench.hybrid) {
+		/* The same runs on the plain COO tensor, for the time saved. */
+		sptTimer coo_timer;
+		sptNewTimer(&coo_timer, 0);
+		sptStartTimer(coo_timer);
+		for(int it=0; it<niters; ++it) {
+			sptAssert(sptConstantMatrix(U[nmodes], 0) == 0);
+			if(dev_id == -1) {
+				sptAssert(sptOmpMTTKRP(&X, U, mats_order, mode, nthreads) == 0);
+			} else {
+				sptAssert(sptMTTKRP(&X, U, mats_order, mode) == 0);
+			}
+		}
+		sptStopTimer(coo_timer);
+		double const coo_time = sptElapsedTime(coo_timer) / niters;
+		printf("Hybrid vs COO: %.6lf s vs %.6lf s, %.1lf%% time saved\n\n", aver_time, coo_time, 100 * (coo_time - aver_time) / coo_time);
+		sptFreeTimer(coo_timer);
+		/* Leave the hybrid result for -o and -v. */
+		sptAssert(bench_run(&bench, &X, U, mats_order, mode) == 0);
+	}
+
+	if(bench.sampled) {
+		/* The exact MTTKRP, for the time saved and the actual error. */
+		sptMatrix estimate;
+		sptAssert(sptNewMatrixWithLayout(&estimate, U[nmodes]->nrows, R, padding, SPT_LAYOUT_ROW_MAJOR, 0) == 0);
+		memcpy(estimate.values, U[nmodes]->values, (size_t)X.ndims[mode] * stride * sizeof(sptValue));
+		sptTimer coo_timer;
+		sptNewTimer(&coo_timer, 0);
+		sptStartTimer(coo_timer);
+		if(dev_id == -1) {
+			sptAssert(sptOmpMTTKRP(&X, U, mats_order, mode, nthreads) == 0);
+		} else {
+			sptAssert(sptMTTKRP(&X, U, mats_order, mode) == 0);
+		}
+		sptStopTimer(coo_timer);
+		double const coo_time = sptElapsedTime(coo_timer);
+		sptFreeTimer(coo_timer);
+		double err2 = 0, norm2 = 0;
+		for(sptIndex i=0; i<X.ndims[mode]; ++i) {
+			for(sptIndex r=0; r<R; ++r) {
+				double const exact = U[nmodes]->values[(size_t)i * stride + r];
+				double const diff = estimate.values[(size_t)i * stride + r] - exact;
+				err2 += diff * diff;
+				norm2 += exact * exact;
+			}
+		}
+		printf("Sampled vs COO: %.6lf s vs %.6lf s, relative error %.4lf (estimated %.4lf)\n\n",
+						aver_time, coo_time, sqrt(err2 / norm2), sqrt(bench.variance / norm2));
+		/* Leave the estimate for -o and -v. */
+		memcpy(U[nmodes]->values, estimate.values, (size_t)X.ndims[mode] * stride * sizeof(sptValue));
+		sptFreeMatrix(&estimate);
+	}
 
 	if(fo != NULL) {
-		sptAssert(sptDumpMatrix(U[nmodes], fo) == 0);
+		sptAssert(sptDumpMatrix(bench.ttm ? &bench.y.values : U[nmodes], fo) == 0);
 		fclose(fo);
 	}
 
 	sptFreeTimer(timer);
+	bench_free(&bench);
+	sptFreeArena(&kernel_arena);
 	for(sptIndex m=0; m<nmodes; ++m) {
 		sptFreeMatrix(U[m]);
 	}
-	sptFreeSparseTensor(&X);
+	if(shared) {
+		sptSharedStoreDetach(&store);
+	} else {
+		sptFreeSparseTensor(&X);
+	}
 	free(mats_order);
 	sptFreeMatrix(U[nmodes]);
 	free(U);
+	sptFreeArena(&arena);
 
 	if (!random){
 		FILE* fPtr1 = fopen(fvname, "r");
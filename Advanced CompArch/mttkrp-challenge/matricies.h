@@ -23,8 +23,23 @@
 static inline sptNnzIndex sptGetMatrixLength(const sptMatrix *mtx) {
 	return mtx->nrows * mtx->stride;
 }
+/* Address of element (i, j) in any layout */
+static inline sptValue * sptMatrixAt(const sptMatrix *mtx, sptIndex const i, sptIndex const j) {
+	if(mtx->layout == SPT_LAYOUT_ROW_MAJOR) {
+		return mtx->values + (size_t)i * mtx->stride + j;
+	}
+	return mtx->values + (size_t)(j / mtx->panel) * mtx->panel_size + (size_t)i * mtx->stride + j % mtx->panel;
+}
+sptIndex sptMatrixStride(sptIndex const n, sptMatrixPadding const padding);
 int sptNewMatrix(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols);
-int sptRandomizeMatrix(sptMatrix *mtx, bool random);
+int sptNewMatrixWithLayout(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols, sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel);
+int sptNewMatrixInArena(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols, sptArena *arena);
+int sptMatrixConvert(sptMatrix *dest, sptMatrix const *src, sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel);
+int sptMatrixSetLayout(sptMatrix *mtx, sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel);
+int sptMatrixCopyValues(sptMatrix *dest, sptMatrix const *src);
+size_t sptMatrixArenaSize(sptIndex const nrows, sptIndex const ncols);
+size_t sptMatrixBytes(sptMatrix const *mtx);
+int sptRandomizeMatrix(sptMatrix *mtx, bool random, sptIndex const stream);
 
 int sptConstantMatrix(sptMatrix * const mtx, sptValue const val);
 
@@ -65,4 +80,8 @@ int sptNewSparseMatrix(sptSparseMatrix *mtx, sptIndex const nrows, sptIndex cons
 int sptCopySparseMatrix(sptSparseMatrix *dest, const sptSparseMatrix *src);
 void sptFreeSparseMatrix(sptSparseMatrix *mtx);
 
+/* Sparse matrix, CSR format */
+int sptNewSparseMatrixCSR(sptSparseMatrixCSR *mtx, sptIndex const nrows, sptIndex const ncols, sptNnzIndex const nnz);
+void sptFreeSparseMatrixCSR(sptSparseMatrixCSR *mtx);
+
 #endif
\ No newline at end of file
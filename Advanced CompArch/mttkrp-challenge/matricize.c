@@ -0,0 +1,212 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+#include "matricies.h"
+
+/**
+ * Mode-m matricization of a sparse tensor in COO format
+ * @param[in]  X    the sparse tensor
+ * @param[in]  m    the mode that becomes the rows
+ * @param[out] A    an uninitialized sparse matrix, receives X_(m), or its transpose
+ * @param[in]  transpose    nonzero to swap rows and columns
+ *
+ * Column indices follow Kolda and Bader: the remaining modes in increasing
+ * order with the first varying fastest. The product of their dimensions
+ * must fit an sptIndex.
+ */
+int sptMatricize(sptSparseTensor const * const X,
+								 sptIndex const m,
+								 sptSparseMatrix * const A,
+								 int const transpose)
+{
+	sptIndex const nmodes = X->nmodes;
+	int result;
+	if(m >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns Matricize", "m >= nmodes");
+	}
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "SpTns Matricize", "pattern-only tensor");
+	}
+	uint64_t ncols = 1;
+	for(sptIndex k=0; k<nmodes; ++k) {
+		if(k != m) {
+			ncols *= X->ndims[k];
+			if(ncols > (sptIndex)-1) {
+				spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns Matricize", "too many columns for sptIndex");
+			}
+		}
+	}
+
+	result = transpose ? sptNewSparseMatrix(A, (sptIndex)ncols, X->ndims[m]) : sptNewSparseMatrix(A, X->ndims[m], (sptIndex)ncols);
+	spt_CheckError(result, "SpTns Matricize", NULL);
+	result = sptResizeIndexVector(&A->rowind, X->nnz);
+	spt_CheckError(result, "SpTns Matricize", NULL);
+	result = sptResizeIndexVector(&A->colind, X->nnz);
+	spt_CheckError(result, "SpTns Matricize", NULL);
+	result = sptResizeValueVector(&A->values, X->nnz);
+	spt_CheckError(result, "SpTns Matricize", NULL);
+
+	sptIndex * const rows = transpose ? A->colind.data : A->rowind.data;
+	sptIndex * const cols = transpose ? A->rowind.data : A->colind.data;
+#pragma omp parallel for schedule(static)
+	for(sptNnzIndex x=0; x<X->nnz; ++x) {
+		sptIndex col = 0, scale = 1;
+		for(sptIndex k=0; k<nmodes; ++k) {
+			if(k != m) {
+				col += X->inds[k].data[x] * scale;
+				scale *= X->ndims[k];
+			}
+		}
+		rows[x] = X->inds[m].data[x];
+		cols[x] = col;
+	}
+	memcpy(A->values.data, X->values.data, X->nnz * sizeof *A->values.data);
+	A->nnz = X->nnz;
+	return 0;
+}
+
+
+/* Stable counting sort of perm by ind[perm[p]], through tmp. */
+static void matricize_pass(
+		sptNnzIndex * const perm,
+		sptNnzIndex * const tmp,
+		sptNnzIndex * const counts,
+		sptNnzIndex const nnz,
+		sptIndex const * const ind,
+		sptIndex const dim)
+{
+	memset(counts, 0, ((size_t)dim + 1) * sizeof *counts);
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		++counts[ind[perm[p]] + 1];
+	}
+	for(sptIndex i=0; i<dim; ++i) {
+		counts[i+1] += counts[i];
+	}
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		tmp[counts[ind[perm[p]]]++] = perm[p];
+	}
+	memcpy(perm, tmp, nnz * sizeof *perm);
+}
+
+
+/**
+ * Mode matricization of a sparse tensor into CSR, keeping only the columns that hold nonzeros
+ * @param[in]  X    the sparse tensor
+ * @param[in]  mode    the mode that becomes the rows
+ * @param[in]  col_order    the other nmodes-1 modes, most significant first
+ * @param[out] A    an uninitialized CSR matrix with ndims[mode] rows
+ * @param[out] col_inds    nmodes-1 uninitialized index vectors, col_inds[k]
+ * receives each column's index in mode col_order[k]
+ *
+ * Column c is the c-th distinct index tuple of the other modes in
+ * lexicographic col_order, so there are at most nnz columns whatever the
+ * dimensions. The nonzeros of each row are sorted by column.
+ */
+int sptMatricizeCSR(
+		sptSparseTensor const * const X,
+		sptIndex const mode,
+		sptIndex const col_order[],
+		sptSparseMatrixCSR * const A,
+		sptIndexVector * const col_inds)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	int result;
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns MatricizeCSR", "mode >= nmodes");
+	}
+	sptIndex max_dim = X->ndims[mode];
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "SpTns MatricizeCSR", "pattern-only tensor");
+	}
+	for(sptIndex k=0; k+1<nmodes; ++k) {
+		if(col_order[k] == mode || col_order[k] >= nmodes) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns MatricizeCSR", "col_order must hold the modes other than mode");
+		}
+		if(X->ndims[col_order[k]] > max_dim) {
+			max_dim = X->ndims[col_order[k]];
+		}
+	}
+
+	sptNnzIndex * perm = malloc((nnz > 0 ? nnz : 1) * sizeof *perm);
+	sptNnzIndex * tmp = malloc((nnz > 0 ? nnz : 1) * sizeof *tmp);
+	sptNnzIndex * counts = malloc(((size_t)max_dim + 1) * sizeof *counts);
+	spt_CheckOSError(!perm || !tmp || !counts, "SpTns MatricizeCSR");
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		perm[p] = p;
+	}
+	/* Least significant mode first, stability keeps the earlier keys ordered. */
+	for(sptIndex k=nmodes-1; k-- > 0; ) {
+		matricize_pass(perm, tmp, counts, nnz, X->inds[col_order[k]].data, X->ndims[col_order[k]]);
+	}
+
+	/* tmp[x] becomes the column of nonzero x. */
+	sptNnzIndex ncols = 0;
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		int start = p == 0;
+		for(sptIndex k=0; !start && k+1<nmodes; ++k) {
+			sptIndex const * const ind = X->inds[col_order[k]].data;
+			start = ind[perm[p]] != ind[perm[p-1]];
+		}
+		ncols += start;
+		tmp[perm[p]] = ncols - 1;
+	}
+	if(ncols > (sptIndex)-1) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns MatricizeCSR", "too many columns for sptIndex");
+	}
+	for(sptIndex k=0; k+1<nmodes; ++k) {
+		result = sptNewIndexVector(&col_inds[k], ncols, ncols);
+		spt_CheckError(result, "SpTns MatricizeCSR", NULL);
+	}
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		sptNnzIndex const x = perm[p];
+		for(sptIndex k=0; k+1<nmodes; ++k) {
+			col_inds[k].data[tmp[x]] = X->inds[col_order[k]].data[x];
+		}
+	}
+
+	/* Rows by a counting sort, visiting nonzeros in column order. */
+	sptIndex const nrows = X->ndims[mode];
+	sptIndex const * const mode_ind = X->inds[mode].data;
+	result = sptNewSparseMatrixCSR(A, nrows, (sptIndex)ncols, nnz);
+	spt_CheckError(result, "SpTns MatricizeCSR", NULL);
+	sptNnzIndex * const rowptr = A->rowptr.data;
+	for(sptNnzIndex x=0; x<nnz; ++x) {
+		++rowptr[mode_ind[x] + 1];
+	}
+	for(sptIndex i=0; i<nrows; ++i) {
+		rowptr[i+1] += rowptr[i];
+	}
+	memcpy(counts, rowptr, (size_t)nrows * sizeof *counts);
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		sptNnzIndex const x = perm[p];
+		sptNnzIndex const pos = counts[mode_ind[x]]++;
+		A->colind.data[pos] = (sptIndex)tmp[x];
+		A->values.data[pos] = X->values.data[x];
+	}
+
+	free(perm);
+	free(tmp);
+	free(counts);
+	return 0;
+}
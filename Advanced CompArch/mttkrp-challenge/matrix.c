@@ -25,6 +25,41 @@
 #include "structs.h"
 #include "error.h"
 #include "helper_funcs.h"
+#include "vector.h"
+#include "matricies.h"
+
+/**
+ * A row length rounded up by a padding policy
+ * @param n       the number of values in a row
+ * @param padding the padding policy
+ */
+sptIndex sptMatrixStride(sptIndex const n, sptMatrixPadding const padding) {
+	sptIndex const unit = padding == SPT_PAD_NONE ? 1 : padding == SPT_PAD_CACHE_LINE ? 16 : 8;
+	return n > 0 ? ((n-1)/unit+1)*unit : unit;
+}
+
+/* Set the geometry of mtx and return the number of values to allocate. */
+static size_t matrix_geometry(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols,
+		sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel) {
+	mtx->nrows = nrows;
+	mtx->ncols = ncols;
+	mtx->cap = nrows != 0 ? nrows : 1;
+	mtx->padding = padding;
+	mtx->layout = layout;
+	if(layout == SPT_LAYOUT_ROW_MAJOR) {
+		mtx->panel = ncols;
+		mtx->stride = sptMatrixStride(ncols, padding);
+		mtx->panel_size = (size_t)mtx->cap * mtx->stride;
+		return mtx->panel_size;
+	}
+	mtx->panel = layout == SPT_LAYOUT_COL_MAJOR ? 1 : panel;
+	mtx->stride = layout == SPT_LAYOUT_COL_MAJOR ? 1 : sptMatrixStride(mtx->panel, padding);
+	/* Pad panels too, so each starts as aligned as a padded row. */
+	size_t const unit = sptMatrixStride(1, padding);
+	mtx->panel_size = ((size_t)mtx->cap * mtx->stride + unit - 1) / unit * unit;
+	sptIndex const npanels = ncols > 0 ? (ncols-1)/mtx->panel+1 : 1;
+	return npanels * mtx->panel_size;
+}
 
 /**
  * Initialize a new dense matrix
@@ -37,47 +72,189 @@
  * rounded up to multiples of 8
  */
 int sptNewMatrix(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols) {
-	mtx->nrows = nrows;
-	mtx->ncols = ncols;
-	mtx->cap = nrows != 0 ? nrows : 1;
-	mtx->stride = ((ncols-1)/8+1)*8;
+	return sptNewMatrixWithLayout(mtx, nrows, ncols, SPT_PAD_VECTOR, SPT_LAYOUT_ROW_MAJOR, 0);
+}
+
+/**
+ * Initialize a new dense matrix with a given layout
+ *
+ * @param mtx     a valid pointer to an uninitialized sptMatrix variable
+ * @param nrows   the number of rows
+ * @param ncols   the number of columns
+ * @param padding what rows (and panels) are rounded up to
+ * @param layout  row-major, column-major or panels
+ * @param panel   the columns per panel for SPT_LAYOUT_PANELS, ignored otherwise
+ *
+ * Values are zeroed and the buffer is 64-byte aligned, so with
+ * SPT_PAD_CACHE_LINE every row starts a cache line.
+ */
+int sptNewMatrixWithLayout(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols,
+		sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel) {
+	if(layout == SPT_LAYOUT_PANELS && panel == 0) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "Mtx New", "panel == 0");
+	}
+	size_t const bytes = (matrix_geometry(mtx, nrows, ncols, padding, layout, panel) * sizeof (sptValue) + 63) / 64 * 64;
+	mtx->arena = NULL;
 #ifdef _ISOC11_SOURCE
-	mtx->values = aligned_alloc(8 * sizeof (sptValue), mtx->cap * mtx->stride * sizeof (sptValue));
+	mtx->values = aligned_alloc(64, bytes);
 #elif _POSIX_C_SOURCE >= 200112L
 	{
-		int result = posix_memalign((void **) &mtx->values, 8 * sizeof (sptValue), mtx->cap * mtx->stride * sizeof (sptValue));
+		int result = posix_memalign((void **) &mtx->values, 64, bytes);
 		if(result != 0) {
 			mtx->values = NULL;
 		}
 	}
 #else
-	mtx->values = malloc(mtx->cap * mtx->stride * sizeof (sptValue));
+	mtx->values = malloc(bytes);
 #endif
 	spt_CheckOSError(!mtx->values, "Mtx New");
-	memset(mtx->values, 0, mtx->cap * mtx->stride * sizeof (sptValue));
+	memset(mtx->values, 0, bytes);
+	return 0;
+}
+
+/**
+ * Initialize a new dense matrix in an arena
+ *
+ * @param mtx   a valid pointer to an uninitialized sptMatrix variable
+ * @param nrows the number of rows
+ * @param ncols the number of columns
+ * @param arena the arena to allocate from
+ *
+ * As sptNewMatrix, the values are zeroed.
+ */
+int sptNewMatrixInArena(sptMatrix *mtx, sptIndex const nrows, sptIndex const ncols, sptArena *arena) {
+	size_t const count = matrix_geometry(mtx, nrows, ncols, SPT_PAD_VECTOR, SPT_LAYOUT_ROW_MAJOR, 0);
+	mtx->arena = arena;
+	mtx->values = sptArenaAlloc(arena, count * sizeof (sptValue));
+	spt_CheckOSError(!mtx->values, "Mtx New");
+	memset(mtx->values, 0, count * sizeof (sptValue));
+	return 0;
+}
+
+/**
+ * Copy a dense matrix into a new layout
+ *
+ * @param dest    a valid pointer to an uninitialized sptMatrix variable
+ * @param src     the matrix to copy
+ * @param padding as for sptNewMatrixWithLayout
+ * @param layout  as for sptNewMatrixWithLayout
+ * @param panel   as for sptNewMatrixWithLayout
+ *
+ * Blocks of rows are copied in parallel; within a block each source row is
+ * read once and, for panels, scattered over one short run per panel, so the
+ * cost is a single pass over both matrices.
+ */
+int sptMatrixConvert(sptMatrix *dest, sptMatrix const *src,
+		sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel) {
+	int result = sptNewMatrixWithLayout(dest, src->nrows, src->ncols, padding, layout, panel);
+	spt_CheckError(result, "Mtx Convert", NULL);
+	result = sptMatrixCopyValues(dest, src);
+	spt_CheckError(result, "Mtx Convert", NULL);
+	return 0;
+}
+
+/**
+ * Copy the values of one matrix into another of the same shape
+ *
+ * @param dest a matrix with src's rows and columns, in any layout
+ * @param src  the matrix to copy, in any layout
+ */
+int sptMatrixCopyValues(sptMatrix *dest, sptMatrix const *src) {
+	if(dest->nrows != src->nrows || dest->ncols != src->ncols) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "Mtx Copy", "shapes differ");
+	}
+	sptIndex const nrows = src->nrows;
+	sptIndex const ncols = src->ncols;
+	/* Rows per block: enough that a column-major side is read in runs. */
+	sptIndex const block = 64;
+#pragma omp parallel for schedule(static)
+	for(sptIndex i0=0; i0<nrows; i0+=block) {
+		sptIndex const i1 = nrows - i0 < block ? nrows : i0 + block;
+		for(sptIndex j0=0; j0<ncols; j0+=dest->panel) {
+			sptIndex const j1 = ncols - j0 < dest->panel ? ncols : j0 + dest->panel;
+			for(sptIndex i=i0; i<i1; ++i) {
+				sptValue * const restrict out = sptMatrixAt(dest, i, j0);
+				if(src->layout == SPT_LAYOUT_ROW_MAJOR) {
+					memcpy(out, sptMatrixAt(src, i, j0), (j1 - j0) * sizeof (sptValue));
+				} else {
+					for(sptIndex j=j0; j<j1; ++j) {
+						out[j - j0] = *sptMatrixAt(src, i, j);
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Change the layout of a dense matrix in place
+ *
+ * @param mtx     a valid matrix, its values are kept
+ * @param padding as for sptNewMatrixWithLayout
+ * @param layout  as for sptNewMatrixWithLayout
+ * @param panel   as for sptNewMatrixWithLayout
+ *
+ * Does nothing if mtx already has that layout. Otherwise the values move to
+ * a new malloc'd buffer and the old one is released, unless it lives in an
+ * arena.
+ */
+int sptMatrixSetLayout(sptMatrix *mtx, sptMatrixPadding const padding, sptMatrixLayout const layout, sptIndex const panel) {
+	if(mtx->padding == padding && mtx->layout == layout &&
+			(layout != SPT_LAYOUT_PANELS || mtx->panel == panel)) {
+		return 0;
+	}
+	sptMatrix converted;
+	int result = sptMatrixConvert(&converted, mtx, padding, layout, panel);
+	spt_CheckError(result, "Mtx Set Layout", NULL);
+	sptFreeMatrix(mtx);
+	*mtx = converted;
 	return 0;
 }
 
+/**
+ * The arena bytes a matrix takes
+ * @param nrows number of rows
+ * @param ncols number of columns
+ */
+size_t sptMatrixArenaSize(sptIndex const nrows, sptIndex const ncols) {
+	size_t const bytes = (size_t)(nrows != 0 ? nrows : 1) * sptMatrixStride(ncols, SPT_PAD_VECTOR) * sizeof (sptValue);
+	return (bytes + SPT_ARENA_ALIGN - 1) / SPT_ARENA_ALIGN * SPT_ARENA_ALIGN;
+}
+
 /**
  * Build a matrix with random number
  *
- * @param mtx   a pointer to an initialized matrix
- * @param nrows fill the specified number of rows
- * @param ncols fill the specified number of columns
+ * @param mtx    a pointer to an initialized matrix
+ * @param random whether to seed from the clock, or use a fixed seed for
+ *               reproducible output
+ * @param stream the stream to draw from, e.g. the mode of a factor matrix,
+ *               so that matrices filled with the same seed differ
  *
- * The matrix is filled with uniform distributed pseudorandom number in [0, 1]
- * The random number will have a precision of 31 bits out of 51 bits
+ * The matrix is filled with uniform distributed pseudorandom number in [-3, 3]
+ * from a counter-based generator keyed by (seed + stream, row, column), so rows
+ * are filled in parallel and the result does not depend on the thread count.
  */
-int sptRandomizeMatrix(sptMatrix *mtx, bool random) {
-	for(sptIndex i=0; i<mtx->nrows; ++i)
-		for(sptIndex j=0; j<mtx->ncols; ++j) {
-			if (random) {
-				srand(time(NULL) + (rand()%100) + i + j);
-			} else {
-				srand(1234 + i + j);
+int sptRandomizeMatrix(sptMatrix *mtx, bool random, sptIndex const stream) {
+	uint64_t const seed = (random ? (uint64_t)time(NULL) : 1234) + stream;
+	sptIndex const ncols = mtx->ncols;
+	sptIndex const stride = mtx->stride;
+	sptValue * const restrict values = mtx->values;
+#pragma omp parallel for schedule(static)
+	for(sptIndex i=0; i<mtx->nrows; ++i) {
+		uint64_t const key = spt_SplitMix64(seed ^ spt_SplitMix64(i));
+		if(mtx->layout != SPT_LAYOUT_ROW_MAJOR) {
+			for(sptIndex j=0; j<ncols; ++j) {
+				*sptMatrixAt(mtx, i, j) = sptCounterRandomValue(key, j);
 			}
-			mtx->values[i * mtx->stride + j] = sptRandomValue();
+			continue;
+		}
+		sptValue * const restrict row = values + (size_t)i * stride;
+#pragma omp simd
+		for(sptIndex j=0; j<ncols; ++j) {
+			row[j] = sptCounterRandomValue(key, j);
 		}
+	}
 	return 0;
 }
 
@@ -92,11 +269,20 @@ int sptRandomizeMatrix(sptMatrix *mtx, bool random) {
 int sptConstantMatrix(sptMatrix *mtx, sptValue const val) {
 	for(sptIndex i=0; i<mtx->nrows; ++i)
 		for(sptIndex j=0; j<mtx->ncols; ++j)
-			mtx->values[i * mtx->stride + j] = val;
+			*sptMatrixAt(mtx, i, j) = val;
 	return 0;
 }
 
 
+/**
+ * The bytes a matrix holds, padding included
+ * @param mtx a valid matrix
+ */
+size_t sptMatrixBytes(sptMatrix const *mtx) {
+	sptIndex const npanels = mtx->ncols > 0 ? (mtx->ncols-1)/mtx->panel+1 : 1;
+	return (mtx->layout == SPT_LAYOUT_ROW_MAJOR ? 1 : npanels) * mtx->panel_size * sizeof (sptValue);
+}
+
 /**
  * Release the memory buffer a dense matrix is holding
  *
@@ -106,7 +292,9 @@ int sptConstantMatrix(sptMatrix *mtx, sptValue const val) {
  * should not be used anymore prior to another initialization
  */
 void sptFreeMatrix(sptMatrix *mtx) {
-	free(mtx->values);
+	if(mtx->arena == NULL) {
+		free(mtx->values);
+	}
 	mtx->nrows = 0;
 	mtx->ncols = 0;
 	mtx->cap = 0;
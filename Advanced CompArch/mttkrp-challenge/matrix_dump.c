@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include "structs.h"
 #include "error.h"
+#include "matricies.h"
 
 
 /**
@@ -37,12 +38,11 @@ int sptDumpMatrix(sptMatrix *mtx, FILE *fp) {
 	int iores;
 	sptIndex nrows = mtx->nrows;
 	sptIndex ncols = mtx->ncols;
-	sptIndex stride = mtx->stride;
 	iores = fprintf(fp, "%"PASTA_PRI_INDEX " x %"PASTA_PRI_INDEX " matrix\n", nrows, ncols);
 	spt_CheckOSError(iores < 0, "Mtx Dump");
 	for(sptIndex i=0; i < nrows; ++i) {
 		for(sptIndex j=0; j < ncols; ++j) {
-			iores = fprintf(fp, "%.1"PASTA_PRI_VALUE "\t", mtx->values[i * stride + j]);
+			iores = fprintf(fp, "%.1"PASTA_PRI_VALUE "\t", *sptMatrixAt(mtx, i, j));
 			spt_CheckOSError(iores < 0, "Mtx Dump");
 		}
 		iores = fprintf(fp, "\n");
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include "helper_funcs.h"
 #include "vector.h"
+#include "sptensors.h"
 //#include <immintrin.h>
 
 int sptMTTKRP_3D(sptSparseTensor const * const X,
@@ -27,6 +28,11 @@ int sptMTTKRP_3D(sptSparseTensor const * const X,
 								 sptIndex const mats_order[],    // Correspond to the mode order of X.
 								 sptIndex const mode);
 
+int sptMTTKRP_ND(sptSparseTensor const * const X,
+								 sptMatrix * mats[],     // mats[nmodes] as temporary space.
+								 sptIndex const mats_order[],    // Correspond to the mode order of X.
+								 sptIndex const mode);
+
 /**
  * Matriced sparse tensor times a sequence of dense matrix Khatri-Rao products (MTTKRP) on a specified mode
  * @param[out] mats[nmodes]    the result of MTTKRP, a dense matrix, with size
@@ -45,10 +51,17 @@ int sptMTTKRP(sptSparseTensor const * const X,
 							sptIndex const mode) {
 
 	sptIndex const nmodes = X->nmodes;
+	if(X->pattern) {
+		return sptMTTKRPPattern(X, mats, mats_order, mode);
+	}
 	if(nmodes == 3) {
 		sptAssert(sptMTTKRP_3D(X, mats, mats_order, mode) == 0);
 		return 0;
 	}
+	if(nmodes != 4) {
+		sptAssert(sptMTTKRP_ND(X, mats, mats_order, mode) == 0);
+		return 0;
+	}
 
 	sptNnzIndex const nnz = X->nnz;
 	sptIndex const * const ndims = X->ndims;
@@ -57,14 +70,8 @@ int sptMTTKRP(sptSparseTensor const * const X,
 	sptValueVector scratch;  // Temporary array
 
 	/* Check the mats. */
-	for(sptIndex i=0; i<nmodes; ++i) {
-		if(mats[i]->ncols != mats[nmodes]->ncols) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Cpu SpTns MTTKRP", "mats[i]->cols != mats[nmodes]->ncols");
-		}
-		if(mats[i]->nrows != ndims[i]) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Cpu SpTns MTTKRP", "mats[i]->nrows != ndims[i]");
-		}
-	}
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Cpu SpTns MTTKRP");
+	spt_CheckError(result, "Cpu SpTns MTTKRP", NULL);
 
 	sptIndex const tmpI = mats[mode]->nrows;
 	sptIndex const R = mats[mode]->ncols;
@@ -124,8 +131,7 @@ int sptMTTKRP(sptSparseTensor const * const X,
 	sptFreeValueVector(&scratch);
 
 	total_time = comp_time;
-	printf("[Total time]: %lf\n", total_time);
-	printf("\n");
+	sptPrintTotalTime(total_time);
 
 	return 0;
 }
@@ -144,14 +150,8 @@ int sptMTTKRP_3D(sptSparseTensor const * const X,
 
 	/* Check the mats. */
 	sptAssert(nmodes ==3);
-	for(sptIndex i=0; i<nmodes; ++i) {
-		if(mats[i]->ncols != mats[nmodes]->ncols) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Cpu SpTns MTTKRP", "mats[i]->cols != mats[nmodes]->ncols");
-		}
-		if(mats[i]->nrows != ndims[i]) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Cpu SpTns MTTKRP", "mats[i]->nrows != ndims[i]");
-		}
-	}
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Cpu SpTns MTTKRP");
+	spt_CheckError(result, "Cpu SpTns MTTKRP", NULL);
 
 
 	sptIndex const tmpI = mats[mode]->nrows;
@@ -192,8 +192,66 @@ int sptMTTKRP_3D(sptSparseTensor const * const X,
 	sptFreeTimer(timer);
 
 	total_time = comp_time;
-	printf("[Total time]: %lf\n", total_time);
-	printf("\n");
+	sptPrintTotalTime(total_time);
+
+	return 0;
+}
+
+
+int sptMTTKRP_ND(sptSparseTensor const * const X,
+								 sptMatrix * mats[],     // mats[nmodes] as temporary space.
+								 sptIndex const mats_order[],    // Correspond to the mode order of X.
+								 sptIndex const mode)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	sptIndex const * const ndims = X->ndims;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const stride = mats[0]->stride;
+	sptValueVector scratch;  // Temporary array
+
+	/* Check the mats. */
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Cpu SpTns MTTKRP");
+	spt_CheckError(result, "Cpu SpTns MTTKRP", NULL);
+
+	sptIndex const tmpI = mats[mode]->nrows;
+	sptIndex const R = mats[mode]->ncols;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+	memset(mvals, 0, tmpI*stride*sizeof(sptValue));
+	sptNewValueVector(&scratch, R, R);
+	sptValue * const restrict row = scratch.data;
+
+	sptTimer timer;
+	sptNewTimer(&timer, 0);
+	double comp_time, total_time;
+
+	sptStartTimer(timer);
+	for(sptNnzIndex x=0; x<nnz; ++x) {
+		sptValue const entry = vals[x];
+		sptValue const * times_row = mats[mats_order[1]]->values + X->inds[mats_order[1]].data[x] * stride;
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] = entry * times_row[r];
+		}
+		for(sptIndex i=2; i<nmodes; ++i) {
+			times_row = mats[mats_order[i]]->values + X->inds[mats_order[i]].data[x] * stride;
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] *= times_row[r];
+			}
+		}
+
+		sptValue * const restrict mvals_row = mvals + mode_ind[x] * stride;
+		for(sptIndex r=0; r<R; ++r) {
+			mvals_row[r] += row[r];
+		}
+	}
+	sptStopTimer(timer);
+	comp_time = sptPrintElapsedTime(timer, "Cpu SpTns MTTKRP");
+	sptFreeTimer(timer);
+	sptFreeValueVector(&scratch);
+
+	total_time = comp_time;
+	sptPrintTotalTime(total_time);
 
 	return 0;
 }
@@ -0,0 +1,123 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+/* Whether a candidate fits, reported to fp. */
+static int budget_try(
+		sptMTTKRPBudget * const choice,
+		char const * const kernel,
+		sptMTTKRPStrategy const strategy,
+		size_t const kernel_bytes,
+		size_t const budget,
+		FILE *fp)
+{
+	size_t const total = choice->tensor_bytes + choice->factor_bytes + choice->output_bytes + kernel_bytes;
+	int const fits = total <= budget;
+	if(fp != NULL) {
+		char const * const detail = strcmp(kernel, "plan") != 0 ? "" :
+				strategy == SPT_MTTKRP_PRIVATIZED ? " privatized" : " atomic";
+		char * bytestr = sptBytesString(total);
+		fprintf(fp, "budget: %s%s %s %s\n", kernel, detail, bytestr, fits ? "fits" : "exceeds");
+		free(bytestr);
+	}
+	if(fits) {
+		strncpy(choice->kernel, kernel, sizeof choice->kernel - 1);
+		choice->kernel[sizeof choice->kernel - 1] = '\0';
+		choice->strategy = strategy;
+		choice->kernel_bytes = kernel_bytes;
+	}
+	return fits;
+}
+
+
+/**
+ * Pick the fastest MTTKRP variant whose footprint fits a memory budget
+ * @param[out] choice    the variant and its footprint by part
+ * @param[in]  X    the sparse tensor input X, already loaded
+ * @param[in]  stride    the row stride the factors will have, sptMatrixStride of the rank
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  nthreads    the number of threads, 1 for a sequential run
+ * @param[in]  budget    the bytes the tensor, factors, output and kernel may hold together
+ * @param[in]  fp    where to report each candidate, or NULL
+ *
+ * The factors and output are sized as the driver allocates them, the kernel
+ * state from the same footprint functions as its constructor, so nothing is
+ * built to find out. Candidates go from fastest to leanest: per-thread
+ * output copies where the plan would privatize anyway, packed records for
+ * order 5 and up, work stealing (a row index, and a permutation unless X is
+ * sorted by mode), an atomic plan, and plain COO, which adds nothing. Fails
+ * if even the tensor, factors and output exceed the budget.
+ */
+int sptMTTKRPChooseForBudget(
+		sptMTTKRPBudget * const choice,
+		sptSparseTensor const * const X,
+		sptIndex const stride,
+		sptIndex const mode,
+		int const nthreads,
+		size_t const budget,
+		FILE *fp)
+{
+	sptIndex const nmodes = X->nmodes;
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Budget", "mode >= nmodes");
+	}
+
+	sptIndex max_ndims = 0;
+	choice->tensor_bytes = sptSparseTensorBytes(X);
+	choice->factor_bytes = 0;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		choice->factor_bytes += (size_t)(X->ndims[m] > 0 ? X->ndims[m] : 1) * stride * sizeof(sptValue);
+		if(X->ndims[m] > max_ndims) {
+			max_ndims = X->ndims[m];
+		}
+	}
+	choice->output_bytes = (size_t)(max_ndims > 0 ? max_ndims : 1) * stride * sizeof(sptValue);
+	choice->kernel_bytes = 0;
+	choice->kernel[0] = '\0';
+
+	if(nthreads > 1) {
+		/* Privatizing only wins when the plan's own rule would pick it. */
+		size_t const automatic = sptMTTKRPPlanFootprint(X, stride, mode, nthreads, SPT_MTTKRP_AUTO);
+		size_t const privatized = sptMTTKRPPlanFootprint(X, stride, mode, nthreads, SPT_MTTKRP_PRIVATIZED);
+		if(automatic == privatized && budget_try(choice, "plan", SPT_MTTKRP_PRIVATIZED, privatized, budget, fp)) {
+			return 0;
+		}
+	}
+	if(nmodes >= 5 && budget_try(choice, "packed", SPT_MTTKRP_AUTO, sptSparseTensorPackedFootprint(X), budget, fp)) {
+		return 0;
+	}
+	if(nthreads > 1) {
+		if(budget_try(choice, "steal", SPT_MTTKRP_STEALING, sptMTTKRPPlanFootprint(X, stride, mode, nthreads, SPT_MTTKRP_STEALING), budget, fp)) {
+			return 0;
+		}
+		if(budget_try(choice, "plan", SPT_MTTKRP_ATOMIC, sptMTTKRPPlanFootprint(X, stride, mode, nthreads, SPT_MTTKRP_ATOMIC), budget, fp)) {
+			return 0;
+		}
+	}
+	if(budget_try(choice, "coo", SPT_MTTKRP_AUTO, 0, budget, fp)) {
+		return 0;
+	}
+	spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Budget", "the tensor, factors and output alone exceed the budget");
+	return 0;
+}
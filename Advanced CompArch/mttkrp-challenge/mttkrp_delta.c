@@ -0,0 +1,101 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+static int delta_check_mats(sptSparseTensor const * const delta, sptMatrix * mats[], sptIndex const mode)
+{
+	if(delta->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Delta", "pattern-only tensor");
+	}
+	return spt_CheckMTTKRPMats(mats, delta->nmodes, delta->ndims, mode, "MTTKRP Delta");
+}
+
+
+/**
+ * Add the MTTKRP of a batch of new nonzeros to an existing MTTKRP output
+ * @param[out] mats[nmodes]    the MTTKRP of the tensor so far, updated in place
+ * @param[in]  delta    the new nonzeros, with the ndims of the tensor
+ * @param[in]  mats    (N+1) dense matrices, the factors the output was computed with
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ *
+ * MTTKRP is linear in the tensor, so the MTTKRP of X plus delta is the
+ * output for X plus the MTTKRP of delta alone: only the delta nonzeros are
+ * read. A changed entry is given as the difference of its new and old
+ * values. The result is exact only while the factors other than mats[mode]
+ * are the ones the output was computed with.
+ */
+int sptMTTKRPDelta(
+		sptSparseTensor const * const delta,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode)
+{
+	sptIndex const nmodes = delta->nmodes;
+	int result = delta_check_mats(delta, mats, mode);
+	spt_CheckError(result, "MTTKRP Delta", NULL);
+
+	sptValue * row = malloc(mats[nmodes]->stride * sizeof *row);
+	spt_CheckOSError(!row, "MTTKRP Delta");
+	spt_MTTKRPCooRange(delta, nmodes, mats, mats_order, mode, 0, delta->nnz, row, 0, 0);
+	free(row);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP version of sptMTTKRPDelta
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPDelta
+ *
+ * Batches are small next to the tensor and their rows rarely collide, so
+ * threads split the nonzeros evenly and add with atomics.
+ */
+int sptOmpMTTKRPDelta(
+		sptSparseTensor const * const delta,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk)
+{
+	sptIndex const nmodes = delta->nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	int result = delta_check_mats(delta, mats, mode);
+	spt_CheckError(result, "Omp MTTKRP Delta", NULL);
+
+	sptValue * rows = malloc((size_t)tk * stride * sizeof *rows);
+	spt_CheckOSError(!rows, "Omp MTTKRP Delta");
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		sptNnzIndex const begin = delta->nnz * tid / nt;
+		sptNnzIndex const end = delta->nnz * (tid + 1) / nt;
+		spt_MTTKRPCooRange(delta, nmodes, mats, mats_order, mode, begin, end, rows + (size_t)tid * stride, 0, nt > 1);
+	}
+	free(rows);
+
+	return 0;
+}
@@ -0,0 +1,576 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+#define SPT_HYBRID_MAX_MODES 16
+/* Slices with fewer nonzeros are not worth a block. */
+#define SPT_HYBRID_MIN_NNZ 16
+/* Largest dense block, in values. */
+#define SPT_HYBRID_MAX_BLOCK ((sptNnzIndex)1 << 24)
+
+static int hybrid_compare_index(void const * a, void const * b)
+{
+	sptIndex const ia = *(sptIndex const *)a;
+	sptIndex const ib = *(sptIndex const *)b;
+	return ia < ib ? -1 : ia > ib;
+}
+
+
+/*
+ * Used indices of slice nonzeros perm[begin, end) in mode m, ascending, into
+ * list. stamp[idx] == tag marks indices already seen. Returns the count.
+ */
+static sptIndex hybrid_used(
+		sptSparseTensor const * const X,
+		sptIndex const m,
+		sptNnzIndex const * const perm,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptIndex * const stamp,
+		sptIndex const tag,
+		sptIndex * const list)
+{
+	sptIndex n = 0;
+	for(sptNnzIndex p=begin; p<end; ++p) {
+		sptIndex const idx = X->inds[m].data[perm[p]];
+		if(stamp[idx] != tag) {
+			stamp[idx] = tag;
+			list[n++] = idx;
+		}
+	}
+	qsort(list, n, sizeof *list, hybrid_compare_index);
+	return n;
+}
+
+
+/**
+ * Split a sparse tensor into dense slice blocks and a COO remainder
+ * @param[out] hyb    an uninitialized hybrid tensor
+ * @param[in]  X    the sparse tensor, not modified
+ * @param[in]  slice_mode    the mode the slices are taken along
+ * @param[in]  threshold    the density, in (0, 1], from which a slice is stored dense
+ *
+ * The density of a slice is its nonzero count over the size of the block
+ * spanned by the indices it uses. Duplicate coordinates are summed into the
+ * block.
+ */
+int sptNewSparseTensorHybrid(
+		sptSparseTensorHybrid * const hyb,
+		sptSparseTensor const * const X,
+		sptIndex const slice_mode,
+		double const threshold)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	sptIndex const nslices = X->ndims[slice_mode];
+	int result;
+
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "Hybrid SpTns", "pattern-only tensor");
+	}
+	if(slice_mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "Hybrid SpTns", "slice_mode >= nmodes");
+	}
+	if(nmodes > SPT_HYBRID_MAX_MODES) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "Hybrid SpTns", "nmodes > SPT_HYBRID_MAX_MODES");
+	}
+	hyb->slice_mode = slice_mode;
+	hyb->threshold = threshold;
+	hyb->arena = NULL;
+
+	/* Nonzeros grouped by slice, as a permutation. */
+	sptNnzIndex * slice_ptr = malloc((nslices + 1) * sizeof *slice_ptr);
+	sptNnzIndex * perm = malloc((nnz > 0 ? nnz : 1) * sizeof *perm);
+	spt_CheckOSError(!slice_ptr || !perm, "Hybrid SpTns");
+	result = spt_ComputeSliceSizes(slice_ptr + 1, (sptSparseTensor *)X, slice_mode);
+	spt_CheckError(result, "Hybrid SpTns", NULL);
+	slice_ptr[0] = 0;
+	for(sptIndex i=0; i<nslices; ++i) {
+		slice_ptr[i+1] += slice_ptr[i];
+	}
+	{
+		sptNnzIndex * fill = malloc((nslices > 0 ? nslices : 1) * sizeof *fill);
+		spt_CheckOSError(!fill, "Hybrid SpTns");
+		memcpy(fill, slice_ptr, nslices * sizeof *fill);
+		for(sptNnzIndex x=0; x<nnz; ++x) {
+			perm[fill[X->inds[slice_mode].data[x]]++] = x;
+		}
+		free(fill);
+	}
+
+	sptIndex * stamp[SPT_HYBRID_MAX_MODES];
+	sptIndex * used[SPT_HYBRID_MAX_MODES];
+	for(sptIndex m=0; m<nmodes; ++m) {
+		stamp[m] = malloc((X->ndims[m] > 0 ? X->ndims[m] : 1) * sizeof *stamp[m]);
+		used[m] = malloc((X->ndims[m] > 0 ? X->ndims[m] : 1) * sizeof *used[m]);
+		spt_CheckOSError(!stamp[m] || !used[m], "Hybrid SpTns");
+		for(sptIndex i=0; i<X->ndims[m]; ++i) {
+			stamp[m][i] = nslices;
+		}
+	}
+
+	/* Pass one picks the dense slices and sizes their storage. */
+	char * dense = calloc(nslices > 0 ? nslices : 1, sizeof *dense);
+	spt_CheckOSError(!dense, "Hybrid SpTns");
+	sptNnzIndex nlists = 0, nvalues = 0;
+	hyb->ndense = 0;
+	hyb->dense_nnz = 0;
+	hyb->max_dim = 1;
+	for(sptIndex i=0; i<nslices; ++i) {
+		sptNnzIndex const cnt = slice_ptr[i+1] - slice_ptr[i];
+		if(cnt < SPT_HYBRID_MIN_NNZ) {
+			continue;
+		}
+		double size = 1;
+		sptIndex lens[SPT_HYBRID_MAX_MODES];
+		for(sptIndex m=0; m<nmodes; ++m) {
+			lens[m] = m == slice_mode ? 1 : hybrid_used(X, m, perm, slice_ptr[i], slice_ptr[i+1], stamp[m], i, used[m]);
+			size *= lens[m];
+		}
+		if(size <= SPT_HYBRID_MAX_BLOCK && cnt >= threshold * size) {
+			dense[i] = 1;
+			++hyb->ndense;
+			hyb->dense_nnz += cnt;
+			nvalues += (sptNnzIndex)size;
+			for(sptIndex m=0; m<nmodes; ++m) {
+				nlists += lens[m];
+				if(lens[m] > hyb->max_dim) {
+					hyb->max_dim = lens[m];
+				}
+			}
+		}
+	}
+
+	sptIndex const nd = hyb->ndense;
+	hyb->slice_ids = malloc((nd > 0 ? nd : 1) * sizeof *hyb->slice_ids);
+	hyb->block_dims = malloc(((size_t)nd * nmodes + 1) * sizeof *hyb->block_dims);
+	hyb->list_ptr = malloc(((size_t)nd * nmodes + 1) * sizeof *hyb->list_ptr);
+	hyb->lists = malloc((nlists > 0 ? nlists : 1) * sizeof *hyb->lists);
+	hyb->value_ptr = malloc((nd + 1) * sizeof *hyb->value_ptr);
+	hyb->values = calloc(nvalues > 0 ? nvalues : 1, sizeof *hyb->values);
+	spt_CheckOSError(!hyb->slice_ids || !hyb->block_dims || !hyb->list_ptr || !hyb->lists ||
+			!hyb->value_ptr || !hyb->values, "Hybrid SpTns");
+
+	/* Pass two fills the blocks. stamp is reused as each index's position in its list. */
+	sptIndex d = 0;
+	hyb->list_ptr[0] = 0;
+	hyb->value_ptr[0] = 0;
+	for(sptIndex i=0; i<nslices; ++i) {
+		if(!dense[i]) {
+			continue;
+		}
+		hyb->slice_ids[d] = i;
+		for(sptIndex m=0; m<nmodes; ++m) {
+			sptIndex * const list = hyb->lists + hyb->list_ptr[d * nmodes + m];
+			sptIndex len;
+			if(m == slice_mode) {
+				list[0] = i;
+				len = 1;
+			} else {
+				len = hybrid_used(X, m, perm, slice_ptr[i], slice_ptr[i+1], stamp[m], nslices + 1, list);
+				for(sptIndex j=0; j<len; ++j) {
+					stamp[m][list[j]] = j;
+				}
+			}
+			hyb->block_dims[d * nmodes + m] = len;
+			hyb->list_ptr[d * nmodes + m + 1] = hyb->list_ptr[d * nmodes + m] + len;
+		}
+		sptValue * const block = hyb->values + hyb->value_ptr[d];
+		sptNnzIndex size = 1;
+		for(sptNnzIndex p=slice_ptr[i]; p<slice_ptr[i+1]; ++p) {
+			sptNnzIndex const x = perm[p];
+			sptNnzIndex offset = 0;
+			for(sptIndex m=0; m<nmodes; ++m) {
+				if(m != slice_mode) {
+					offset = offset * hyb->block_dims[d * nmodes + m] + stamp[m][X->inds[m].data[x]];
+				}
+			}
+			block[offset] += X->values.data[x];
+		}
+		for(sptIndex m=0; m<nmodes; ++m) {
+			size *= hyb->block_dims[d * nmodes + m];
+		}
+		hyb->value_ptr[d+1] = hyb->value_ptr[d] + size;
+		/* Reset the stamps so the next slice starts clean. */
+		for(sptIndex m=0; m<nmodes; ++m) {
+			if(m != slice_mode) {
+				for(sptNnzIndex p=slice_ptr[i]; p<slice_ptr[i+1]; ++p) {
+					stamp[m][X->inds[m].data[perm[p]]] = nslices;
+				}
+			}
+		}
+		++d;
+	}
+
+	/* The remainder, in its original order. */
+	result = sptNewSparseTensor(&hyb->sparse, nmodes, X->ndims);
+	spt_CheckError(result, "Hybrid SpTns", NULL);
+	sptNnzIndex const sparse_nnz = nnz - hyb->dense_nnz;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		result = sptResizeIndexVector(&hyb->sparse.inds[m], sparse_nnz);
+		spt_CheckError(result, "Hybrid SpTns", NULL);
+	}
+	result = sptResizeValueVector(&hyb->sparse.values, sparse_nnz);
+	spt_CheckError(result, "Hybrid SpTns", NULL);
+	sptNnzIndex y = 0;
+	for(sptNnzIndex x=0; x<nnz; ++x) {
+		if(!dense[X->inds[slice_mode].data[x]]) {
+			for(sptIndex m=0; m<nmodes; ++m) {
+				hyb->sparse.inds[m].data[y] = X->inds[m].data[x];
+			}
+			hyb->sparse.values.data[y] = X->values.data[x];
+			++y;
+		}
+	}
+	hyb->sparse.nnz = sparse_nnz;
+
+	for(sptIndex m=0; m<nmodes; ++m) {
+		free(stamp[m]);
+		free(used[m]);
+	}
+	free(dense);
+	free(perm);
+	free(slice_ptr);
+
+	return 0;
+}
+
+
+/**
+ * The bytes a hybrid sparse tensor holds, its sparse part included
+ * @param hyb a valid hybrid sparse tensor
+ */
+size_t sptSparseTensorHybridBytes(sptSparseTensorHybrid const * const hyb)
+{
+	size_t const nd = hyb->ndense;
+	size_t const nlists = nd * hyb->sparse.nmodes;
+	return sptSparseTensorBytes(&hyb->sparse) + nd * sizeof *hyb->slice_ids
+			+ (nlists + 1) * (sizeof *hyb->block_dims + sizeof *hyb->list_ptr) + hyb->list_ptr[nlists] * sizeof *hyb->lists
+			+ (nd + 1) * sizeof *hyb->value_ptr + hyb->value_ptr[nd] * sizeof *hyb->values;
+}
+
+
+/* Lengths of the block index lists and values, as allocated. */
+static sptNnzIndex hybrid_nlists(sptSparseTensorHybrid const * const hyb)
+{
+	sptNnzIndex const n = hyb->list_ptr[(size_t)hyb->ndense * hyb->sparse.nmodes];
+	return n > 0 ? n : 1;
+}
+
+static sptNnzIndex hybrid_nvalues(sptSparseTensorHybrid const * const hyb)
+{
+	sptNnzIndex const n = hyb->value_ptr[hyb->ndense];
+	return n > 0 ? n : 1;
+}
+
+
+/**
+ * The arena bytes sptSparseTensorHybridMoveToArena takes
+ * @param hyb a valid hybrid tensor
+ */
+size_t sptSparseTensorHybridArenaSize(sptSparseTensorHybrid const * const hyb)
+{
+	return sptSparseTensorArenaSize(hyb->sparse.nmodes, hyb->sparse.nnz) + sptArenaRounded(hybrid_nlists(hyb) * sizeof *hyb->lists)
+			+ sptArenaRounded(hybrid_nvalues(hyb) * sizeof *hyb->values);
+}
+
+
+/**
+ * Move the COO part, block index lists and dense blocks into an arena
+ * @param hyb   a hybrid tensor on the heap
+ * @param arena the arena, with sptSparseTensorHybridArenaSize bytes free
+ */
+int sptSparseTensorHybridMoveToArena(sptSparseTensorHybrid * const hyb, sptArena * const arena)
+{
+	if(arena->used + sptSparseTensorHybridArenaSize(hyb) > arena->size) {
+		spt_CheckError(SPTERR_OS_ERROR + ENOMEM, "Hybrid SpTns Move", "the arena is full");
+	}
+	int result = sptSparseTensorMoveToArena(&hyb->sparse, arena);
+	spt_CheckError(result, "Hybrid SpTns Move", NULL);
+	result = sptArenaMove(arena, (void **)&hyb->lists, hybrid_nlists(hyb) * sizeof *hyb->lists);
+	spt_CheckError(result, "Hybrid SpTns Move", NULL);
+	result = sptArenaMove(arena, (void **)&hyb->values, hybrid_nvalues(hyb) * sizeof *hyb->values);
+	spt_CheckError(result, "Hybrid SpTns Move", NULL);
+	hyb->arena = arena;
+	return 0;
+}
+
+
+/**
+ * Release a hybrid sparse tensor
+ * @param hyb the hybrid tensor
+ */
+void sptFreeSparseTensorHybrid(sptSparseTensorHybrid *hyb)
+{
+	sptFreeSparseTensor(&hyb->sparse);
+	free(hyb->slice_ids);
+	free(hyb->block_dims);
+	free(hyb->list_ptr);
+	free(hyb->value_ptr);
+	if(hyb->arena == NULL) {
+		free(hyb->lists);
+		free(hyb->values);
+	}
+	hyb->ndense = 0;
+}
+
+
+/**
+ * Print the split of a hybrid tensor and the index memory it saves
+ * @param hyb the hybrid tensor
+ * @param fp  the file to print to
+ *
+ * A dense nonzero needs no index tuple, but a block also stores its zeros
+ * and one index list per mode. The net saving can be negative.
+ */
+void sptSparseTensorHybridStatus(sptSparseTensorHybrid const * const hyb, FILE *fp)
+{
+	sptIndex const nmodes = hyb->sparse.nmodes;
+	int64_t const coo_bytes = (int64_t)hyb->dense_nnz * (nmodes * sizeof(sptIndex) + sizeof(sptValue));
+	int64_t const block_bytes = (int64_t)hyb->value_ptr[hyb->ndense] * sizeof(sptValue) +
+			(int64_t)hyb->list_ptr[(size_t)hyb->ndense * nmodes] * sizeof(sptIndex);
+
+	fprintf(fp, "Hybrid sparse tensor (slices along mode %"PASTA_PRI_INDEX ", density >= %.3lf)---------\n",
+					hyb->slice_mode, hyb->threshold);
+	fprintf(fp, "Dense slices: %"PASTA_PRI_INDEX ", %"PASTA_PRI_NNZ_INDEX " nnz in %"PASTA_PRI_NNZ_INDEX " block entries; COO remainder: %"PASTA_PRI_NNZ_INDEX " nnz\n",
+					hyb->ndense, hyb->dense_nnz, hyb->value_ptr[hyb->ndense], hyb->sparse.nnz);
+	char * const coo_str = sptBytesString(coo_bytes);
+	char * const block_str = sptBytesString(block_bytes);
+	char * const saved_str = sptBytesString(coo_bytes > block_bytes ? coo_bytes - block_bytes : block_bytes - coo_bytes);
+	fprintf(fp, "Dense part as COO: %s, as blocks: %s, %s %s\n", coo_str, block_str,
+					coo_bytes >= block_bytes ? "saved" : "extra", saved_str);
+	free(coo_str);
+	free(block_str);
+	free(saved_str);
+	fprintf(fp, "\n");
+}
+
+
+/*
+ * MTTKRP of dense block d. The innermost block mode c is contracted as a
+ * matrix product over the block's rows: with the factor panel of c when c is
+ * not the output mode, or against the Khatri-Rao rows of the other modes
+ * when it is. row holds one row, acc max_dim rows.
+ */
+static void hybrid_block(
+		sptSparseTensorHybrid const * const hyb,
+		sptIndex const d,
+		sptMatrix * mats[],
+		sptIndex const mode,
+		sptValue * const restrict row,
+		sptValue * const restrict acc,
+		int const atomic)
+{
+	sptIndex const nmodes = hyb->sparse.nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const * const dims = hyb->block_dims + (size_t)d * nmodes;
+	sptValue const * const restrict block = hyb->values + hyb->value_ptr[d];
+	sptValue * const restrict mvals = mats[nmodes]->values;
+	sptIndex const * lists[SPT_HYBRID_MAX_MODES];
+	sptIndex idx[SPT_HYBRID_MAX_MODES] = { 0 };
+
+	sptIndex c = nmodes - 1;
+	if(c == hyb->slice_mode && c > 0) {
+		--c;
+	}
+	sptNnzIndex nrows = 1;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		lists[m] = hyb->lists + hyb->list_ptr[(size_t)d * nmodes + m];
+		if(m != c) {
+			nrows *= dims[m];
+		}
+	}
+	sptIndex const nc = dims[c];
+	sptValue const * const restrict panel_c = mats[c]->values;
+
+	memset(acc, 0, (size_t)dims[mode] * stride * sizeof *acc);
+	for(sptNnzIndex p=0; p<nrows; ++p) {
+		sptValue const * const restrict brow = block + p * nc;
+		if(mode == c) {
+			/* acc[jc] += brow[jc] * (Khatri-Rao row of the other modes) */
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] = 1;
+			}
+			for(sptIndex m=0; m<nmodes; ++m) {
+				if(m != c) {
+					sptValue const * const restrict f = mats[m]->values + (size_t)lists[m][idx[m]] * stride;
+#pragma omp simd
+					for(sptIndex r=0; r<R; ++r) {
+						row[r] *= f[r];
+					}
+				}
+			}
+			for(sptIndex jc=0; jc<nc; ++jc) {
+				sptValue const v = brow[jc];
+				if(v == 0) {
+					continue;
+				}
+				sptValue * const restrict acc_row = acc + (size_t)jc * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					acc_row[r] += v * row[r];
+				}
+			}
+		} else {
+			/* acc[j_mode] += (brow * panel_c) .* (rows of the other modes) */
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] = 0;
+			}
+			for(sptIndex jc=0; jc<nc; ++jc) {
+				sptValue const v = brow[jc];
+				if(v == 0) {
+					continue;
+				}
+				sptValue const * const restrict f = panel_c + (size_t)lists[c][jc] * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					row[r] += v * f[r];
+				}
+			}
+			for(sptIndex m=0; m<nmodes; ++m) {
+				if(m != c && m != mode) {
+					sptValue const * const restrict f = mats[m]->values + (size_t)lists[m][idx[m]] * stride;
+#pragma omp simd
+					for(sptIndex r=0; r<R; ++r) {
+						row[r] *= f[r];
+					}
+				}
+			}
+			sptValue * const restrict acc_row = acc + (size_t)idx[mode] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				acc_row[r] += row[r];
+			}
+		}
+
+		/* Next block row, the highest mode varying fastest. */
+		for(sptIndex m=nmodes; m-- > 0;) {
+			if(m == c) {
+				continue;
+			}
+			if(++idx[m] < dims[m]) {
+				break;
+			}
+			idx[m] = 0;
+		}
+	}
+
+	for(sptIndex j=0; j<dims[mode]; ++j) {
+		sptValue * const restrict mvals_row = mvals + (size_t)lists[mode][j] * stride;
+		sptValue const * const restrict acc_row = acc + (size_t)j * stride;
+		if(atomic) {
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += acc_row[r];
+			}
+		} else {
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				mvals_row[r] += acc_row[r];
+			}
+		}
+	}
+}
+
+
+/**
+ * MTTKRP on a hybrid dense/sparse tensor
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  hyb    the hybrid tensor
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ */
+int sptMTTKRPHybrid(
+		sptSparseTensorHybrid const * const hyb,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode)
+{
+	sptIndex const nmodes = hyb->sparse.nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	int result = spt_CheckMTTKRPMats(mats, nmodes, hyb->sparse.ndims, mode, "MTTKRP Hybrid");
+	spt_CheckError(result, "MTTKRP Hybrid", NULL);
+
+	sptValue * scratch = malloc(((size_t)hyb->max_dim + 1) * stride * sizeof *scratch);
+	spt_CheckOSError(!scratch, "MTTKRP Hybrid");
+	memset(mats[nmodes]->values, 0, (size_t)hyb->sparse.ndims[mode] * stride * sizeof(sptValue));
+	spt_MTTKRPCooRange(&hyb->sparse, nmodes, mats, mats_order, mode, 0, hyb->sparse.nnz, scratch, 0, 0);
+	for(sptIndex d=0; d<hyb->ndense; ++d) {
+		hybrid_block(hyb, d, mats, mode, scratch, scratch + stride, 0);
+	}
+	free(scratch);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP on a hybrid dense/sparse tensor
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPHybrid
+ *
+ * The COO remainder is split statically and the dense blocks dynamically.
+ * Output updates are atomic, except that blocks own their single output row
+ * when the output mode is the slice mode.
+ */
+int sptOmpMTTKRPHybrid(
+		sptSparseTensorHybrid const * const hyb,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk)
+{
+	sptIndex const nmodes = hyb->sparse.nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const nrows = hyb->sparse.ndims[mode];
+	sptNnzIndex const nnz = hyb->sparse.nnz;
+	int result = spt_CheckMTTKRPMats(mats, nmodes, hyb->sparse.ndims, mode, "Omp MTTKRP Hybrid");
+	spt_CheckError(result, "Omp MTTKRP Hybrid", NULL);
+
+	size_t const per_thread = ((size_t)hyb->max_dim + 1) * stride;
+	sptValue * scratch = malloc((size_t)tk * per_thread * sizeof *scratch);
+	spt_CheckOSError(!scratch, "Omp MTTKRP Hybrid");
+	sptValue * const mvals = mats[nmodes]->values;
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		sptValue * const own = scratch + (size_t)tid * per_thread;
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<nrows; ++i) {
+			memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+		}
+		spt_MTTKRPCooRange(&hyb->sparse, nmodes, mats, mats_order, mode, nnz * tid / nt, nnz * (tid + 1) / nt, own, 0, nt > 1);
+		/* Dense slices are absent from the remainder, so their rows are theirs alone. */
+		int const block_atomic = nt > 1 && mode != hyb->slice_mode;
+#pragma omp for schedule(dynamic, 1)
+		for(sptIndex d=0; d<hyb->ndense; ++d) {
+			hybrid_block(hyb, d, mats, mode, own, own + stride, block_atomic);
+		}
+	}
+	free(scratch);
+
+	return 0;
+}
@@ -0,0 +1,550 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include <sched.h>
+#include <dirent.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+#define SPT_MAX_NUMA_NODES 64
+
+/*
+ * CPUs of every NUMA node we may run on, read from sysfs and intersected with
+ * our affinity mask. Without sysfs NUMA information everything is one node.
+ */
+static int numa_discover(cpu_set_t node_cpus[SPT_MAX_NUMA_NODES])
+{
+	cpu_set_t allowed;
+	int nnodes = 0;
+
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+		for(int c=0; c<CPU_SETSIZE; ++c) {
+			CPU_SET(c, &allowed);
+		}
+	}
+
+	DIR * dir = opendir("/sys/devices/system/node");
+	if(dir != NULL) {
+		struct dirent * ent;
+		while((ent = readdir(dir)) != NULL && nnodes < SPT_MAX_NUMA_NODES) {
+			int node;
+			char path[300];
+			if(sscanf(ent->d_name, "node%d", &node) != 1) {
+				continue;
+			}
+			snprintf(path, sizeof path, "/sys/devices/system/node/%s/cpulist", ent->d_name);
+			FILE * fp = fopen(path, "r");
+			if(fp == NULL) {
+				continue;
+			}
+			/* cpulist looks like "0-3,8-11" */
+			CPU_ZERO(&node_cpus[nnodes]);
+			int lo, hi;
+			while(fscanf(fp, "%d", &lo) == 1) {
+				hi = lo;
+				int ch = fgetc(fp);
+				if(ch == '-') {
+					if(fscanf(fp, "%d", &hi) != 1) {
+						break;
+					}
+					ch = fgetc(fp);
+				}
+				for(int c=lo; c<=hi && c<CPU_SETSIZE; ++c) {
+					if(CPU_ISSET(c, &allowed)) {
+						CPU_SET(c, &node_cpus[nnodes]);
+					}
+				}
+				if(ch != ',') {
+					break;
+				}
+			}
+			fclose(fp);
+			if(CPU_COUNT(&node_cpus[nnodes]) > 0) {
+				++nnodes;
+			}
+		}
+		closedir(dir);
+	}
+
+	if(nnodes == 0) {
+		node_cpus[0] = allowed;
+		nnodes = 1;
+	}
+	return nnodes;
+}
+
+
+/* The k-th CPU (modulo the count) of a set. */
+static int numa_nth_cpu(cpu_set_t const * const cpus, int k)
+{
+	k %= CPU_COUNT(cpus);
+	for(int c=0; c<CPU_SETSIZE; ++c) {
+		if(CPU_ISSET(c, cpus) && k-- == 0) {
+			return c;
+		}
+	}
+	return -1;
+}
+
+
+/* Pin the calling thread to cpu. Returns whether it was pinned. */
+static int numa_pin(int const cpu)
+{
+	cpu_set_t pin;
+	if(cpu < 0) {
+		return 0;
+	}
+	CPU_ZERO(&pin);
+	CPU_SET(cpu, &pin);
+	return sched_setaffinity(0, sizeof pin, &pin) == 0;
+}
+
+
+/*
+ * Re-pin the calling thread only if it runs elsewhere, say when the OpenMP
+ * runtime handed its thread number to another thread. sched_getcpu needs
+ * no system call, so this is free on the pinned threads of earlier calls.
+ */
+static void numa_ensure(int const cpu)
+{
+	if(cpu >= 0 && sched_getcpu() != cpu) {
+		numa_pin(cpu);
+	}
+}
+
+
+/**
+ * Set up NUMA-aware MTTKRP
+ * @param[out] numa    an uninitialized state
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    (N+1) dense matrices, only their shapes are inspected
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  nthreads    the number of threads
+ *
+ * Discovers the nodes, spreads the threads evenly over them and pins each
+ * thread to a CPU of its node. The OpenMP threads stay pinned, so the calls
+ * that follow make no affinity system calls; sptFreeMTTKRPNuma restores
+ * the masks they had. Every
+ * node receives a contiguous, thread-proportional share of the nonzeros,
+ * copied by a thread of that node so the pages are local.
+ * Call sptMTTKRPNumaReplicate before executing and whenever factors change.
+ */
+int sptNewMTTKRPNuma(
+		sptMTTKRPNuma * const numa,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mode,
+		int const nthreads)
+{
+	sptIndex const nmodes = X->nmodes;
+	cpu_set_t node_cpus[SPT_MAX_NUMA_NODES];
+
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Numa", "pattern-only tensor");
+	}
+	/* Check the mats. */
+	int result = spt_CheckMTTKRPMats(mats, nmodes, X->ndims, mode, "MTTKRP Numa");
+	spt_CheckError(result, "MTTKRP Numa", NULL);
+
+	numa->X = X;
+	numa->nmodes = nmodes;
+	numa->mode = mode;
+	numa->R = mats[nmodes]->ncols;
+	numa->stride = mats[nmodes]->stride;
+	numa->nrows = X->ndims[mode];
+	numa->nthreads = nthreads > 0 ? nthreads : 1;
+
+	int const tk = numa->nthreads;
+	int nnodes = numa_discover(node_cpus);
+	if(nnodes > tk) {
+		nnodes = tk;
+	}
+	numa->nnodes = nnodes;
+
+	numa->thread_node = malloc(tk * sizeof *numa->thread_node);
+	numa->thread_rank = malloc(tk * sizeof *numa->thread_rank);
+	numa->thread_cpu = malloc(tk * sizeof *numa->thread_cpu);
+	numa->thread_saved = malloc(tk * sizeof *numa->thread_saved);
+	numa->rows = calloc(tk, sizeof *numa->rows);
+	numa->node_nthreads = calloc(nnodes, sizeof *numa->node_nthreads);
+	numa->node_begin = malloc((nnodes + 1) * sizeof *numa->node_begin);
+	numa->inds = calloc((size_t)nnodes * nmodes, sizeof *numa->inds);
+	numa->vals = calloc(nnodes, sizeof *numa->vals);
+	numa->factors = calloc((size_t)nnodes * nmodes, sizeof *numa->factors);
+	numa->outs = calloc(nnodes, sizeof *numa->outs);
+	spt_CheckOSError(!numa->thread_node || !numa->thread_rank || !numa->thread_cpu || !numa->thread_saved || !numa->rows || !numa->node_nthreads ||
+			!numa->node_begin || !numa->inds || !numa->vals || !numa->factors || !numa->outs, "MTTKRP Numa");
+
+	/* Threads in blocks per node, nonzeros in proportion to threads. */
+	for(int t=0; t<tk; ++t) {
+		int const node = (int)((int64_t)t * nnodes / tk);
+		numa->thread_node[t] = node;
+		numa->thread_rank[t] = numa->node_nthreads[node]++;
+	}
+	numa->node_begin[0] = 0;
+	int threads_before = 0;
+	for(int n=0; n<nnodes; ++n) {
+		threads_before += numa->node_nthreads[n];
+		numa->node_begin[n+1] = X->nnz * threads_before / tk;
+	}
+
+	result = 0;
+	double const start = omp_get_wtime();
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const node = numa->thread_node[tid];
+		int const cpu = numa_nth_cpu(&node_cpus[node], numa->thread_rank[tid]);
+		int const pinned = cpu >= 0 && sched_getaffinity(0, sizeof numa->thread_saved[tid], &numa->thread_saved[tid]) == 0 && numa_pin(cpu);
+		numa->thread_cpu[tid] = pinned ? cpu : -1;
+		numa->rows[tid] = malloc(numa->stride * sizeof *numa->rows[tid]);
+		if(numa->rows[tid] == NULL) {
+#pragma omp atomic write
+			result = -1;
+		}
+
+		/* The node leader copies the partition, first touching it locally. */
+		if(numa->thread_rank[tid] == 0) {
+			sptNnzIndex const begin = numa->node_begin[node];
+			sptNnzIndex const len = numa->node_begin[node+1] - begin;
+			int ok = 1;
+			for(sptIndex m=0; m<nmodes; ++m) {
+				sptIndex * inds = malloc((len > 0 ? len : 1) * sizeof *inds);
+				numa->inds[node * nmodes + m] = inds;
+				if(inds == NULL) {
+					ok = 0;
+					continue;
+				}
+				memcpy(inds, X->inds[m].data + begin, len * sizeof *inds);
+			}
+			numa->vals[node] = malloc((len > 0 ? len : 1) * sizeof *numa->vals[node]);
+			numa->outs[node] = malloc((size_t)numa->nrows * numa->stride * sizeof *numa->outs[node]);
+			if(numa->vals[node] == NULL || numa->outs[node] == NULL) {
+				ok = 0;
+			} else {
+				memcpy(numa->vals[node], X->values.data + begin, len * sizeof *numa->vals[node]);
+				memset(numa->outs[node], 0, (size_t)numa->nrows * numa->stride * sizeof *numa->outs[node]);
+			}
+			if(!ok) {
+#pragma omp atomic write
+				result = -1;
+			}
+		}
+	}
+	numa->partition_time = omp_get_wtime() - start;
+	numa->replicate_time = 0;
+	numa->replicate_bytes = 0;
+	numa->exec_time = 0;
+	numa->compare_time = 0;
+	numa->baseline_time = 0;
+	spt_CheckOSError(result != 0, "MTTKRP Numa");
+
+	return 0;
+}
+
+
+/**
+ * Copy the factor matrices to every node
+ * @param numa    a state created by sptNewMTTKRPNuma
+ * @param mats    (N+1) dense matrices, all but mats[mode] and mats[nmodes] are replicated
+ *
+ * Each node's leader thread copies the factors, so the replicas are node-local.
+ * The time and bytes are kept for sptMTTKRPNumaStatus.
+ */
+int sptMTTKRPNumaReplicate(sptMTTKRPNuma * const numa, sptMatrix * mats[])
+{
+	sptIndex const nmodes = numa->nmodes;
+	int result = 0;
+	uint64_t bytes = 0;
+
+	double const start = omp_get_wtime();
+#pragma omp parallel num_threads(numa->nthreads) reduction(+:bytes)
+	{
+		int const tid = omp_get_thread_num();
+		int const node = numa->thread_node[tid];
+		numa_ensure(numa->thread_cpu[tid]);
+		if(numa->thread_rank[tid] == 0) {
+			for(sptIndex m=0; m<nmodes; ++m) {
+				if(m == numa->mode) {
+					continue;
+				}
+				size_t const len = (size_t)mats[m]->nrows * numa->stride * sizeof(sptValue);
+				sptValue ** replica = &numa->factors[node * nmodes + m];
+				if(*replica == NULL) {
+					*replica = malloc(len > 0 ? len : 1);
+				}
+				if(*replica == NULL) {
+#pragma omp atomic write
+					result = -1;
+					continue;
+				}
+				memcpy(*replica, mats[m]->values, len);
+				bytes += len;
+			}
+		}
+	}
+	numa->replicate_time = omp_get_wtime() - start;
+	numa->replicate_bytes = bytes;
+	spt_CheckOSError(result != 0, "MTTKRP Numa Replicate");
+
+	return 0;
+}
+
+
+/**
+ * NUMA-aware MTTKRP
+ * @param numa    a state with replicated factors
+ * @param mats_order    the order of the Khatri-Rao products
+ * @param mats    (N+1) dense matrices, mats[nmodes] receives the result
+ *
+ * Threads read only their node's nonzeros and factor replicas, build each
+ * Khatri-Rao row in their own scratch row and add it to their node's output,
+ * atomically unless they are alone on the node. The per-node outputs are
+ * then summed into mats[nmodes], each thread merging a block of rows.
+ */
+int sptMTTKRPNumaExecute(sptMTTKRPNuma * const numa, sptIndex const mats_order[], sptMatrix * mats[])
+{
+	sptIndex const nmodes = numa->nmodes;
+	sptIndex const R = numa->R;
+	sptIndex const stride = numa->stride;
+	sptIndex const nrows = numa->nrows;
+	int const nnodes = numa->nnodes;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+
+	double const start = omp_get_wtime();
+#pragma omp parallel num_threads(numa->nthreads)
+	{
+		int const tid = omp_get_thread_num();
+		int const node = numa->thread_node[tid];
+		int const rank = numa->thread_rank[tid];
+		int const node_tk = numa->node_nthreads[node];
+		sptNnzIndex const len = numa->node_begin[node+1] - numa->node_begin[node];
+		sptValue * const restrict out = numa->outs[node];
+		sptIndex * const * const inds = numa->inds + node * nmodes;
+		sptValue * const * const factors = numa->factors + node * nmodes;
+		sptValue const * const restrict vals = numa->vals[node];
+		sptIndex const * const restrict mode_ind = inds[numa->mode];
+		sptValue * const restrict row = numa->rows[tid];
+		numa_ensure(numa->thread_cpu[tid]);
+
+		/* Zero this node's output, rows split among its threads. */
+		sptIndex const zbegin = (sptIndex)((uint64_t)nrows * rank / node_tk);
+		sptIndex const zend = (sptIndex)((uint64_t)nrows * (rank + 1) / node_tk);
+		memset(out + (size_t)zbegin * stride, 0, (size_t)(zend - zbegin) * stride * sizeof *out);
+#pragma omp barrier
+
+		sptNnzIndex const begin = len * rank / node_tk;
+		sptNnzIndex const end = len * (rank + 1) / node_tk;
+		for(sptNnzIndex x=begin; x<end; ++x) {
+			sptValue * const restrict out_row = out + (size_t)mode_ind[x] * stride;
+			sptValue const * const restrict row_1 = factors[mats_order[1]] + (size_t)inds[mats_order[1]][x] * stride;
+			sptValue const v = vals[x];
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] = v * row_1[r];
+			}
+			for(sptIndex i=2; i<nmodes; ++i) {
+				sptValue const * const restrict times_row = factors[mats_order[i]] + (size_t)inds[mats_order[i]][x] * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					row[r] *= times_row[r];
+				}
+			}
+			if(node_tk == 1) {
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					out_row[r] += row[r];
+				}
+			} else {
+				for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+					out_row[r] += row[r];
+				}
+			}
+		}
+#pragma omp barrier
+
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<nrows; ++i) {
+			sptValue * const restrict mvals_row = mvals + (size_t)i * stride;
+			sptValue const * const restrict first = numa->outs[0] + (size_t)i * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				mvals_row[r] = first[r];
+			}
+			for(int n=1; n<nnodes; ++n) {
+				sptValue const * const restrict node_row = numa->outs[n] + (size_t)i * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] += node_row[r];
+				}
+			}
+		}
+	}
+	numa->exec_time = omp_get_wtime() - start;
+
+	return 0;
+}
+
+
+/**
+ * Time NUMA-aware MTTKRP against sptOmpMTTKRP on the same input
+ * @param numa    a state with replicated factors
+ * @param mats_order    the order of the Khatri-Rao products
+ * @param mats    (N+1) dense matrices, mats[nmodes] is left with the NUMA result
+ * @param niters    the number of runs of each kernel to average over
+ *
+ * sptOmpMTTKRP runs on numa->X with as many threads, which are still
+ * pinned, so both kernels run on the same CPUs. The mean
+ * times are kept for sptMTTKRPNumaStatus.
+ */
+int sptMTTKRPNumaCompare(sptMTTKRPNuma * const numa, sptIndex const mats_order[], sptMatrix * mats[], int const niters)
+{
+	int const runs = niters > 0 ? niters : 1;
+	double elapsed = 0;
+	for(int it=0; it<runs; ++it) {
+		double const start = omp_get_wtime();
+		int result = sptOmpMTTKRP(numa->X, mats, mats_order, numa->mode, numa->nthreads);
+		elapsed += omp_get_wtime() - start;
+		spt_CheckError(result, "MTTKRP Numa Compare", NULL);
+	}
+	numa->baseline_time = elapsed / runs;
+
+	elapsed = 0;
+	for(int it=0; it<runs; ++it) {
+		int result = sptMTTKRPNumaExecute(numa, mats_order, mats);
+		spt_CheckError(result, "MTTKRP Numa Compare", NULL);
+		elapsed += numa->exec_time;
+	}
+	numa->compare_time = elapsed / runs;
+
+	return 0;
+}
+
+
+/**
+ * Print the NUMA layout, replication overhead and gather bandwidth
+ * @param numa the state
+ * @param fp   the file to print to
+ *
+ * After sptMTTKRPNumaCompare the bandwidth is also set against sptOmpMTTKRP.
+ */
+void sptMTTKRPNumaStatus(sptMTTKRPNuma const * const numa, FILE *fp)
+{
+	fprintf(fp, "NUMA MTTKRP (%d nodes, %d threads)---------\n", numa->nnodes, numa->nthreads);
+	for(int n=0; n<numa->nnodes; ++n) {
+		fprintf(fp, "node %d: %d threads, %"PASTA_PRI_NNZ_INDEX " nnz, CPUs", n, numa->node_nthreads[n],
+						numa->node_begin[n+1] - numa->node_begin[n]);
+		for(int t=0; t<numa->nthreads; ++t) {
+			if(numa->thread_node[t] == n) {
+				fprintf(fp, " %d", numa->thread_cpu[t]);
+			}
+		}
+		fprintf(fp, "\n");
+	}
+	char * bytestr = sptBytesString(numa->replicate_bytes);
+	fprintf(fp, "Partition copy: %.6lf s\n", numa->partition_time);
+	fprintf(fp, "Factor replication: %s in %.6lf s (%.2lf GB/s)", bytestr, numa->replicate_time,
+					numa->replicate_time > 0 ? numa->replicate_bytes / numa->replicate_time / 1e9 : 0.0);
+	if(numa->exec_time > 0) {
+		fprintf(fp, ", %.2lfx one execution", numa->replicate_time / numa->exec_time);
+	}
+	fprintf(fp, "\n");
+	free(bytestr);
+	if(numa->exec_time > 0) {
+		/* Every nonzero gathers nmodes-1 factor rows and updates one output row. */
+		double const gathered = (double)numa->X->nnz * numa->nmodes * numa->R * sizeof(sptValue);
+		fprintf(fp, "Last execution: %.6lf s, row traffic %.2lf GB/s\n", numa->exec_time, gathered / numa->exec_time / 1e9);
+		if(numa->baseline_time > 0 && numa->compare_time > 0) {
+			double const numa_bw = gathered / numa->compare_time / 1e9;
+			double const omp_bw = gathered / numa->baseline_time / 1e9;
+			fprintf(fp, "NUMA vs Omp COO: %.6lf s vs %.6lf s, row traffic %.2lf vs %.2lf GB/s, %.2lfx bandwidth\n",
+							numa->compare_time, numa->baseline_time, numa_bw, omp_bw, numa_bw / omp_bw);
+		}
+	}
+	fprintf(fp, "\n");
+}
+
+
+/**
+ * The bytes NUMA MTTKRP state holds: partitions, factor replicas and outputs
+ * @param numa a valid NUMA state, replicas count once they are made
+ */
+size_t sptMTTKRPNumaBytes(sptMTTKRPNuma const * const numa)
+{
+	size_t const nslots = (size_t)numa->nnodes * numa->nmodes;
+	size_t bytes = (size_t)numa->nthreads * (3 * sizeof(int) + sizeof(cpu_set_t) + sizeof *numa->rows + numa->stride * sizeof(sptValue))
+			+ numa->nnodes * sizeof(int)
+			+ (numa->nnodes + 1) * sizeof *numa->node_begin
+			+ nslots * (sizeof *numa->inds + sizeof *numa->factors) + numa->nnodes * (sizeof *numa->vals + sizeof *numa->outs);
+	for(int n=0; n<numa->nnodes; ++n) {
+		sptNnzIndex const len = numa->node_begin[n+1] - numa->node_begin[n];
+		bytes += len * (numa->nmodes * sizeof(sptIndex) + sizeof(sptValue));
+		bytes += (size_t)numa->nrows * numa->stride * sizeof(sptValue);
+		for(sptIndex m=0; m<numa->nmodes; ++m) {
+			if(numa->factors[n * numa->nmodes + m] != NULL) {
+				bytes += (size_t)numa->X->ndims[m] * numa->stride * sizeof(sptValue);
+			}
+		}
+	}
+	return bytes;
+}
+
+
+/**
+ * Release the node-local copies of a NUMA MTTKRP state
+ * @param numa the state
+ *
+ * The OpenMP threads get back the affinity they had before sptNewMTTKRPNuma.
+ */
+void sptFreeMTTKRPNuma(sptMTTKRPNuma *numa)
+{
+#pragma omp parallel num_threads(numa->nthreads)
+	{
+		int const tid = omp_get_thread_num();
+		if(numa->thread_cpu[tid] >= 0) {
+			sched_setaffinity(0, sizeof numa->thread_saved[tid], &numa->thread_saved[tid]);
+		}
+		free(numa->rows[tid]);
+	}
+	for(int n=0; n<numa->nnodes; ++n) {
+		for(sptIndex m=0; m<numa->nmodes; ++m) {
+			free(numa->inds[n * numa->nmodes + m]);
+			free(numa->factors[n * numa->nmodes + m]);
+		}
+		free(numa->vals[n]);
+		free(numa->outs[n]);
+	}
+	free(numa->thread_node);
+	free(numa->thread_rank);
+	free(numa->thread_cpu);
+	free(numa->thread_saved);
+	free(numa->rows);
+	free(numa->node_nthreads);
+	free(numa->node_begin);
+	free(numa->inds);
+	free(numa->vals);
+	free(numa->factors);
+	free(numa->outs);
+	numa->nnodes = 0;
+	numa->nthreads = 0;
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include "helper_funcs.h"
 #include "vector.h"
+#include "sptensors.h"
 
 int sptOmpMTTKRP_3D(sptSparseTensor const * const X,
 										sptMatrix * mats[],     // mats[nmodes] as temporary space.
@@ -27,6 +28,12 @@ int sptOmpMTTKRP_3D(sptSparseTensor const * const X,
 										sptIndex const mode,
 										const int tk);
 
+int sptOmpMTTKRP_ND(sptSparseTensor const * const X,
+										sptMatrix * mats[],     // mats[nmodes] as temporary space.
+										sptIndex const mats_order[],    // Correspond to the mode order of X.
+										sptIndex const mode,
+										const int tk);
+
 /**
  * OpenMP parallelized Matriced sparse tensor times a sequence of dense matrix Khatri-Rao products (MTTKRP) on a specified mode
  * @param[out] mats[nmodes]    the result of MTTKRP, a dense matrix, with size
@@ -49,10 +56,17 @@ int sptOmpMTTKRP(sptSparseTensor const * const X,
 {
 	sptIndex const nmodes = X->nmodes;
 
+	if(X->pattern) {
+		return sptOmpMTTKRPPattern(X, mats, mats_order, mode, tk);
+	}
 	if(nmodes == 3) {
 		sptAssert(sptOmpMTTKRP_3D(X, mats, mats_order, mode, tk) == 0);
 		return 0;
 	}
+	if(nmodes != 4) {
+		sptAssert(sptOmpMTTKRP_ND(X, mats, mats_order, mode, tk) == 0);
+		return 0;
+	}
 
 	sptNnzIndex const nnz = X->nnz;
 	sptIndex const * const ndims = X->ndims;
@@ -60,14 +74,8 @@ int sptOmpMTTKRP(sptSparseTensor const * const X,
 	sptIndex const stride = mats[0]->stride;
 
 	/* Check the mats. */
-	for(sptIndex i=0; i<nmodes; ++i) {
-		if(mats[i]->ncols != mats[nmodes]->ncols) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Omp SpTns MTTKRP", "mats[i]->cols != mats[nmodes]->ncols");
-		}
-		if(mats[i]->nrows != ndims[i]) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Omp SpTns MTTKRP", "mats[i]->nrows != ndims[i]");
-		}
-	}
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Omp SpTns MTTKRP");
+	spt_CheckError(result, "Omp SpTns MTTKRP", NULL);
 
 	sptIndex const tmpI = mats[mode]->nrows;
 	sptIndex const R = mats[mode]->ncols;
@@ -104,8 +112,8 @@ int sptOmpMTTKRP(sptSparseTensor const * const X,
 		sptValue* times_mat_values_1 = times_mat_1 + tmp_mult_1;
 		sptValue* times_mat_values_2 = times_mat_2 + tmp_mult_2;
 		sptValue* times_mat_values_3 = times_mat_3 + tmp_mult_3;
-#pragma omp simd
 		for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
 			mvals[tmp_mode + r] += entry * times_mat_values_1[r] * times_mat_values_2[r] * times_mat_values_3[r];
 		}
 
@@ -165,8 +173,7 @@ int sptOmpMTTKRP(sptSparseTensor const * const X,
 	sptFreeTimer(timer);
 
 	total_time = comp_time;
-	printf("[Total time]: %lf\n", total_time);
-	printf("\n");
+	sptPrintTotalTime(total_time);
 
 	return 0;
 }
@@ -186,14 +193,8 @@ int sptOmpMTTKRP_3D(sptSparseTensor const * const X,
 
 	/* Check the mats. */
 	sptAssert(nmodes ==3);
-	for(sptIndex i=0; i<nmodes; ++i) {
-		if(mats[i]->ncols != mats[nmodes]->ncols) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Omp SpTns MTTKRP", "mats[i]->cols != mats[nmodes]->ncols");
-		}
-		if(mats[i]->nrows != ndims[i]) {
-			spt_CheckError(SPTERR_SHAPE_MISMATCH, "Omp SpTns MTTKRP", "mats[i]->nrows != ndims[i]");
-		}
-	}
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Omp SpTns MTTKRP");
+	spt_CheckError(result, "Omp SpTns MTTKRP", NULL);
 
 	sptIndex const tmpI = mats[mode]->nrows;
 	sptIndex const R = mats[mode]->ncols;
@@ -232,8 +233,76 @@ int sptOmpMTTKRP_3D(sptSparseTensor const * const X,
 	sptFreeTimer(timer);
 
 	total_time = comp_time;
-	printf("[Total time]: %lf\n", total_time);
-	printf("\n");
+	sptPrintTotalTime(total_time);
+
+	return 0;
+}
+
+
+int sptOmpMTTKRP_ND(sptSparseTensor const * const X,
+										sptMatrix * mats[],     // mats[nmodes] as temporary space.
+										sptIndex const mats_order[],    // Correspond to the mode order of X.
+										sptIndex const mode,
+										const int tk)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	sptIndex const * const ndims = X->ndims;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const stride = mats[0]->stride;
+
+	/* Check the mats. */
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Omp SpTns MTTKRP");
+	spt_CheckError(result, "Omp SpTns MTTKRP", NULL);
+
+	sptIndex const tmpI = mats[mode]->nrows;
+	sptIndex const R = mats[mode]->ncols;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+	memset(mvals, 0, tmpI*stride*sizeof(sptValue));
+
+	/* One scratch row per thread instead of one per nonzero. */
+	sptValue * scratch = malloc((size_t)tk * stride * sizeof *scratch);
+	spt_CheckOSError(!scratch, "Omp SpTns MTTKRP");
+
+	sptTimer timer;
+	sptNewTimer(&timer, 0);
+	double comp_time, total_time;
+
+	sptStartTimer(timer);
+#pragma omp parallel num_threads(tk)
+	{
+		sptValue * const restrict row = scratch + (size_t)omp_get_thread_num() * stride;
+#pragma omp for schedule(static)
+		for(sptNnzIndex x=0; x<nnz; ++x) {
+			sptValue const entry = vals[x];
+			sptValue const * times_row = mats[mats_order[1]]->values + X->inds[mats_order[1]].data[x] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] = entry * times_row[r];
+			}
+			for(sptIndex i=2; i<nmodes; ++i) {
+				times_row = mats[mats_order[i]]->values + X->inds[mats_order[i]].data[x] * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					row[r] *= times_row[r];
+				}
+			}
+
+			sptValue * const restrict mvals_row = mvals + mode_ind[x] * stride;
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += row[r];
+			}
+		}
+	}
+	sptStopTimer(timer);
+	comp_time = sptPrintElapsedTime(timer, "Omp SpTns MTTKRP");
+	sptFreeTimer(timer);
+	free(scratch);
+
+	total_time = comp_time;
+	sptPrintTotalTime(total_time);
 
 	return 0;
 }
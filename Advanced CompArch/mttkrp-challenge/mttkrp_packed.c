@@ -0,0 +1,341 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+/* Words per record: the indices, the value unless pattern, rounded up to a power of two. */
+static sptIndex packed_width(sptIndex const nmodes, int const pattern)
+{
+	sptIndex const words = pattern ? nmodes : nmodes + 1;
+	sptIndex width = 1;
+	while(width < words) {
+		width *= 2;
+	}
+	return width;
+}
+
+
+/**
+ * Pack a sparse tensor into one record per nonzero
+ * @param packed an uninitialized packed tensor
+ * @param X      the sparse tensor, left unchanged
+ *
+ * Records keep the nonzero order of X, so sort X first for a kernel that
+ * benefits from it. A third-order record is 16 bytes, orders 4 to 7 take 32.
+ * A pattern-only X packs without values, so a fourth-order record takes 16.
+ */
+int sptNewSparseTensorPacked(sptSparseTensorPacked * const packed, sptSparseTensor const * const X)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const width = packed_width(nmodes, X->pattern);
+	sptIndex const pad = X->pattern ? nmodes : nmodes + 1;
+	packed->nmodes = nmodes;
+	packed->nnz = X->nnz;
+	packed->width = width;
+	packed->pattern = X->pattern;
+	packed->arena = NULL;
+	packed->ndims = malloc(nmodes * sizeof *packed->ndims);
+	spt_CheckOSError(!packed->ndims, "SpTns Packed");
+	memcpy(packed->ndims, X->ndims, nmodes * sizeof *packed->ndims);
+	size_t const bytes = (X->nnz > 0 ? X->nnz : 1) * width * sizeof *packed->records;
+	int result = posix_memalign((void **)&packed->records, 64, bytes);
+	if(result != 0) {
+		free(packed->ndims);
+		errno = result;
+	}
+	spt_CheckOSError(result != 0, "SpTns Packed");
+
+	sptPackedWord * const restrict records = packed->records;
+#pragma omp parallel for schedule(static)
+	for(sptNnzIndex x=0; x<X->nnz; ++x) {
+		sptPackedWord * const rec = records + x * width;
+		for(sptIndex m=0; m<nmodes; ++m) {
+			rec[m].ind = X->inds[m].data[x];
+		}
+		if(!X->pattern) {
+			rec[nmodes].val = X->values.data[x];
+		}
+		for(sptIndex w=pad; w<width; ++w) {
+			rec[w].ind = 0;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * The bytes sptNewSparseTensorPacked would allocate for X
+ * @param X the sparse tensor
+ */
+size_t sptSparseTensorPackedFootprint(sptSparseTensor const * const X)
+{
+	sptIndex const width = packed_width(X->nmodes, X->pattern);
+	return X->nmodes * sizeof(sptIndex) + (X->nnz > 0 ? X->nnz : 1) * width * sizeof(sptPackedWord);
+}
+
+
+/**
+ * The bytes a packed sparse tensor holds
+ * @param packed a valid packed sparse tensor
+ */
+size_t sptSparseTensorPackedBytes(sptSparseTensorPacked const * const packed)
+{
+	return packed->nmodes * sizeof *packed->ndims + (packed->nnz > 0 ? packed->nnz : 1) * packed->width * sizeof *packed->records;
+}
+
+
+/**
+ * The arena bytes sptSparseTensorPackedMoveToArena takes
+ * @param packed a valid packed sparse tensor
+ */
+size_t sptSparseTensorPackedArenaSize(sptSparseTensorPacked const * const packed)
+{
+	return sptArenaRounded((packed->nnz > 0 ? packed->nnz : 1) * packed->width * sizeof *packed->records);
+}
+
+
+/**
+ * Move the records of a packed sparse tensor into an arena
+ * @param packed a packed sparse tensor on the heap
+ * @param arena  the arena, with sptSparseTensorPackedArenaSize bytes free
+ *
+ * The arena is 64-byte aligned, so records still never straddle a cache line.
+ */
+int sptSparseTensorPackedMoveToArena(sptSparseTensorPacked * const packed, sptArena * const arena)
+{
+	if(arena->used + sptSparseTensorPackedArenaSize(packed) > arena->size) {
+		spt_CheckError(SPTERR_OS_ERROR + ENOMEM, "SpTns Packed Move", "the arena is full");
+	}
+	int result = sptArenaMove(arena, (void **)&packed->records, (packed->nnz > 0 ? packed->nnz : 1) * packed->width * sizeof *packed->records);
+	spt_CheckError(result, "SpTns Packed Move", NULL);
+	packed->arena = arena;
+	return 0;
+}
+
+
+/**
+ * Release the memory of a packed sparse tensor
+ * @param packed a valid packed sparse tensor
+ */
+void sptFreeSparseTensorPacked(sptSparseTensorPacked *packed)
+{
+	free(packed->ndims);
+	if(packed->arena == NULL) {
+		free(packed->records);
+	}
+	packed->nmodes = 0;
+	packed->nnz = 0;
+}
+
+
+void sptSparseTensorPackedStatus(sptSparseTensorPacked const * const packed, FILE *fp)
+{
+	size_t const record = packed->width * sizeof *packed->records;
+	size_t const soa = packed->nmodes * sizeof(sptIndex) + (packed->pattern ? 0 : sizeof(sptValue));
+	fprintf(fp, "Packed sparse tensor---------\n");
+	fprintf(fp, "Record: %"PASTA_PRI_INDEX " words, %zu bytes per nonzero (%zu as arrays), %.2lf MB\n",
+					packed->width, record, soa, (double)packed->nnz * record / 1e6);
+	fprintf(fp, "\n");
+}
+
+
+/*
+ * Records [begin, end) added into mats[nmodes], atomically if several
+ * threads share it. Called with constant nmodes, width and pattern so that
+ * each order gets its own unrolled copy; orders 3 and 4 multiply straight
+ * into the output row, higher orders build the product in row first.
+ * Pattern records have no value to load or multiply.
+ */
+static inline void packed_range(
+		sptPackedWord const * const restrict records,
+		sptIndex const nmodes,
+		sptIndex const width,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const atomic,
+		int const pattern)
+{
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+
+	for(sptNnzIndex x=begin; x<end; ++x) {
+		sptPackedWord const * const rec = records + x * width;
+		sptValue const entry = pattern ? 1 : rec[nmodes].val;
+		sptValue * const restrict mvals_row = mvals + (size_t)rec[mode].ind * stride;
+		sptValue const * const restrict a = mats[mats_order[1]]->values + (size_t)rec[mats_order[1]].ind * stride;
+		if((nmodes == 3 || nmodes == 4) && !atomic) {
+			sptValue const * const restrict b = mats[mats_order[2]]->values + (size_t)rec[mats_order[2]].ind * stride;
+			if(nmodes == 3) {
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] += pattern ? a[r] * b[r] : entry * a[r] * b[r];
+				}
+			} else {
+				sptValue const * const restrict c = mats[mats_order[3]]->values + (size_t)rec[mats_order[3]].ind * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] += pattern ? a[r] * b[r] * c[r] : entry * a[r] * b[r] * c[r];
+				}
+			}
+			continue;
+		}
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] = pattern ? a[r] : entry * a[r];
+		}
+		for(sptIndex i=2; i<nmodes; ++i) {
+			sptValue const * const restrict times_row = mats[mats_order[i]]->values + (size_t)rec[mats_order[i]].ind * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] *= times_row[r];
+			}
+		}
+		if(atomic) {
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += row[r];
+			}
+		} else {
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				mvals_row[r] += row[r];
+			}
+		}
+	}
+}
+
+
+/* packed_range specialized for the common orders, with and without values. */
+static void packed_dispatch(
+		sptSparseTensorPacked const * const packed,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const atomic)
+{
+	if(packed->pattern) {
+		switch(packed->nmodes) {
+		case 3:
+			packed_range(packed->records, 3, 4, mats, mats_order, mode, begin, end, row, atomic, 1);
+			break;
+		case 4:
+			packed_range(packed->records, 4, 4, mats, mats_order, mode, begin, end, row, atomic, 1);
+			break;
+		default:
+			packed_range(packed->records, packed->nmodes, packed->width, mats, mats_order, mode, begin, end, row, atomic, 1);
+			break;
+		}
+		return;
+	}
+	switch(packed->nmodes) {
+	case 3:
+		packed_range(packed->records, 3, 4, mats, mats_order, mode, begin, end, row, atomic, 0);
+		break;
+	case 4:
+		packed_range(packed->records, 4, 8, mats, mats_order, mode, begin, end, row, atomic, 0);
+		break;
+	default:
+		packed_range(packed->records, packed->nmodes, packed->width, mats, mats_order, mode, begin, end, row, atomic, 0);
+		break;
+	}
+}
+
+
+/**
+ * MTTKRP over a packed sparse tensor
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  packed    the packed sparse tensor
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ *
+ * Each nonzero is one aligned load of its record, so the whole tensor is a
+ * single sequential stream for the hardware prefetcher and the TLB.
+ */
+int sptMTTKRPPacked(
+		sptSparseTensorPacked const * const packed,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode)
+{
+	sptIndex const nmodes = packed->nmodes;
+	int result = spt_CheckMTTKRPMats(mats, nmodes, packed->ndims, mode, "MTTKRP Packed");
+	spt_CheckError(result, "MTTKRP Packed", NULL);
+
+	sptValue * row = malloc(mats[nmodes]->stride * sizeof *row);
+	spt_CheckOSError(!row, "MTTKRP Packed");
+	memset(mats[nmodes]->values, 0, (size_t)packed->ndims[mode] * mats[nmodes]->stride * sizeof(sptValue));
+	packed_dispatch(packed, mats, mats_order, mode, 0, packed->nnz, row, 0);
+	free(row);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP over a packed sparse tensor
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPPacked
+ *
+ * Threads take equal record ranges and add with atomics, as sptOmpMTTKRP.
+ */
+int sptOmpMTTKRPPacked(
+		sptSparseTensorPacked const * const packed,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk)
+{
+	sptIndex const nmodes = packed->nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const nrows = packed->ndims[mode];
+	int result = spt_CheckMTTKRPMats(mats, nmodes, packed->ndims, mode, "Omp MTTKRP Packed");
+	spt_CheckError(result, "Omp MTTKRP Packed", NULL);
+
+	sptValue * rows = malloc((size_t)tk * stride * sizeof *rows);
+	spt_CheckOSError(!rows, "Omp MTTKRP Packed");
+	sptValue * const mvals = mats[nmodes]->values;
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<nrows; ++i) {
+			memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+		}
+		sptNnzIndex const begin = packed->nnz * tid / nt;
+		sptNnzIndex const end = packed->nnz * (tid + 1) / nt;
+		packed_dispatch(packed, mats, mats_order, mode, begin, end, rows + (size_t)tid * stride, nt > 1);
+	}
+	free(rows);
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+static int pattern_check_mats(sptSparseTensor const * const X, sptMatrix * mats[], sptIndex const mode)
+{
+	if(!X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Pattern", "the tensor has values");
+	}
+	return spt_CheckMTTKRPMats(mats, X->nmodes, X->ndims, mode, "MTTKRP Pattern");
+}
+
+
+/*
+ * spt_MTTKRPCooRange with every value 1, specialized for the common orders:
+ * the Khatri-Rao row is the product of the factor rows alone, with no value
+ * stream to read.
+ */
+static void pattern_dispatch(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const atomic)
+{
+	switch(X->nmodes) {
+	case 3:
+		spt_MTTKRPCooRange(X, 3, mats, mats_order, mode, begin, end, row, 1, atomic);
+		break;
+	case 4:
+		spt_MTTKRPCooRange(X, 4, mats, mats_order, mode, begin, end, row, 1, atomic);
+		break;
+	default:
+		spt_MTTKRPCooRange(X, X->nmodes, mats, mats_order, mode, begin, end, row, 1, atomic);
+		break;
+	}
+}
+
+
+/**
+ * MTTKRP over a pattern-only sparse tensor
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  X    the sparse tensor, pattern-only (sptSparseTensorDropValues)
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ *
+ * sptMTTKRP calls this for pattern tensors. Each nonzero streams only its
+ * indices, and the Khatri-Rao row takes one multiply less per column.
+ */
+int sptMTTKRPPattern(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode)
+{
+	sptIndex const nmodes = X->nmodes;
+	int result = pattern_check_mats(X, mats, mode);
+	spt_CheckError(result, "MTTKRP Pattern", NULL);
+
+	sptValue * row = malloc(mats[nmodes]->stride * sizeof *row);
+	spt_CheckOSError(!row, "MTTKRP Pattern");
+	memset(mats[nmodes]->values, 0, (size_t)X->ndims[mode] * mats[nmodes]->stride * sizeof(sptValue));
+	pattern_dispatch(X, mats, mats_order, mode, 0, X->nnz, row, 0);
+	free(row);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP over a pattern-only sparse tensor
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPPattern
+ *
+ * sptOmpMTTKRP calls this for pattern tensors. Threads take equal nonzero
+ * ranges and add with atomics, as sptOmpMTTKRP.
+ */
+int sptOmpMTTKRPPattern(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const nrows = X->ndims[mode];
+	int result = pattern_check_mats(X, mats, mode);
+	spt_CheckError(result, "Omp MTTKRP Pattern", NULL);
+
+	sptValue * rows = malloc((size_t)tk * stride * sizeof *rows);
+	spt_CheckOSError(!rows, "Omp MTTKRP Pattern");
+	sptValue * const mvals = mats[nmodes]->values;
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<nrows; ++i) {
+			memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+		}
+		sptNnzIndex const begin = X->nnz * tid / nt;
+		sptNnzIndex const end = X->nnz * (tid + 1) / nt;
+		pattern_dispatch(X, mats, mats_order, mode, begin, end, rows + (size_t)tid * stride, nt > 1);
+	}
+	free(rows);
+
+	return 0;
+}
@@ -0,0 +1,392 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/* The strategy a plan for tk threads uses, never SPT_MTTKRP_AUTO. */
+static sptMTTKRPStrategy plan_resolve(sptMTTKRPStrategy const strategy, int const tk, sptNnzIndex const private_len, sptSparseTensor const * const X)
+{
+	if(tk == 1) {
+		return SPT_MTTKRP_ATOMIC;  // no concurrent updates, the atomics are compiled out
+	} else if(strategy == SPT_MTTKRP_AUTO) {
+		return private_len <= X->nnz * (X->nmodes + 1) ? SPT_MTTKRP_PRIVATIZED : SPT_MTTKRP_ATOMIC;
+	}
+	return strategy;
+}
+
+
+/* The bytes a plan allocates, whatever the strategy adds on top of the shared part. */
+static size_t plan_bytes(sptIndex const nmodes, sptIndex const stride, int const tk, sptMTTKRPStrategy const strategy, sptNnzIndex const private_len)
+{
+	size_t bytes = nmodes * sizeof(sptIndex) + (tk + 1) * sizeof(sptNnzIndex) + (size_t)tk * 2 * stride * sizeof(sptValue);
+	if(strategy == SPT_MTTKRP_PRIVATIZED) {
+		bytes += private_len * sizeof(sptValue);
+	}
+	return bytes;
+}
+
+
+/**
+ * Create a reusable MTTKRP plan
+ * @param[out] plan    an uninitialized plan
+ * @param[in]  X    the sparse tensor input X, must outlive the plan and keep its nonzeros
+ * @param[in]  mats    (N+1) dense matrices, only their shapes are inspected
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  nthreads    the number of threads sptMTTKRPExecute will use
+ * @param[in]  strategy    how threads combine updates of a shared output row
+ *
+ * Shapes are checked here once. The nonzero partition, the per-thread scratch
+ * rows and, for SPT_MTTKRP_PRIVATIZED, the per-thread output copies are
+ * allocated here too. SPT_MTTKRP_STEALING groups the nonzeros by output row
+ * and sets up the task deques instead. SPT_MTTKRP_AUTO privatizes when the
+ * copies are no larger than the tensor, since then their reduction costs less
+ * than atomics.
+ */
+int sptNewMTTKRPPlan(
+		sptMTTKRPPlan * const plan,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const nthreads,
+		sptMTTKRPStrategy const strategy)
+{
+	sptIndex const nmodes = X->nmodes;
+
+	/* Check the mats. */
+	int result = spt_CheckMTTKRPMats(mats, nmodes, X->ndims, mode, "MTTKRP Plan");
+	spt_CheckError(result, "MTTKRP Plan", NULL);
+
+	plan->X = X;
+	plan->nmodes = nmodes;
+	plan->mode = mode;
+	plan->R = mats[nmodes]->ncols;
+	plan->stride = mats[nmodes]->stride;
+	plan->nrows = X->ndims[mode];
+	plan->nthreads = nthreads > 0 ? nthreads : 1;
+	plan->arena = NULL;
+
+	plan->mats_order = malloc(nmodes * sizeof *plan->mats_order);
+	spt_CheckOSError(!plan->mats_order, "MTTKRP Plan");
+	memcpy(plan->mats_order, mats_order, nmodes * sizeof *plan->mats_order);
+
+	/* Same contiguous blocks as schedule(static). */
+	int const tk = plan->nthreads;
+	plan->part = malloc((tk + 1) * sizeof *plan->part);
+	spt_CheckOSError(!plan->part, "MTTKRP Plan");
+	sptNnzIndex const rem = X->nnz % tk;
+	for(sptNnzIndex t=0; t<=(sptNnzIndex)tk; ++t) {
+		plan->part[t] = X->nnz / tk * t + (t < rem ? t : rem);
+	}
+
+	plan->scratch = malloc((size_t)tk * 2 * plan->stride * sizeof *plan->scratch);
+	spt_CheckOSError(!plan->scratch, "MTTKRP Plan");
+
+	sptNnzIndex const private_len = (sptNnzIndex)tk * plan->nrows * plan->stride;
+	plan->strategy = plan_resolve(strategy, tk, private_len, X);
+	plan->privates = NULL;
+	plan->slice_ptr = NULL;
+	plan->perm = NULL;
+	plan->deques = NULL;
+	if(plan->strategy == SPT_MTTKRP_PRIVATIZED) {
+		plan->privates = malloc(private_len * sizeof *plan->privates);
+		spt_CheckOSError(!plan->privates, "MTTKRP Plan");
+	} else if(plan->strategy == SPT_MTTKRP_STEALING) {
+		int result = spt_NewMTTKRPStealing(plan);
+		spt_CheckError(result, "MTTKRP Plan", NULL);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Khatri-Rao row of nonzero x, scaled by its value, into row. Called with a
+ * constant pattern, so pattern-only tensors neither load nor multiply a value.
+ */
+static inline void plan_krp_row(
+		sptMTTKRPPlan const * const plan,
+		sptMatrix * mats[],
+		sptNnzIndex const x,
+		int const pattern,
+		sptValue * const restrict row)
+{
+	sptSparseTensor const * const X = plan->X;
+	sptIndex const R = plan->R;
+	sptIndex const stride = plan->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptValue const * restrict times_row = mats[plan->mats_order[1]]->values + (size_t)X->inds[plan->mats_order[1]].data[x] * stride;
+#pragma omp simd
+	for(sptIndex r=0; r<R; ++r) {
+		row[r] = pattern ? times_row[r] : vals[x] * times_row[r];
+	}
+	for(sptIndex i=2; i<plan->nmodes; ++i) {
+		times_row = mats[plan->mats_order[i]]->values + (size_t)X->inds[plan->mats_order[i]].data[x] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] *= times_row[r];
+		}
+	}
+}
+
+
+/*
+ * Nonzeros [begin, end) added into the rows of out, atomically if several
+ * threads share it. A constant pattern picks the value-free copy.
+ */
+static inline void plan_range(
+		sptMTTKRPPlan const * const plan,
+		sptMatrix * mats[],
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		sptValue * const restrict out,
+		int const atomic,
+		int const pattern)
+{
+	sptIndex const R = plan->R;
+	sptIndex const stride = plan->stride;
+	sptIndex const * const restrict mode_ind = plan->X->inds[plan->mode].data;
+	for(sptNnzIndex x=begin; x<end; ++x) {
+		plan_krp_row(plan, mats, x, pattern, row);
+		sptValue * const restrict out_row = out + (size_t)mode_ind[x] * stride;
+		if(atomic) {
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				out_row[r] += row[r];
+			}
+		} else {
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				out_row[r] += row[r];
+			}
+		}
+	}
+}
+
+
+/* plan_range specialized for pattern-only tensors and the atomic flag. */
+static void plan_dispatch(
+		sptMTTKRPPlan const * const plan,
+		sptMatrix * mats[],
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		sptValue * const restrict out,
+		int const atomic)
+{
+	if(plan->X->pattern) {
+		if(atomic) {
+			plan_range(plan, mats, begin, end, row, out, 1, 1);
+		} else {
+			plan_range(plan, mats, begin, end, row, out, 0, 1);
+		}
+	} else {
+		if(atomic) {
+			plan_range(plan, mats, begin, end, row, out, 1, 0);
+		} else {
+			plan_range(plan, mats, begin, end, row, out, 0, 0);
+		}
+	}
+}
+
+
+/**
+ * Execute a MTTKRP plan
+ * @param[in]  plan    a plan created by sptNewMTTKRPPlan
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  mats    (N+1) dense matrices with the shapes the plan was created with
+ *
+ * Nothing is allocated, checked or timed. The output is zeroed here, so
+ * callers need not clear it between calls.
+ */
+int sptMTTKRPExecute(sptMTTKRPPlan const * const plan, sptMatrix * mats[])
+{
+	sptSparseTensor const * const X = plan->X;
+	sptIndex const R = plan->R;
+	sptIndex const stride = plan->stride;
+	sptIndex const nrows = plan->nrows;
+	sptValue * const restrict mvals = mats[plan->nmodes]->values;
+	int const tk = plan->nthreads;
+
+	if(tk == 1) {
+		sptValue * const restrict row = plan->scratch;
+		memset(mvals, 0, (size_t)nrows * stride * sizeof *mvals);
+		plan_dispatch(plan, mats, 0, X->nnz, row, mvals, 0);
+		return 0;
+	}
+
+	if(plan->strategy == SPT_MTTKRP_STEALING) {
+		return spt_MTTKRPExecuteStealing(plan, mats);
+	} else if(plan->strategy == SPT_MTTKRP_ATOMIC) {
+#pragma omp parallel num_threads(tk)
+		{
+			int const tid = omp_get_thread_num();
+			sptValue * const restrict row = plan->scratch + (size_t)tid * 2 * stride;
+#pragma omp for schedule(static)
+			for(sptIndex i=0; i<nrows; ++i) {
+				memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+			}
+			plan_dispatch(plan, mats, plan->part[tid], plan->part[tid+1], row, mvals, 1);
+		}
+	} else {
+#pragma omp parallel num_threads(tk)
+		{
+			int const tid = omp_get_thread_num();
+			sptValue * const restrict row = plan->scratch + (size_t)tid * 2 * stride;
+			sptValue * const restrict priv = plan->privates + (size_t)tid * nrows * stride;
+			memset(priv, 0, (size_t)nrows * stride * sizeof *priv);
+			plan_dispatch(plan, mats, plan->part[tid], plan->part[tid+1], row, priv, 0);
+#pragma omp barrier
+			/* Reduce the copies, each thread owning a block of rows. */
+#pragma omp for schedule(static)
+			for(sptIndex i=0; i<nrows; ++i) {
+				sptValue * const restrict mvals_row = mvals + (size_t)i * stride;
+				sptValue const * restrict priv_row = plan->privates + (size_t)i * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] = priv_row[r];
+				}
+				for(int t=1; t<tk; ++t) {
+					priv_row += (size_t)nrows * stride;
+#pragma omp simd
+					for(sptIndex r=0; r<R; ++r) {
+						mvals_row[r] += priv_row[r];
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * The bytes sptNewMTTKRPPlan would allocate, without building the plan
+ * @param X    the sparse tensor input X
+ * @param stride    the row stride of the factors, sptMatrixStride of the rank
+ * @param mode the mode on which the MTTKRP is performed
+ * @param nthreads    the number of threads
+ * @param strategy    as for sptNewMTTKRPPlan, SPT_MTTKRP_AUTO is resolved the same way
+ *
+ * Exact except for SPT_MTTKRP_STEALING on a tensor not recorded as sorted
+ * by mode, where it assumes the nonzeros need a permutation.
+ */
+size_t sptMTTKRPPlanFootprint(
+		sptSparseTensor const * const X,
+		sptIndex const stride,
+		sptIndex const mode,
+		int const nthreads,
+		sptMTTKRPStrategy const strategy)
+{
+	int const tk = nthreads > 0 ? nthreads : 1;
+	sptIndex const nrows = X->ndims[mode];
+	sptNnzIndex const private_len = (sptNnzIndex)tk * nrows * stride;
+	sptMTTKRPStrategy const resolved = plan_resolve(strategy, tk, private_len, X);
+	size_t bytes = plan_bytes(X->nmodes, stride, tk, resolved, private_len);
+	if(resolved == SPT_MTTKRP_STEALING) {
+		int const grouped = spt_SortOrderKnown(X) && X->sortorder[0] == mode;
+		bytes += spt_MTTKRPStealingBytes(nrows, X->nnz, !grouped, tk);
+	}
+	return bytes;
+}
+
+
+/**
+ * The bytes a MTTKRP plan holds, the planned tensor not included
+ * @param plan a valid plan
+ */
+size_t sptMTTKRPPlanBytes(sptMTTKRPPlan const * const plan)
+{
+	sptNnzIndex const private_len = (sptNnzIndex)plan->nthreads * plan->nrows * plan->stride;
+	size_t bytes = plan_bytes(plan->nmodes, plan->stride, plan->nthreads, plan->strategy, private_len);
+	if(plan->strategy == SPT_MTTKRP_STEALING) {
+		bytes += spt_MTTKRPStealingBytes(plan->nrows, plan->X->nnz, plan->perm != NULL, plan->nthreads);
+	}
+	return bytes;
+}
+
+
+/**
+ * The arena bytes sptMTTKRPPlanMoveToArena takes
+ * @param plan a valid plan
+ */
+size_t sptMTTKRPPlanArenaSize(sptMTTKRPPlan const * const plan)
+{
+	size_t bytes = sptArenaRounded((size_t)plan->nthreads * 2 * plan->stride * sizeof *plan->scratch);
+	if(plan->privates != NULL) {
+		bytes += sptArenaRounded((size_t)plan->nthreads * plan->nrows * plan->stride * sizeof *plan->privates);
+	}
+	if(plan->slice_ptr != NULL) {
+		bytes += sptArenaRounded(((size_t)plan->nrows + 1) * sizeof *plan->slice_ptr);
+	}
+	if(plan->perm != NULL) {
+		bytes += sptArenaRounded(plan->X->nnz * sizeof *plan->perm);
+	}
+	return bytes;
+}
+
+
+/**
+ * Move the workspace of a MTTKRP plan into an arena
+ * @param plan  a plan on the heap
+ * @param arena the arena, with sptMTTKRPPlanArenaSize bytes free
+ *
+ * Moves the scratch rows, the private outputs and the stealing slices and
+ * permutation; the deques stay on the heap.
+ */
+int sptMTTKRPPlanMoveToArena(sptMTTKRPPlan * const plan, sptArena * const arena)
+{
+	if(arena->used + sptMTTKRPPlanArenaSize(plan) > arena->size) {
+		spt_CheckError(SPTERR_OS_ERROR + ENOMEM, "MTTKRP Plan Move", "the arena is full");
+	}
+	int result = sptArenaMove(arena, (void **)&plan->scratch, (size_t)plan->nthreads * 2 * plan->stride * sizeof *plan->scratch);
+	spt_CheckError(result, "MTTKRP Plan Move", NULL);
+	result = sptArenaMove(arena, (void **)&plan->privates, (size_t)plan->nthreads * plan->nrows * plan->stride * sizeof *plan->privates);
+	spt_CheckError(result, "MTTKRP Plan Move", NULL);
+	result = sptArenaMove(arena, (void **)&plan->slice_ptr, ((size_t)plan->nrows + 1) * sizeof *plan->slice_ptr);
+	spt_CheckError(result, "MTTKRP Plan Move", NULL);
+	result = sptArenaMove(arena, (void **)&plan->perm, plan->X->nnz * sizeof *plan->perm);
+	spt_CheckError(result, "MTTKRP Plan Move", NULL);
+	plan->arena = arena;
+	return 0;
+}
+
+
+/**
+ * Release the memory held by a MTTKRP plan
+ * @param plan the plan, the planned tensor is not touched
+ */
+void sptFreeMTTKRPPlan(sptMTTKRPPlan *plan)
+{
+	free(plan->mats_order);
+	free(plan->part);
+	if(plan->arena == NULL) {
+		free(plan->scratch);
+		free(plan->privates);
+	}
+	spt_FreeMTTKRPStealing(plan);
+	plan->X = NULL;
+	plan->nthreads = 0;
+}
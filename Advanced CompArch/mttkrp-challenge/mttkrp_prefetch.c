@@ -0,0 +1,239 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+#define SPT_CACHE_LINE 64
+
+static sptIndex const prefetch_distances[] = { 0, 2, 4, 8, 16, 32, 64 };
+
+
+static int prefetch_check_mats(sptSparseTensor const * const X, sptMatrix * mats[], sptIndex const mode)
+{
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Prefetch", "pattern-only tensor");
+	}
+	return spt_CheckMTTKRPMats(mats, X->nmodes, X->ndims, mode, "MTTKRP Prefetch");
+}
+
+
+/* Every cache line of R values starting at row. */
+static inline void prefetch_row(sptValue const * const row, sptIndex const R, int const write)
+{
+	char const * const p = (char const *)row;
+	for(size_t off=0; off<R * sizeof(sptValue); off+=SPT_CACHE_LINE) {
+		if(write) {
+			__builtin_prefetch(p + off, 1, 3);
+		} else {
+			__builtin_prefetch(p + off, 0, 3);
+		}
+	}
+}
+
+
+/*
+ * Nonzeros [begin, end). The factor rows and the output row of nonzero
+ * x + dist are prefetched while x is computed.
+ */
+static void prefetch_range(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const dist,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const atomic)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+
+	for(sptNnzIndex x=begin; x<end; ++x) {
+		if(dist > 0 && x + dist < end) {
+			sptNnzIndex const ahead = x + dist;
+			for(sptIndex i=1; i<nmodes; ++i) {
+				prefetch_row(mats[mats_order[i]]->values + (size_t)X->inds[mats_order[i]].data[ahead] * stride, R, 0);
+			}
+			prefetch_row(mvals + (size_t)mode_ind[ahead] * stride, R, 1);
+		}
+
+		sptValue const * restrict times_row = mats[mats_order[1]]->values + (size_t)X->inds[mats_order[1]].data[x] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] = vals[x] * times_row[r];
+		}
+		for(sptIndex i=2; i<nmodes; ++i) {
+			times_row = mats[mats_order[i]]->values + (size_t)X->inds[mats_order[i]].data[x] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] *= times_row[r];
+			}
+		}
+		sptValue * const restrict mvals_row = mvals + (size_t)mode_ind[x] * stride;
+		if(atomic) {
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += row[r];
+			}
+		} else {
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				mvals_row[r] += row[r];
+			}
+		}
+	}
+}
+
+
+/**
+ * MTTKRP with software prefetching of upcoming rows
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  dist    the lookahead in nonzeros, 0 disables prefetching
+ *
+ * The index arrays are read in order, so the rows nonzero x + dist will
+ * gather are known while x is computed and can be requested early.
+ */
+int sptMTTKRPPrefetch(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const dist)
+{
+	sptIndex const nmodes = X->nmodes;
+	int result = prefetch_check_mats(X, mats, mode);
+	spt_CheckError(result, "MTTKRP Prefetch", NULL);
+
+	sptValue * row = malloc(mats[nmodes]->stride * sizeof *row);
+	spt_CheckOSError(!row, "MTTKRP Prefetch");
+	memset(mats[nmodes]->values, 0, (size_t)X->ndims[mode] * mats[nmodes]->stride * sizeof(sptValue));
+	prefetch_range(X, mats, mats_order, mode, dist, 0, X->nnz, row, 0);
+	free(row);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP with software prefetching of upcoming rows
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPPrefetch
+ */
+int sptOmpMTTKRPPrefetch(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const dist,
+		int const tk)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const nrows = X->ndims[mode];
+	int result = prefetch_check_mats(X, mats, mode);
+	spt_CheckError(result, "Omp MTTKRP Prefetch", NULL);
+
+	sptValue * rows = malloc((size_t)tk * stride * sizeof *rows);
+	spt_CheckOSError(!rows, "Omp MTTKRP Prefetch");
+	sptValue * const mvals = mats[nmodes]->values;
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<nrows; ++i) {
+			memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+		}
+		sptNnzIndex const begin = X->nnz * tid / nt;
+		sptNnzIndex const end = X->nnz * (tid + 1) / nt;
+		prefetch_range(X, mats, mats_order, mode, dist, begin, end, rows + (size_t)tid * stride, nt > 1);
+	}
+	free(rows);
+
+	return 0;
+}
+
+
+/**
+ * Pick the prefetch lookahead by timing candidates
+ * @param[out] dist    the fastest lookahead, 0 if prefetching does not help
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    (N+1) dense matrices, mats[nmodes] is overwritten
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  tk    the number of threads, 1 times the sequential kernel
+ * @param[in]  fp    where to report each candidate's time, or NULL
+ *
+ * Each distance runs twice on a prefix of up to 2^20 nonzeros and keeps its
+ * faster time. The best distance depends on memory latency relative to the
+ * work per nonzero, so it shifts with the machine, R and nmodes.
+ */
+int sptMTTKRPPrefetchTune(
+		sptIndex * const dist,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk,
+		FILE *fp)
+{
+	/* Only nnz differs, the data is shared with X. */
+	sptSparseTensor sample = *X;
+	if(sample.nnz > ((sptNnzIndex)1 << 20)) {
+		sample.nnz = (sptNnzIndex)1 << 20;
+	}
+
+	double best = 0;
+	*dist = 0;
+	for(size_t d=0; d<sizeof prefetch_distances / sizeof prefetch_distances[0]; ++d) {
+		double fastest = 0;
+		for(int rep=0; rep<2; ++rep) {
+			double const start = omp_get_wtime();
+			int result = tk > 1 ?
+					sptOmpMTTKRPPrefetch(&sample, mats, mats_order, mode, prefetch_distances[d], tk) :
+					sptMTTKRPPrefetch(&sample, mats, mats_order, mode, prefetch_distances[d]);
+			spt_CheckError(result, "MTTKRP Prefetch Tune", NULL);
+			double const elapsed = omp_get_wtime() - start;
+			if(rep == 0 || elapsed < fastest) {
+				fastest = elapsed;
+			}
+		}
+		if(fp != NULL) {
+			fprintf(fp, "prefetch distance %"PASTA_PRI_INDEX ": %.6lf s\n", prefetch_distances[d], fastest);
+		}
+		if(d == 0 || fastest < best) {
+			best = fastest;
+			*dist = prefetch_distances[d];
+		}
+	}
+
+	return 0;
+}
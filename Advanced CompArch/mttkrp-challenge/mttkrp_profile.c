@@ -0,0 +1,202 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/**
+ * OpenMP MTTKRP instrumented to explain poor scaling
+ * @param[out] mats[nmodes]    the result of MTTKRP, a dense matrix, with size
+ * ndims[mode] * R
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  tk    the number of threads
+ * @param[out] prof    per-thread statistics, release with sptFreeMTTKRPProfile
+ *
+ * Nonzeros are split into the same contiguous blocks `schedule(static)` hands
+ * out in sptOmpMTTKRP, so the numbers describe that kernel. Busy time measures
+ * each thread's own block and idle time its wait at the barrier: uneven nonzero
+ * counts point to the partition, even counts with uneven busy time point to the
+ * memory system. Shared rows are the output rows needing atomic updates.
+ */
+int sptOmpMTTKRPProfile(sptSparseTensor const * const X,
+												sptMatrix * mats[],     // mats[nmodes] as temporary space.
+												sptIndex const mats_order[],    // Correspond to the mode order of X.
+												sptIndex const mode,
+												const int tk,
+												sptMTTKRPProfile * const prof)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	sptIndex const * const ndims = X->ndims;
+	sptValue const * const restrict vals = X->pattern ? NULL : X->values.data;
+	sptIndex const stride = mats[0]->stride;
+
+	/* Check the mats. */
+	int result = spt_CheckMTTKRPMats(mats, nmodes, ndims, mode, "Omp SpTns MTTKRP Profile");
+	spt_CheckError(result, "Omp SpTns MTTKRP Profile", NULL);
+
+	sptIndex const tmpI = mats[mode]->nrows;
+	sptIndex const R = mats[mode]->ncols;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+	memset(mvals, 0, tmpI*stride*sizeof(sptValue));
+
+	prof->nthreads = tk;
+	prof->nrows = tmpI;
+	prof->nnzs = calloc(tk, sizeof *prof->nnzs);
+	prof->rows = calloc(tk, sizeof *prof->rows);
+	prof->busy = calloc(tk, sizeof *prof->busy);
+	prof->idle = calloc(tk, sizeof *prof->idle);
+	spt_CheckOSError(!prof->nnzs || !prof->rows || !prof->busy || !prof->idle, "Omp SpTns MTTKRP Profile");
+	prof->shared_rows = 0;
+	prof->shared_nnzs = 0;
+
+	/* One byte per (thread, output row), set on the first touch. */
+	unsigned char * touched = calloc((size_t)tk * tmpI, sizeof *touched);
+	sptValue * scratch = malloc((size_t)tk * stride * sizeof *scratch);
+	spt_CheckOSError(!touched || !scratch, "Omp SpTns MTTKRP Profile");
+
+	double const region_start = omp_get_wtime();
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		sptNnzIndex const q = nnz / tk;
+		sptNnzIndex const rem = nnz % tk;
+		sptNnzIndex const t = (sptNnzIndex)tid;
+		sptNnzIndex const begin = t * q + (t < rem ? t : rem);
+		sptNnzIndex const end = begin + q + (t < rem ? 1 : 0);
+		unsigned char * const my_touched = touched + (size_t)tid * tmpI;
+		sptValue * const restrict row = scratch + (size_t)tid * stride;
+		sptIndex nrows_touched = 0;
+
+		double const busy_start = omp_get_wtime();
+		for(sptNnzIndex x=begin; x<end; ++x) {
+			sptIndex const mode_i = mode_ind[x];
+			if(!my_touched[mode_i]) {
+				my_touched[mode_i] = 1;
+				++nrows_touched;
+			}
+
+			sptValue const entry = vals != NULL ? vals[x] : 1;
+			sptValue const * times_row = mats[mats_order[1]]->values + X->inds[mats_order[1]].data[x] * stride;
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] = entry * times_row[r];
+			}
+			for(sptIndex i=2; i<nmodes; ++i) {
+				times_row = mats[mats_order[i]]->values + X->inds[mats_order[i]].data[x] * stride;
+				for(sptIndex r=0; r<R; ++r) {
+					row[r] *= times_row[r];
+				}
+			}
+
+			sptValue * const restrict mvals_row = mvals + mode_i * stride;
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += row[r];
+			}
+		}
+		double const busy_end = omp_get_wtime();
+#pragma omp barrier
+		double const barrier_end = omp_get_wtime();
+
+		prof->nnzs[tid] = end - begin;
+		prof->rows[tid] = nrows_touched;
+		prof->busy[tid] = busy_end - busy_start;
+		prof->idle[tid] = barrier_end - busy_end;
+	}
+	prof->elapsed = omp_get_wtime() - region_start;
+
+	/* Rows touched by more than one thread, and the nonzeros landing on them. */
+	sptNnzIndex * slice_nnzs = malloc(tmpI * sizeof *slice_nnzs);
+	spt_CheckOSError(!slice_nnzs, "Omp SpTns MTTKRP Profile");
+	spt_ComputeSliceSizes(slice_nnzs, (sptSparseTensor *)X, mode);
+	for(sptIndex i=0; i<tmpI; ++i) {
+		int owners = 0;
+		for(int t=0; t<tk; ++t) {
+			owners += touched[(size_t)t * tmpI + i];
+		}
+		if(owners > 1) {
+			++prof->shared_rows;
+			prof->shared_nnzs += slice_nnzs[i];
+		}
+	}
+
+	free(slice_nnzs);
+	free(scratch);
+	free(touched);
+
+	return 0;
+}
+
+
+/**
+ * Print the statistics gathered by sptOmpMTTKRPProfile
+ * @param prof the profile
+ * @param fp   the file to print to
+ */
+void sptMTTKRPProfileStatus(sptMTTKRPProfile const * const prof, FILE *fp)
+{
+	sptNnzIndex total_nnzs = 0, max_nnzs = 0;
+	double total_busy = 0, max_busy = 0, total_idle = 0;
+
+	fprintf(fp, "MTTKRP thread profile (%d threads)---------\n", prof->nthreads);
+	fprintf(fp, "tid\tnnz\trows\tbusy(s)\tidle(s)\tnnz/s\n");
+	for(int t=0; t < prof->nthreads; ++t) {
+		fprintf(fp, "%d\t%"PASTA_PRI_NNZ_INDEX "\t%"PASTA_PRI_INDEX "\t%.6lf\t%.6lf\t%.3e\n",
+						t, prof->nnzs[t], prof->rows[t], prof->busy[t], prof->idle[t],
+						prof->busy[t] > 0 ? prof->nnzs[t] / prof->busy[t] : 0.0);
+		total_nnzs += prof->nnzs[t];
+		total_busy += prof->busy[t];
+		total_idle += prof->idle[t];
+		if(prof->nnzs[t] > max_nnzs) max_nnzs = prof->nnzs[t];
+		if(prof->busy[t] > max_busy) max_busy = prof->busy[t];
+	}
+
+	double const mean_nnzs = (double)total_nnzs / prof->nthreads;
+	double const mean_busy = total_busy / prof->nthreads;
+	fprintf(fp, "Region time: %.6lf s\n", prof->elapsed);
+	fprintf(fp, "NNZ imbalance (max/mean): %.3lf\n", mean_nnzs > 0 ? max_nnzs / mean_nnzs : 1.0);
+	fprintf(fp, "Busy imbalance (max/mean): %.3lf\n", mean_busy > 0 ? max_busy / mean_busy : 1.0);
+	fprintf(fp, "Idle fraction: %.2lf%%\n",
+					prof->elapsed > 0 ? 100.0 * total_idle / (prof->elapsed * prof->nthreads) : 0.0);
+	fprintf(fp, "Shared output rows: %"PASTA_PRI_INDEX " / %"PASTA_PRI_INDEX " (%.2lf%%), covering %.2lf%% of nonzeros\n",
+					prof->shared_rows, prof->nrows,
+					prof->nrows > 0 ? 100.0 * prof->shared_rows / prof->nrows : 0.0,
+					total_nnzs > 0 ? 100.0 * prof->shared_nnzs / total_nnzs : 0.0);
+	fprintf(fp, "\n");
+}
+
+
+/**
+ * Release the memory held by a MTTKRP profile
+ * @param prof the profile
+ */
+void sptFreeMTTKRPProfile(sptMTTKRPProfile *prof)
+{
+	free(prof->nnzs);
+	free(prof->rows);
+	free(prof->busy);
+	free(prof->idle);
+	prof->nthreads = 0;
+}
@@ -0,0 +1,251 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/**
+ * Choose the panel width and nonzero block of a rank-tiled MTTKRP
+ * @param[out] tile    the number of columns per panel, a multiple of 8 or R
+ * @param[out] block    the number of nonzeros swept per panel
+ * @param[in]  nmodes    the number of modes of the tensor
+ * @param[in]  R    the rank
+ *
+ * A block's indices and values are sized to stay in half of L1 while every
+ * panel sweeps it, and the panels of the rows one block touches (nmodes rows
+ * per nonzero) to fit in half of L2.
+ */
+int sptMTTKRPRankTile(sptIndex * const tile, sptNnzIndex * const block, sptIndex const nmodes, sptIndex const R)
+{
+	long const l1 = sptCacheSize(1);
+	long const l2 = sptCacheSize(2);
+
+	*block = l1 / 2 / (nmodes * sizeof(sptIndex) + sizeof(sptValue));
+	if(*block < 64) {
+		*block = 64;
+	}
+	sptNnzIndex width = l2 / 2 / (*block * nmodes * sizeof(sptValue));
+	width -= width % 8;
+	if(width < 8) {
+		width = 8;
+	}
+	*tile = width < R ? (sptIndex)width : R;
+	return 0;
+}
+
+
+static int rank_check_mats(sptSparseTensor const * const X, sptMatrix * mats[])
+{
+	sptIndex const nmodes = X->nmodes;
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Rank Tiled", "pattern-only tensor");
+	}
+	for(sptIndex i=0; i<nmodes; ++i) {
+		if(mats[i]->ncols != mats[nmodes]->ncols) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Rank Tiled", "mats[i]->cols != mats[nmodes]->ncols");
+		}
+		if(mats[i]->nrows != X->ndims[i]) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Rank Tiled", "mats[i]->nrows != ndims[i]");
+		}
+		if(mats[i]->stride != mats[nmodes]->stride) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Rank Tiled", "mats[i]->stride != mats[nmodes]->stride");
+		}
+		if(mats[i]->layout != mats[nmodes]->layout ||
+				(mats[i]->layout != SPT_LAYOUT_ROW_MAJOR && mats[i]->panel != mats[nmodes]->panel)) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Rank Tiled", "mats[i] and mats[nmodes] have different layouts");
+		}
+	}
+	return 0;
+}
+
+
+/* Start of panel p, the one holding column r0; its rows are stride apart. */
+static inline sptValue * rank_panel(sptMatrix * const mtx, sptIndex const p, sptIndex const r0)
+{
+	return mtx->layout == SPT_LAYOUT_ROW_MAJOR ? mtx->values + r0 : mtx->values + p * mtx->panel_size;
+}
+
+
+/* Zero output rows [lo, hi) in every panel. */
+static void rank_zero_rows(sptMatrix * const mtx, sptIndex const lo, sptIndex const hi)
+{
+	sptIndex const npanels = mtx->layout == SPT_LAYOUT_ROW_MAJOR || mtx->ncols == 0 ? 1 : (mtx->ncols-1)/mtx->panel+1;
+	for(sptIndex p=0; p<npanels; ++p) {
+		memset(mtx->values + p * mtx->panel_size + (size_t)lo * mtx->stride, 0, (size_t)(hi - lo) * mtx->stride * sizeof(sptValue));
+	}
+}
+
+
+/*
+ * Nonzeros [begin, end) in blocks, each block swept once per column panel.
+ * row holds one panel of the Khatri-Rao product. With a panel layout the
+ * tile is the matrices' panel, so panel p is its own dense block.
+ */
+static void rank_tiled_range(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const tile,
+		sptNnzIndex const block,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const atomic)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+
+	for(sptNnzIndex b=begin; b<end; b+=block) {
+		sptNnzIndex const b_end = end - b < block ? end : b + block;
+		for(sptIndex r0=0; r0<R; r0+=tile) {
+			sptIndex const width = R - r0 < tile ? R - r0 : tile;
+			sptIndex const p = r0 / tile;
+			sptValue * const restrict mvals = rank_panel(mats[nmodes], p, r0);
+			for(sptNnzIndex x=b; x<b_end; ++x) {
+				sptValue const * restrict times_row = rank_panel(mats[mats_order[1]], p, r0) + (size_t)X->inds[mats_order[1]].data[x] * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<width; ++r) {
+					row[r] = vals[x] * times_row[r];
+				}
+				for(sptIndex i=2; i<nmodes; ++i) {
+					times_row = rank_panel(mats[mats_order[i]], p, r0) + (size_t)X->inds[mats_order[i]].data[x] * stride;
+#pragma omp simd
+					for(sptIndex r=0; r<width; ++r) {
+						row[r] *= times_row[r];
+					}
+				}
+				sptValue * const restrict mvals_row = mvals + (size_t)mode_ind[x] * stride;
+				if(atomic) {
+					for(sptIndex r=0; r<width; ++r) {
+#pragma omp atomic update
+						mvals_row[r] += row[r];
+					}
+				} else {
+#pragma omp simd
+					for(sptIndex r=0; r<width; ++r) {
+						mvals_row[r] += row[r];
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/**
+ * MTTKRP with the rank split into column panels
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  tile    columns per panel, 0 to choose with sptMTTKRPRankTile; ignored for matrices in panels, whose panel width is used
+ * @param[in]  block    nonzeros per block, 0 to choose with sptMTTKRPRankTile
+ *
+ * For large R a factor row spans many cache lines, and streaming whole rows
+ * per nonzero evicts the rows the next nonzeros reuse. Here each block of
+ * nonzeros is swept once per panel, so only one panel of every row it touches
+ * is live at a time.
+ */
+int sptMTTKRPRankTiled(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex tile,
+		sptNnzIndex block)
+{
+	sptIndex const nmodes = X->nmodes;
+	int result = rank_check_mats(X, mats);
+	spt_CheckError(result, "MTTKRP Rank Tiled", NULL);
+	if(tile == 0 || block == 0) {
+		sptIndex auto_tile;
+		sptNnzIndex auto_block;
+		sptMTTKRPRankTile(&auto_tile, &auto_block, nmodes, mats[nmodes]->ncols);
+		tile = tile == 0 ? auto_tile : tile;
+		block = block == 0 ? auto_block : block;
+	}
+	if(mats[nmodes]->layout != SPT_LAYOUT_ROW_MAJOR) {
+		tile = mats[nmodes]->panel;
+	}
+
+	sptValue * row = malloc(tile * sizeof *row);
+	spt_CheckOSError(!row, "MTTKRP Rank Tiled");
+	rank_zero_rows(mats[nmodes], 0, X->ndims[mode]);
+	rank_tiled_range(X, mats, mats_order, mode, tile, block, 0, X->nnz, row, 0);
+	free(row);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP with the rank split into column panels
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPRankTiled
+ *
+ * Each thread tiles its static share of the nonzeros and updates the output
+ * atomically.
+ */
+int sptOmpMTTKRPRankTiled(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex tile,
+		sptNnzIndex block,
+		int const tk)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const nrows = X->ndims[mode];
+	int result = rank_check_mats(X, mats);
+	spt_CheckError(result, "Omp MTTKRP Rank Tiled", NULL);
+	if(tile == 0 || block == 0) {
+		sptIndex auto_tile;
+		sptNnzIndex auto_block;
+		sptMTTKRPRankTile(&auto_tile, &auto_block, nmodes, mats[nmodes]->ncols);
+		tile = tile == 0 ? auto_tile : tile;
+		block = block == 0 ? auto_block : block;
+	}
+	if(mats[nmodes]->layout != SPT_LAYOUT_ROW_MAJOR) {
+		tile = mats[nmodes]->panel;
+	}
+
+	sptValue * rows = malloc((size_t)tk * tile * sizeof *rows);
+	spt_CheckOSError(!rows, "Omp MTTKRP Rank Tiled");
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		rank_zero_rows(mats[nmodes], (sptIndex)((size_t)nrows * tid / nt), (sptIndex)((size_t)nrows * (tid + 1) / nt));
+#pragma omp barrier
+		sptNnzIndex const begin = X->nnz * tid / nt;
+		sptNnzIndex const end = X->nnz * (tid + 1) / nt;
+		rank_tiled_range(X, mats, mats_order, mode, tile, block, begin, end, rows + (size_t)tid * tile, nt > 1);
+	}
+	free(rows);
+
+	return 0;
+}
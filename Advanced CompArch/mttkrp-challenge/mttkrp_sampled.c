@@ -0,0 +1,338 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include <math.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+
+/* The sampling weight of nonzero x. */
+static inline double sampled_weight(sptMTTKRPSampler const * const sampler, sptSparseTensor const * const X, sptNnzIndex const x)
+{
+	double w = fabs((double)X->values.data[x]);
+	if(sampler->norms != NULL) {
+		for(sptIndex m=0; m<X->nmodes; ++m) {
+			if(m != sampler->mode) {
+				w *= sampler->norms[m][X->inds[m].data[x]];
+			}
+		}
+	}
+	return w;
+}
+
+
+/**
+ * Build the sampling distribution of a sampled MTTKRP
+ * @param[out] sampler    an uninitialized sampler
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    the factor matrices, only read for SPT_SAMPLE_ROW_NORM
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ * @param[in]  weighting    what the probability of a nonzero is proportional to
+ *
+ * |value| weights depend on X alone, so one sampler serves every iteration.
+ * Row-norm weights bound each nonzero's contribution to the output, which
+ * gives a lower variance, but the sampler must be rebuilt when the factors
+ * of the other modes change.
+ */
+int sptNewMTTKRPSampler(
+		sptMTTKRPSampler * const sampler,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mode,
+		sptSampleWeighting const weighting)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Sampler", "mode >= nmodes");
+	}
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Sampler", "pattern-only tensor");
+	}
+	sampler->mode = mode;
+	sampler->nmodes = nmodes;
+	sampler->weighting = weighting;
+	sampler->nnz = nnz;
+	sampler->norms = NULL;
+	sampler->cdf = malloc((nnz > 0 ? nnz : 1) * sizeof *sampler->cdf);
+	spt_CheckOSError(!sampler->cdf, "MTTKRP Sampler");
+
+	if(weighting == SPT_SAMPLE_ROW_NORM) {
+		sampler->norms = calloc(nmodes, sizeof *sampler->norms);
+		spt_CheckOSError(!sampler->norms, "MTTKRP Sampler");
+		for(sptIndex m=0; m<nmodes; ++m) {
+			if(m == mode) {
+				continue;
+			}
+			if(mats[m]->nrows != X->ndims[m]) {
+				spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Sampler", "mats[i]->nrows != ndims[i]");
+			}
+			if(mats[m]->layout != SPT_LAYOUT_ROW_MAJOR) {
+				spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Sampler", "mats[i] is not row-major");
+			}
+			sampler->norms[m] = malloc((X->ndims[m] > 0 ? X->ndims[m] : 1) * sizeof *sampler->norms[m]);
+			spt_CheckOSError(!sampler->norms[m], "MTTKRP Sampler");
+			sptIndex const R = mats[m]->ncols;
+			sptIndex const stride = mats[m]->stride;
+#pragma omp parallel for schedule(static)
+			for(sptIndex i=0; i<X->ndims[m]; ++i) {
+				sptValue const * const row = mats[m]->values + (size_t)i * stride;
+				double sum = 0;
+				for(sptIndex r=0; r<R; ++r) {
+					sum += (double)row[r] * row[r];
+				}
+				sampler->norms[m][i] = sqrt(sum);
+			}
+		}
+	}
+
+	/* Each thread sums its share, then prefixes it from the shares before. */
+	int const nt = omp_get_max_threads();
+	double * partial = malloc((nt + 1) * sizeof *partial);
+	spt_CheckOSError(!partial, "MTTKRP Sampler");
+#pragma omp parallel num_threads(nt)
+	{
+		int const tid = omp_get_thread_num();
+		int const nth = omp_get_num_threads();
+		sptNnzIndex const begin = nnz * tid / nth;
+		sptNnzIndex const end = nnz * (tid + 1) / nth;
+		double sum = 0;
+		for(sptNnzIndex x=begin; x<end; ++x) {
+			sum += sampled_weight(sampler, X, x);
+			sampler->cdf[x] = sum;
+		}
+		partial[tid + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+		{
+			partial[0] = 0;
+			for(int t=1; t<=nth; ++t) {
+				partial[t] += partial[t-1];
+			}
+		}
+		for(sptNnzIndex x=begin; x<end; ++x) {
+			sampler->cdf[x] += partial[tid];
+		}
+	}
+	free(partial);
+
+	return 0;
+}
+
+
+/**
+ * The bytes a sampler holds
+ * @param sampler a valid sampler
+ * @param X       the tensor it was built for, for the sizes of the row norms
+ */
+size_t sptMTTKRPSamplerBytes(sptMTTKRPSampler const * const sampler, sptSparseTensor const * const X)
+{
+	size_t bytes = sampler->nnz * sizeof *sampler->cdf;
+	if(sampler->norms != NULL) {
+		bytes += sampler->nmodes * sizeof *sampler->norms;
+		for(sptIndex m=0; m<sampler->nmodes; ++m) {
+			if(sampler->norms[m] != NULL) {
+				bytes += X->ndims[m] * sizeof *sampler->norms[m];
+			}
+		}
+	}
+	return bytes;
+}
+
+
+/**
+ * Release a sampler
+ * @param sampler the sampler
+ */
+void sptFreeMTTKRPSampler(sptMTTKRPSampler *sampler)
+{
+	if(sampler->norms != NULL) {
+		for(sptIndex m=0; m<sampler->nmodes; ++m) {
+			free(sampler->norms[m]);
+		}
+		free(sampler->norms);
+	}
+	free(sampler->cdf);
+	sampler->nnz = 0;
+}
+
+
+/**
+ * Approximate MTTKRP from a weighted sample of the nonzeros
+ * @param[out] variance    an unbiased estimate of E ||mats[nmodes] - exact||_F^2
+ * @param[out] mats[nmodes]    the estimated MTTKRP, overwritten
+ * @param[in]  sampler    the distribution, built for X and the mode
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products, mats_order[0] is the mode
+ * @param[in]  nsamples    the number of draws, at least 2
+ * @param[in]  seed    the random stream, equal seeds give equal samples
+ * @param[in]  tk    the number of threads
+ *
+ * nsamples nonzeros are drawn with replacement, nonzero x with probability
+ * p_x, and each draw contributes its Khatri-Rao row scaled by 1 / (nsamples
+ * p_x), so the result is unbiased. Repeated draws are merged into a small
+ * tensor whose MTTKRP is the estimate. The variance comes from the spread
+ * of the draws around it; its square root over the norm of the result is
+ * the expected relative error, which shrinks as 1 / sqrt(nsamples).
+ */
+int sptMTTKRPSampled(
+		double * const variance,
+		sptMTTKRPSampler const * const sampler,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptNnzIndex const nsamples,
+		uint64_t const seed,
+		int const tk)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const mode = sampler->mode;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	int result;
+
+	if(sampler->nnz != X->nnz || sampler->nmodes != nmodes || mats_order[0] != mode) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Sampled", "the sampler was built for another tensor or mode");
+	}
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Sampled", "pattern-only tensor");
+	}
+	if(nsamples < 2) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "MTTKRP Sampled", "nsamples < 2");
+	}
+	double const total = X->nnz > 0 ? sampler->cdf[X->nnz - 1] : 0;
+	if(!(total > 0)) {
+		/* Every weight is zero, and so is every contribution. */
+		memset(mats[nmodes]->values, 0, (size_t)X->ndims[mode] * stride * sizeof(sptValue));
+		*variance = 0;
+		return 0;
+	}
+
+	/*
+	 * Counter-based draws, sorted first so that the first nonzero whose
+	 * prefix passes each draw is found by a forward search from the last.
+	 */
+	uint64_t * picks = malloc(nsamples * sizeof *picks);
+	spt_CheckOSError(!picks, "MTTKRP Sampled");
+#pragma omp parallel for schedule(static) num_threads(tk)
+	for(sptNnzIndex s=0; s<nsamples; ++s) {
+		picks[s] = spt_SplitMix64(seed ^ spt_SplitMix64(s)) >> 11;
+	}
+	result = spt_RadixSortPairs(picks, NULL, nsamples, 0, 53);
+	spt_CheckError(result, "MTTKRP Sampled", NULL);
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nth = omp_get_num_threads();
+		sptNnzIndex const begin = nsamples * tid / nth;
+		sptNnzIndex const end = nsamples * (tid + 1) / nth;
+		sptNnzIndex lo = 0;
+		for(sptNnzIndex s=begin; s<end; ++s) {
+			double const u = (double)picks[s] * 0x1p-53 * total;
+			/* Gallop to a bracket [lo, hi], then bisect it. */
+			sptNnzIndex step = 1, hi = lo;
+			while(hi < X->nnz - 1 && !(sampler->cdf[hi] > u)) {
+				lo = hi + 1;
+				hi = hi + step < X->nnz - 1 ? hi + step : X->nnz - 1;
+				step *= 2;
+			}
+			while(lo < hi) {
+				sptNnzIndex const mid = lo + (hi - lo) / 2;
+				if(sampler->cdf[mid] > u) {
+					hi = mid;
+				} else {
+					lo = mid + 1;
+				}
+			}
+			picks[s] = lo;
+		}
+	}
+
+	/* Merge repeated draws, counts[d] for distinct pick d. */
+	sptNnzIndex ndistinct = 0;
+	sptNnzIndex * counts = malloc(nsamples * sizeof *counts);
+	spt_CheckOSError(!counts, "MTTKRP Sampled");
+	for(sptNnzIndex s=0; s<nsamples; ++s) {
+		if(s > 0 && picks[s] == picks[s-1]) {
+			++counts[ndistinct-1];
+		} else {
+			picks[ndistinct] = picks[s];
+			counts[ndistinct] = 1;
+			++ndistinct;
+		}
+	}
+
+	sptSparseTensor T;
+	result = sptNewSparseTensor(&T, nmodes, X->ndims);
+	spt_CheckError(result, "MTTKRP Sampled", NULL);
+	for(sptIndex m=0; m<nmodes; ++m) {
+		result = sptResizeIndexVector(&T.inds[m], ndistinct);
+		spt_CheckError(result, "MTTKRP Sampled", NULL);
+	}
+	result = sptResizeValueVector(&T.values, ndistinct);
+	spt_CheckError(result, "MTTKRP Sampled", NULL);
+	T.nnz = ndistinct;
+
+	/* Sum over the draws of |contribution / p|^2, for the variance. */
+	double second = 0;
+#pragma omp parallel for schedule(static) num_threads(tk) reduction(+:second)
+	for(sptNnzIndex d=0; d<ndistinct; ++d) {
+		sptNnzIndex const x = picks[d];
+		double const p = sampled_weight(sampler, X, x) / total;
+		double const scaled = X->values.data[x] / p;
+		for(sptIndex m=0; m<nmodes; ++m) {
+			T.inds[m].data[d] = X->inds[m].data[x];
+		}
+		T.values.data[d] = (sptValue)(scaled * counts[d] / nsamples);
+
+		double kr2 = 0;
+		for(sptIndex r=0; r<R; ++r) {
+			double prod = 1;
+			for(sptIndex i=1; i<nmodes; ++i) {
+				prod *= mats[mats_order[i]]->values[(size_t)X->inds[mats_order[i]].data[x] * stride + r];
+			}
+			kr2 += prod * prod;
+		}
+		second += counts[d] * scaled * scaled * kr2;
+	}
+	free(picks);
+	free(counts);
+
+	result = tk > 1 ? sptOmpMTTKRP(&T, mats, mats_order, mode, tk) : sptMTTKRP(&T, mats, mats_order, mode);
+	sptFreeSparseTensor(&T);
+	spt_CheckError(result, "MTTKRP Sampled", NULL);
+
+	double norm2 = 0;
+	sptValue const * const mvals = mats[nmodes]->values;
+#pragma omp parallel for schedule(static) num_threads(tk) reduction(+:norm2)
+	for(sptIndex i=0; i<X->ndims[mode]; ++i) {
+		for(sptIndex r=0; r<R; ++r) {
+			norm2 += (double)mvals[(size_t)i * stride + r] * mvals[(size_t)i * stride + r];
+		}
+	}
+	/* Sample variance of the draws, over nsamples for the variance of their mean. */
+	double const var = (second / nsamples - norm2) / (nsamples - 1);
+	*variance = var > 0 ? var : 0;
+
+	return 0;
+}
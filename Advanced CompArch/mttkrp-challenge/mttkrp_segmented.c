@@ -0,0 +1,236 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/* Accumulator width, a divisor of the row stride unless rows are unpadded. */
+#define SPT_SEG_LANES 8
+
+
+/*
+ * Columns [r0, r0 + lanes) of the sum of the Khatri-Rao rows of nonzeros
+ * [begin, end), stored into out. Called with lanes == SPT_SEG_LANES for the
+ * full blocks, so each partial sum stays in registers for the whole run,
+ * and with a constant pattern so pattern-only tensors skip the values.
+ */
+static inline void segmented_lanes(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptIndex const r0,
+		sptIndex const lanes,
+		int const pattern,
+		sptValue * const restrict out)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptValue acc[SPT_SEG_LANES] = { 0 };
+
+	for(sptNnzIndex x=begin; x<end; ++x) {
+		sptValue prod[SPT_SEG_LANES];
+		sptValue const * restrict times_row = mats[mats_order[1]]->values + (size_t)X->inds[mats_order[1]].data[x] * stride + r0;
+#pragma omp simd
+		for(sptIndex l=0; l<lanes; ++l) {
+			prod[l] = pattern ? times_row[l] : vals[x] * times_row[l];
+		}
+		for(sptIndex i=2; i<nmodes; ++i) {
+			times_row = mats[mats_order[i]]->values + (size_t)X->inds[mats_order[i]].data[x] * stride + r0;
+#pragma omp simd
+			for(sptIndex l=0; l<lanes; ++l) {
+				prod[l] *= times_row[l];
+			}
+		}
+#pragma omp simd
+		for(sptIndex l=0; l<lanes; ++l) {
+			acc[l] += prod[l];
+		}
+	}
+	sptIndex const width = mats[nmodes]->ncols - r0 < lanes ? mats[nmodes]->ncols - r0 : lanes;
+	for(sptIndex l=0; l<width; ++l) {
+		out[r0 + l] = acc[l];
+	}
+}
+
+
+/*
+ * Sum of the Khatri-Rao rows of nonzeros [begin, end) into out. Padding is
+ * read as a harmless extra column; with unpadded rows the last columns take
+ * a narrower pass so no row reads into the next.
+ */
+static inline void segmented_run(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict out)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+
+	for(sptIndex r0=0; r0<R; r0+=SPT_SEG_LANES) {
+		if(r0 + SPT_SEG_LANES > stride) {
+			segmented_lanes(X, mats, mats_order, begin, end, r0, R - r0, X->pattern, out);
+		} else if(X->pattern) {
+			segmented_lanes(X, mats, mats_order, begin, end, r0, SPT_SEG_LANES, 1, out);
+		} else {
+			segmented_lanes(X, mats, mats_order, begin, end, r0, SPT_SEG_LANES, 0, out);
+		}
+	}
+}
+
+
+/*
+ * Nonzeros [begin, end) writing output rows [lo, hi), each once. Rows with
+ * no nonzeros are zeroed. If the first run continues a row from before begin,
+ * its sum goes to head instead and *has_head is set.
+ */
+static void segmented_range(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptIndex const lo,
+		sptIndex const hi,
+		sptValue * const restrict head,
+		int * const has_head)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+	sptIndex next = lo;
+
+	*has_head = 0;
+	sptNnzIndex x = begin;
+	while(x < end) {
+		sptIndex const row = mode_ind[x];
+		sptNnzIndex run_end = x + 1;
+		while(run_end < end && mode_ind[run_end] == row) {
+			++run_end;
+		}
+		if(x == begin && begin > 0 && mode_ind[begin-1] == row) {
+			segmented_run(X, mats, mats_order, x, run_end, head);
+			*has_head = 1;
+		} else {
+			for(; next<row; ++next) {
+				memset(mvals + (size_t)next * stride, 0, stride * sizeof *mvals);
+			}
+			segmented_run(X, mats, mats_order, x, run_end, mvals + (size_t)row * stride);
+			next = row + 1;
+		}
+		x = run_end;
+	}
+	for(; next<hi; ++next) {
+		memset(mvals + (size_t)next * stride, 0, stride * sizeof *mvals);
+	}
+}
+
+
+/**
+ * MTTKRP on a mode-sorted tensor with one write per output row
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  X    the sparse tensor input X, must be sorted by mode (sptSparseTensorSortByMode)
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ * @param[in]  mode   the mode on which the MTTKRP is performed
+ *
+ * Consecutive nonzeros of one output row form a run. A run is summed in
+ * registers and its row stored once, instead of a read-modify-write of the
+ * output row per nonzero.
+ */
+int sptMTTKRPSegmented(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode)
+{
+	int has_head;
+	int result = spt_CheckMTTKRPMats(mats, X->nmodes, X->ndims, mode, "MTTKRP Segmented");
+	spt_CheckError(result, "MTTKRP Segmented", NULL);
+	segmented_range(X, mats, mats_order, mode, 0, X->nnz, 0, X->ndims[mode], NULL, &has_head);
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP on a mode-sorted tensor with one write per output row
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPSegmented
+ *
+ * Threads take equal nonzero ranges. A row belongs to the thread its run
+ * starts in. A thread whose range begins inside another thread's run keeps
+ * that partial sum aside, and after a barrier these at most tk-1 partial
+ * rows are added in a short fix-up pass. No atomics are needed.
+ */
+int sptOmpMTTKRPSegmented(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const * const mode_ind = X->inds[mode].data;
+	sptValue * const mvals = mats[nmodes]->values;
+	int result = spt_CheckMTTKRPMats(mats, nmodes, X->ndims, mode, "Omp MTTKRP Segmented");
+	spt_CheckError(result, "Omp MTTKRP Segmented", NULL);
+
+	sptValue * heads = malloc((size_t)tk * stride * sizeof *heads);
+	int * has_head = malloc(tk * sizeof *has_head);
+	spt_CheckOSError(!heads || !has_head, "Omp MTTKRP Segmented");
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		sptNnzIndex const begin = X->nnz * tid / nt;
+		sptNnzIndex const end = X->nnz * (tid + 1) / nt;
+		/* Rows after the last nonzero before a range belong to that range's thread. */
+		sptIndex const lo = begin == 0 ? 0 : mode_ind[begin-1] + 1;
+		sptIndex const hi = tid == nt - 1 ? X->ndims[mode] : (end == 0 ? 0 : mode_ind[end-1] + 1);
+		segmented_range(X, mats, mats_order, mode, begin, end, lo, hi, heads + (size_t)tid * stride, &has_head[tid]);
+#pragma omp barrier
+#pragma omp single
+		for(int t=1; t<nt; ++t) {
+			if(has_head[t]) {
+				sptNnzIndex const b = X->nnz * t / nt;
+				sptValue * const restrict mvals_row = mvals + (size_t)mode_ind[b] * stride;
+				sptValue const * const restrict head = heads + (size_t)t * stride;
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] += head[r];
+				}
+			}
+		}
+	}
+	free(heads);
+	free(has_head);
+
+	return 0;
+}
@@ -0,0 +1,368 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+#include "matricies.h"
+
+/**
+ * Prepare MTTKRP as a sparse matrix times a Khatri-Rao product
+ * @param[out] spmm    an uninitialized engine
+ * @param[in]  X    the sparse tensor input X
+ * @param[in]  mats_order    the order of the Khatri-Rao products, mats_order[0] == mode
+ * @param[in]  mode    the mode on which the MTTKRP is performed
+ * @param[in]  R    the rank the engine will run at, used to size the blocks
+ * @param[in]  block_cols    columns per block, 0 sizes the Khatri-Rao block to half of L2
+ *
+ * X_(mode) is built in CSR over the columns that hold nonzeros
+ * (sptMatricizeCSR), then reordered block-major: the nonzeros of each
+ * column block, by row. A block's Khatri-Rao rows are formed once per run
+ * and reused by every row of that block while they are in cache.
+ */
+int sptNewMTTKRPSpMM(
+		sptMTTKRPSpMM * const spmm,
+		sptSparseTensor const * const X,
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const R,
+		sptIndex const block_cols)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptSparseMatrixCSR A;
+	int result;
+	if(mode >= nmodes || mats_order[0] != mode) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP SpMM", "mats_order[0] != mode");
+	}
+
+	spmm->mode = mode;
+	spmm->nmodes = nmodes;
+	spmm->arena = NULL;
+	spmm->col_modes = malloc((nmodes > 1 ? nmodes - 1 : 1) * sizeof *spmm->col_modes);
+	spmm->col_inds = malloc((nmodes > 1 ? nmodes - 1 : 1) * sizeof *spmm->col_inds);
+	spt_CheckOSError(!spmm->col_modes || !spmm->col_inds, "MTTKRP SpMM");
+	memcpy(spmm->col_modes, mats_order + 1, (nmodes - 1) * sizeof *spmm->col_modes);
+	result = sptMatricizeCSR(X, mode, spmm->col_modes, &A, spmm->col_inds);
+	spt_CheckError(result, "MTTKRP SpMM", NULL);
+	spmm->nrows = A.nrows;
+	spmm->ncols = A.ncols;
+	spmm->nnz = A.nnz;
+
+	sptIndex width = block_cols;
+	if(width == 0) {
+		size_t const row_bytes = (size_t)(((R-1)/8+1)*8) * sizeof(sptValue);
+		width = (sptIndex)(sptCacheSize(2) / 2 / row_bytes);
+	}
+	if(width < 8) {
+		width = 8;
+	}
+	spmm->block_cols = width;
+	spmm->nblocks = (sptIndex)(((sptNnzIndex)A.ncols + width - 1) / width);
+
+	/* Count the segments and nonzeros of each block. Rows are sorted by column. */
+	sptNnzIndex const * const rowptr = A.rowptr.data;
+	sptIndex const * const colind = A.colind.data;
+	sptNnzIndex * seg_next = calloc((size_t)spmm->nblocks + 1, sizeof *seg_next);
+	sptNnzIndex * nz_next = calloc((size_t)spmm->nblocks + 1, sizeof *nz_next);
+	spmm->block_ptr = malloc(((size_t)spmm->nblocks + 1) * sizeof *spmm->block_ptr);
+	spt_CheckOSError(!seg_next || !nz_next || !spmm->block_ptr, "MTTKRP SpMM");
+	for(sptIndex i=0; i<A.nrows; ++i) {
+		for(sptNnzIndex x=rowptr[i]; x<rowptr[i+1]; ++x) {
+			sptIndex const b = colind[x] / width;
+			if(x == rowptr[i] || colind[x-1] / width != b) {
+				++seg_next[b + 1];
+			}
+			++nz_next[b + 1];
+		}
+	}
+	for(sptIndex b=0; b<spmm->nblocks; ++b) {
+		seg_next[b + 1] += seg_next[b];
+		nz_next[b + 1] += nz_next[b];
+	}
+	spmm->nsegs = seg_next[spmm->nblocks];
+	memcpy(spmm->block_ptr, seg_next, ((size_t)spmm->nblocks + 1) * sizeof *spmm->block_ptr);
+
+	spmm->seg_row = malloc((spmm->nsegs > 0 ? spmm->nsegs : 1) * sizeof *spmm->seg_row);
+	spmm->seg_ptr = malloc((spmm->nsegs + 1) * sizeof *spmm->seg_ptr);
+	spmm->colind = malloc((A.nnz > 0 ? A.nnz : 1) * sizeof *spmm->colind);
+	spmm->values = malloc((A.nnz > 0 ? A.nnz : 1) * sizeof *spmm->values);
+	spt_CheckOSError(!spmm->seg_row || !spmm->seg_ptr || !spmm->colind || !spmm->values, "MTTKRP SpMM");
+	for(sptIndex i=0; i<A.nrows; ++i) {
+		for(sptNnzIndex x=rowptr[i]; x<rowptr[i+1]; ++x) {
+			sptIndex const b = colind[x] / width;
+			if(x == rowptr[i] || colind[x-1] / width != b) {
+				sptNnzIndex const s = seg_next[b]++;
+				spmm->seg_row[s] = i;
+				spmm->seg_ptr[s] = nz_next[b];
+			}
+			sptNnzIndex const pos = nz_next[b]++;
+			spmm->colind[pos] = colind[x] - b * width;
+			spmm->values[pos] = A.values.data[x];
+		}
+	}
+	spmm->seg_ptr[spmm->nsegs] = A.nnz;
+	free(seg_next);
+	free(nz_next);
+	sptFreeSparseMatrixCSR(&A);
+
+	return 0;
+}
+
+
+/**
+ * The bytes a CSR MTTKRP holds
+ * @param spmm a valid CSR MTTKRP
+ */
+size_t sptMTTKRPSpMMBytes(sptMTTKRPSpMM const * const spmm)
+{
+	size_t bytes = (spmm->nmodes - 1) * (sizeof *spmm->col_modes + sizeof *spmm->col_inds);
+	for(sptIndex k=0; k+1<spmm->nmodes; ++k) {
+		bytes += spmm->col_inds[k].cap * sizeof *spmm->col_inds[k].data;
+	}
+	return bytes + ((size_t)spmm->nblocks + 1) * sizeof *spmm->block_ptr
+			+ spmm->nsegs * sizeof *spmm->seg_row + (spmm->nsegs + 1) * sizeof *spmm->seg_ptr
+			+ spmm->nnz * (sizeof *spmm->colind + sizeof *spmm->values);
+}
+
+
+/**
+ * The arena bytes sptMTTKRPSpMMMoveToArena takes
+ * @param spmm a valid SpMM MTTKRP engine
+ */
+size_t sptMTTKRPSpMMArenaSize(sptMTTKRPSpMM const * const spmm)
+{
+	sptNnzIndex const nsegs = spmm->nsegs > 0 ? spmm->nsegs : 1;
+	sptNnzIndex const nnz = spmm->nnz > 0 ? spmm->nnz : 1;
+	size_t bytes = sptArenaRounded(nsegs * sizeof *spmm->seg_row) + sptArenaRounded((spmm->nsegs + 1) * sizeof *spmm->seg_ptr)
+			+ sptArenaRounded(nnz * sizeof *spmm->colind) + sptArenaRounded(nnz * sizeof *spmm->values);
+	for(sptIndex k=0; k+1<spmm->nmodes; ++k) {
+		bytes += sptArenaRounded(spmm->col_inds[k].cap * sizeof *spmm->col_inds[k].data);
+	}
+	return bytes;
+}
+
+
+/**
+ * Move the CSR arrays and column index tuples of an SpMM engine into an arena
+ * @param spmm  an SpMM MTTKRP engine on the heap
+ * @param arena the arena, with sptMTTKRPSpMMArenaSize bytes free
+ */
+int sptMTTKRPSpMMMoveToArena(sptMTTKRPSpMM * const spmm, sptArena * const arena)
+{
+	sptNnzIndex const nsegs = spmm->nsegs > 0 ? spmm->nsegs : 1;
+	sptNnzIndex const nnz = spmm->nnz > 0 ? spmm->nnz : 1;
+	if(arena->used + sptMTTKRPSpMMArenaSize(spmm) > arena->size) {
+		spt_CheckError(SPTERR_OS_ERROR + ENOMEM, "MTTKRP SpMM Move", "the arena is full");
+	}
+	int result = sptArenaMove(arena, (void **)&spmm->seg_row, nsegs * sizeof *spmm->seg_row);
+	spt_CheckError(result, "MTTKRP SpMM Move", NULL);
+	result = sptArenaMove(arena, (void **)&spmm->seg_ptr, (spmm->nsegs + 1) * sizeof *spmm->seg_ptr);
+	spt_CheckError(result, "MTTKRP SpMM Move", NULL);
+	result = sptArenaMove(arena, (void **)&spmm->colind, nnz * sizeof *spmm->colind);
+	spt_CheckError(result, "MTTKRP SpMM Move", NULL);
+	result = sptArenaMove(arena, (void **)&spmm->values, nnz * sizeof *spmm->values);
+	spt_CheckError(result, "MTTKRP SpMM Move", NULL);
+	for(sptIndex k=0; k+1<spmm->nmodes; ++k) {
+		result = sptArenaMove(arena, (void **)&spmm->col_inds[k].data, spmm->col_inds[k].cap * sizeof *spmm->col_inds[k].data);
+		spt_CheckError(result, "MTTKRP SpMM Move", NULL);
+		spmm->col_inds[k].arena = arena;
+	}
+	spmm->arena = arena;
+	return 0;
+}
+
+
+/**
+ * Release an SpMM MTTKRP engine
+ * @param spmm the engine
+ */
+void sptFreeMTTKRPSpMM(sptMTTKRPSpMM *spmm)
+{
+	for(sptIndex k=0; k+1<spmm->nmodes; ++k) {
+		sptFreeIndexVector(&spmm->col_inds[k]);
+	}
+	free(spmm->col_modes);
+	free(spmm->col_inds);
+	free(spmm->block_ptr);
+	if(spmm->arena == NULL) {
+		free(spmm->seg_row);
+		free(spmm->seg_ptr);
+		free(spmm->colind);
+		free(spmm->values);
+	}
+	spmm->nmodes = 0;
+}
+
+
+/**
+ * Report the shape of the matricization and its column blocking
+ * @param spmm the engine
+ * @param fp   the file to write to
+ */
+void sptMTTKRPSpMMStatus(sptMTTKRPSpMM const * const spmm, FILE *fp)
+{
+	fprintf(fp, "SpMM MTTKRP (mode %"PASTA_PRI_INDEX ")---------\n", spmm->mode);
+	fprintf(fp, "X_(%"PASTA_PRI_INDEX "): %"PASTA_PRI_INDEX " x %"PASTA_PRI_INDEX " nonempty columns, AVG nnz per column = %.2lf\n",
+					spmm->mode, spmm->nrows, spmm->ncols, spmm->ncols > 0 ? (double)spmm->nnz / spmm->ncols : 0.0);
+	fprintf(fp, "Column blocks: %"PASTA_PRI_INDEX " of %"PASTA_PRI_INDEX " columns, %"PASTA_PRI_NNZ_INDEX " row segments, AVG nnz per segment = %.2lf\n",
+					spmm->nblocks, spmm->block_cols, spmm->nsegs, spmm->nsegs > 0 ? (double)spmm->nnz / spmm->nsegs : 0.0);
+	fprintf(fp, "\n");
+}
+
+
+static int spmm_check_mats(sptMTTKRPSpMM const * const spmm, sptMatrix * mats[])
+{
+	sptIndex const nmodes = spmm->nmodes;
+	int result = spt_CheckMTTKRPMats(mats, nmodes, NULL, spmm->mode, "MTTKRP SpMM");
+	spt_CheckError(result, "MTTKRP SpMM", NULL);
+	if(mats[spmm->mode]->nrows != spmm->nrows || mats[nmodes]->nrows < spmm->nrows) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP SpMM", "mats[mode]->nrows != ndims[mode]");
+	}
+	return 0;
+}
+
+
+/* Khatri-Rao row of block column c, the product of the factor rows of its indices. */
+static inline void spmm_kr_row(
+		sptMTTKRPSpMM const * const spmm,
+		sptMatrix * mats[],
+		sptIndex const c,
+		sptValue * const restrict kr_row)
+{
+	sptIndex const nmodes = spmm->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue const * restrict times_row = mats[spmm->col_modes[0]]->values + (size_t)spmm->col_inds[0].data[c] * stride;
+#pragma omp simd
+	for(sptIndex r=0; r<R; ++r) {
+		kr_row[r] = times_row[r];
+	}
+	for(sptIndex k=1; k+1<nmodes; ++k) {
+		times_row = mats[spmm->col_modes[k]]->values + (size_t)spmm->col_inds[k].data[c] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			kr_row[r] *= times_row[r];
+		}
+	}
+}
+
+
+/* Segment s of a block: its row += sum of value times the block's Khatri-Rao row. */
+static inline void spmm_segment(
+		sptMTTKRPSpMM const * const spmm,
+		sptNnzIndex const s,
+		sptValue const * const restrict kr,
+		sptIndex const R,
+		sptIndex const stride,
+		sptValue * const restrict mvals)
+{
+	sptValue * const restrict out = mvals + (size_t)spmm->seg_row[s] * stride;
+	for(sptNnzIndex x=spmm->seg_ptr[s]; x<spmm->seg_ptr[s+1]; ++x) {
+		sptValue const v = spmm->values[x];
+		sptValue const * const restrict kr_row = kr + (size_t)spmm->colind[x] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			out[r] += v * kr_row[r];
+		}
+	}
+}
+
+
+/**
+ * MTTKRP as a column-blocked SpMM
+ * @param[in]  spmm    the engine, from sptNewMTTKRPSpMM
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ */
+int sptMTTKRPSpMMExecute(
+		sptMTTKRPSpMM const * const spmm,
+		sptMatrix * mats[])
+{
+	sptIndex const nmodes = spmm->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue * const mvals = mats[nmodes]->values;
+	int result = spmm_check_mats(spmm, mats);
+	spt_CheckError(result, "MTTKRP SpMM", NULL);
+
+	sptValue * kr = malloc((size_t)spmm->block_cols * stride * sizeof *kr);
+	spt_CheckOSError(!kr, "MTTKRP SpMM");
+	memset(mvals, 0, (size_t)spmm->nrows * stride * sizeof *mvals);
+	for(sptIndex b=0; b<spmm->nblocks; ++b) {
+		sptIndex const c0 = b * spmm->block_cols;
+		sptIndex const cn = spmm->ncols - c0 < spmm->block_cols ? spmm->ncols - c0 : spmm->block_cols;
+		for(sptIndex c=0; c<cn; ++c) {
+			spmm_kr_row(spmm, mats, c0 + c, kr + (size_t)c * stride);
+		}
+		for(sptNnzIndex s=spmm->block_ptr[b]; s<spmm->block_ptr[b+1]; ++s) {
+			spmm_segment(spmm, s, kr, R, stride, mvals);
+		}
+	}
+	free(kr);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP as a column-blocked SpMM
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPSpMMExecute
+ *
+ * The team forms each block's Khatri-Rao rows together, then splits its
+ * segments. A block has at most one segment per row, so no atomics are needed.
+ */
+int sptOmpMTTKRPSpMMExecute(
+		sptMTTKRPSpMM const * const spmm,
+		sptMatrix * mats[],
+		int const tk)
+{
+	sptIndex const nmodes = spmm->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue * const mvals = mats[nmodes]->values;
+	int result = spmm_check_mats(spmm, mats);
+	spt_CheckError(result, "Omp MTTKRP SpMM", NULL);
+
+	sptValue * kr = malloc((size_t)spmm->block_cols * stride * sizeof *kr);
+	spt_CheckOSError(!kr, "Omp MTTKRP SpMM");
+
+#pragma omp parallel num_threads(tk)
+	{
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<spmm->nrows; ++i) {
+			memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+		}
+		for(sptIndex b=0; b<spmm->nblocks; ++b) {
+			sptIndex const c0 = b * spmm->block_cols;
+			sptIndex const cn = spmm->ncols - c0 < spmm->block_cols ? spmm->ncols - c0 : spmm->block_cols;
+#pragma omp for schedule(static)
+			for(sptIndex c=0; c<cn; ++c) {
+				spmm_kr_row(spmm, mats, c0 + c, kr + (size_t)c * stride);
+			}
+#pragma omp for schedule(dynamic, 16)
+			for(sptNnzIndex s=spmm->block_ptr[b]; s<spmm->block_ptr[b+1]; ++s) {
+				spmm_segment(spmm, s, kr, R, stride, mvals);
+			}
+		}
+	}
+	free(kr);
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include <sched.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/*
+ * A task is a range of output rows [begin, end), packed in 64 bits so deque
+ * slots are read and written atomically. Only the thread running a task
+ * writes its rows, so stealing never needs atomics on the output.
+ */
+#define SPT_TASK(begin, end) (((uint64_t)(begin) << 32) | (uint64_t)(end))
+#define SPT_TASK_BEGIN(task) ((sptIndex)((task) >> 32))
+#define SPT_TASK_END(task) ((sptIndex)((task) & 0xFFFFFFFFu))
+#define SPT_DEQUE_CAP 64
+
+/**
+ * Chase-Lev deque. The owner pushes and pops at the bottom, thieves take from
+ * the top. Lazy splitting pushes only onto an empty deque, so a handful of
+ * slots is enough. Padded to keep each deque on its own cache lines.
+ */
+struct sptTagTaskDeque {
+		int64_t top;
+		char pad_top[64 - sizeof(int64_t)];
+		int64_t bottom;
+		char pad_bottom[64 - sizeof(int64_t)];
+		uint64_t tasks[SPT_DEQUE_CAP];
+};
+
+static int deque_push(sptTaskDeque * const d, uint64_t const task)
+{
+	int64_t const b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t const t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if(b - t >= SPT_DEQUE_CAP) {
+		return -1;
+	}
+	__atomic_store_n(&d->tasks[b % SPT_DEQUE_CAP], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int deque_pop(sptTaskDeque * const d, uint64_t * const task)
+{
+	int64_t const b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if(t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	*task = __atomic_load_n(&d->tasks[b % SPT_DEQUE_CAP], __ATOMIC_RELAXED);
+	if(t == b) {
+		/* Last task, race the thieves for it. */
+		int const won = __atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return won ? 0 : -1;
+	}
+	return 0;
+}
+
+static int deque_steal(sptTaskDeque * const d, uint64_t * const task)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t const b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if(t >= b) {
+		return -1;
+	}
+	*task = __atomic_load_n(&d->tasks[t % SPT_DEQUE_CAP], __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int deque_empty(sptTaskDeque * const d)
+{
+	return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+}
+
+
+/* First row in [begin, end] whose start position reaches target. */
+static sptIndex slice_search(sptNnzIndex const * const slice_ptr, sptIndex begin, sptIndex end, sptNnzIndex const target)
+{
+	while(begin < end) {
+		sptIndex const mid = begin + (end - begin) / 2;
+		if(slice_ptr[mid] < target) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return begin;
+}
+
+
+/**
+ * Set up work stealing for a MTTKRP plan
+ * @param plan a plan whose common fields are already filled in
+ *
+ * Groups the nonzeros by output row with a counting sort (kept as a
+ * permutation, X is not modified) and allocates one deque per thread.
+ */
+int spt_NewMTTKRPStealing(sptMTTKRPPlan * const plan)
+{
+	sptSparseTensor const * const X = plan->X;
+	sptNnzIndex const nnz = X->nnz;
+	sptIndex const nrows = plan->nrows;
+	sptIndex const * const mode_ind = X->inds[plan->mode].data;
+	int result;
+
+	plan->slice_ptr = malloc((nrows + 1) * sizeof *plan->slice_ptr);
+	spt_CheckOSError(!plan->slice_ptr, "MTTKRP Stealing");
+	result = spt_ComputeSliceSizes(plan->slice_ptr + 1, (sptSparseTensor *)X, plan->mode);
+	spt_CheckError(result, "MTTKRP Stealing", NULL);
+	plan->slice_ptr[0] = 0;
+	for(sptIndex i=0; i<nrows; ++i) {
+		plan->slice_ptr[i+1] += plan->slice_ptr[i];
+	}
+
+	int grouped = 1;
+	for(sptNnzIndex x=1; x<nnz && grouped; ++x) {
+		grouped = mode_ind[x-1] <= mode_ind[x];
+	}
+	plan->perm = NULL;
+	if(!grouped) {
+		sptNnzIndex * fill = malloc(nrows * sizeof *fill);
+		plan->perm = malloc(nnz * sizeof *plan->perm);
+		spt_CheckOSError(!fill || !plan->perm, "MTTKRP Stealing");
+		memcpy(fill, plan->slice_ptr, nrows * sizeof *fill);
+		for(sptNnzIndex x=0; x<nnz; ++x) {
+			plan->perm[fill[mode_ind[x]]++] = x;
+		}
+		free(fill);
+	}
+
+	/* Small enough to rebalance late, large enough to amortize a split check. */
+	plan->grain = nnz / ((sptNnzIndex)plan->nthreads * 64);
+	if(plan->grain < 256) {
+		plan->grain = 256;
+	}
+
+	plan->deques = NULL;
+	result = posix_memalign((void **)&plan->deques, 64, plan->nthreads * sizeof *plan->deques);
+	if(result != 0) {
+		plan->deques = NULL;
+	}
+	spt_CheckOSError(!plan->deques, "MTTKRP Stealing");
+	return 0;
+}
+
+
+/*
+ * Output rows [begin, end), each summed in acc and written once. Called with
+ * a constant pattern, so pattern-only tensors neither load nor multiply a value.
+ */
+static inline void steal_rows(
+		sptMTTKRPPlan const * const plan,
+		sptMatrix * mats[],
+		sptIndex const begin,
+		sptIndex const end,
+		sptValue * const restrict row,
+		sptValue * const restrict acc,
+		int const pattern)
+{
+	sptSparseTensor const * const X = plan->X;
+	sptIndex const nmodes = plan->nmodes;
+	sptIndex const R = plan->R;
+	sptIndex const stride = plan->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptNnzIndex const * const restrict slice_ptr = plan->slice_ptr;
+	sptNnzIndex const * const restrict perm = plan->perm;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+
+	for(sptIndex i=begin; i<end; ++i) {
+		for(sptIndex r=0; r<R; ++r) {
+			acc[r] = 0;
+		}
+		for(sptNnzIndex p=slice_ptr[i]; p<slice_ptr[i+1]; ++p) {
+			sptNnzIndex const x = perm != NULL ? perm[p] : p;
+			sptValue const * restrict times_row = mats[plan->mats_order[1]]->values + (size_t)X->inds[plan->mats_order[1]].data[x] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] = pattern ? times_row[r] : vals[x] * times_row[r];
+			}
+			for(sptIndex m=2; m<nmodes; ++m) {
+				times_row = mats[plan->mats_order[m]]->values + (size_t)X->inds[plan->mats_order[m]].data[x] * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					row[r] *= times_row[r];
+				}
+			}
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				acc[r] += row[r];
+			}
+		}
+		/* Each row is written once, by its owner. */
+		sptValue * const restrict mvals_row = mvals + (size_t)i * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			mvals_row[r] = acc[r];
+		}
+	}
+}
+
+
+/**
+ * Execute a work-stealing MTTKRP plan
+ * @param plan    a plan created with SPT_MTTKRP_STEALING
+ * @param mats    (N+1) dense matrices, mats[nmodes] receives the result
+ *
+ * Each thread starts with an equal-nonzero range of rows. It works through its
+ * task grain by grain, and whenever its deque is empty splits off the upper
+ * half for thieves. Idle threads steal from the others until every row is done.
+ * A single row is never split, so one huge slice bounds the achievable balance.
+ */
+int spt_MTTKRPExecuteStealing(sptMTTKRPPlan const * const plan, sptMatrix * mats[])
+{
+	sptSparseTensor const * const X = plan->X;
+	sptIndex const stride = plan->stride;
+	sptIndex const nrows = plan->nrows;
+	sptNnzIndex const * const restrict slice_ptr = plan->slice_ptr;
+	sptNnzIndex const grain = plan->grain;
+	int const tk = plan->nthreads;
+	sptIndex remaining = nrows;
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		sptTaskDeque * const own = &plan->deques[tid];
+		sptValue * const restrict row = plan->scratch + (size_t)tid * 2 * stride;
+		sptValue * const restrict acc = row + stride;
+		uint32_t victim_seed = 2463534242u ^ (uint32_t)tid;
+		uint64_t task;
+
+		own->top = 0;
+		own->bottom = 0;
+		sptIndex const first = slice_search(slice_ptr, 0, nrows, X->nnz / tk * tid);
+		sptIndex const last = tid == tk - 1 ? nrows : slice_search(slice_ptr, 0, nrows, X->nnz / tk * (tid + 1));
+		if(first < last) {
+			deque_push(own, SPT_TASK(first, last));
+		}
+#pragma omp barrier
+
+		while(__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) > 0) {
+			if(deque_pop(own, &task) != 0) {
+				victim_seed ^= victim_seed << 13;
+				victim_seed ^= victim_seed >> 17;
+				victim_seed ^= victim_seed << 5;
+				int const victim = victim_seed % tk;
+				if(victim == tid || deque_steal(&plan->deques[victim], &task) != 0) {
+					sched_yield();
+					continue;
+				}
+			}
+
+			sptIndex begin = SPT_TASK_BEGIN(task);
+			sptIndex end = SPT_TASK_END(task);
+			while(begin < end) {
+				if(end - begin > 1 && slice_ptr[end] - slice_ptr[begin] > 2 * grain && deque_empty(own)) {
+					sptIndex mid = slice_search(slice_ptr, begin, end, slice_ptr[begin] + (slice_ptr[end] - slice_ptr[begin]) / 2);
+					if(mid == begin) {
+						mid = begin + 1;
+					}
+					if(mid < end && deque_push(own, SPT_TASK(mid, end)) == 0) {
+						end = mid;
+					}
+				}
+
+				sptIndex chunk_end = slice_search(slice_ptr, begin + 1, end, slice_ptr[begin] + grain);
+				if(X->pattern) {
+					steal_rows(plan, mats, begin, chunk_end, row, acc, 1);
+				} else {
+					steal_rows(plan, mats, begin, chunk_end, row, acc, 0);
+				}
+				__atomic_fetch_sub(&remaining, chunk_end - begin, __ATOMIC_RELEASE);
+				begin = chunk_end;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * The bytes the work-stealing state of a plan holds
+ * @param nrows    # output rows
+ * @param nnz      # nonzeros
+ * @param permuted whether the nonzeros need a permutation, i.e. are not grouped by row
+ * @param nthreads # threads, one deque each
+ */
+size_t spt_MTTKRPStealingBytes(sptIndex const nrows, sptNnzIndex const nnz, int const permuted, int const nthreads)
+{
+	return ((size_t)nrows + 1) * sizeof(sptNnzIndex) + (permuted ? nnz * sizeof(sptNnzIndex) : 0)
+			+ (size_t)nthreads * sizeof(sptTaskDeque);
+}
+
+
+/**
+ * Release the work-stealing state of a MTTKRP plan
+ * @param plan the plan
+ */
+void spt_FreeMTTKRPStealing(sptMTTKRPPlan * const plan)
+{
+	if(plan->arena == NULL) {
+		free(plan->slice_ptr);
+		free(plan->perm);
+	}
+	free(plan->deques);
+	plan->slice_ptr = NULL;
+	plan->perm = NULL;
+	plan->deques = NULL;
+}
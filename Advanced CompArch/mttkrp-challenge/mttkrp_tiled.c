@@ -0,0 +1,381 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/**
+ * Reorder a sparse tensor into cache tiles for MTTKRP
+ * @param[out] tiled    an uninitialized tiled tensor
+ * @param[in]  X    the sparse tensor, not modified
+ * @param[in]  mode    the output mode, tiles are grouped by its row blocks
+ * @param[in]  R    the rank the tiles are sized for
+ * @param[in]  cache_bytes    the budget for one tile's factor rows, 0 for half of L2
+ *
+ * The budget is counted in padded factor rows and shared between the modes,
+ * smallest dimension first: a mode that fits in its share is not split and
+ * leaves the rest to the others, so short modes stay whole and long modes
+ * get blocks as tall as the cache allows.
+ */
+int sptNewSparseTensorTiled(
+		sptSparseTensorTiled * const tiled,
+		sptSparseTensor const * const X,
+		sptIndex const mode,
+		sptIndex const R,
+		size_t cache_bytes)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	int result;
+
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "Tiled SpTns", "mode >= nmodes");
+	}
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "Tiled SpTns", "pattern-only tensor");
+	}
+	if(cache_bytes == 0) {
+		cache_bytes = sptCacheSize(2) / 2;
+	}
+	sptIndex const stride = (R + 7) / 8 * 8;
+
+	tiled->mode = mode;
+	tiled->arena = NULL;
+	tiled->block_rows = malloc(nmodes * sizeof *tiled->block_rows);
+	tiled->nblocks = malloc(nmodes * sizeof *tiled->nblocks);
+	spt_CheckOSError(!tiled->block_rows || !tiled->nblocks, "Tiled SpTns");
+
+	/* Share the row budget out, smallest dimension first. */
+	uint64_t budget = cache_bytes / (stride * sizeof(sptValue));
+	int * done = calloc(nmodes, sizeof *done);
+	spt_CheckOSError(!done, "Tiled SpTns");
+	for(sptIndex left=nmodes; left>0; --left) {
+		sptIndex m = 0;
+		for(sptIndex i=0; i<nmodes; ++i) {
+			if(!done[i] && (done[m] || X->ndims[i] < X->ndims[m])) {
+				m = i;
+			}
+		}
+		done[m] = 1;
+		uint64_t share = budget / left;
+		if(share < 1) {
+			share = 1;
+		}
+		tiled->block_rows[m] = X->ndims[m] <= share ? X->ndims[m] : (sptIndex)share;
+		if(tiled->block_rows[m] == 0) {
+			tiled->block_rows[m] = 1;
+		}
+		budget = budget > tiled->block_rows[m] ? budget - tiled->block_rows[m] : 0;
+	}
+	free(done);
+
+	/* Keys are mixed radix, the output mode most significant. */
+	uint64_t nkeys = 1;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		tiled->nblocks[m] = (X->ndims[m] + tiled->block_rows[m] - 1) / tiled->block_rows[m];
+		if(tiled->nblocks[m] == 0) {
+			tiled->nblocks[m] = 1;
+		}
+		if(nkeys > UINT64_MAX / tiled->nblocks[m]) {
+			spt_CheckError(SPTERR_VALUE_ERROR, "Tiled SpTns", "too many tiles for a 64-bit key");
+		}
+		nkeys *= tiled->nblocks[m];
+	}
+	uint64_t const group_keys = nkeys / tiled->nblocks[mode];
+
+	uint64_t * keys = malloc((nnz > 0 ? nnz : 1) * sizeof *keys);
+	sptNnzIndex * perm = malloc((nnz > 0 ? nnz : 1) * sizeof *perm);
+	spt_CheckOSError(!keys || !perm, "Tiled SpTns");
+#pragma omp parallel for schedule(static)
+	for(sptNnzIndex x=0; x<nnz; ++x) {
+		uint64_t key = X->inds[mode].data[x] / tiled->block_rows[mode];
+		for(sptIndex m=0; m<nmodes; ++m) {
+			if(m != mode) {
+				key = key * tiled->nblocks[m] + X->inds[m].data[x] / tiled->block_rows[m];
+			}
+		}
+		keys[x] = key;
+		perm[x] = x;
+	}
+	unsigned key_bits = 0;
+	while(key_bits < 64 && (nkeys - 1) >> key_bits != 0) {
+		++key_bits;
+	}
+	result = spt_RadixSortPairs(keys, perm, nnz, 0, key_bits);
+	spt_CheckError(result, "Tiled SpTns", NULL);
+
+	result = sptNewSparseTensor(&tiled->tsr, nmodes, X->ndims);
+	spt_CheckError(result, "Tiled SpTns", NULL);
+	for(sptIndex m=0; m<nmodes; ++m) {
+		result = sptResizeIndexVector(&tiled->tsr.inds[m], nnz);
+		spt_CheckError(result, "Tiled SpTns", NULL);
+	}
+	result = sptResizeValueVector(&tiled->tsr.values, nnz);
+	spt_CheckError(result, "Tiled SpTns", NULL);
+	tiled->tsr.nnz = nnz;
+#pragma omp parallel for schedule(static)
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		sptNnzIndex const x = perm[p];
+		for(sptIndex m=0; m<nmodes; ++m) {
+			tiled->tsr.inds[m].data[p] = X->inds[m].data[x];
+		}
+		tiled->tsr.values.data[p] = X->values.data[x];
+	}
+
+	/* Tile and group boundaries where the key changes. */
+	tiled->ntiles = 0;
+	tiled->ngroups = 0;
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		if(p == 0 || keys[p] != keys[p-1]) {
+			++tiled->ntiles;
+			if(p == 0 || keys[p] / group_keys != keys[p-1] / group_keys) {
+				++tiled->ngroups;
+			}
+		}
+	}
+	tiled->tile_ptr = malloc((tiled->ntiles + 1) * sizeof *tiled->tile_ptr);
+	tiled->group_ptr = malloc((tiled->ngroups + 1) * sizeof *tiled->group_ptr);
+	spt_CheckOSError(!tiled->tile_ptr || !tiled->group_ptr, "Tiled SpTns");
+	sptNnzIndex t = 0, g = 0;
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		if(p == 0 || keys[p] != keys[p-1]) {
+			if(p == 0 || keys[p] / group_keys != keys[p-1] / group_keys) {
+				tiled->group_ptr[g++] = t;
+			}
+			tiled->tile_ptr[t++] = p;
+		}
+	}
+	tiled->tile_ptr[t] = nnz;
+	tiled->group_ptr[g] = t;
+	free(keys);
+	free(perm);
+
+	return 0;
+}
+
+
+/**
+ * The bytes a tiled sparse tensor holds, its reordered copy included
+ * @param tiled a valid tiled sparse tensor
+ */
+size_t sptSparseTensorTiledBytes(sptSparseTensorTiled const * const tiled)
+{
+	return sptSparseTensorBytes(&tiled->tsr) + 2 * tiled->tsr.nmodes * sizeof(sptIndex)
+			+ (tiled->ntiles + 1 + tiled->ngroups + 1) * sizeof(sptNnzIndex);
+}
+
+
+/**
+ * The arena bytes sptSparseTensorTiledMoveToArena takes
+ * @param tiled a valid tiled tensor
+ */
+size_t sptSparseTensorTiledArenaSize(sptSparseTensorTiled const * const tiled)
+{
+	return sptSparseTensorArenaSize(tiled->tsr.nmodes, tiled->tsr.nnz) + sptArenaRounded((tiled->ntiles + 1) * sizeof *tiled->tile_ptr)
+			+ sptArenaRounded((tiled->ngroups + 1) * sizeof *tiled->group_ptr);
+}
+
+
+/**
+ * Move the nonzeros and tile ranges of a tiled tensor into an arena
+ * @param tiled a tiled tensor on the heap
+ * @param arena the arena, with sptSparseTensorTiledArenaSize bytes free
+ */
+int sptSparseTensorTiledMoveToArena(sptSparseTensorTiled * const tiled, sptArena * const arena)
+{
+	if(arena->used + sptSparseTensorTiledArenaSize(tiled) > arena->size) {
+		spt_CheckError(SPTERR_OS_ERROR + ENOMEM, "Tiled SpTns Move", "the arena is full");
+	}
+	int result = sptSparseTensorMoveToArena(&tiled->tsr, arena);
+	spt_CheckError(result, "Tiled SpTns Move", NULL);
+	result = sptArenaMove(arena, (void **)&tiled->tile_ptr, (tiled->ntiles + 1) * sizeof *tiled->tile_ptr);
+	spt_CheckError(result, "Tiled SpTns Move", NULL);
+	result = sptArenaMove(arena, (void **)&tiled->group_ptr, (tiled->ngroups + 1) * sizeof *tiled->group_ptr);
+	spt_CheckError(result, "Tiled SpTns Move", NULL);
+	tiled->arena = arena;
+	return 0;
+}
+
+
+/**
+ * Release a tiled sparse tensor
+ * @param tiled the tiled tensor
+ */
+void sptFreeSparseTensorTiled(sptSparseTensorTiled *tiled)
+{
+	sptFreeSparseTensor(&tiled->tsr);
+	free(tiled->block_rows);
+	free(tiled->nblocks);
+	if(tiled->arena == NULL) {
+		free(tiled->tile_ptr);
+		free(tiled->group_ptr);
+	}
+	tiled->ntiles = 0;
+	tiled->ngroups = 0;
+}
+
+
+/**
+ * Print the tile grid of a tiled sparse tensor
+ * @param tiled the tiled tensor
+ * @param fp    the file to print to
+ */
+void sptSparseTensorTiledStatus(sptSparseTensorTiled const * const tiled, FILE *fp)
+{
+	fprintf(fp, "Tiled sparse tensor (mode %"PASTA_PRI_INDEX ")---------\n", tiled->mode);
+	fprintf(fp, "Rows per tile:");
+	for(sptIndex m=0; m<tiled->tsr.nmodes; ++m) {
+		fprintf(fp, " %"PASTA_PRI_INDEX " (%"PASTA_PRI_INDEX " blocks)", tiled->block_rows[m], tiled->nblocks[m]);
+	}
+	fprintf(fp, "\n");
+	fprintf(fp, "Tiles: %"PASTA_PRI_NNZ_INDEX ", output row blocks: %"PASTA_PRI_NNZ_INDEX ", AVG nnz per tile = %.2lf\n",
+					tiled->ntiles, tiled->ngroups, tiled->ntiles > 0 ? (double)tiled->tsr.nnz / tiled->ntiles : 0.0);
+	fprintf(fp, "\n");
+}
+
+
+/* The nonzeros of tiles [begin, end), row holds one Khatri-Rao row. */
+static void tiled_range(
+		sptSparseTensorTiled const * const tiled,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const atomic)
+{
+	sptSparseTensor const * const X = &tiled->tsr;
+	sptIndex const nmodes = X->nmodes;
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const * const restrict mode_ind = X->inds[tiled->mode].data;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+
+	for(sptNnzIndex x=tiled->tile_ptr[begin]; x<tiled->tile_ptr[end]; ++x) {
+		sptValue const * restrict times_row = mats[mats_order[1]]->values + (size_t)X->inds[mats_order[1]].data[x] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] = vals[x] * times_row[r];
+		}
+		for(sptIndex i=2; i<nmodes; ++i) {
+			times_row = mats[mats_order[i]]->values + (size_t)X->inds[mats_order[i]].data[x] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] *= times_row[r];
+			}
+		}
+		sptValue * const restrict mvals_row = mvals + (size_t)mode_ind[x] * stride;
+		if(atomic) {
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += row[r];
+			}
+		} else {
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				mvals_row[r] += row[r];
+			}
+		}
+	}
+}
+
+
+/**
+ * MTTKRP on a tiled sparse tensor
+ * @param[out] mats[nmodes]    the result of MTTKRP, overwritten
+ * @param[in]  tiled    the tensor, tiled for mats_order[0]
+ * @param[in]  mats    (N+1) dense matrices, with mats[nmodes] as temporary
+ * @param[in]  mats_order    the order of the Khatri-Rao products
+ */
+int sptMTTKRPTiled(
+		sptSparseTensorTiled const * const tiled,
+		sptMatrix * mats[],
+		sptIndex const mats_order[])
+{
+	sptIndex const nmodes = tiled->tsr.nmodes;
+	int result = spt_CheckMTTKRPMats(mats, nmodes, tiled->tsr.ndims, tiled->mode, "MTTKRP Tiled");
+	spt_CheckError(result, "MTTKRP Tiled", NULL);
+	if(mats_order[0] != tiled->mode) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "MTTKRP Tiled", "tiled for another mode");
+	}
+
+	sptValue * row = malloc(mats[nmodes]->stride * sizeof *row);
+	spt_CheckOSError(!row, "MTTKRP Tiled");
+	memset(mats[nmodes]->values, 0, (size_t)tiled->tsr.ndims[tiled->mode] * mats[nmodes]->stride * sizeof(sptValue));
+	tiled_range(tiled, mats, mats_order, 0, tiled->ntiles, row, 0);
+	free(row);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP MTTKRP on a tiled sparse tensor
+ * @param tk    the number of threads, the other parameters are as for sptMTTKRPTiled
+ *
+ * With enough output row blocks each thread takes whole blocks and owns
+ * their rows, so no atomics are needed. Otherwise tiles are shared out and
+ * the output is updated atomically.
+ */
+int sptOmpMTTKRPTiled(
+		sptSparseTensorTiled const * const tiled,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		int const tk)
+{
+	sptIndex const nmodes = tiled->tsr.nmodes;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptIndex const nrows = tiled->tsr.ndims[tiled->mode];
+	int result = spt_CheckMTTKRPMats(mats, nmodes, tiled->tsr.ndims, tiled->mode, "Omp MTTKRP Tiled");
+	spt_CheckError(result, "Omp MTTKRP Tiled", NULL);
+	if(mats_order[0] != tiled->mode) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "Omp MTTKRP Tiled", "tiled for another mode");
+	}
+
+	sptValue * rows = malloc((size_t)tk * stride * sizeof *rows);
+	spt_CheckOSError(!rows, "Omp MTTKRP Tiled");
+	sptValue * const mvals = mats[nmodes]->values;
+	int const owned = tiled->ngroups >= (sptNnzIndex)tk * 2;
+
+#pragma omp parallel num_threads(tk)
+	{
+		sptValue * const row = rows + (size_t)omp_get_thread_num() * stride;
+#pragma omp for schedule(static)
+		for(sptIndex i=0; i<nrows; ++i) {
+			memset(mvals + (size_t)i * stride, 0, stride * sizeof *mvals);
+		}
+		if(owned) {
+#pragma omp for schedule(dynamic, 1)
+			for(sptNnzIndex g=0; g<tiled->ngroups; ++g) {
+				tiled_range(tiled, mats, mats_order, tiled->group_ptr[g], tiled->group_ptr[g+1], row, 0);
+			}
+		} else {
+#pragma omp for schedule(dynamic, 1)
+			for(sptNnzIndex t=0; t<tiled->ntiles; ++t) {
+				tiled_range(tiled, mats, mats_order, t, t + 1, row, 1);
+			}
+		}
+	}
+	free(rows);
+
+	return 0;
+}
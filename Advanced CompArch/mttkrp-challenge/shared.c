@@ -0,0 +1,527 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+#include "matricies.h"
+
+/* Bumped whenever the header or the data layout changes. */
+#define SPT_SHARED_FORMAT 3
+
+/* Attachments a store can hold at once, one pid each. */
+#define SPT_SHARED_SLOTS 256
+
+static char const spt_shared_magic[8] = "sptshm\n";
+
+enum {
+	SPT_SHARED_WRITING = 0,  /* being filled, not attachable yet */
+	SPT_SHARED_READY = 1,
+	SPT_SHARED_RETIRED = 2,  /* unpublished or replaced, not attachable */
+};
+
+/*
+ * Start of the mapping. state and pids are shared between processes and
+ * only accessed atomically; a pid of 0 marks a free slot. Then come ndims[nmodes], sortorder[nmodes]
+ * and the matrix descriptors, whose pointers are meaningless here.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t format;
+	uint32_t state;
+	uint64_t generation;
+	uint32_t index_bytes;    /* sizeof(sptIndex) of the publisher */
+	uint32_t value_bytes;    /* sizeof(sptValue) of the publisher */
+	uint64_t header_bytes;
+	uint64_t data_bytes;
+	sptNnzIndex nnz;
+	sptIndex nmodes;
+	sptIndex nmats;
+	uint32_t pattern;        /* no values section, every value is 1 */
+	int32_t pids[SPT_SHARED_SLOTS];  /* the process of each attachment */
+} spt_SharedHeader;
+
+
+static size_t shared_round(size_t const bytes, size_t const unit)
+{
+	return (bytes + unit - 1) / unit * unit;
+}
+
+static size_t shared_header_bytes(sptIndex const nmodes, sptIndex const nmats)
+{
+	size_t const bytes = sizeof(spt_SharedHeader) + 2 * nmodes * sizeof(sptIndex) + nmats * sizeof(sptMatrix);
+	return shared_round(bytes, (size_t)sysconf(_SC_PAGESIZE));
+}
+
+/*
+ * Every array starts SPT_ARENA_ALIGN-aligned: the indices of each mode, the
+ * nvals values (none for a pattern tensor), then each matrix.
+ */
+static size_t shared_data_bytes(sptNnzIndex const nnz, sptNnzIndex const nvals, sptIndex const nmodes, sptIndex const nmats, sptMatrix const * const descs)
+{
+	size_t bytes = nmodes * shared_round(nnz * sizeof(sptIndex), SPT_ARENA_ALIGN) + shared_round(nvals * sizeof(sptValue), SPT_ARENA_ALIGN);
+	for(sptIndex k=0; k<nmats; ++k) {
+		bytes += shared_round(sptMatrixBytes(&descs[k]), SPT_ARENA_ALIGN);
+	}
+	return bytes;
+}
+
+static sptIndex * shared_ndims(spt_SharedHeader * const hdr)
+{
+	return (sptIndex *)(hdr + 1);
+}
+
+static sptMatrix * shared_descs(spt_SharedHeader * const hdr)
+{
+	return (sptMatrix *)(shared_ndims(hdr) + 2 * hdr->nmodes);
+}
+
+/* A name with a '/' past its first character is a file path, otherwise a shared memory object. */
+static int shared_is_path(char const * const name)
+{
+	return name[0] != '\0' && strchr(name + 1, '/') != NULL;
+}
+
+static int shared_open(char const * const name, int const flags)
+{
+	return shared_is_path(name) ? open(name, flags, 0660) : shm_open(name, flags, 0660);
+}
+
+static int shared_unlink(char const * const name)
+{
+	return shared_is_path(name) ? unlink(name) : shm_unlink(name);
+}
+
+
+/* Whether pid is running, so that the slots of processes that died can be reused. */
+static int shared_alive(int32_t const pid)
+{
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Take a free slot, or one left by a dead process, for this process. -1 if all are live. */
+static int shared_join(spt_SharedHeader * const hdr)
+{
+	int32_t const self = (int32_t)getpid();
+	for(int i=0; i<SPT_SHARED_SLOTS; ++i) {
+		int32_t pid = __atomic_load_n(&hdr->pids[i], __ATOMIC_ACQUIRE);
+		if((pid == 0 || !shared_alive(pid)) &&
+				__atomic_compare_exchange_n(&hdr->pids[i], &pid, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void shared_leave(spt_SharedHeader * const hdr, int const slot)
+{
+	__atomic_store_n(&hdr->pids[slot], 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Point the views of store into its mapping. Only the small per-mode
+ * arrays are private; indices, values and matrices stay in the mapping.
+ */
+static int shared_views(sptSharedStore * const store)
+{
+	spt_SharedHeader * const hdr = (spt_SharedHeader *)store->map;
+	sptIndex const nmodes = hdr->nmodes;
+	sptNnzIndex const nnz = hdr->nnz;
+	sptSparseTensor * const X = &store->tensor;
+	size_t const array = shared_round(nnz * sizeof(sptIndex), SPT_ARENA_ALIGN);
+
+	/* Full, so vectors that grow copy out to the heap instead. */
+	store->arena.base = store->map + store->header_bytes;
+	store->arena.size = store->size - store->header_bytes;
+	store->arena.used = store->arena.size;
+	store->arena.flags = 0;
+
+	X->nmodes = nmodes;
+	X->nnz = nnz;
+	X->arena = &store->arena;
+	X->pattern = hdr->pattern != 0;
+	X->ndims = malloc(nmodes * sizeof *X->ndims);
+	X->sortorder = malloc(nmodes * sizeof *X->sortorder);
+	X->inds = malloc(nmodes * sizeof *X->inds);
+	store->nmats = hdr->nmats;
+	store->mats = malloc((hdr->nmats > 0 ? hdr->nmats : 1) * sizeof *store->mats);
+	if(!X->ndims || !X->sortorder || !X->inds || !store->mats) {
+		free(X->ndims);
+		free(X->sortorder);
+		free(X->inds);
+		free(store->mats);
+		spt_CheckOSError(1, "Shared Views");
+	}
+	memcpy(X->ndims, shared_ndims(hdr), nmodes * sizeof *X->ndims);
+	memcpy(X->sortorder, shared_ndims(hdr) + nmodes, nmodes * sizeof *X->sortorder);
+
+	char * data = store->arena.base;
+	for(sptIndex m=0; m<nmodes; ++m) {
+		X->inds[m].len = nnz;
+		X->inds[m].cap = nnz;
+		X->inds[m].data = (sptIndex *)data;
+		X->inds[m].arena = &store->arena;
+		data += array;
+	}
+	sptNnzIndex const nvals = X->pattern ? 0 : nnz;
+	X->values.len = nvals;
+	X->values.cap = nvals;
+	X->values.data = X->pattern ? NULL : (sptValue *)data;
+	X->values.arena = &store->arena;
+	data += shared_round(nvals * sizeof(sptValue), SPT_ARENA_ALIGN);
+	for(sptIndex k=0; k<hdr->nmats; ++k) {
+		store->mats[k] = shared_descs(hdr)[k];
+		store->mats[k].values = (sptValue *)data;
+		store->mats[k].arena = &store->arena;
+		data += shared_round(sptMatrixBytes(&store->mats[k]), SPT_ARENA_ALIGN);
+	}
+	return 0;
+}
+
+
+/*
+ * Mark the store published under name as retired and remove the name.
+ * Nothing to do if the name is free; EEXIST if it is not a store.
+ */
+static int shared_retire(char const * const name)
+{
+	int const fd = shared_open(name, O_RDWR);
+	if(fd < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	int retired = 0;
+	struct stat st;
+	if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(spt_SharedHeader)) {
+		spt_SharedHeader * const hdr = mmap(NULL, sizeof *hdr, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(hdr != MAP_FAILED) {
+			if(memcmp(hdr->magic, spt_shared_magic, sizeof spt_shared_magic) == 0) {
+				__atomic_store_n(&hdr->state, SPT_SHARED_RETIRED, __ATOMIC_RELEASE);
+				retired = 1;
+			}
+			munmap(hdr, sizeof *hdr);
+		}
+	}
+	close(fd);
+	if(!retired) {
+		errno = EEXIST;
+		return -1;
+	}
+	return shared_unlink(name) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+
+/**
+ * Publish a sparse tensor and dense matrices under a name
+ * @param[out] store    the published store, attached for this process
+ * @param[in]  name    a POSIX shared memory name such as "/tensor", or a file path such as "/mnt/huge/tensor"
+ * @param[in]  X    the sparse tensor to copy, may be freed afterwards
+ * @param[in]  mats    matrices to copy along, in any layout, or NULL
+ * @param[in]  nmats    the number of matrices
+ *
+ * A store already published under the name is retired first: processes
+ * attached to it keep a valid mapping, but sptSharedStoreIsCurrent tells
+ * them to reattach. A name taken by anything else fails with EEXIST. The data pages are read-only here too, so store->tensor
+ * is exactly what attached processes see. The store outlives this process
+ * until sptSharedStoreUnpublish.
+ */
+int sptSharedStorePublish(
+		sptSharedStore * const store,
+		char const * const name,
+		sptSparseTensor const * const X,
+		sptMatrix * const mats[],
+		sptIndex const nmats)
+{
+	sptIndex const nmodes = X->nmodes;
+	sptNnzIndex const nnz = X->nnz;
+	if(strlen(name) >= sizeof store->name) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "Shared Publish", "name too long");
+	}
+	sptMatrix * descs = malloc((nmats > 0 ? nmats : 1) * sizeof *descs);
+	spt_CheckOSError(!descs, "Shared Publish");
+	for(sptIndex k=0; k<nmats; ++k) {
+		descs[k] = *mats[k];
+	}
+	size_t const header_bytes = shared_header_bytes(nmodes, nmats);
+	size_t const data_bytes = shared_data_bytes(nnz, X->pattern ? 0 : nnz, nmodes, nmats, descs);
+
+	int result = shared_retire(name);
+	int fd = result == 0 ? shared_open(name, O_RDWR | O_CREAT | O_EXCL) : -1;
+	if(fd < 0 || ftruncate(fd, header_bytes + data_bytes) != 0) {
+		int const err = errno;
+		if(fd >= 0) {
+			close(fd);
+			shared_unlink(name);
+		}
+		free(descs);
+		errno = err;
+		spt_CheckOSError(1, "Shared Publish");
+	}
+	char * const map = mmap(NULL, header_bytes + data_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		int const err = errno;
+		shared_unlink(name);
+		free(descs);
+		errno = err;
+		spt_CheckOSError(1, "Shared Publish");
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	spt_SharedHeader * const hdr = (spt_SharedHeader *)map;
+	memcpy(hdr->magic, spt_shared_magic, sizeof spt_shared_magic);
+	hdr->format = SPT_SHARED_FORMAT;
+	hdr->state = SPT_SHARED_WRITING;
+	hdr->generation = spt_SplitMix64(((uint64_t)now.tv_sec * 1000000000u + now.tv_nsec) ^ ((uint64_t)getpid() << 40));
+	hdr->pids[0] = (int32_t)getpid();
+	hdr->index_bytes = sizeof(sptIndex);
+	hdr->value_bytes = sizeof(sptValue);
+	hdr->header_bytes = header_bytes;
+	hdr->data_bytes = data_bytes;
+	hdr->nnz = nnz;
+	hdr->nmodes = nmodes;
+	hdr->nmats = nmats;
+	hdr->pattern = X->pattern;
+	memcpy(shared_ndims(hdr), X->ndims, nmodes * sizeof *X->ndims);
+	memcpy(shared_ndims(hdr) + nmodes, X->sortorder, nmodes * sizeof *X->sortorder);
+	memcpy(shared_descs(hdr), descs, nmats * sizeof *descs);
+	free(descs);
+
+	strcpy(store->name, name);
+	store->map = map;
+	store->size = header_bytes + data_bytes;
+	store->header_bytes = header_bytes;
+	store->generation = hdr->generation;
+	store->slot = 0;
+	result = shared_views(store);
+	if(result != 0) {
+		munmap(map, store->size);
+		shared_unlink(name);
+		spt_CheckError(result, "Shared Publish", NULL);
+	}
+
+	/* The views point at the data, so copying into them fills the mapping. */
+	sptSparseTensor * const S = &store->tensor;
+#pragma omp parallel for schedule(dynamic, 1)
+	for(sptIndex m=0; m<=nmodes; ++m) {
+		if(m < nmodes) {
+			memcpy(S->inds[m].data, X->inds[m].data, nnz * sizeof *S->inds[m].data);
+		} else if(!X->pattern) {
+			memcpy(S->values.data, X->values.data, nnz * sizeof *S->values.data);
+		}
+	}
+	for(sptIndex k=0; k<nmats; ++k) {
+		memcpy(store->mats[k].values, mats[k]->values, sptMatrixBytes(mats[k]));
+	}
+	mprotect(store->arena.base, store->arena.size, PROT_READ);
+	__atomic_store_n(&hdr->state, SPT_SHARED_READY, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Attach to a published store without copying
+ * @param[out] store    the attached store, store->tensor and store->mats are its views
+ * @param[in]  name    the name it was published under
+ *
+ * Fails with SPTERR_VALUE_ERROR if the store was written by an
+ * incompatible build, is still being written, or was retired. The views
+ * are read-only: kernels that sort or coalesce in place need a copy
+ * (sptCopySparseTensor), unless the store was published in their order.
+ */
+int sptSharedStoreAttach(sptSharedStore * const store, char const * const name)
+{
+	if(strlen(name) >= sizeof store->name) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "Shared Attach", "name too long");
+	}
+	int const fd = shared_open(name, O_RDWR);
+	spt_CheckOSError(fd < 0, "Shared Attach");
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		int const err = errno;
+		close(fd);
+		errno = err;
+		spt_CheckOSError(1, "Shared Attach");
+	}
+	if((size_t)st.st_size < sizeof(spt_SharedHeader)) {
+		close(fd);
+		spt_CheckError(SPTERR_VALUE_ERROR, "Shared Attach", "not a shared store");
+	}
+	char * const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	spt_CheckOSError(map == MAP_FAILED, "Shared Attach");
+
+	spt_SharedHeader * const hdr = (spt_SharedHeader *)map;
+	char const * error = NULL;
+	if(memcmp(hdr->magic, spt_shared_magic, sizeof spt_shared_magic) != 0) {
+		error = "not a shared store";
+	} else if(hdr->format != SPT_SHARED_FORMAT || hdr->index_bytes != sizeof(sptIndex) || hdr->value_bytes != sizeof(sptValue)) {
+		error = "written by an incompatible build";
+	} else if(hdr->header_bytes + hdr->data_bytes != (uint64_t)st.st_size) {
+		error = "truncated";
+	} else if(mprotect(map, hdr->header_bytes, PROT_READ | PROT_WRITE) != 0) {
+		error = "header not writable";
+	}
+	int slot = -1;
+	if(error == NULL) {
+		/* Join first, then check, so a concurrent unpublish sees this attachment. */
+		slot = shared_join(hdr);
+		uint32_t const state = __atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE);
+		if(slot < 0) {
+			error = "too many processes attached";
+		} else if(state != SPT_SHARED_READY) {
+			shared_leave(hdr, slot);
+			error = state == SPT_SHARED_WRITING ? "still being published" : "retired";
+		}
+	}
+	if(error != NULL) {
+		munmap(map, st.st_size);
+		spt_CheckError(SPTERR_VALUE_ERROR, "Shared Attach", error);
+	}
+
+	strcpy(store->name, name);
+	store->map = map;
+	store->size = st.st_size;
+	store->header_bytes = hdr->header_bytes;
+	store->generation = hdr->generation;
+	store->slot = slot;
+	int result = shared_views(store);
+	if(result != 0) {
+		shared_leave(hdr, slot);
+		munmap(map, st.st_size);
+		spt_CheckError(result, "Shared Attach", NULL);
+	}
+	return 0;
+}
+
+
+/**
+ * Whether an attached store is still the one published under its name
+ * @param store an attached store
+ *
+ * False once it has been unpublished or replaced; the views stay valid,
+ * but new work should reattach.
+ */
+int sptSharedStoreIsCurrent(sptSharedStore const * const store)
+{
+	spt_SharedHeader const * const hdr = (spt_SharedHeader const *)store->map;
+	if(__atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE) != SPT_SHARED_READY) {
+		return 0;
+	}
+	int const fd = shared_open(store->name, O_RDONLY);
+	if(fd < 0) {
+		return 0;
+	}
+	spt_SharedHeader named;
+	ssize_t const got = pread(fd, &named, sizeof named, 0);
+	close(fd);
+	return got == (ssize_t)sizeof named && named.generation == store->generation;
+}
+
+
+/**
+ * The number of attachments to a store, the publisher's included
+ * @param store an attached store
+ *
+ * Attachments of processes that exited without sptSharedStoreDetach are
+ * not counted.
+ */
+int64_t sptSharedStoreRefCount(sptSharedStore const * const store)
+{
+	spt_SharedHeader * const hdr = (spt_SharedHeader *)store->map;
+	int64_t count = 0;
+	for(int i=0; i<SPT_SHARED_SLOTS; ++i) {
+		int32_t const pid = __atomic_load_n(&hdr->pids[i], __ATOMIC_ACQUIRE);
+		if(pid != 0 && shared_alive(pid)) {
+			++count;
+		}
+	}
+	return count;
+}
+
+
+/**
+ * Detach from a store
+ * @param store an attached store, its views must no longer be used
+ *
+ * The store itself stays published.
+ */
+void sptSharedStoreDetach(sptSharedStore * const store)
+{
+	if(store->map == NULL) {
+		return;
+	}
+	shared_leave((spt_SharedHeader *)store->map, store->slot);
+	free(store->tensor.ndims);
+	free(store->tensor.sortorder);
+	free(store->tensor.inds);
+	free(store->mats);
+	munmap(store->map, store->size);
+	store->map = NULL;
+	store->tensor.nmodes = 0;
+	store->nmats = 0;
+}
+
+
+/**
+ * Retire a store and remove its name
+ * @param name     the name it was published under
+ * @param force    remove it even while processes are attached
+ *
+ * Without force, fails with SPTERR_VALUE_ERROR while a running process is
+ * attached.
+ * Attached processes keep their mapping either way; the memory is returned
+ * once the last one detaches.
+ */
+int sptSharedStoreUnpublish(char const * const name, int const force)
+{
+	if(!force) {
+		sptSharedStore store;
+		int result = sptSharedStoreAttach(&store, name);
+		spt_CheckError(result, "Shared Unpublish", NULL);
+		int64_t const others = sptSharedStoreRefCount(&store) - 1;
+		sptSharedStoreDetach(&store);
+		if(others > 0) {
+			spt_CheckError(SPTERR_VALUE_ERROR, "Shared Unpublish", "still attached");
+		}
+	}
+	int result = shared_retire(name);
+	spt_CheckOSError(result != 0, "Shared Unpublish");
+	return 0;
+}
+
+
+void sptSharedStoreStatus(sptSharedStore const * const store, FILE *fp)
+{
+	char * bytestr = sptBytesString(store->size);
+	fprintf(fp, "Shared store---------\n");
+	fprintf(fp, "Name: %s, generation %016"PRIx64 ", %s, %"PRId64 " attached%s\n", store->name, store->generation,
+					bytestr, sptSharedStoreRefCount(store), sptSharedStoreIsCurrent(store) ? "" : ", stale");
+	fprintf(fp, "\n");
+	free(bytestr);
+}
@@ -0,0 +1,378 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+
+/* Most key bits per radix pass, the histograms stay in L1/L2. */
+#define SPT_RADIX_BITS 11
+#define SPT_RADIX_BUCKETS (1 << SPT_RADIX_BITS)
+
+
+/**
+ * Stable parallel LSD radix sort of (key, value) pairs by a bit field of the key
+ * @param keys    the keys, length n, sorted in place
+ * @param vals    the values that move with the keys, length n, or NULL
+ * @param n       number of pairs
+ * @param lo      the lowest key bit sorted on
+ * @param hi      one past the highest key bit sorted on
+ *
+ * Bits outside [lo, hi) do not affect the order, so a payload packed into
+ * the low bits of a key can stand in for vals at half the memory traffic.
+ * The field is split evenly over the fewest passes of at most
+ * SPT_RADIX_BITS bits. Each pass: threads histogram their share, a
+ * prefix over (digit, thread) gives every thread its own output positions,
+ * and the threads scatter. Passes whose digit is the same for every key
+ * are skipped.
+ */
+int spt_RadixSortPairs(uint64_t * keys, sptNnzIndex * vals, sptNnzIndex const n, unsigned const lo, unsigned const hi)
+{
+	unsigned const bits = hi > lo ? hi - lo : 0;
+	int const tk = omp_get_max_threads();
+	uint64_t * tmp_keys = malloc((n > 0 ? n : 1) * sizeof *tmp_keys);
+	sptNnzIndex * tmp_vals = vals != NULL ? malloc((n > 0 ? n : 1) * sizeof *tmp_vals) : NULL;
+	sptNnzIndex * hist = malloc((size_t)tk * SPT_RADIX_BUCKETS * sizeof *hist);
+	spt_CheckOSError(!tmp_keys || (vals != NULL && !tmp_vals) || !hist, "Radix Sort");
+	int swapped = 0;
+	unsigned const npasses = (bits + SPT_RADIX_BITS - 1) / SPT_RADIX_BITS;
+	unsigned const digit = npasses > 0 ? (bits + npasses - 1) / npasses : 0;
+	uint64_t const mask = ((uint64_t)1 << digit) - 1;
+	sptIndex const nbuckets = (sptIndex)1 << digit;
+
+#pragma omp parallel num_threads(tk)
+	{
+		int const tid = omp_get_thread_num();
+		int const nt = omp_get_num_threads();
+		sptNnzIndex const begin = n * tid / nt;
+		sptNnzIndex const end = n * (tid + 1) / nt;
+		sptNnzIndex * const my_hist = hist + (size_t)tid * SPT_RADIX_BUCKETS;
+		uint64_t * src_keys = keys, * dst_keys = tmp_keys;
+		sptNnzIndex * src_vals = vals, * dst_vals = tmp_vals;
+
+		for(unsigned shift=lo; shift<hi; shift+=digit) {
+			memset(my_hist, 0, nbuckets * sizeof *my_hist);
+			for(sptNnzIndex x=begin; x<end; ++x) {
+				++my_hist[(src_keys[x] >> shift) & mask];
+			}
+#pragma omp barrier
+			/* Every thread sees the same totals, so all take the same branch. */
+			int skip = 0;
+			for(sptIndex d=0; d<nbuckets && !skip; ++d) {
+				sptNnzIndex total = 0;
+				for(int t=0; t<nt; ++t) {
+					total += hist[(size_t)t * SPT_RADIX_BUCKETS + d];
+				}
+				skip = total == n;
+			}
+#pragma omp barrier
+			if(skip) {
+				continue;
+			}
+#pragma omp single
+			{
+				sptNnzIndex pos = 0;
+				for(sptIndex d=0; d<nbuckets; ++d) {
+					for(int t=0; t<nt; ++t) {
+						sptNnzIndex const count = hist[(size_t)t * SPT_RADIX_BUCKETS + d];
+						hist[(size_t)t * SPT_RADIX_BUCKETS + d] = pos;
+						pos += count;
+					}
+				}
+			}
+			for(sptNnzIndex x=begin; x<end; ++x) {
+				sptNnzIndex const p = my_hist[(src_keys[x] >> shift) & mask]++;
+				dst_keys[p] = src_keys[x];
+				if(src_vals != NULL) {
+					dst_vals[p] = src_vals[x];
+				}
+			}
+			uint64_t * const k = src_keys;
+			src_keys = dst_keys;
+			dst_keys = k;
+			sptNnzIndex * const v = src_vals;
+			src_vals = dst_vals;
+			dst_vals = v;
+#pragma omp barrier
+		}
+		if(tid == 0) {
+			swapped = src_keys != keys;
+		}
+#pragma omp barrier
+		if(swapped) {
+#pragma omp for schedule(static)
+			for(sptNnzIndex x=0; x<n; ++x) {
+				keys[x] = tmp_keys[x];
+				if(vals != NULL) {
+					vals[x] = tmp_vals[x];
+				}
+			}
+		}
+	}
+
+	free(tmp_keys);
+	free(tmp_vals);
+	free(hist);
+	return 0;
+}
+
+
+/* Bits needed for indices below dim. */
+static unsigned sort_bits(sptIndex const dim)
+{
+	unsigned bits = 0;
+	while(bits < 32 && ((uint64_t)1 << bits) < dim) {
+		++bits;
+	}
+	return bits;
+}
+
+
+/**
+ * Whether sortorder is a permutation, i.e. records the order of a previous sort
+ * @param tsr the sparse tensor
+ */
+int spt_SortOrderKnown(sptSparseTensor const * const tsr)
+{
+	uint64_t seen = 0;
+	for(sptIndex i=0; i<tsr->nmodes; ++i) {
+		if(tsr->sortorder[i] >= tsr->nmodes || tsr->sortorder[i] >= 64 || (seen >> tsr->sortorder[i]) & 1) {
+			return 0;
+		}
+		seen |= (uint64_t)1 << tsr->sortorder[i];
+	}
+	return 1;
+}
+
+
+/*
+ * Make the gathered buffer sorted the vector's data. An arena buffer stays
+ * where it is and takes a copy, so the tensor does not leave the arena.
+ */
+static void sort_adopt(void ** const data, void * const sorted, size_t const bytes, int const in_arena)
+{
+	if(in_arena) {
+		char * const dst = *data;
+		char const * const src = sorted;
+		size_t const chunk = 1 << 20;
+#pragma omp parallel for schedule(static)
+		for(size_t off=0; off<bytes; off+=chunk) {
+			memcpy(dst + off, src + off, bytes - off < chunk ? bytes - off : chunk);
+		}
+		free(sorted);
+	} else {
+		free(*data);
+		*data = sorted;
+	}
+}
+
+
+/*
+ * Stable sort of the nonzeros by the modes keys[0..nkeys), keys[0] most
+ * significant. The modes are packed into 64-bit composite keys, as many per
+ * word as fit, and the words radix sorted least significant first into one
+ * permutation, which is then applied to every array.
+ */
+static int sort_by_keys(sptSparseTensor *tsr, sptIndex const keys[], sptIndex const nkeys)
+{
+	sptIndex const nmodes = tsr->nmodes;
+	sptNnzIndex const nnz = tsr->nnz;
+	int result;
+
+	uint64_t * words = malloc((nnz > 0 ? nnz : 1) * sizeof *words);
+	sptNnzIndex * perm = malloc((nnz > 0 ? nnz : 1) * sizeof *perm);
+	spt_CheckOSError(!words || !perm, "SpTns Sort");
+#pragma omp parallel for schedule(static)
+	for(sptNnzIndex p=0; p<nnz; ++p) {
+		perm[p] = p;
+	}
+
+	unsigned idx_bits = 0;
+	while(idx_bits < 64 && ((uint64_t)1 << idx_bits) < nnz) {
+		++idx_bits;
+	}
+	sptIndex last = nkeys;
+	while(last > 0) {
+		/* keys[first..last) fill one word. */
+		sptIndex first = last;
+		unsigned bits = 0;
+		while(first > 0 && bits + sort_bits(tsr->ndims[keys[first-1]]) <= 64) {
+			--first;
+			bits += sort_bits(tsr->ndims[keys[first]]);
+		}
+		/* The position rides in the low bits of the word when there is room. */
+		unsigned const low = bits + idx_bits <= 64 ? idx_bits : 0;
+#pragma omp parallel for schedule(static)
+		for(sptNnzIndex p=0; p<nnz; ++p) {
+			uint64_t word = 0;
+			for(sptIndex k=first; k<last; ++k) {
+				word = (word << sort_bits(tsr->ndims[keys[k]])) | tsr->inds[keys[k]].data[perm[p]];
+			}
+			words[p] = low > 0 ? word << low | perm[p] : word;
+		}
+		result = spt_RadixSortPairs(words, low > 0 ? NULL : perm, nnz, low, low + bits);
+		spt_CheckError(result, "SpTns Sort", NULL);
+		if(low > 0) {
+			uint64_t const mask = ((uint64_t)1 << low) - 1;
+#pragma omp parallel for schedule(static)
+			for(sptNnzIndex p=0; p<nnz; ++p) {
+				perm[p] = words[p] & mask;
+			}
+		}
+		last = first;
+	}
+	free(words);
+
+	/* Gather every array through the permutation into a buffer of the same capacity. */
+	for(sptIndex m=0; m<nmodes; ++m) {
+		sptIndex * const old = tsr->inds[m].data;
+		sptIndex * inds = malloc((tsr->inds[m].cap > 0 ? tsr->inds[m].cap : 1) * sizeof *inds);
+		spt_CheckOSError(!inds, "SpTns Sort");
+#pragma omp parallel for schedule(static)
+		for(sptNnzIndex p=0; p<nnz; ++p) {
+			inds[p] = old[perm[p]];
+		}
+		sort_adopt((void **)&tsr->inds[m].data, inds, nnz * sizeof *inds, tsr->inds[m].arena != NULL);
+	}
+
+	if(!tsr->pattern) {
+		sptValue * vals = malloc((tsr->values.cap > 0 ? tsr->values.cap : 1) * sizeof *vals);
+		spt_CheckOSError(!vals, "SpTns Sort");
+		sptValue * const old_vals = tsr->values.data;
+#pragma omp parallel for schedule(static)
+		for(sptNnzIndex p=0; p<nnz; ++p) {
+			vals[p] = old_vals[perm[p]];
+		}
+		sort_adopt((void **)&tsr->values.data, vals, nnz * sizeof *vals, tsr->values.arena != NULL);
+	}
+	free(perm);
+
+	return 0;
+}
+
+
+/**
+ * Sort the nonzeros of a sparse tensor by one mode
+ * @param tsr  the sparse tensor, reordered in place
+ * @param mode the mode to sort by, ascending
+ *
+ * A stable sort, so nonzeros of one slice keep their previous relative
+ * order. If tsr was sorted in its sortorder, it ends up sorted by mode
+ * followed by the rest of that order and sortorder records it; otherwise
+ * sortorder is marked unknown.
+ */
+int sptSparseTensorSortByMode(sptSparseTensor *tsr, sptIndex const mode)
+{
+	sptIndex const nmodes = tsr->nmodes;
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns SortByMode", "mode >= nmodes");
+	}
+	int const known = spt_SortOrderKnown(tsr);
+	if(known && tsr->sortorder[0] == mode) {
+		/* Nothing to do, and nothing written, so read-only tensors qualify. */
+		return 0;
+	}
+	int result = sort_by_keys(tsr, &mode, 1);
+	spt_CheckError(result, "SpTns SortByMode", NULL);
+
+	if(known) {
+		sptIndex i = 0;
+		while(tsr->sortorder[i] != mode) {
+			++i;
+		}
+		memmove(tsr->sortorder + 1, tsr->sortorder, i * sizeof *tsr->sortorder);
+		tsr->sortorder[0] = mode;
+	} else {
+		for(sptIndex i=0; i<nmodes; ++i) {
+			tsr->sortorder[i] = nmodes;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Whether the nonzeros of a sparse tensor are in lexicographic order
+ * @param tsr   the sparse tensor
+ * @param order a permutation of the modes, order[0] is the most significant key
+ *
+ * Equal coordinates count as sorted. Returns 1 or 0.
+ */
+int sptSparseTensorIsSortedByOrder(sptSparseTensor const *tsr, sptIndex const order[])
+{
+	int sorted = 1;
+#pragma omp parallel for schedule(static) reduction(&&:sorted)
+	for(sptNnzIndex x=1; x<tsr->nnz; ++x) {
+		for(sptIndex i=0; i<tsr->nmodes; ++i) {
+			sptIndex const prev = tsr->inds[order[i]].data[x-1];
+			sptIndex const cur = tsr->inds[order[i]].data[x];
+			if(prev != cur) {
+				sorted = sorted && prev < cur;
+				break;
+			}
+		}
+	}
+	return sorted;
+}
+
+
+/**
+ * Sort the nonzeros of a sparse tensor lexicographically in a given mode order
+ * @param tsr   the sparse tensor, reordered in place
+ * @param order a permutation of the modes, order[0] is the most significant key
+ *
+ * A parallel radix sort on composite keys. When sortorder records an
+ * earlier sort whose order, less the leading modes of order, matches the
+ * rest of order, only those leading modes are sorted on: stability keeps
+ * the rest. A new leading mode thus costs one key. sortorder becomes order.
+ */
+int sptSparseTensorSortByOrder(sptSparseTensor *tsr, sptIndex const order[])
+{
+	sptIndex const nmodes = tsr->nmodes;
+	sptIndex nkeys = nmodes;
+
+	if(spt_SortOrderKnown(tsr)) {
+		/* The shortest prefix of order whose removal leaves sortorder equal to the rest. */
+		for(sptIndex k=0; k<nmodes; ++k) {
+			sptIndex j = k;
+			int match = 1;
+			for(sptIndex i=0; i<nmodes && match; ++i) {
+				int leading = 0;
+				for(sptIndex l=0; l<k; ++l) {
+					leading |= tsr->sortorder[i] == order[l];
+				}
+				if(!leading) {
+					match = tsr->sortorder[i] == order[j++];
+				}
+			}
+			if(match) {
+				nkeys = k;
+				break;
+			}
+		}
+	}
+	if(nkeys > 0) {
+		int result = sort_by_keys(tsr, order, nkeys);
+		spt_CheckError(result, "SpTns SortByOrder", NULL);
+	}
+	memcpy(tsr->sortorder, order, nmodes * sizeof *tsr->sortorder);
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "matricies.h"
+
+/**
+ * Create a new sparse matrix in COO format with no nonzeros
+ * @param mtx   a pointer to an uninitialized sparse matrix
+ * @param nrows number of rows
+ * @param ncols number of columns
+ */
+int sptNewSparseMatrix(sptSparseMatrix *mtx, sptIndex const nrows, sptIndex const ncols) {
+	int result;
+	mtx->nrows = nrows;
+	mtx->ncols = ncols;
+	mtx->nnz = 0;
+	result = sptNewIndexVector(&mtx->rowind, 0, 0);
+	spt_CheckError(result, "SpMtx New", NULL);
+	result = sptNewIndexVector(&mtx->colind, 0, 0);
+	spt_CheckError(result, "SpMtx New", NULL);
+	result = sptNewValueVector(&mtx->values, 0, 0);
+	spt_CheckError(result, "SpMtx New", NULL);
+	return 0;
+}
+
+
+/**
+ * Copy a sparse matrix in COO format
+ * @param dest a pointer to an uninitialized sparse matrix
+ * @param src  a pointer to a valid sparse matrix
+ */
+int sptCopySparseMatrix(sptSparseMatrix *dest, const sptSparseMatrix *src) {
+	int result = sptNewSparseMatrix(dest, src->nrows, src->ncols);
+	spt_CheckError(result, "SpMtx Copy", NULL);
+	result = sptResizeIndexVector(&dest->rowind, src->nnz);
+	spt_CheckError(result, "SpMtx Copy", NULL);
+	result = sptResizeIndexVector(&dest->colind, src->nnz);
+	spt_CheckError(result, "SpMtx Copy", NULL);
+	result = sptResizeValueVector(&dest->values, src->nnz);
+	spt_CheckError(result, "SpMtx Copy", NULL);
+	memcpy(dest->rowind.data, src->rowind.data, src->nnz * sizeof *dest->rowind.data);
+	memcpy(dest->colind.data, src->colind.data, src->nnz * sizeof *dest->colind.data);
+	memcpy(dest->values.data, src->values.data, src->nnz * sizeof *dest->values.data);
+	dest->nnz = src->nnz;
+	return 0;
+}
+
+
+/**
+ * Release any memory the sparse matrix is holding
+ * @param mtx a pointer to a valid sparse matrix
+ */
+void sptFreeSparseMatrix(sptSparseMatrix *mtx) {
+	sptFreeIndexVector(&mtx->rowind);
+	sptFreeIndexVector(&mtx->colind);
+	sptFreeValueVector(&mtx->values);
+	mtx->nnz = 0;
+}
+
+
+/**
+ * Create a new sparse matrix in CSR format with room for nnz nonzeros
+ * @param mtx   a pointer to an uninitialized sparse matrix
+ * @param nrows number of rows
+ * @param ncols number of columns
+ * @param nnz   number of nonzeros
+ *
+ * rowptr has nrows + 1 zeroed entries, colind and values have length nnz.
+ */
+int sptNewSparseMatrixCSR(sptSparseMatrixCSR *mtx, sptIndex const nrows, sptIndex const ncols, sptNnzIndex const nnz) {
+	int result;
+	mtx->nrows = nrows;
+	mtx->ncols = ncols;
+	mtx->nnz = nnz;
+	mtx->rowptr.len = (sptNnzIndex)nrows + 1;
+	mtx->rowptr.cap = (sptNnzIndex)nrows + 1;
+	mtx->rowptr.data = calloc(mtx->rowptr.cap, sizeof *mtx->rowptr.data);
+	spt_CheckOSError(!mtx->rowptr.data, "SpMtx CSR New");
+	result = sptNewIndexVector(&mtx->colind, nnz, nnz);
+	spt_CheckError(result, "SpMtx CSR New", NULL);
+	result = sptNewValueVector(&mtx->values, nnz, nnz);
+	spt_CheckError(result, "SpMtx CSR New", NULL);
+	return 0;
+}
+
+
+/**
+ * Release any memory the CSR sparse matrix is holding
+ * @param mtx a pointer to a valid CSR sparse matrix
+ */
+void sptFreeSparseMatrixCSR(sptSparseMatrixCSR *mtx) {
+	free(mtx->rowptr.data);
+	sptFreeIndexVector(&mtx->colind);
+	sptFreeValueVector(&mtx->values);
+	mtx->nnz = 0;
+}
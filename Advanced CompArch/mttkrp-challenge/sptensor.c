@@ -35,9 +35,12 @@ int sptNewSparseTensor(sptSparseTensor *tsr, sptIndex nmodes, const sptIndex ndi
 	sptIndex i;
 	int result;
 	tsr->nmodes = nmodes;
+	tsr->arena = NULL;
+	tsr->pattern = false;
+	/* Not a permutation until a sort records one, nonzeros may be added in any order. */
 	tsr->sortorder = malloc(nmodes * sizeof tsr->sortorder[0]);
 	for(i = 0; i < nmodes; ++i) {
-		tsr->sortorder[i] = i;
+		tsr->sortorder[i] = nmodes;
 	}
 	tsr->ndims = malloc(nmodes * sizeof *tsr->ndims);
 //	spt_CheckOSError(!tsr->ndims, "SpTns New");
@@ -55,6 +58,255 @@ int sptNewSparseTensor(sptSparseTensor *tsr, sptIndex nmodes, const sptIndex ndi
 }
 
 
+/**
+ * The arena bytes a sparse tensor takes
+ * @param nmodes number of modes
+ * @param cap    number of nonzeros to make room for
+ */
+size_t sptSparseTensorArenaSize(sptIndex const nmodes, sptNnzIndex const cap) {
+	sptNnzIndex const c = cap > 2 ? cap : 2;
+	return 2 * sptArenaRounded(nmodes * sizeof(sptIndex)) + sptArenaRounded(nmodes * sizeof(sptIndexVector))
+			+ nmodes * sptArenaRounded(c * sizeof(sptIndex)) + sptArenaRounded(c * sizeof(sptValue));
+}
+
+
+/**
+ * Create a new sparse tensor in an arena
+ * @param tsr    a pointer to an uninitialized sparse tensor
+ * @param nmodes number of modes the tensor will have
+ * @param ndims  the dimension of each mode the tensor will have
+ * @param cap    number of nonzeros to make room for
+ * @param arena  the arena, with sptSparseTensorArenaSize(nmodes, cap) bytes free
+ *
+ * Every array of the tensor is one block of the arena, so the tensor is
+ * contiguous and freeing the arena frees it. sptFreeSparseTensor does not
+ * release the blocks. Vectors that grow past cap continue in the arena while
+ * it has room, then on the heap.
+ */
+int sptNewSparseTensorInArena(sptSparseTensor *tsr, sptIndex nmodes, const sptIndex ndims[], sptNnzIndex const cap, sptArena *arena) {
+	int result;
+	tsr->nmodes = nmodes;
+	tsr->arena = arena;
+	tsr->pattern = false;
+	tsr->sortorder = sptArenaAlloc(arena, nmodes * sizeof *tsr->sortorder);
+	tsr->ndims = sptArenaAlloc(arena, nmodes * sizeof *tsr->ndims);
+	tsr->inds = sptArenaAlloc(arena, nmodes * sizeof *tsr->inds);
+	spt_CheckOSError(!tsr->sortorder || !tsr->ndims || !tsr->inds, "SpTns New");
+	for(sptIndex i = 0; i < nmodes; ++i) {
+		tsr->sortorder[i] = nmodes;
+	}
+	memcpy(tsr->ndims, ndims, nmodes * sizeof *tsr->ndims);
+	tsr->nnz = 0;
+	for(sptIndex i = 0; i < nmodes; ++i) {
+		result = sptNewIndexVectorInArena(&tsr->inds[i], 0, cap, arena);
+		spt_CheckError(result, "SpTns New", NULL);
+	}
+	result = sptNewValueVectorInArena(&tsr->values, 0, cap, arena);
+	spt_CheckError(result, "SpTns New", NULL);
+	return 0;
+}
+
+
+/**
+ * Move a sparse tensor into an arena
+ * @param tsr   the sparse tensor, its heap arrays are released
+ * @param arena the arena, with sptSparseTensorArenaSize(nmodes, nnz) bytes free
+ *
+ * For tensors built by the loaders: afterwards the tensor is laid out as
+ * by sptNewSparseTensorInArena, with capacity nnz.
+ */
+int sptSparseTensorMoveToArena(sptSparseTensor *tsr, sptArena *arena) {
+	sptSparseTensor moved;
+	int result = sptNewSparseTensorInArena(&moved, tsr->nmodes, tsr->ndims, tsr->nnz, arena);
+	spt_CheckError(result, "SpTns Move", NULL);
+	memcpy(moved.sortorder, tsr->sortorder, tsr->nmodes * sizeof *moved.sortorder);
+	for(sptIndex i = 0; i < tsr->nmodes; ++i) {
+		memcpy(moved.inds[i].data, tsr->inds[i].data, tsr->nnz * sizeof *moved.inds[i].data);
+		moved.inds[i].len = tsr->nnz;
+	}
+	if(tsr->pattern) {
+		moved.values.data = NULL;
+		moved.values.cap = 0;
+		moved.pattern = true;
+	} else {
+		memcpy(moved.values.data, tsr->values.data, tsr->nnz * sizeof *moved.values.data);
+		moved.values.len = tsr->nnz;
+	}
+	moved.nnz = tsr->nnz;
+	sptFreeSparseTensor(tsr);
+	*tsr = moved;
+	return 0;
+}
+
+
+/**
+ * Copy a sparse tensor
+ * @param[out] dest a pointer to an uninitialized sparse tensor
+ * @param[in]  src  the tensor to copy, its sortorder is kept
+ */
+int sptCopySparseTensor(sptSparseTensor *dest, const sptSparseTensor *src) {
+	int result = sptNewSparseTensor(dest, src->nmodes, src->ndims);
+	spt_CheckError(result, "SpTns Copy", NULL);
+	memcpy(dest->sortorder, src->sortorder, src->nmodes * sizeof *dest->sortorder);
+	for(sptIndex i = 0; i < src->nmodes; ++i) {
+		result = sptResizeIndexVector(&dest->inds[i], src->nnz);
+		spt_CheckError(result, "SpTns Copy", NULL);
+		memcpy(dest->inds[i].data, src->inds[i].data, src->nnz * sizeof *dest->inds[i].data);
+	}
+	dest->nnz = src->nnz;
+	dest->pattern = src->pattern;
+	if(!src->pattern) {
+		result = sptResizeValueVector(&dest->values, src->nnz);
+		spt_CheckError(result, "SpTns Copy", NULL);
+		memcpy(dest->values.data, src->values.data, src->nnz * sizeof *dest->values.data);
+	}
+	return 0;
+}
+
+
+/**
+ * Whether every value of a sparse tensor is 1
+ * @param tsr the sparse tensor
+ *
+ * True for a pattern tensor, and for an empty one.
+ */
+int sptSparseTensorIsAllOnes(sptSparseTensor const * const tsr) {
+	if(tsr->pattern) {
+		return 1;
+	}
+	sptValue const * const vals = tsr->values.data;
+	sptNnzIndex ones = 0;
+#pragma omp parallel for schedule(static) reduction(+:ones)
+	for(sptNnzIndex x=0; x<tsr->nnz; ++x) {
+		ones += vals[x] == 1;
+	}
+	return ones == tsr->nnz;
+}
+
+
+/**
+ * Make a sparse tensor pattern-only, releasing its values
+ * @param tsr the sparse tensor, every value must be 1
+ *
+ * A pattern tensor keeps only its coordinates, a quarter less memory for a
+ * third-order tensor. sptMTTKRP, sptOmpMTTKRP, the plan, stealing and
+ * segmented kernels take it, with the value load and multiply dropped; the
+ * other kernels fail on it until sptSparseTensorRestoreValues.
+ */
+int sptSparseTensorDropValues(sptSparseTensor *tsr) {
+	if(tsr->pattern) {
+		return 0;
+	}
+	if(!sptSparseTensorIsAllOnes(tsr)) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "SpTns Drop Values", "a value is not 1");
+	}
+	sptFreeValueVector(&tsr->values);
+	tsr->values.data = NULL;
+	tsr->pattern = true;
+	return 0;
+}
+
+
+/**
+ * Give a pattern-only sparse tensor its values back, all 1
+ * @param tsr the sparse tensor, left as is unless pattern-only
+ */
+int sptSparseTensorRestoreValues(sptSparseTensor *tsr) {
+	if(!tsr->pattern) {
+		return 0;
+	}
+	int result = sptNewValueVector(&tsr->values, tsr->nnz, tsr->nnz);
+	spt_CheckError(result, "SpTns Restore Values", NULL);
+	sptValue * const vals = tsr->values.data;
+#pragma omp parallel for schedule(static)
+	for(sptNnzIndex x=0; x<tsr->nnz; ++x) {
+		vals[x] = 1;
+	}
+	tsr->pattern = false;
+	return 0;
+}
+
+
+/**
+ * Reserve space for nonzeros in a sparse tensor
+ * @param tsr the sparse tensor
+ * @param cap the number of nonzeros to make room for
+ *
+ * Every index vector and the value vector grow to at least cap, the
+ * nonzeros are kept.
+ */
+int sptSparseTensorReserve(sptSparseTensor *tsr, sptNnzIndex const cap) {
+	int result;
+	for(sptIndex i = 0; i < tsr->nmodes; ++i) {
+		result = sptReserveIndexVector(&tsr->inds[i], cap);
+		spt_CheckError(result, "SpTns Reserve", NULL);
+	}
+	result = sptReserveValueVector(&tsr->values, cap);
+	spt_CheckError(result, "SpTns Reserve", NULL);
+	return 0;
+}
+
+
+/**
+ * Append the nonzeros of another sparse tensor
+ * @param tsr   the sparse tensor to grow
+ * @param delta the nonzeros to append, with the same nmodes and ndims
+ *
+ * Storage grows geometrically, by at least half of the current capacity,
+ * so a sequence of small batches reallocates each array O(log nnz) times.
+ * A coordinate may repeat an existing one, e.g. to record a changed value
+ * as the difference; the sort order is marked unknown.
+ */
+int sptSparseTensorAppend(sptSparseTensor *tsr, const sptSparseTensor *delta) {
+	if(delta->nmodes != tsr->nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns Append", "delta->nmodes != tsr->nmodes");
+	}
+	if(tsr->pattern || delta->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "SpTns Append", "pattern-only tensor, restore its values first");
+	}
+	for(sptIndex i = 0; i < tsr->nmodes; ++i) {
+		if(delta->ndims[i] != tsr->ndims[i]) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns Append", "delta->ndims[i] != tsr->ndims[i]");
+		}
+	}
+	if(delta->nnz == 0) {
+		return 0;
+	}
+
+	sptNnzIndex const nnz = tsr->nnz + delta->nnz;
+	if(nnz > tsr->values.cap) {
+		sptNnzIndex const grown = tsr->values.cap + tsr->values.cap / 2;
+		int result = sptSparseTensorReserve(tsr, nnz > grown ? nnz : grown);
+		spt_CheckError(result, "SpTns Append", NULL);
+	}
+	for(sptIndex i = 0; i < tsr->nmodes; ++i) {
+		memcpy(tsr->inds[i].data + tsr->nnz, delta->inds[i].data, delta->nnz * sizeof *tsr->inds[i].data);
+		tsr->inds[i].len = nnz;
+		tsr->sortorder[i] = tsr->nmodes;
+	}
+	memcpy(tsr->values.data + tsr->nnz, delta->values.data, delta->nnz * sizeof *tsr->values.data);
+	tsr->values.len = nnz;
+	tsr->nnz = nnz;
+	return 0;
+}
+
+
+/**
+ * The bytes a sparse tensor holds
+ * @param tsr a valid sparse tensor
+ *
+ * Counts the allocated capacity of every array, not just nnz, so a tensor
+ * grown by appends reports what it actually occupies.
+ */
+size_t sptSparseTensorBytes(sptSparseTensor const *tsr) {
+	size_t bytes = 2 * tsr->nmodes * sizeof(sptIndex) + tsr->nmodes * sizeof(sptIndexVector);
+	for(sptIndex m=0; m < tsr->nmodes; ++m) {
+		bytes += tsr->inds[m].cap * sizeof *tsr->inds[m].data;
+	}
+	return bytes + tsr->values.cap * sizeof *tsr->values.data;
+}
+
+
 /**
  * Release any memory the sparse tensor is holding
  * @param tsr the tensor to release
@@ -64,11 +316,77 @@ void sptFreeSparseTensor(sptSparseTensor *tsr) {
 	for(i = 0; i < tsr->nmodes; ++i) {
 		sptFreeIndexVector(&tsr->inds[i]);
 	}
-	free(tsr->sortorder);
-	free(tsr->ndims);
-	free(tsr->inds);
+	if(tsr->arena == NULL) {
+		free(tsr->sortorder);
+		free(tsr->ndims);
+		free(tsr->inds);
+	}
 	sptFreeValueVector(&tsr->values);
 	tsr->nmodes = 0;
 }
 
 
+
+/**
+ * Check the dense matrices given to an MTTKRP kernel
+ * @param mats    (N+1) dense matrices, mats[nmodes] receives the result
+ * @param nmodes  the order of the tensor
+ * @param ndims   the tensor's dimensions, or NULL if the caller checks the row counts itself
+ * @param mode    the mode on which the MTTKRP is performed
+ * @param module  the name errors are reported under
+ *
+ * Every matrix is row-major with the columns and stride of mats[nmodes];
+ * mats[i] has ndims[i] rows and mats[nmodes] at least ndims[mode].
+ */
+int spt_CheckMTTKRPMats(
+		sptMatrix * const mats[],
+		sptIndex const nmodes,
+		sptIndex const ndims[],
+		sptIndex const mode,
+		char const * const module)
+{
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, module, "mode >= nmodes");
+	}
+	for(sptIndex i=0; i<nmodes; ++i) {
+		if(mats[i]->ncols != mats[nmodes]->ncols) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, module, "mats[i]->cols != mats[nmodes]->ncols");
+		}
+		if(ndims != NULL && mats[i]->nrows != ndims[i]) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, module, "mats[i]->nrows != ndims[i]");
+		}
+		if(mats[i]->layout != SPT_LAYOUT_ROW_MAJOR || mats[nmodes]->layout != SPT_LAYOUT_ROW_MAJOR) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, module, "the matrices are not row-major");
+		}
+		if(mats[i]->stride != mats[nmodes]->stride) {
+			spt_CheckError(SPTERR_SHAPE_MISMATCH, module, "mats[i]->stride != mats[nmodes]->stride");
+		}
+	}
+	if(ndims != NULL && mats[nmodes]->nrows < ndims[mode]) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, module, "mats[nmodes]->nrows < ndims[mode]");
+	}
+	return 0;
+}
+
+
+/**
+ * Count the nonzeros in every slice of a sparse tensor
+ * @param slice_nnzs the output array, length ndims[mode], allocated by the caller
+ * @param tsr        the sparse tensor
+ * @param mode       the mode whose slices are counted
+ */
+int spt_ComputeSliceSizes(
+		sptNnzIndex * slice_nnzs,
+		sptSparseTensor * const tsr,
+		sptIndex const mode)
+{
+	if(mode >= tsr->nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns SliceSizes", "mode >= nmodes");
+	}
+	sptIndex const * const mode_ind = tsr->inds[mode].data;
+	memset(slice_nnzs, 0, tsr->ndims[mode] * sizeof *slice_nnzs);
+	for(sptNnzIndex x=0; x < tsr->nnz; ++x) {
+		++slice_nnzs[mode_ind[x]];
+	}
+	return 0;
+}
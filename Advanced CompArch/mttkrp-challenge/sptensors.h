@@ -23,6 +23,28 @@
 
 /* Sparse tensor */
 int sptNewSparseTensor(sptSparseTensor *tsr, sptIndex nmodes, const sptIndex ndims[]);
+int sptNewSparseTensorInArena(sptSparseTensor *tsr, sptIndex nmodes, const sptIndex ndims[], sptNnzIndex const cap, sptArena *arena);
+size_t sptSparseTensorArenaSize(sptIndex const nmodes, sptNnzIndex const cap);
+int sptSparseTensorMoveToArena(sptSparseTensor *tsr, sptArena *arena);
+int sptSharedStorePublish(
+		sptSharedStore * const store,
+		char const * const name,
+		sptSparseTensor const * const X,
+		sptMatrix * const mats[],
+		sptIndex const nmats);
+int sptSharedStoreAttach(sptSharedStore * const store, char const * const name);
+int sptSharedStoreIsCurrent(sptSharedStore const * const store);
+int64_t sptSharedStoreRefCount(sptSharedStore const * const store);
+void sptSharedStoreDetach(sptSharedStore * const store);
+int sptSharedStoreUnpublish(char const * const name, int const force);
+void sptSharedStoreStatus(sptSharedStore const * const store, FILE *fp);
+size_t sptSparseTensorBytes(sptSparseTensor const *tsr);
+int sptCopySparseTensor(sptSparseTensor *dest, const sptSparseTensor *src);
+int sptSparseTensorReserve(sptSparseTensor *tsr, sptNnzIndex const cap);
+int sptSparseTensorAppend(sptSparseTensor *tsr, const sptSparseTensor *delta);
+int sptSparseTensorIsAllOnes(sptSparseTensor const * const tsr);
+int sptSparseTensorDropValues(sptSparseTensor *tsr);
+int sptSparseTensorRestoreValues(sptSparseTensor *tsr);
 
 void sptFreeSparseTensor(sptSparseTensor *tsr);
 
@@ -33,13 +55,25 @@ int sptMatricize(sptSparseTensor const * const X,
 								 sptIndex const m,
 								 sptSparseMatrix * const A,
 								 int const transpose);
+int sptMatricizeCSR(
+		sptSparseTensor const * const X,
+		sptIndex const mode,
+		sptIndex const col_order[],
+		sptSparseMatrixCSR * const A,
+		sptIndexVector * const col_inds);
 
 void sptSparseTensorCalcIndexBounds(sptIndex inds_low[], sptIndex inds_high[], const sptSparseTensor *tsr);
 int spt_ComputeSliceSizes(
 		sptNnzIndex * slice_nnzs,
 		sptSparseTensor * const tsr,
 		sptIndex const mode);
+int sptSparseTensorSortByMode(sptSparseTensor *tsr, sptIndex const mode);
+int sptSparseTensorSortByOrder(sptSparseTensor *tsr, sptIndex const order[]);
+int sptSparseTensorIsSortedByOrder(sptSparseTensor const *tsr, sptIndex const order[]);
+int spt_SortOrderKnown(sptSparseTensor const * const tsr);
+int sptSparseTensorCoalesce(sptSparseTensor *tsr, sptNnzIndex * const ndups, sptNnzIndex * const nzeros);
 void sptSparseTensorStatus(sptSparseTensor *tsr, FILE *fp);
+void sptSparseTensorSliceHistogram(sptSparseTensor *tsr, FILE *fp);
 double sptSparseTensorDensity(sptSparseTensor const * const tsr);
 int sptSparseTensorSetFibers(
 		sptNnzIndexVector *fiberidx,
@@ -53,6 +87,10 @@ int sptSparseTensorSetIndices(
 		sptSparseTensor *ref
 );
 
+/* Semi-sparse tensor */
+int sptNewSemiSparseTensor(sptSemiSparseTensor *tsr, sptIndex nmodes, sptIndex mode, const sptIndex ndims[]);
+void sptFreeSemiSparseTensor(sptSemiSparseTensor *tsr);
+
 
 int sptDumpSparseTensorHiCOO(sptSparseTensorHiCOO * const hitsr, FILE *fp);
 int sptSparseTensorSetIndicesHiCOO(
@@ -123,6 +161,24 @@ int sptCudaSparseTensorDotDivEqHiCOO(sptSparseTensorHiCOO *Z, const sptSparseTen
 
 int sptSparseTensorMulMatrix(sptSemiSparseTensor *Y, sptSparseTensor *X, const sptMatrix *U, sptIndex const mode);
 int sptOmpSparseTensorMulMatrix(sptSemiSparseTensor *Y, sptSparseTensor *X, const sptMatrix *U, sptIndex const mode);
+int sptSparseTensorMulMatrixPrepare(
+		sptSemiSparseTensor *Y,
+		sptNnzIndexVector *fiberidx,
+		sptSparseTensor *X,
+		const sptMatrix *U,
+		sptIndex const mode);
+int sptSparseTensorMulMatrixFill(
+		sptSemiSparseTensor *Y,
+		sptNnzIndexVector const *fiberidx,
+		sptSparseTensor const *X,
+		const sptMatrix *U,
+		sptIndex const mode);
+int sptOmpSparseTensorMulMatrixFill(
+		sptSemiSparseTensor *Y,
+		sptNnzIndexVector const *fiberidx,
+		sptSparseTensor const *X,
+		const sptMatrix *U,
+		sptIndex const mode);
 int sptCudaSparseTensorMulMatrix(
 		sptSemiSparseTensor *Y,
 		sptSparseTensor *X,
@@ -174,6 +230,12 @@ int sptSparseTensorKhatriRaoMul(sptSparseTensor *Y, const sptSparseTensor *A, co
 /**
  * Matricized tensor times Khatri-Rao product.
  */
+int spt_CheckMTTKRPMats(
+		sptMatrix * const mats[],
+		sptIndex const nmodes,
+		sptIndex const ndims[],
+		sptIndex const mode,
+		char const * const module);
 int sptMTTKRP(
 		sptSparseTensor const * const X,
 		sptMatrix * mats[],     // mats[nmodes] as temporary space.
@@ -185,6 +247,308 @@ int sptOmpMTTKRP(
 		sptIndex const mats_order[],    // Correspond to the mode order of X.
 		sptIndex const mode,
 		const int tk);
+
+/*
+ * COO nonzeros [begin, end) of X added into mats[nmodes], atomically if
+ * several threads share it; row holds one Khatri-Rao row. With pattern the
+ * values are all 1 and never read, and the multiply by 1 folds away. Callers
+ * pass pattern, and nmodes where they can, as constants; orders 3 and 4 fuse
+ * the product into the output row when no atomics are needed.
+ */
+static inline void spt_MTTKRPCooRange(
+		sptSparseTensor const * const X,
+		sptIndex const nmodes,
+		sptMatrix * const mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict row,
+		int const pattern,
+		int const atomic)
+{
+	sptIndex const R = mats[nmodes]->ncols;
+	sptIndex const stride = mats[nmodes]->stride;
+	sptValue * const restrict mvals = mats[nmodes]->values;
+	sptValue const * const restrict vals = pattern ? NULL : X->values.data;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+	sptIndex const * const restrict inds_1 = X->inds[mats_order[1]].data;
+	sptValue const * const restrict mat_1 = mats[mats_order[1]]->values;
+
+	for(sptNnzIndex x=begin; x<end; ++x) {
+		sptValue * const restrict mvals_row = mvals + (size_t)mode_ind[x] * stride;
+		sptValue const * const restrict a = mat_1 + (size_t)inds_1[x] * stride;
+		sptValue const c = pattern ? 1 : vals[x];
+		if((nmodes == 3 || nmodes == 4) && !atomic) {
+			sptValue const * const restrict b = mats[mats_order[2]]->values + (size_t)X->inds[mats_order[2]].data[x] * stride;
+			if(nmodes == 3) {
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] += c * a[r] * b[r];
+				}
+			} else {
+				sptValue const * const restrict d = mats[mats_order[3]]->values + (size_t)X->inds[mats_order[3]].data[x] * stride;
+#pragma omp simd
+				for(sptIndex r=0; r<R; ++r) {
+					mvals_row[r] += c * a[r] * b[r] * d[r];
+				}
+			}
+			continue;
+		}
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			row[r] = c * a[r];
+		}
+		for(sptIndex i=2; i<nmodes; ++i) {
+			sptValue const * const restrict times_row = mats[mats_order[i]]->values + (size_t)X->inds[mats_order[i]].data[x] * stride;
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				row[r] *= times_row[r];
+			}
+		}
+		if(atomic) {
+			for(sptIndex r=0; r<R; ++r) {
+#pragma omp atomic update
+				mvals_row[r] += row[r];
+			}
+		} else {
+#pragma omp simd
+			for(sptIndex r=0; r<R; ++r) {
+				mvals_row[r] += row[r];
+			}
+		}
+	}
+}
+
+int sptOmpMTTKRPProfile(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],     // mats[nmodes] as temporary space.
+		sptIndex const mats_order[],    // Correspond to the mode order of X.
+		sptIndex const mode,
+		const int tk,
+		sptMTTKRPProfile * const prof);
+void sptMTTKRPProfileStatus(sptMTTKRPProfile const * const prof, FILE *fp);
+void sptFreeMTTKRPProfile(sptMTTKRPProfile *prof);
+int sptNewMTTKRPPlan(
+		sptMTTKRPPlan * const plan,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const nthreads,
+		sptMTTKRPStrategy const strategy);
+int sptMTTKRPExecute(sptMTTKRPPlan const * const plan, sptMatrix * mats[]);
+void sptFreeMTTKRPPlan(sptMTTKRPPlan *plan);
+int spt_NewMTTKRPStealing(sptMTTKRPPlan * const plan);
+int spt_MTTKRPExecuteStealing(sptMTTKRPPlan const * const plan, sptMatrix * mats[]);
+void spt_FreeMTTKRPStealing(sptMTTKRPPlan * const plan);
+size_t spt_MTTKRPStealingBytes(sptIndex const nrows, sptNnzIndex const nnz, int const permuted, int const nthreads);
+size_t sptMTTKRPPlanFootprint(
+		sptSparseTensor const * const X,
+		sptIndex const stride,
+		sptIndex const mode,
+		int const nthreads,
+		sptMTTKRPStrategy const strategy);
+size_t sptMTTKRPPlanBytes(sptMTTKRPPlan const * const plan);
+size_t sptMTTKRPPlanArenaSize(sptMTTKRPPlan const * const plan);
+int sptMTTKRPPlanMoveToArena(sptMTTKRPPlan * const plan, sptArena * const arena);
+int sptMTTKRPChooseForBudget(
+		sptMTTKRPBudget * const choice,
+		sptSparseTensor const * const X,
+		sptIndex const stride,
+		sptIndex const mode,
+		int const nthreads,
+		size_t const budget,
+		FILE *fp);
+int sptNewMTTKRPNuma(
+		sptMTTKRPNuma * const numa,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mode,
+		int const nthreads);
+int sptMTTKRPNumaReplicate(sptMTTKRPNuma * const numa, sptMatrix * mats[]);
+int sptMTTKRPNumaExecute(sptMTTKRPNuma * const numa, sptIndex const mats_order[], sptMatrix * mats[]);
+int sptMTTKRPNumaCompare(sptMTTKRPNuma * const numa, sptIndex const mats_order[], sptMatrix * mats[], int const niters);
+void sptMTTKRPNumaStatus(sptMTTKRPNuma const * const numa, FILE *fp);
+void sptFreeMTTKRPNuma(sptMTTKRPNuma *numa);
+size_t sptMTTKRPNumaBytes(sptMTTKRPNuma const * const numa);
+int sptMTTKRPRankTile(sptIndex * const tile, sptNnzIndex * const block, sptIndex const nmodes, sptIndex const R);
+int sptMTTKRPRankTiled(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex tile,
+		sptNnzIndex block);
+int sptOmpMTTKRPRankTiled(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex tile,
+		sptNnzIndex block,
+		int const tk);
+int sptNewSparseTensorTiled(
+		sptSparseTensorTiled * const tiled,
+		sptSparseTensor const * const X,
+		sptIndex const mode,
+		sptIndex const R,
+		size_t cache_bytes);
+void sptFreeSparseTensorTiled(sptSparseTensorTiled *tiled);
+size_t sptSparseTensorTiledBytes(sptSparseTensorTiled const * const tiled);
+size_t sptSparseTensorTiledArenaSize(sptSparseTensorTiled const * const tiled);
+int sptSparseTensorTiledMoveToArena(sptSparseTensorTiled * const tiled, sptArena * const arena);
+void sptSparseTensorTiledStatus(sptSparseTensorTiled const * const tiled, FILE *fp);
+int sptMTTKRPTiled(
+		sptSparseTensorTiled const * const tiled,
+		sptMatrix * mats[],
+		sptIndex const mats_order[]);
+int sptOmpMTTKRPTiled(
+		sptSparseTensorTiled const * const tiled,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		int const tk);
+int sptMTTKRPPrefetch(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const dist);
+int sptOmpMTTKRPPrefetch(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const dist,
+		int const tk);
+int sptMTTKRPPrefetchTune(
+		sptIndex * const dist,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk,
+		FILE *fp);
+int sptMTTKRPSegmented(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode);
+int sptOmpMTTKRPSegmented(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk);
+int sptNewSparseTensorPacked(sptSparseTensorPacked * const packed, sptSparseTensor const * const X);
+void sptFreeSparseTensorPacked(sptSparseTensorPacked *packed);
+size_t sptSparseTensorPackedFootprint(sptSparseTensor const * const X);
+size_t sptSparseTensorPackedBytes(sptSparseTensorPacked const * const packed);
+size_t sptSparseTensorPackedArenaSize(sptSparseTensorPacked const * const packed);
+int sptSparseTensorPackedMoveToArena(sptSparseTensorPacked * const packed, sptArena * const arena);
+void sptSparseTensorPackedStatus(sptSparseTensorPacked const * const packed, FILE *fp);
+int sptMTTKRPPacked(
+		sptSparseTensorPacked const * const packed,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode);
+int sptOmpMTTKRPPacked(
+		sptSparseTensorPacked const * const packed,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk);
+int sptMTTKRPPattern(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode);
+int sptOmpMTTKRPPattern(
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk);
+int sptNewSparseTensorHybrid(
+		sptSparseTensorHybrid * const hyb,
+		sptSparseTensor const * const X,
+		sptIndex const slice_mode,
+		double const threshold);
+void sptFreeSparseTensorHybrid(sptSparseTensorHybrid *hyb);
+size_t sptSparseTensorHybridBytes(sptSparseTensorHybrid const * const hyb);
+size_t sptSparseTensorHybridArenaSize(sptSparseTensorHybrid const * const hyb);
+int sptSparseTensorHybridMoveToArena(sptSparseTensorHybrid * const hyb, sptArena * const arena);
+void sptSparseTensorHybridStatus(sptSparseTensorHybrid const * const hyb, FILE *fp);
+int sptMTTKRPHybrid(
+		sptSparseTensorHybrid const * const hyb,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode);
+int sptOmpMTTKRPHybrid(
+		sptSparseTensorHybrid const * const hyb,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk);
+int sptLoadSparseTensorBatch(sptSparseTensorBatch * const batch, char const * const manifest);
+void sptFreeSparseTensorBatch(sptSparseTensorBatch *batch);
+int sptMTTKRPBatch(
+		double * const checksums,
+		double * const elapsed,
+		sptSparseTensorBatch const * const batch,
+		sptIndex const R,
+		sptIndex const mode,
+		int const tk,
+		int const niters);
+int sptMTTKRPBatchFactor(sptMatrix * const mtx, sptIndex const m);
+int sptNewMTTKRPSpMM(
+		sptMTTKRPSpMM * const spmm,
+		sptSparseTensor const * const X,
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		sptIndex const R,
+		sptIndex const block_cols);
+void sptFreeMTTKRPSpMM(sptMTTKRPSpMM *spmm);
+size_t sptMTTKRPSpMMBytes(sptMTTKRPSpMM const * const spmm);
+size_t sptMTTKRPSpMMArenaSize(sptMTTKRPSpMM const * const spmm);
+int sptMTTKRPSpMMMoveToArena(sptMTTKRPSpMM * const spmm, sptArena * const arena);
+void sptMTTKRPSpMMStatus(sptMTTKRPSpMM const * const spmm, FILE *fp);
+int sptMTTKRPSpMMExecute(
+		sptMTTKRPSpMM const * const spmm,
+		sptMatrix * mats[]);
+int sptOmpMTTKRPSpMMExecute(
+		sptMTTKRPSpMM const * const spmm,
+		sptMatrix * mats[],
+		int const tk);
+int sptMTTKRPDelta(
+		sptSparseTensor const * const delta,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode);
+int sptOmpMTTKRPDelta(
+		sptSparseTensor const * const delta,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptIndex const mode,
+		int const tk);
+int sptNewMTTKRPSampler(
+		sptMTTKRPSampler * const sampler,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mode,
+		sptSampleWeighting const weighting);
+void sptFreeMTTKRPSampler(sptMTTKRPSampler *sampler);
+size_t sptMTTKRPSamplerBytes(sptMTTKRPSampler const * const sampler, sptSparseTensor const * const X);
+int sptMTTKRPSampled(
+		double * const variance,
+		sptMTTKRPSampler const * const sampler,
+		sptSparseTensor const * const X,
+		sptMatrix * mats[],
+		sptIndex const mats_order[],
+		sptNnzIndex const nsamples,
+		uint64_t const seed,
+		int const tk);
+int sptCheckMTTKRP(int const nthreads, FILE *fp);
 int sptCudaMTTKRP(
 		sptSparseTensor const * const X,
 		sptMatrix ** const mats,     // mats[nmodes] as temporary space.
@@ -0,0 +1,71 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+#include "matricies.h"
+
+/**
+ * Create a new semi-sparse tensor with no fibers
+ * @param tsr    a pointer to an uninitialized semi-sparse tensor
+ * @param nmodes number of modes the tensor will have
+ * @param mode   the mode stored densely
+ * @param ndims  the dimension of each mode the tensor will have
+ */
+int sptNewSemiSparseTensor(sptSemiSparseTensor *tsr, sptIndex nmodes, sptIndex mode, const sptIndex ndims[]) {
+	int result;
+	if(nmodes < 2) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SspTns New", "nmodes < 2");
+	}
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SspTns New", "mode >= nmodes");
+	}
+	tsr->nmodes = nmodes;
+	tsr->ndims = malloc(nmodes * sizeof *tsr->ndims);
+	spt_CheckOSError(!tsr->ndims, "SspTns New");
+	memcpy(tsr->ndims, ndims, nmodes * sizeof *tsr->ndims);
+	tsr->mode = mode;
+	tsr->nnz = 0;
+	tsr->inds = malloc(nmodes * sizeof *tsr->inds);
+	spt_CheckOSError(!tsr->inds, "SspTns New");
+	for(sptIndex i = 0; i < nmodes; ++i) {
+		result = sptNewIndexVector(&tsr->inds[i], 0, 0);
+		spt_CheckError(result, "SspTns New", NULL);
+	}
+	result = sptNewMatrix(&tsr->values, 0, ndims[mode]);
+	spt_CheckError(result, "SspTns New", NULL);
+	return 0;
+}
+
+
+/**
+ * Release any memory the semi-sparse tensor is holding
+ * @param tsr the tensor to release
+ */
+void sptFreeSemiSparseTensor(sptSemiSparseTensor *tsr) {
+	for(sptIndex i = 0; i < tsr->nmodes; ++i) {
+		sptFreeIndexVector(&tsr->inds[i]);
+	}
+	free(tsr->ndims);
+	free(tsr->inds);
+	sptFreeMatrix(&tsr->values);
+	tsr->nmodes = 0;
+}
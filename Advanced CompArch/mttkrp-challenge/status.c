@@ -19,6 +19,7 @@
 //#include <pasta.h>
 #include "helper_funcs.h"
 #include "structs.h"
+#include "sptensors.h"
 #include <math.h>
 #include <bits/types/FILE.h>
 #include <stdio.h>
@@ -53,8 +54,61 @@ void sptSparseTensorStatus(sptSparseTensor *tsr, FILE *fp)
 	}
 	fprintf(fp, "%.2lf\n", (double)tsr->nnz / tsr->ndims[tsr->nmodes-1]);
 
-	char * bytestr = sptBytesString(tsr->nnz * (sizeof(sptIndex) * tsr->nmodes + sizeof(sptValue)));
-	fprintf(fp, "COO-STORAGE = %s\n", bytestr);
+	char * bytestr = sptBytesString(tsr->nnz * (sizeof(sptIndex) * tsr->nmodes + (tsr->pattern ? 0 : sizeof(sptValue))));
+	char * residentstr = sptBytesString(sptSparseTensorBytes(tsr));
+	fprintf(fp, "COO-STORAGE = %s, RESIDENT = %s%s\n", bytestr, residentstr, tsr->pattern ? ", PATTERN-ONLY" : "");
 	fprintf(fp, "\n");
 	free(bytestr);
+	free(residentstr);
+}
+
+
+/**
+ * Print a log2-bucketed histogram of the slice sizes of every mode
+ * @param tsr the sparse tensor
+ * @param fp  the file to print to
+ *
+ * Bucket b counts the slices holding [2^(b-1), 2^b) nonzeros, bucket 0 the
+ * empty slices. A heavy right tail means nonzero partitions by slice will be
+ * skewed regardless of the scheduler.
+ */
+void sptSparseTensorSliceHistogram(sptSparseTensor *tsr, FILE *fp)
+{
+	fprintf(fp, "Slice size histogram (log2 buckets)---------\n");
+	for(sptIndex m=0; m < tsr->nmodes; ++m) {
+		sptIndex const nslices = tsr->ndims[m];
+		sptNnzIndex * slice_nnzs = malloc(nslices * sizeof *slice_nnzs);
+		if(slice_nnzs == NULL || spt_ComputeSliceSizes(slice_nnzs, tsr, m) != 0) {
+			free(slice_nnzs);
+			return;
+		}
+		sptNnzIndex buckets[65] = {0};
+		sptNnzIndex max_nnz = 0;
+		int nbuckets = 1;
+		for(sptIndex s=0; s < nslices; ++s) {
+			int b = 0;
+			for(sptNnzIndex n = slice_nnzs[s]; n != 0; n >>= 1) {
+				++b;
+			}
+			++buckets[b];
+			if(b + 1 > nbuckets) {
+				nbuckets = b + 1;
+			}
+			if(slice_nnzs[s] > max_nnz) {
+				max_nnz = slice_nnzs[s];
+			}
+		}
+		fprintf(fp, "Mode %"PASTA_PRI_INDEX ": MAX = %"PASTA_PRI_NNZ_INDEX " AVG = %.2lf\n",
+						m, max_nnz, (double)tsr->nnz / nslices);
+		fprintf(fp, "  [0]: %"PASTA_PRI_NNZ_INDEX "\n", buckets[0]);
+		for(int b=1; b < nbuckets; ++b) {
+			if(buckets[b] == 0) {
+				continue;
+			}
+			fprintf(fp, "  [%"PASTA_PRI_NNZ_INDEX ", %"PASTA_PRI_NNZ_INDEX "): %"PASTA_PRI_NNZ_INDEX "\n",
+							(sptNnzIndex)1 << (b-1), (sptNnzIndex)1 << b, buckets[b]);
+		}
+		free(slice_nnzs);
+	}
+	fprintf(fp, "\n");
 }
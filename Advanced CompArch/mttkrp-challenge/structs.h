@@ -21,9 +21,26 @@
 
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sched.h>
 #include <omp.h>
 #include "types.h"
 
+/**
+ * Region allocator: one aligned block, handed out by bumping an offset and
+ * released as a whole
+ */
+typedef struct {
+		char * base;    /// start of the block
+		size_t size;    /// bytes in the block
+		size_t used;    /// bytes handed out, a multiple of SPT_ARENA_ALIGN
+		int flags;      /// the SPT_ARENA_* flags the block was made with
+} sptArena;
+
+#define SPT_ARENA_ALIGN 64
+#define SPT_ARENA_HUGE_PAGES 1  /// back with transparent huge pages
+#define SPT_ARENA_LOCKED 2      /// pin in memory with mlock
+
 /**
  * Dense dynamic array of specified type of scalars
  */
@@ -31,6 +48,7 @@ typedef struct {
 		sptNnzIndex    len;   /// length
 		sptNnzIndex    cap;   /// capacity
 		sptValue    *data; /// data
+		sptArena    *arena; /// the arena data lives in, NULL if malloc'd
 } sptValueVector;
 
 /**
@@ -40,6 +58,7 @@ typedef struct {
 		sptNnzIndex len;   /// length
 		sptNnzIndex cap;   /// capacity
 		sptIndex *data; /// data
+		sptArena *arena; /// the arena data lives in, NULL if malloc'd
 } sptIndexVector;
 
 typedef struct {
@@ -61,15 +80,43 @@ typedef struct {
 } sptNnzIndexVector;
 
 
+/**
+ * What row strides of a dense matrix are rounded up to
+ */
+typedef enum {
+		SPT_PAD_VECTOR = 0,      /// 8 values, one AVX register of floats
+		SPT_PAD_NONE = 1,        /// no padding
+		SPT_PAD_CACHE_LINE = 2,  /// 16 values, one 64-byte line
+} sptMatrixPadding;
+
+/**
+ * How the values of a dense matrix are laid out
+ */
+typedef enum {
+		SPT_LAYOUT_ROW_MAJOR = 0,  /// one row after another
+		SPT_LAYOUT_COL_MAJOR = 1,  /// one column after another
+		SPT_LAYOUT_PANELS = 2,     /// row-major blocks of `panel` columns, one after another
+} sptMatrixLayout;
+
 /**
  * Dense matrix type
+ *
+ * Row-major: (i, j) is values[i*stride + j]. Otherwise the columns are cut
+ * into panels of `panel` columns, each a row-major block of cap rows, and
+ * (i, j) is values[(j/panel)*panel_size + i*stride + j%panel]; column-major
+ * is panels of one column.
  */
 typedef struct {
 		sptIndex nrows;   /// # rows
 		sptIndex ncols;   /// # columns
 		sptIndex cap;     /// # of allocated rows
-		sptIndex stride;  /// ncols rounded up to 8
-		sptValue *values; /// values, length cap*stride
+		sptIndex stride;  /// distance between rows, ncols (or panel) rounded up by the padding
+		sptValue *values; /// values, length cap*stride, or panel_size per panel
+		sptArena *arena;  /// the arena values live in, NULL if malloc'd
+		sptMatrixPadding padding;  /// what stride and panel_size are rounded up to
+		sptMatrixLayout layout;    /// row-major, column-major or panels
+		sptIndex panel;            /// columns per panel, ncols if row-major
+		size_t panel_size;         /// values between panels, cap*stride rounded up by the padding
 } sptMatrix;
 
 
@@ -115,11 +162,13 @@ typedef struct {
  */
 typedef struct {
 		sptIndex nmodes;      /// # modes
-		sptIndex * sortorder;  /// the order in which the indices are sorted
+		sptIndex * sortorder;  /// the order in which the indices are sorted, or all nmodes if unknown
 		sptIndex * ndims;      /// size of each mode, length nmodes
 		sptNnzIndex nnz;         /// # non-zeros
 		sptIndexVector * inds;       /// indices of each element, length [nmodes][nnz]
-		sptValueVector values;      /// non-zero values, length nnz
+		sptValueVector values;      /// non-zero values, length nnz, or empty if pattern
+		sptArena * arena;      /// the arena sortorder, ndims and inds live in, NULL if malloc'd
+		bool pattern;          /// every value is 1 and not stored (sptSparseTensorDropValues)
 } sptSparseTensor;
 
 
@@ -247,6 +296,245 @@ typedef struct {
 		sptRankMatrix ** factors;
 } sptRankKruskalTensor;
 
+/**
+ * Per-thread load balance and write-conflict statistics of a parallel MTTKRP
+ */
+typedef struct {
+		int nthreads;              /// # threads profiled
+		sptIndex nrows;            /// # output rows, ndims[mode]
+		sptNnzIndex *nnzs;         /// nonzeros processed by each thread, length nthreads
+		sptIndex *rows;            /// distinct output rows touched by each thread, length nthreads
+		double *busy;              /// seconds each thread spent on its nonzeros, length nthreads
+		double *idle;              /// seconds each thread waited at the closing barrier, length nthreads
+		sptIndex shared_rows;      /// output rows written by more than one thread
+		sptNnzIndex shared_nnzs;   /// nonzeros whose output row is shared
+		double elapsed;            /// wall time of the whole parallel region
+} sptMTTKRPProfile;
+
+/**
+ * How a parallel MTTKRP resolves concurrent updates of an output row
+ */
+typedef enum {
+		SPT_MTTKRP_AUTO       = 0,  /// choose at plan time
+		SPT_MTTKRP_ATOMIC     = 1,  /// atomic updates of the shared output
+		SPT_MTTKRP_PRIVATIZED = 2,  /// one output copy per thread, reduced at the end
+		SPT_MTTKRP_STEALING   = 3,  /// tasks own disjoint output rows, balanced by work stealing
+} sptMTTKRPStrategy;
+
+/**
+ * Per-thread work-stealing deque of MTTKRP tasks, opaque
+ */
+typedef struct sptTagTaskDeque sptTaskDeque;
+
+/**
+ * Reusable MTTKRP execution plan
+ * Everything derived from the tensor, mode and rank is computed and allocated
+ * once by sptNewMTTKRPPlan, so sptMTTKRPExecute does no allocation.
+ */
+typedef struct {
+		sptSparseTensor const * X;   /// the planned tensor, not owned
+		sptIndex nmodes;             /// # modes of X
+		sptIndex mode;               /// the mode MTTKRP is performed on
+		sptIndex R;                  /// rank, # columns of the factors
+		sptIndex stride;             /// row stride of the factors and output
+		sptIndex nrows;              /// # output rows, ndims[mode]
+		sptIndex * mats_order;       /// the order of the Khatri-Rao products, length nmodes
+		int nthreads;                /// # threads
+		sptMTTKRPStrategy strategy;  /// resolved, never SPT_MTTKRP_AUTO
+		sptNnzIndex * part;          /// nonzero range of each thread, length nthreads+1
+		sptValue * scratch;          /// Khatri-Rao and accumulator rows of each thread, length nthreads*2*stride
+		sptValue * privates;         /// per-thread outputs if privatized, length nthreads*nrows*stride
+		sptNnzIndex * slice_ptr;     /// if stealing, row i owns positions [slice_ptr[i], slice_ptr[i+1]), length nrows+1
+		sptNnzIndex * perm;          /// if stealing, nonzeros grouped by output row, NULL when X already is
+		sptNnzIndex grain;           /// if stealing, # nonzeros processed between two split checks
+		sptTaskDeque * deques;       /// if stealing, one deque per thread
+		sptArena * arena;            /// the arena scratch, privates, slice_ptr and perm were moved to, NULL if malloc'd
+} sptMTTKRPPlan;
+
+/**
+ * The MTTKRP variant chosen to fit a memory budget, and what it will hold
+ */
+typedef struct {
+		char kernel[16];             /// the driver kernel: "plan", "steal", "packed" or "coo"
+		sptMTTKRPStrategy strategy;  /// the plan strategy, for "plan"
+		size_t tensor_bytes;         /// the COO tensor
+		size_t factor_bytes;         /// the factor matrices of all modes
+		size_t output_bytes;         /// the output matrix
+		size_t kernel_bytes;         /// what the kernel allocates on top: plan, copies, derived format
+} sptMTTKRPBudget;
+
+/**
+ * NUMA-aware MTTKRP state
+ * Threads are pinned to the CPUs of their node from creation until release. Each node holds its own
+ * partition of the nonzeros, its own replica of the read-only factors and
+ * its own output, all first touched by a thread of that node.
+ */
+typedef struct {
+		sptSparseTensor const * X;   /// the source tensor, not owned
+		sptIndex nmodes;             /// # modes of X
+		sptIndex mode;               /// the mode MTTKRP is performed on
+		sptIndex R;                  /// rank
+		sptIndex stride;             /// row stride of the factors and outputs
+		sptIndex nrows;              /// # output rows, ndims[mode]
+		int nthreads;                /// # threads
+		int nnodes;                  /// # NUMA nodes in use
+		int * thread_node;           /// node of each thread, length nthreads
+		int * thread_rank;           /// rank of each thread within its node, length nthreads
+		int * node_nthreads;         /// # threads on each node, length nnodes
+		int * thread_cpu;            /// CPU each thread is pinned to, -1 if unpinned, length nthreads
+		cpu_set_t * thread_saved;    /// affinity of each thread before pinning, length nthreads
+		sptValue ** rows;            /// node-local scratch Khatri-Rao row of each thread, [tid]
+		sptNnzIndex * node_begin;    /// nonzero range of each node, length nnodes+1
+		sptIndex ** inds;            /// node-local indices, [node*nmodes + m]
+		sptValue ** vals;            /// node-local values, [node]
+		sptValue ** factors;         /// node-local factor replicas, [node*nmodes + m], NULL for mode
+		sptValue ** outs;            /// node-local outputs, [node]
+		double partition_time;       /// seconds spent copying the partitions
+		double replicate_time;       /// seconds spent in the last replication
+		uint64_t replicate_bytes;    /// bytes copied by the last replication
+		double exec_time;            /// seconds of the last execution
+		double compare_time;         /// mean seconds of an execution in sptMTTKRPNumaCompare, 0 before
+		double baseline_time;        /// mean seconds of sptOmpMTTKRP in sptMTTKRPNumaCompare, 0 before
+} sptMTTKRPNuma;
+
+/**
+ * Sparse tensor reordered into cache tiles
+ * A tile covers a block of rows in every mode, block sizes are chosen per
+ * mode so that all factor rows a tile can touch fit in the cache budget.
+ * Tiles of the same output row block are contiguous.
+ */
+typedef struct {
+		sptSparseTensor tsr;         /// the nonzeros, tile by tile
+		sptIndex mode;               /// the output mode the tiles are grouped by
+		sptIndex * block_rows;       /// rows per tile in each mode, length nmodes
+		sptIndex * nblocks;          /// # row blocks in each mode, length nmodes
+		sptNnzIndex ntiles;          /// # non-empty tiles
+		sptNnzIndex * tile_ptr;      /// nonzero range of each tile, length ntiles+1
+		sptNnzIndex ngroups;         /// # non-empty output row blocks
+		sptNnzIndex * group_ptr;     /// tile range of each output row block, length ngroups+1
+		sptArena * arena;            /// the arena tile_ptr and group_ptr were moved to, NULL if malloc'd
+} sptSparseTensorTiled;
+
+/**
+ * One word of a packed nonzero record, an index or the value
+ */
+typedef union {
+		sptIndex ind;
+		sptValue val;
+} sptPackedWord;
+
+/**
+ * Sparse tensor with each nonzero packed into one record
+ * A record is the nmodes indices followed by the value, padded with zeros to
+ * a power of two words, so the kernels read one stream instead of nmodes+1
+ * and records never straddle a cache line. Records of a pattern-only tensor
+ * have no value word.
+ */
+typedef struct {
+		sptIndex nmodes;             /// # modes
+		sptIndex * ndims;            /// size of each mode, length nmodes
+		sptNnzIndex nnz;             /// # nonzeros
+		sptIndex width;              /// words per record, a power of two > nmodes, >= nmodes if pattern
+		bool pattern;                /// every value is 1 and not stored
+		sptPackedWord * records;     /// the records, nnz*width words, 64-byte aligned
+		sptArena * arena;            /// the arena the records were moved to, NULL if malloc'd
+} sptSparseTensorPacked;
+
+/**
+ * Sparse tensor with its densest slices stored as dense blocks
+ * A dense block spans, in every other mode, only the indices its slice
+ * uses, so it needs one index list per mode instead of one index tuple per
+ * nonzero. The remaining nonzeros stay in COO.
+ */
+typedef struct {
+		sptSparseTensor sparse;      /// the nonzeros of the sparse slices
+		sptIndex slice_mode;         /// the mode the slices are taken along
+		double threshold;            /// minimum density of a dense block
+		sptIndex ndense;             /// # dense slices
+		sptIndex * slice_ids;        /// index of each dense slice, length ndense
+		sptIndex * block_dims;       /// block extent in each mode, [d*nmodes + m], 1 for slice_mode
+		sptNnzIndex * list_ptr;      /// start of each block's index list, [d*nmodes + m], length ndense*nmodes+1
+		sptIndex * lists;            /// used indices of each block mode
+		sptNnzIndex * value_ptr;     /// start of each block's values, length ndense+1
+		sptValue * values;           /// dense blocks, row-major over the other modes in order
+		sptNnzIndex dense_nnz;       /// # nonzeros moved into dense blocks
+		sptIndex max_dim;            /// largest block extent, for scratch sizing
+		sptArena * arena;            /// the arena lists and values were moved to, NULL if malloc'd
+} sptSparseTensorHybrid;
+
+/**
+ * Many small sparse tensors loaded from one manifest
+ */
+typedef struct {
+		sptIndex ntensors;           /// # tensors
+		sptSparseTensor * tensors;   /// the tensors, in manifest order
+		char ** names;               /// the file of each tensor
+		sptIndex max_nmodes;         /// largest order
+		sptIndex * max_dims;         /// largest dimension of each mode, length max_nmodes
+		sptNnzIndex total_nnz;       /// # nonzeros over all tensors
+} sptSparseTensorBatch;
+
+/**
+ * A sparse tensor, and optionally dense matrices, published under a name
+ * The mapping starts with a header (format, generation, state and the pid
+ * of every attachment) that every attached process updates, followed by the
+ * arrays, which attached processes map read-only and use without copying.
+ */
+typedef struct {
+		char name[256];              /// a shared memory name, or a file path if it has a '/' after the first character
+		char * map;                  /// the whole mapping, header first
+		size_t size;                 /// bytes mapped
+		size_t header_bytes;         /// bytes of header pages, the rest is data
+		uint64_t generation;         /// unique to one publication of the name
+		int slot;                    /// this attachment's entry in the header's pid table
+		sptArena arena;              /// the data pages, marked full so that the views never allocate from them
+		sptSparseTensor tensor;      /// view of the tensor, its indices and values read-only
+		sptIndex nmats;              /// # matrices
+		sptMatrix * mats;            /// views of the matrices, values read-only, length nmats
+} sptSharedStore;
+
+/**
+ * MTTKRP as a column-blocked CSR times Khatri-Rao SpMM
+ */
+typedef struct {
+		sptIndex mode;               /// the output mode, rows of the matricization
+		sptIndex nmodes;             /// # modes of the tensor
+		sptIndex nrows;              /// X->ndims[mode]
+		sptIndex ncols;              /// # distinct index tuples of the other modes
+		sptNnzIndex nnz;             /// # nonzeros
+		sptIndex * col_modes;        /// the other modes in mats_order, length nmodes-1
+		sptIndexVector * col_inds;   /// each column's index in col_modes[k], length [nmodes-1][ncols]
+		sptIndex block_cols;         /// columns per block, whose Khatri-Rao rows fit in L2
+		sptIndex nblocks;            /// # column blocks
+		sptNnzIndex * block_ptr;     /// first segment of each block, length nblocks+1
+		sptNnzIndex nsegs;           /// # (block, row) segments
+		sptIndex * seg_row;          /// row of each segment, length nsegs
+		sptNnzIndex * seg_ptr;       /// first nonzero of each segment, length nsegs+1
+		sptIndex * colind;           /// column of each nonzero relative to its block, block-major
+		sptValue * values;           /// value of each nonzero, block-major
+		sptArena * arena;            /// the arena seg_row, seg_ptr, colind and values were moved to, NULL if malloc'd
+} sptMTTKRPSpMM;
+
+/**
+ * How a sampled MTTKRP weights the nonzeros
+ */
+typedef enum {
+		SPT_SAMPLE_VALUE    = 0,  /// |value|
+		SPT_SAMPLE_ROW_NORM = 1,  /// |value| times the norms of the factor rows it gathers
+} sptSampleWeighting;
+
+/**
+ * Importance sampling distribution over the nonzeros of a tensor, for one mode
+ */
+typedef struct {
+		sptIndex mode;                 /// the output mode
+		sptIndex nmodes;               /// # modes of the tensor
+		sptSampleWeighting weighting;  /// what the weights are
+		sptNnzIndex nnz;               /// # nonzeros
+		double * cdf;                  /// inclusive prefix sums of the weights, length nnz
+		double ** norms;               /// for SPT_SAMPLE_ROW_NORM, the row norms of each factor, NULL otherwise
+} sptMTTKRPSampler;
+
 /**
  * Key-value pair structure
  */
@@ -32,6 +32,9 @@ struct sptTagTimer {
 		struct timespec stop_timespec;
 };
 
+/* Whether the sptPrint*Time functions print, see sptSetTimerPrint. */
+static int spt_timer_print = 1;
+
 int sptNewTimer(sptTimer *timer, int use_cuda) {
 	*timer = (sptTimer) malloc(sizeof **timer);
 	(*timer)->use_cuda = use_cuda;
@@ -74,18 +77,38 @@ double sptElapsedTime(const sptTimer timer) {
 
 double sptPrintElapsedTime(const sptTimer timer, const char *name) {
 	double elapsed_time = sptElapsedTime(timer);
-	fprintf(stdout, "[%s]: %.9lf s\n", name, elapsed_time);
+	if(spt_timer_print) {
+		fprintf(stdout, "[%s]: %.9lf s\n", name, elapsed_time);
+	}
 	return elapsed_time;
 }
 
 
 double sptPrintAverageElapsedTime(const sptTimer timer, const int niters, const char *name) {
 	double elapsed_time = sptElapsedTime(timer) / niters;
-	fprintf(stdout, "[%s]: %.9lf s\n", name, elapsed_time);
+	if(spt_timer_print) {
+		fprintf(stdout, "[%s]: %.9lf s\n", name, elapsed_time);
+	}
 	return elapsed_time;
 }
 
 
+/* The closing line of a kernel's timing report. */
+void sptPrintTotalTime(double const total_time) {
+	if(spt_timer_print) {
+		fprintf(stdout, "[Total time]: %lf\n\n", total_time);
+	}
+}
+
+
+/* Turn the sptPrint*Time reports on (nonzero) or off, returning the previous setting. */
+int sptSetTimerPrint(int const on) {
+	int const was = spt_timer_print;
+	spt_timer_print = on;
+	return was;
+}
+
+
 int sptFreeTimer(sptTimer timer) {
 	if(timer->use_cuda) {
 		spt_CheckError(3 + SPTERR_CUDA_ERROR, "Timer New", "CUDA support is disabled in this build");
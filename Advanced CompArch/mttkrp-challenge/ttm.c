@@ -0,0 +1,314 @@
+/*
+    This file is part of ParTI!.
+
+    ParTI! is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    ParTI! is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with ParTI!.
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//#include <pasta.h>
+#include <stdio.h>
+#include "helper_funcs.h"
+#include "vector.h"
+#include "sptensors.h"
+#include "matricies.h"
+
+
+/* Whether nonzeros x-1 and x differ outside mode, i.e. x starts a new fiber. */
+static inline int ttm_fiber_starts(sptSparseTensor const * const tsr, sptIndex const mode, sptNnzIndex const x)
+{
+	for(sptIndex m=0; m<tsr->nmodes; ++m) {
+		if(m != mode && tsr->inds[m].data[x-1] != tsr->inds[m].data[x]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Find the mode-n fibers of a sorted sparse tensor
+ * @param[out] fiberidx    an uninitialized vector, receives the first nonzero
+ * of each fiber followed by ref->nnz, so fiber f is [data[f], data[f+1])
+ * @param[in]  mode    the mode the fibers run along
+ * @param[in]  ref    the sparse tensor, sorted with mode as its least significant key
+ *
+ * Release fiberidx->data with free().
+ */
+int sptSparseTensorSetFibers(
+		sptNnzIndexVector *fiberidx,
+		sptIndex mode,
+		sptSparseTensor *ref)
+{
+	sptNnzIndex const nnz = ref->nnz;
+	if(mode >= ref->nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns SetFibers", "mode >= nmodes");
+	}
+
+	sptNnzIndex nfibers = nnz > 0;
+	for(sptNnzIndex x=1; x<nnz; ++x) {
+		nfibers += ttm_fiber_starts(ref, mode, x);
+	}
+	fiberidx->len = nfibers + 1;
+	fiberidx->cap = nfibers + 1;
+	fiberidx->data = malloc(fiberidx->cap * sizeof *fiberidx->data);
+	spt_CheckOSError(!fiberidx->data, "SpTns SetFibers");
+
+	sptNnzIndex f = 0;
+	for(sptNnzIndex x=0; x<nnz; ++x) {
+		if(x == 0 || ttm_fiber_starts(ref, mode, x)) {
+			fiberidx->data[f++] = x;
+		}
+	}
+	fiberidx->data[nfibers] = nnz;
+	return 0;
+}
+
+
+/**
+ * Collect the coordinates of each fiber
+ * @param[out] dest    a sparse tensor with ref's nmodes, receives one entry
+ * per fiber holding the indices of its first nonzero, 0 in mode. Its values
+ * are zeroed.
+ * @param[in]  fiberidx    the fibers, from sptSparseTensorSetFibers
+ * @param[in]  mode    the mode the fibers run along
+ * @param[in]  ref    the sparse tensor the fibers were found in
+ */
+int sptSparseTensorSetIndices(
+		sptSparseTensor *dest,
+		sptNnzIndexVector *fiberidx,
+		sptIndex mode,
+		sptSparseTensor *ref)
+{
+	sptNnzIndex const nfibers = fiberidx->len - 1;
+	int result;
+	if(dest->nmodes != ref->nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns SetIndices", "dest->nmodes != ref->nmodes");
+	}
+
+	for(sptIndex m=0; m<ref->nmodes; ++m) {
+		result = sptResizeIndexVector(&dest->inds[m], nfibers);
+		spt_CheckError(result, "SpTns SetIndices", NULL);
+		sptIndex * const restrict dest_ind = dest->inds[m].data;
+		sptIndex const * const restrict ref_ind = ref->inds[m].data;
+		for(sptNnzIndex f=0; f<nfibers; ++f) {
+			dest_ind[f] = m == mode ? 0 : ref_ind[fiberidx->data[f]];
+		}
+	}
+	result = sptResizeValueVector(&dest->values, nfibers);
+	spt_CheckError(result, "SpTns SetIndices", NULL);
+	memset(dest->values.data, 0, nfibers * sizeof *dest->values.data);
+	dest->nnz = nfibers;
+	return 0;
+}
+
+
+/**
+ * Shape the result of a TTM, without computing it
+ * @param[out] Y    an uninitialized semi-sparse tensor, receives one dense row per
+ * nonempty mode fiber of X
+ * @param[out] fiberidx    an uninitialized vector, receives the fibers as from
+ * sptSparseTensorSetFibers. Release its data with free().
+ * @param[in]  X    the sparse tensor input X, sorted in place unless its mode
+ * fibers are already contiguous
+ * @param[in]  U    the dense matrix, X->ndims[mode] rows
+ * @param[in]  mode    the mode on which the multiplication is performed
+ *
+ * sptSparseTensorMulMatrixFill then computes Y, as often as U changes, as long
+ * as X does not.
+ */
+int sptSparseTensorMulMatrixPrepare(
+		sptSemiSparseTensor *Y,
+		sptNnzIndexVector *fiberidx,
+		sptSparseTensor *X,
+		const sptMatrix *U,
+		sptIndex const mode)
+{
+	sptIndex const nmodes = X->nmodes;
+	int result;
+	if(mode >= nmodes) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns * Mtx", "mode >= nmodes");
+	}
+	if(X->pattern) {
+		spt_CheckError(SPTERR_VALUE_ERROR, "SpTns * Mtx", "pattern-only tensor");
+	}
+	if(U->nrows != X->ndims[mode]) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns * Mtx", "U->nrows != X->ndims[mode]");
+	}
+	if(U->layout != SPT_LAYOUT_ROW_MAJOR) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns * Mtx", "U is not row-major");
+	}
+
+	/* The other modes in order, then mode. Skipped when X is already sorted. */
+	sptIndex * order = malloc(nmodes * sizeof *order);
+	sptIndex * ndims = malloc(nmodes * sizeof *ndims);
+	spt_CheckOSError(!order || !ndims, "SpTns * Mtx");
+	for(sptIndex m=0, k=0; m<nmodes; ++m) {
+		if(m != mode) {
+			order[k++] = m;
+		}
+	}
+	order[nmodes-1] = mode;
+	if(!sptSparseTensorIsSortedByOrder(X, order)) {
+		result = sptSparseTensorSortByOrder(X, order);
+		spt_CheckError(result, "SpTns * Mtx", NULL);
+	}
+	free(order);
+
+	result = sptSparseTensorSetFibers(fiberidx, mode, X);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+
+	memcpy(ndims, X->ndims, nmodes * sizeof *ndims);
+	ndims[mode] = U->ncols;
+	result = sptNewSemiSparseTensor(Y, nmodes, mode, ndims);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+	free(ndims);
+
+	/* The fiber coordinates are built in a scratch tensor and moved into Y. */
+	sptSparseTensor fibers;
+	result = sptNewSparseTensor(&fibers, nmodes, X->ndims);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+	result = sptSparseTensorSetIndices(&fibers, fiberidx, mode, X);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+	sptIndexVector * const inds = Y->inds;
+	Y->inds = fibers.inds;
+	fibers.inds = inds;
+	sptFreeSparseTensor(&fibers);
+	Y->nnz = fiberidx->len - 1;
+
+	sptFreeMatrix(&Y->values);
+	result = sptNewMatrix(&Y->values, Y->nnz, U->ncols);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+	return 0;
+}
+
+
+/* Dense row of fiber [begin, end): the sum of value times the U row of its mode index. Overwrites out. */
+static inline void ttm_fiber(
+		sptSparseTensor const * const X,
+		const sptMatrix *U,
+		sptIndex const mode,
+		sptNnzIndex const begin,
+		sptNnzIndex const end,
+		sptValue * const restrict out)
+{
+	sptIndex const R = U->ncols;
+	sptIndex const stride = U->stride;
+	sptValue const * const restrict vals = X->values.data;
+	sptIndex const * const restrict mode_ind = X->inds[mode].data;
+
+	memset(out, 0, R * sizeof *out);
+	for(sptNnzIndex x=begin; x<end; ++x) {
+		sptValue const v = vals[x];
+		sptValue const * const restrict u_row = U->values + (size_t)mode_ind[x] * stride;
+#pragma omp simd
+		for(sptIndex r=0; r<R; ++r) {
+			out[r] += v * u_row[r];
+		}
+	}
+}
+
+
+/**
+ * Sparse tensor times a dense matrix (TTM)
+ * @param[out] Y    an uninitialized semi-sparse tensor, receives X x_mode U^T with
+ * mode dense of size U->ncols, one row per nonempty mode fiber of X
+ * @param[in]  X    the sparse tensor input X, sorted in place unless its mode
+ * fibers are already contiguous
+ * @param[in]  U    the dense matrix, X->ndims[mode] rows
+ * @param[in]  mode    the mode on which the multiplication is performed
+ *
+ * Y(i_1, ..., r, ..., i_N) = sum over i_mode of X(i_1, ..., i_mode, ..., i_N) U(i_mode, r)
+ */
+int sptSparseTensorMulMatrix(sptSemiSparseTensor *Y, sptSparseTensor *X, const sptMatrix *U, sptIndex const mode)
+{
+	sptNnzIndexVector fiberidx;
+	int result = sptSparseTensorMulMatrixPrepare(Y, &fiberidx, X, U, mode);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+	result = sptSparseTensorMulMatrixFill(Y, &fiberidx, X, U, mode);
+	free(fiberidx.data);
+	spt_CheckError(result, "SpTns * Mtx", NULL);
+
+	return 0;
+}
+
+
+/**
+ * Compute a TTM shaped by sptSparseTensorMulMatrixPrepare
+ * @param Y, fiberidx    from sptSparseTensorMulMatrixPrepare, Y's values are overwritten
+ * @param X, U, mode    as given to sptSparseTensorMulMatrixPrepare, U may hold new values
+ */
+int sptSparseTensorMulMatrixFill(
+		sptSemiSparseTensor *Y,
+		sptNnzIndexVector const *fiberidx,
+		sptSparseTensor const *X,
+		const sptMatrix *U,
+		sptIndex const mode)
+{
+	if(Y->nnz + 1 != fiberidx->len || Y->values.ncols != U->ncols) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "SpTns * Mtx Fill", "Y was not prepared for these fibers and U");
+	}
+	sptIndex const stride = Y->values.stride;
+	for(sptNnzIndex f=0; f<Y->nnz; ++f) {
+		ttm_fiber(X, U, mode, fiberidx->data[f], fiberidx->data[f+1], Y->values.values + (size_t)f * stride);
+	}
+
+	return 0;
+}
+
+
+/**
+ * OpenMP sparse tensor times a dense matrix (TTM)
+ * @param Y, X, U, mode    as for sptSparseTensorMulMatrix
+ *
+ * Each fiber's row is written by the one thread that owns the fiber, so
+ * no atomics are needed. Fibers are handed out dynamically since their
+ * lengths vary.
+ */
+int sptOmpSparseTensorMulMatrix(sptSemiSparseTensor *Y, sptSparseTensor *X, const sptMatrix *U, sptIndex const mode)
+{
+	sptNnzIndexVector fiberidx;
+	int result = sptSparseTensorMulMatrixPrepare(Y, &fiberidx, X, U, mode);
+	spt_CheckError(result, "Omp SpTns * Mtx", NULL);
+	result = sptOmpSparseTensorMulMatrixFill(Y, &fiberidx, X, U, mode);
+	free(fiberidx.data);
+	spt_CheckError(result, "Omp SpTns * Mtx", NULL);
+
+	return 0;
+}
+
+
+/**
+ * OpenMP sptSparseTensorMulMatrixFill
+ * @param Y, fiberidx, X, U, mode    as for sptSparseTensorMulMatrixFill
+ */
+int sptOmpSparseTensorMulMatrixFill(
+		sptSemiSparseTensor *Y,
+		sptNnzIndexVector const *fiberidx,
+		sptSparseTensor const *X,
+		const sptMatrix *U,
+		sptIndex const mode)
+{
+	if(Y->nnz + 1 != fiberidx->len || Y->values.ncols != U->ncols) {
+		spt_CheckError(SPTERR_SHAPE_MISMATCH, "Omp SpTns * Mtx Fill", "Y was not prepared for these fibers and U");
+	}
+	sptIndex const stride = Y->values.stride;
+	sptValue * const yvals = Y->values.values;
+	sptNnzIndex const * const fptr = fiberidx->data;
+#pragma omp parallel for schedule(dynamic, 256)
+	for(sptNnzIndex f=0; f<Y->nnz; ++f) {
+		ttm_fiber(X, U, mode, fptr[f], fptr[f+1], yvals + (size_t)f * stride);
+	}
+
+	return 0;
+}
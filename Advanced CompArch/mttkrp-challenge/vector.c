@@ -24,6 +24,27 @@
 #include "error.h"
 #include "helper_funcs.h"
 
+/*
+ * Move a vector's buffer to new_bytes. Arena buffers are copied to a new
+ * block of the arena, or to the heap once it is full, setting *arena to NULL.
+ */
+static void * vector_move(void * const data, size_t const old_bytes, size_t const new_bytes, sptArena ** const arena)
+{
+	if(*arena == NULL) {
+		return realloc(data, new_bytes);
+	}
+	void * moved = sptArenaAlloc(*arena, new_bytes);
+	if(moved == NULL) {
+		moved = malloc(new_bytes);
+		*arena = NULL;
+	}
+	if(moved != NULL) {
+		memcpy(moved, data, old_bytes < new_bytes ? old_bytes : new_bytes);
+	}
+	return moved;
+}
+
+
 /**
  * Initialize a new value vector
  *
@@ -42,6 +63,7 @@ int sptNewValueVector(sptValueVector *vec, sptNnzIndex len, sptNnzIndex cap) {
 	}
 	vec->len = len;
 	vec->cap = cap;
+	vec->arena = NULL;
 	vec->data = malloc(cap * sizeof *vec->data);
 	spt_CheckOSError(!vec->data, "ValVec New");
 	memset(vec->data, 0, cap * sizeof *vec->data);
@@ -49,6 +71,33 @@ int sptNewValueVector(sptValueVector *vec, sptNnzIndex len, sptNnzIndex cap) {
 }
 
 
+/**
+ * Initialize a new value vector in an arena
+ *
+ * @param vec   a valid pointer to an uninitialized sptValueVector variable,
+ * @param len   number of values to create
+ * @param cap   total number of values to reserve
+ * @param arena the arena to allocate from
+ *
+ * The values are not zeroed. Growing past cap takes a new block from the
+ * arena, or moves the vector to the heap once the arena is full.
+ */
+int sptNewValueVectorInArena(sptValueVector *vec, sptNnzIndex len, sptNnzIndex cap, sptArena *arena) {
+	if(cap < len) {
+		cap = len;
+	}
+	if(cap < 2) {
+		cap = 2;
+	}
+	vec->len = len;
+	vec->cap = cap;
+	vec->arena = arena;
+	vec->data = sptArenaAlloc(arena, cap * sizeof *vec->data);
+	spt_CheckOSError(!vec->data, "ValVec New");
+	return 0;
+}
+
+
 /**
  * Fill an existed dense value vector with a specified constant
  *
@@ -78,7 +127,7 @@ int sptAppendValueVector(sptValueVector *vec, sptValue const value) {
 #else
 		sptNnzIndex newcap = vec->len+1;
 #endif
-		sptValue *newdata = realloc(vec->data, newcap * sizeof *vec->data);
+		sptValue *newdata = vector_move(vec->data, vec->len * sizeof *vec->data, newcap * sizeof *vec->data, &vec->arena);
 		spt_CheckOSError(!newdata, "ValVec Append");
 		vec->cap = newcap;
 		vec->data = newdata;
@@ -100,8 +149,9 @@ int sptAppendValueVector(sptValueVector *vec, sptValue const value) {
  */
 int sptResizeValueVector(sptValueVector *vec, sptNnzIndex const size) {
 	sptNnzIndex newcap = size < 2 ? 2 : size;
-	if(newcap != vec->cap) {
-		sptValue *newdata = realloc(vec->data, newcap * sizeof *vec->data);
+	/* Arena blocks are not returned one by one, so they do not shrink. */
+	if(newcap != vec->cap && !(vec->arena != NULL && newcap < vec->cap)) {
+		sptValue *newdata = vector_move(vec->data, vec->len * sizeof *vec->data, newcap * sizeof *vec->data, &vec->arena);
 		spt_CheckOSError(!newdata, "ValVec Resize");
 		vec->len = size;
 		vec->cap = newcap;
@@ -112,6 +162,24 @@ int sptResizeValueVector(sptValueVector *vec, sptNnzIndex const size) {
 	return 0;
 }
 
+/**
+ * Reserve space in a value vector
+ *
+ * @param vec the value vector
+ * @param cap the number of values to make room for
+ *
+ * The length and the values are kept, the capacity only grows.
+ */
+int sptReserveValueVector(sptValueVector *vec, sptNnzIndex const cap) {
+	if(cap > vec->cap) {
+		sptValue *newdata = vector_move(vec->data, vec->len * sizeof *vec->data, cap * sizeof *vec->data, &vec->arena);
+		spt_CheckOSError(!newdata, "ValVec Reserve");
+		vec->cap = cap;
+		vec->data = newdata;
+	}
+	return 0;
+}
+
 /**
  * Release the memory buffer a value vector is holding
  *
@@ -121,7 +189,9 @@ int sptResizeValueVector(sptValueVector *vec, sptNnzIndex const size) {
 void sptFreeValueVector(sptValueVector *vec) {
 	vec->len = 0;
 	vec->cap = 0;
-	free(vec->data);
+	if(vec->arena == NULL) {
+		free(vec->data);
+	}
 }
 
 
@@ -144,6 +214,7 @@ int sptNewIndexVector(sptIndexVector *vec, sptNnzIndex len, sptNnzIndex cap) {
 	}
 	vec->len = len;
 	vec->cap = cap;
+	vec->arena = NULL;
 	vec->data = malloc(cap * sizeof *vec->data);
 	spt_CheckOSError(!vec->data, "IdxVec New");
 	memset(vec->data, 0, cap * sizeof *vec->data);
@@ -151,6 +222,32 @@ int sptNewIndexVector(sptIndexVector *vec, sptNnzIndex len, sptNnzIndex cap) {
 }
 
 
+/**
+ * Initialize a new sptIndex vector in an arena
+ *
+ * @param vec   a valid pointer to an uninitialized sptIndexVector variable,
+ * @param len   number of values to create
+ * @param cap   total number of values to reserve
+ * @param arena the arena to allocate from
+ *
+ * As for sptNewValueVectorInArena.
+ */
+int sptNewIndexVectorInArena(sptIndexVector *vec, sptNnzIndex len, sptNnzIndex cap, sptArena *arena) {
+	if(cap < len) {
+		cap = len;
+	}
+	if(cap < 2) {
+		cap = 2;
+	}
+	vec->len = len;
+	vec->cap = cap;
+	vec->arena = arena;
+	vec->data = sptArenaAlloc(arena, cap * sizeof *vec->data);
+	spt_CheckOSError(!vec->data, "IdxVec New");
+	return 0;
+}
+
+
 /**
  * Add a value to the end of a sptIndexVector
  *
@@ -166,7 +263,7 @@ int sptAppendIndexVector(sptIndexVector *vec, sptIndex const value) {
 #else
 		sptNnzIndex newcap = vec->len+1;
 #endif
-		sptIndex *newdata = realloc(vec->data, newcap * sizeof *vec->data);
+		sptIndex *newdata = vector_move(vec->data, vec->len * sizeof *vec->data, newcap * sizeof *vec->data, &vec->arena);
 		spt_CheckOSError(!newdata, "IdxVec Append");
 		vec->cap = newcap;
 		vec->data = newdata;
@@ -188,8 +285,9 @@ int sptAppendIndexVector(sptIndexVector *vec, sptIndex const value) {
  */
 int sptResizeIndexVector(sptIndexVector *vec, sptNnzIndex const size) {
 	sptNnzIndex newcap = size < 2 ? 2 : size;
-	if(newcap != vec->cap) {
-		sptIndex *newdata = realloc(vec->data, newcap * sizeof *vec->data);
+	/* Arena blocks are not returned one by one, so they do not shrink. */
+	if(newcap != vec->cap && !(vec->arena != NULL && newcap < vec->cap)) {
+		sptIndex *newdata = vector_move(vec->data, vec->len * sizeof *vec->data, newcap * sizeof *vec->data, &vec->arena);
 		spt_CheckOSError(!newdata, "IdxVec Resize");
 		vec->len = size;
 		vec->cap = newcap;
@@ -200,6 +298,24 @@ int sptResizeIndexVector(sptIndexVector *vec, sptNnzIndex const size) {
 	return 0;
 }
 
+/**
+ * Reserve space in an index vector
+ *
+ * @param vec the index vector
+ * @param cap the number of values to make room for
+ *
+ * The length and the values are kept, the capacity only grows.
+ */
+int sptReserveIndexVector(sptIndexVector *vec, sptNnzIndex const cap) {
+	if(cap > vec->cap) {
+		sptIndex *newdata = vector_move(vec->data, vec->len * sizeof *vec->data, cap * sizeof *vec->data, &vec->arena);
+		spt_CheckOSError(!newdata, "IdxVec Reserve");
+		vec->cap = cap;
+		vec->data = newdata;
+	}
+	return 0;
+}
+
 /**
  * Release the memory buffer a sptIndexVector is holding
  *
@@ -207,7 +323,9 @@ int sptResizeIndexVector(sptIndexVector *vec, sptNnzIndex const size) {
  *
  */
 void sptFreeIndexVector(sptIndexVector *vec) {
-	free(vec->data);
+	if(vec->arena == NULL) {
+		free(vec->data);
+	}
 	vec->len = 0;
 	vec->cap = 0;
 }
@@ -25,21 +25,33 @@
 
 void sptQuickSortNnzIndexArray(sptNnzIndex * array, sptNnzIndex l, sptNnzIndex r);
 
+/* Arena */
+int sptNewArena(sptArena * const arena, size_t const size, int const flags);
+void * sptArenaAlloc(sptArena * const arena, size_t const bytes);
+void sptArenaRewind(sptArena * const arena, size_t const mark);
+size_t sptArenaRounded(size_t const bytes);
+int sptArenaMove(sptArena * const arena, void ** const ptr, size_t const bytes);
+void sptFreeArena(sptArena * const arena);
+
 /* Dense vector, with sptValueVector type */
 int sptNewValueVector(sptValueVector *vec, sptNnzIndex len, sptNnzIndex cap);
+int sptNewValueVectorInArena(sptValueVector *vec, sptNnzIndex len, sptNnzIndex cap, sptArena *arena);
 int sptConstantValueVector(sptValueVector * const vec, sptValue const val);
 
 int sptAppendValueVector(sptValueVector *vec, sptValue const value);
 
 int sptResizeValueVector(sptValueVector *vec, sptNnzIndex const size);
+int sptReserveValueVector(sptValueVector *vec, sptNnzIndex const cap);
 void sptFreeValueVector(sptValueVector *vec);
 
 /* Dense vector, with sptIndexVector type */
 int sptNewIndexVector(sptIndexVector *vec, sptNnzIndex len, sptNnzIndex cap);
+int sptNewIndexVectorInArena(sptIndexVector *vec, sptNnzIndex len, sptNnzIndex cap, sptArena *arena);
 
 int sptAppendIndexVector(sptIndexVector *vec, sptIndex const value);
 
 int sptResizeIndexVector(sptIndexVector *vec, sptNnzIndex const size);
+int sptReserveIndexVector(sptIndexVector *vec, sptNnzIndex const cap);
 void sptFreeIndexVector(sptIndexVector *vec);
 
 